@@ -1,5 +1,9 @@
 ﻿#pragma once
 
+#include <bit>
+#include <cstdio>
+#include <string>
+
 #include "Utils.h"
 #include "Geometry.h"
 #include "Interaction.h"
@@ -11,18 +15,205 @@ namespace xitils {
 
 	class _NaiveAccelerationStructure;
 	class _BVH;
+	class BVHCache;
+	template<int Width> class _WideBVH;
+
+	using _BVH4 = _WideBVH<4>;
+	using _BVH8 = _WideBVH<8>;
 
+#ifdef XITILS_USE_EMBREE
+	// 定義は EmbreeAccelerationStructure.h (TriangleMesh を使うので Scene.h から読み込む)
+	class _EmbreeAccelerationStructure;
+	using AccelerationStructure = _EmbreeAccelerationStructure;
+	// Embree に三角形を渡せない TriangleMesh (プリズムによるシェルマッピング) が内部で使う
+	using MeshAccelerationStructure = _BVH;
+#else
 	using AccelerationStructure = _BVH;
+	// TriangleMesh が内部で使う、プリミティブの AABB のみから構築してリーフを番号で参照するもの
+	// AccelerationStructure を _BVH4, _BVH8 に切り替えるとメッシュの BVH も同じになる
+	using MeshAccelerationStructure = AccelerationStructure;
+#endif
 
 	//---------------------------------------------------
 
+	// AccelerationStructure の木構造の統計
+	// ビルダーのパラメータの調整や、構築結果の品質が落ちていないかの確認に使う
+	struct AccelerationStructureStatistics {
+		int nodeNum = 0; // リーフを含む
+		int leafNum = 0;
+		int primitiveNum = 0; // リーフから参照されているプリミティブの総数
+		size_t memoryBytes = 0;
+		float sahCost = 0.0f; // 根の表面積で正規化した SAH コスト
+		int maxDepth = 0;
+		float averageLeafDepth = 0.0f;
+		// 内部ノードの体積のうち、どの子ノードにも含まれない部分の割合の平均
+		// 子ノード同士の重なりは 2 つずつの組の分だけを差し引いて求める
+		float emptySpaceRatio = 0.0f;
+		// 内部ノードの体積に対する、子ノード同士が重なっている部分の体積の割合の平均
+		float overlapRatio = 0.0f;
+		std::vector<int> leafDepthHistogram; // [深さ] = リーフ数
+		std::vector<int> leafSizeHistogram; // [プリミティブ数] = リーフ数
+
+		// ノードを 1 つずつ加えていき、最後に finish を呼ぶ
+		// コストは BVHBuildSettings と同じく、ノードの AABB 判定 1 回あたりを traversalCost、プリミティブ 1 つあたりを intersectionCost とする
+		void addLeaf(const Bounds3f& bound, int depth, int primNum, float intersectionCost) {
+			++nodeNum;
+			++leafNum;
+			primitiveNum += primNum;
+			maxDepth = max(maxDepth, depth);
+			leafDepthSum += depth;
+			sahSum += intersectionCost * primNum * bound.surfaceArea();
+			if (leafDepthHistogram.size() <= depth) { leafDepthHistogram.resize(depth + 1, 0); }
+			++leafDepthHistogram[depth];
+			if (leafSizeHistogram.size() <= primNum) { leafSizeHistogram.resize(primNum + 1, 0); }
+			++leafSizeHistogram[primNum];
+		}
+
+		// 体積が 0 の内部ノード (平面上のメッシュの一部など) は emptySpaceRatio と overlapRatio の平均から除く
+		void addInterior(const Bounds3f& bound, int depth, const Bounds3f* children, int childNum, float traversalCost) {
+			++nodeNum;
+			maxDepth = max(maxDepth, depth);
+			sahSum += traversalCost * bound.surfaceArea();
+
+			const double volume = bound.volume();
+			if (volume <= 0.0) { return; }
+			double childVolume = 0.0;
+			double overlapVolume = 0.0;
+			for (int i = 0; i < childNum; ++i) {
+				childVolume += children[i].volume();
+				for (int k = i + 1; k < childNum; ++k) {
+					overlapVolume += intersectionVolume(children[i], children[k]);
+				}
+			}
+			emptySpaceSum += clamp01(1.0 - (childVolume - overlapVolume) / volume);
+			overlapSum += overlapVolume / volume;
+			++volumeNodeNum;
+		}
+
+		void finish(const Bounds3f& rootBound) {
+			const float rootArea = rootBound.surfaceArea();
+			sahCost = rootArea > 0.0f ? sahSum / rootArea : 0.0f;
+			averageLeafDepth = leafNum > 0 ? (float)(leafDepthSum / leafNum) : 0.0f;
+			emptySpaceRatio = volumeNodeNum > 0 ? (float)(emptySpaceSum / volumeNodeNum) : 0.0f;
+			overlapRatio = volumeNodeNum > 0 ? (float)(overlapSum / volumeNodeNum) : 0.0f;
+		}
+
+		std::string report() const {
+			std::string res;
+			char line[256];
+			auto append = [&](const char* format, auto... args) {
+				snprintf(line, sizeof(line), format, args...);
+				res += line;
+			};
+			append("nodes         : %d (leaves %d)\n", nodeNum, leafNum);
+			append("primitives    : %d (%.2f per leaf)\n", primitiveNum, leafNum > 0 ? (float)primitiveNum / leafNum : 0.0f);
+			append("memory        : %.1f KB\n", memoryBytes / 1024.0);
+			append("SAH cost      : %.3f\n", sahCost);
+			append("depth         : max %d, average leaf %.2f\n", maxDepth, averageLeafDepth);
+			append("empty space   : %.3f\n", emptySpaceRatio);
+			append("overlap       : %.3f\n", overlapRatio);
+			append("leaf sizes    :");
+			for (int i = 0; i < leafSizeHistogram.size(); ++i) {
+				if (leafSizeHistogram[i] > 0) { append(" %d:%d", i, leafSizeHistogram[i]); }
+			}
+			append("\nleaf depths   :");
+			for (int i = 0; i < leafDepthHistogram.size(); ++i) {
+				if (leafDepthHistogram[i] > 0) { append(" %d:%d", i, leafDepthHistogram[i]); }
+			}
+			append("\n");
+			return res;
+		}
+
+	private:
+		double sahSum = 0.0;
+		double leafDepthSum = 0.0;
+		double emptySpaceSum = 0.0;
+		double overlapSum = 0.0;
+		int volumeNodeNum = 0;
+
+		static double intersectionVolume(const Bounds3f& a, const Bounds3f& b) {
+			double volume = 1.0;
+			for (int axis = 0; axis < 3; ++axis) {
+				const double extent = (double)min(a.max[axis], b.max[axis]) - (double)max(a.min[axis], b.min[axis]);
+				if (extent <= 0.0) { return 0.0; }
+				volume *= extent;
+			}
+			return volume;
+		}
+	};
+
 	class _AccelerationStructure {
 	public:
-		virtual bool intersect(Ray& ray, SurfaceIntersection *isect) const = 0;
-		virtual bool intersectAny(const Ray& ray) const {
-			Ray rayTmp(ray);
-			SurfaceIntersection isect;
-			return intersect(rayTmp, &isect);
+		// 最も近い交差点を hit に記録し、ray.tMax をその距離に更新する
+		// SurfaceIntersection の計算は呼び出し側で交差点が確定してから行う
+		virtual bool intersect(Ray& ray, HitRecord* hit) const = 0;
+		// 遮蔽の判定のみを行い、最初に見つかった交差で打ち切る
+		virtual bool intersectAny(const Ray& ray) const = 0;
+
+		// packet のうち activeMask のビットが立っているレイについて intersect を行い、交差したレイのビットを立てたマスクを返す
+		virtual int intersectPacket(RayPacket& packet, int activeMask, HitRecord* hits) const {
+			int hitMask = 0;
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				if (!(activeMask & (1 << i))) { continue; }
+				Ray ray = packet.ray(i);
+				if (intersect(ray, &hits[i])) {
+					packet.tMax[i] = ray.tMax;
+					hitMask |= 1 << i;
+				}
+			}
+			return hitMask;
+		}
+		// 遮蔽されたレイのビットを立てたマスクを返す
+		virtual int intersectAnyPacket(const RayPacket& packet, int activeMask) const {
+			int occludedMask = 0;
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				if (!(activeMask & (1 << i))) { continue; }
+				if (intersectAny(packet.ray(i))) {
+					occludedMask |= 1 << i;
+				}
+			}
+			return occludedMask;
+		}
+
+		// intersect, intersectAny と同じ判定を行い、辿ったノード数と判定したプリミティブ数を stats に加える
+		// プリミティブが内部に高速化構造を持つ場合はその分も加える
+		// 数えることに対応していない実装では stats は変化しない
+		virtual bool intersectWithStatistics(Ray& ray, HitRecord* hit, TraversalStatistics* stats) const {
+			return intersect(ray, hit);
+		}
+		virtual bool intersectAnyWithStatistics(const Ray& ray, TraversalStatistics* stats) const {
+			return intersectAny(ray);
+		}
+
+		// 木構造の統計
+		// 対応していない実装では空のものを返す
+		virtual AccelerationStructureStatistics statistics() const {
+			return AccelerationStructureStatistics();
+		}
+
+		// 木構造はそのままに、プリミティブの現在の AABB に合わせてノードの AABB を更新する
+		virtual void refit() = 0;
+
+		// refit によって SAH コストが構築時の threshold 倍より悪化した部分を作り直す
+		// 作り直した場合は true を返す
+		virtual bool rebuildDegradedSubtree(float threshold) { return false; }
+
+	protected:
+		// CountStatistics が false の場合は統計を取らない通常の判定になる
+		template<bool CountStatistics> static bool intersectGeometry(const Geometry* geometry, Ray& ray, HitRecord* hit, TraversalStatistics* stats) {
+			if constexpr (CountStatistics) {
+				return geometry->intersectWithStatistics(ray, &ray.tMax, hit, stats);
+			} else {
+				return geometry->intersect(ray, &ray.tMax, hit);
+			}
+		}
+
+		template<bool CountStatistics> static bool intersectAnyGeometry(const Geometry* geometry, const Ray& ray, TraversalStatistics* stats) {
+			if constexpr (CountStatistics) {
+				return geometry->intersectAnyWithStatistics(ray, stats);
+			} else {
+				return geometry->intersectAny(ray);
+			}
 		}
 	};
 
@@ -38,258 +229,2549 @@ namespace xitils {
 			map<Shape*, Geometry*>(shapes, &geometries, [](const Geometry* shape) { return (Geometry*)shape; });
 		}
 
-		bool intersect(Ray& ray, SurfaceIntersection *isect) const override {
-			bool hit = false;
-			for(const auto& geometry : geometries) {
-				if (geometry->intersect(ray, &ray.tMax, isect)) {
-					hit = true;
+		bool intersect(Ray& ray, HitRecord* hit) const override {
+			return intersectGeometries<false>(ray, hit, nullptr);
+		}
+
+		bool intersectAny(const Ray& ray) const override {
+			return intersectAnyGeometries<false>(ray, nullptr);
+		}
+
+		bool intersectWithStatistics(Ray& ray, HitRecord* hit, TraversalStatistics* stats) const override {
+			return intersectGeometries<true>(ray, hit, stats);
+		}
+
+		bool intersectAnyWithStatistics(const Ray& ray, TraversalStatistics* stats) const override {
+			return intersectAnyGeometries<true>(ray, stats);
+		}
+
+		// 全てのプリミティブを 1 つのリーフに入れたものとして扱う
+		AccelerationStructureStatistics statistics() const override {
+			AccelerationStructureStatistics stats;
+			Bounds3f bound;
+			for (const auto& geometry : geometries) {
+				bound = merge(bound, geometry->bound());
+			}
+			stats.addLeaf(bound, 0, geometries.size(), 1.0f);
+			stats.memoryBytes = sizeof(Geometry*) * geometries.size();
+			stats.finish(bound);
+			return stats;
+		}
+
+		void refit() override {}
+
+	private:
+		std::vector<Geometry*> geometries;
+
+		template<bool CountStatistics> bool intersectGeometries(Ray& ray, HitRecord* hit, TraversalStatistics* stats) const {
+			bool found = false;
+			for (const auto& geometry : geometries) {
+				if (intersectGeometry<CountStatistics>(geometry, ray, hit, stats)) {
+					found = true;
 				}
 			}
-			return hit;
+			return found;
 		}
 
-		bool intersectAny(const Ray& ray) const override {
-			Ray rayTmp(ray);
+		template<bool CountStatistics> bool intersectAnyGeometries(const Ray& ray, TraversalStatistics* stats) const {
 			for (const auto& geometry : geometries) {
-				if (geometry->intersectAny(rayTmp)) {
+				if (intersectAnyGeometry<CountStatistics>(geometry, ray, stats)) {
 					return true;
 				}
 			}
 			return false;
 		}
-
-	private:
-		std::vector<Geometry*> geometries;
 	};
 
-	struct BVHNode {
-		~BVHNode() {
+	// 深さ優先順に並べた BVH ノード
+	// 1 つめの子ノードは常に自身の直後に置かれるので、2 つめの子ノードの位置のみを持つ
+	struct LinearBVHNode {
+		float aabbMin[3];
+		float aabbMax[3];
+		union {
+			int primitiveOffset;   // リーフノードの場合
+			int secondChildOffset; // 内部ノードの場合
+		};
+		uint16_t primitiveNum; // 0 なら内部ノード
+		uint8_t axis;
+		uint8_t anyHitSecondFirst; // 1 なら intersectAny で 2 つめの子ノードから辿る
+
+		bool isLeaf() const { return primitiveNum > 0; }
+
+		Bounds3f bound() const {
+			return Bounds3f(Vector3f(aabbMin[0], aabbMin[1], aabbMin[2]), Vector3f(aabbMax[0], aabbMax[1], aabbMax[2]));
+		}
+
+		void setBound(const Bounds3f& b) {
+			for (int i = 0; i < 3; ++i) {
+				aabbMin[i] = b.min[i];
+				aabbMax[i] = b.max[i];
+			}
+		}
+
+		// 遮蔽判定ではどちらの子から辿っても結果は変わらないので、
+		// 遮蔽物を含んでいる見込みの高い、表面積の大きい子ノードを先に辿る
+		void setAnyHitOrder(const Bounds3f& firstChild, const Bounds3f& secondChild) {
+			anyHitSecondFirst = secondChild.surfaceArea() > firstChild.surfaceArea() ? 1 : 0;
+		}
+
+		bool intersect(const Ray& ray, const float invDir[3], const int dirIsNeg[3]) const {
+			const float* bounds[2] = { aabbMin, aabbMax };
+			float t1 = 0;
+			float t2 = ray.tMax;
+			for (int i = 0; i < 3; ++i) {
+				float tNear = (bounds[dirIsNeg[i]][i] - ray.o[i]) * invDir[i];
+				float tFar = (bounds[1 - dirIsNeg[i]][i] - ray.o[i]) * invDir[i];
+				t1 = tNear > t1 ? tNear : t1;
+				t2 = tFar < t2 ? tFar : t2;
+				if (t1 > t2) { return false; }
+			}
+			return true;
 		}
-		int depth;
-		Bounds3f aabb;
-		BVHNode* parent;
-		int axis;
-		const Geometry* geometry;
-		BVHNode* children[2];
+	};
+	static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode must be 32 bytes");
+
+	// BVH 構築時のパラメータ
+	// コストはノードの AABB 判定 1 回あたりを traversalCost、プリミティブとの交差判定 1 回あたりを intersectionCost とする
+	struct BVHBuildSettings {
+		int binNum = 16;
+		float traversalCost = 1.0f;
+		float intersectionCost = 1.0f;
+		int maxPrimitivesInLeaf = 4;
+
+		// 空間分割 (SBVH) を行うかどうか
+		// プリミティブを分割面で切り分けて両側の子ノードから参照させ、細長いプリミティブや重なり合うプリミティブによる子ノード同士の重なりを減らす
+		bool spatialSplit = false;
+		// 物体分割での子ノード同士の重なりの表面積が、根の表面積に対してこの割合より大きいノードでのみ空間分割を試す
+		float spatialSplitOverlapThreshold = 1e-5f;
+		// 空間分割で複製して増やせる参照の数の、プリミティブ数に対する割合の上限
+		float spatialSplitMaxGrowth = 0.3f;
+
+		// Morton 符号の順に並べたプリミティブを上位のビットから分割していく LBVH として構築するかどうか
+		// SAH による構築より木の質は落ちるが構築が速いので、毎フレーム作り直す場合に向く
+		// 有効にした場合、binNum と空間分割の設定は使わない
+		bool linear = false;
+		// LBVH の構築後に、treelet の組み替えで SAH コストを下げる処理を繰り返す回数 (0 なら行わない)
+		int treeletOptimizationIterations = 0;
 	};
 
 	class _BVH : public _AccelerationStructure {
 	public:
-		_BVH(const std::vector<TriangleIndexed*>& primitives) {
-			buildTrianglesAndBVH((const Geometry**)primitives.data(), primitives.size());
+		// index 番目のプリミティブのうち bound 内にある部分を、axis 軸に垂直な plane の位置の平面で分割したそれぞれの側の AABB を求める
+		// 空間分割を行う場合に使い、指定しなければ bound をそのまま分割する
+		using PrimitiveSplitter = std::function<void(int index, const Bounds3f& bound, int axis, float plane, Bounds3f* left, Bounds3f* right)>;
+
+		_BVH(const std::vector<TriangleIndexed*>& primitives, const BVHBuildSettings& settings = BVHBuildSettings()) :
+			settings(settings)
+		{
+			buildTrianglesAndBVH((const Geometry**)primitives.data(), primitives.size(), [&primitives](int index, const Bounds3f& bound, int axis, float plane, Bounds3f* left, Bounds3f* right) {
+				primitives[index]->splitBound(bound, axis, plane, left, right);
+				});
 		}
 
-		_BVH(const std::vector<Object*>& objects) {
+		_BVH(const std::vector<Object*>& objects, const BVHBuildSettings& settings = BVHBuildSettings()) :
+			settings(settings)
+		{
 			buildTrianglesAndBVH((const Geometry**)objects.data(), objects.size());
 		}
 
-		_BVH(const std::vector<Shape*>& shapes) {
+		_BVH(const std::vector<Shape*>& shapes, const BVHBuildSettings& settings = BVHBuildSettings()) :
+			settings(settings)
+		{
 			buildTrianglesAndBVH((const Geometry**)shapes.data(), shapes.size());
 		}
 
-		~_BVH() {
-			delete nodes;
+		// プリミティブの AABB のみから構築する
+		// Geometry を持たないので、交差判定は traverse, traverseAny にプリミティブとの判定を渡して行う
+		_BVH(const std::vector<Bounds3f>& primitiveBounds, const BVHBuildSettings& settings = BVHBuildSettings(), const PrimitiveSplitter& splitPrimitive = nullptr) :
+			settings(settings)
+		{
+			buildBVH(primitiveBounds, splitPrimitive);
 		}
 
-		bool intersect(Ray& ray, SurfaceIntersection* isect) const override {
-			return intersectSub(ray, isect, nodeRoot);
+		// 空の BVH
+		// BVHCache::load で読み込む場合に使う
+		_BVH(const BVHBuildSettings& settings) :
+			settings(settings)
+		{}
+
+		bool intersect(Ray& ray, HitRecord* hit) const override {
+			return intersectPrimitives<false>(ray, hit, nullptr);
 		}
 
 		bool intersectAny(const Ray& ray) const override {
-			return intersectAnySub(ray, nodeRoot);
+			return intersectAnyPrimitives<false>(ray, nullptr);
+		}
+
+		bool intersectWithStatistics(Ray& ray, HitRecord* hit, TraversalStatistics* stats) const override {
+			return intersectPrimitives<true>(ray, hit, stats);
+		}
+
+		bool intersectAnyWithStatistics(const Ray& ray, TraversalStatistics* stats) const override {
+			return intersectAnyPrimitives<true>(ray, stats);
+		}
+
+		AccelerationStructureStatistics statistics() const override {
+			AccelerationStructureStatistics stats;
+			if (nodes.empty()) { return stats; }
+
+			struct NodeEntry {
+				int nodeIndex;
+				int depth;
+			};
+			std::vector<NodeEntry> stack;
+			stack.push_back(NodeEntry{ 0, 0 });
+			while (!stack.empty()) {
+				const NodeEntry entry = stack.back();
+				stack.pop_back();
+				const LinearBVHNode& node = nodes[entry.nodeIndex];
+				if (node.isLeaf()) {
+					stats.addLeaf(node.bound(), entry.depth, node.primitiveNum, settings.intersectionCost);
+				} else {
+					const Bounds3f children[2] = { nodes[entry.nodeIndex + 1].bound(), nodes[node.secondChildOffset].bound() };
+					stats.addInterior(node.bound(), entry.depth, children, 2, settings.traversalCost);
+					stack.push_back(NodeEntry{ node.secondChildOffset, entry.depth + 1 });
+					stack.push_back(NodeEntry{ entry.nodeIndex + 1, entry.depth + 1 });
+				}
+			}
+
+			stats.memoryBytes =
+				sizeof(LinearBVHNode) * nodes.size() +
+				sizeof(int) * primitiveIndices.size() +
+				sizeof(const Geometry*) * primitives.size() +
+				sizeof(float) * builtCosts.size();
+			stats.finish(nodes[0].bound());
+			return stats;
+		}
+
+		int intersectPacket(RayPacket& packet, int activeMask, HitRecord* hits) const override {
+			return traversePacket(packet, activeMask, [&](int offset, int num, RayPacket& leafPacket, int laneMask) {
+				int hitMask = 0;
+				for (int i = offset; i < offset + num; ++i) {
+					hitMask |= primitives[i]->intersectPacket(leafPacket, laneMask, hits);
+				}
+				return hitMask;
+				});
+		}
+
+		int intersectAnyPacket(const RayPacket& packet, int activeMask) const override {
+			return traversePacketAny(packet, activeMask, [&](int offset, int num, const RayPacket& leafPacket, int laneMask) {
+				int occludedMask = 0;
+				for (int i = offset; i < offset + num && occludedMask != laneMask; ++i) {
+					occludedMask |= primitives[i]->intersectAnyPacket(leafPacket, laneMask & ~occludedMask);
+				}
+				return occludedMask;
+				});
+		}
+
+		// intersectLeaf(offset, num, ray) でリーフ内の [offset, offset + num) 番目のプリミティブとの交差判定を行う
+		// intersectLeaf は交差した場合に ray.tMax を交点までの距離に更新して true を返す
+		// CountStatistics が true なら、AABB の判定を行ったノードの数を stats に加える (プリミティブ数は intersectLeaf 側で数える)
+		template<bool CountStatistics = false, typename F> bool traverse(Ray& ray, const F& intersectLeaf, TraversalStatistics* stats = nullptr) const {
+			if (nodes.empty()) { return false; }
+
+			float invDir[3];
+			int dirIsNeg[3];
+			for (int i = 0; i < 3; ++i) {
+				invDir[i] = 1.0f / ray.d[i];
+				dirIsNeg[i] = invDir[i] < 0;
+			}
+
+			bool found = false;
+			int nodesToVisit[MaxDepth];
+			int toVisitNum = 0;
+			int currentNodeIndex = 0;
+			while (true) {
+				const LinearBVHNode& node = nodes[currentNodeIndex];
+				if constexpr (CountStatistics) { ++stats->nodesVisited; }
+				if (node.intersect(ray, invDir, dirIsNeg)) {
+					if (node.isLeaf()) {
+						if (intersectLeaf(node.primitiveOffset, (int)node.primitiveNum, ray)) {
+							found = true;
+						}
+						if (toVisitNum == 0) { break; }
+						currentNodeIndex = nodesToVisit[--toVisitNum];
+					} else {
+						ASSERT(toVisitNum < MaxDepth);
+						if (dirIsNeg[node.axis]) {
+							nodesToVisit[toVisitNum++] = currentNodeIndex + 1;
+							currentNodeIndex = node.secondChildOffset;
+						} else {
+							nodesToVisit[toVisitNum++] = node.secondChildOffset;
+							currentNodeIndex = currentNodeIndex + 1;
+						}
+					}
+				} else {
+					if (toVisitNum == 0) { break; }
+					currentNodeIndex = nodesToVisit[--toVisitNum];
+				}
+			}
+			return found;
+		}
+
+		// intersectLeaf(offset, num, ray) が true を返した時点で打ち切る
+		template<bool CountStatistics = false, typename F> bool traverseAny(const Ray& ray, const F& intersectLeaf, TraversalStatistics* stats = nullptr) const {
+			if (nodes.empty()) { return false; }
+
+			float invDir[3];
+			int dirIsNeg[3];
+			for (int i = 0; i < 3; ++i) {
+				invDir[i] = 1.0f / ray.d[i];
+				dirIsNeg[i] = invDir[i] < 0;
+			}
+
+			int nodesToVisit[MaxDepth];
+			int toVisitNum = 0;
+			int currentNodeIndex = 0;
+			while (true) {
+				const LinearBVHNode& node = nodes[currentNodeIndex];
+				if constexpr (CountStatistics) { ++stats->nodesVisited; }
+				if (node.intersect(ray, invDir, dirIsNeg)) {
+					if (node.isLeaf()) {
+						if (intersectLeaf(node.primitiveOffset, (int)node.primitiveNum, ray)) {
+							return true;
+						}
+						if (toVisitNum == 0) { break; }
+						currentNodeIndex = nodesToVisit[--toVisitNum];
+					} else {
+						ASSERT(toVisitNum < MaxDepth);
+						if (node.anyHitSecondFirst) {
+							nodesToVisit[toVisitNum++] = currentNodeIndex + 1;
+							currentNodeIndex = node.secondChildOffset;
+						} else {
+							nodesToVisit[toVisitNum++] = node.secondChildOffset;
+							currentNodeIndex = currentNodeIndex + 1;
+						}
+					}
+				} else {
+					if (toVisitNum == 0) { break; }
+					currentNodeIndex = nodesToVisit[--toVisitNum];
+				}
+			}
+			return false;
+		}
+
+		// packet のうち activeMask のレイについてまとめてトラバーサルを行い、交差したレイのビットを立てたマスクを返す
+		// intersectLeaf(offset, num, packet, laneMask) は laneMask のレイとリーフ内のプリミティブとの交差判定を行い、
+		// 交差したレイの packet.tMax を交点までの距離に更新して、それらのビットを立てたマスクを返す
+		template<typename F> int traversePacket(RayPacket& packet, int activeMask, const F& intersectLeaf) const {
+			if (nodes.empty() || activeMask == 0) { return 0; }
+
+			const RayPacketSIMD packetSIMD(packet, activeMask);
+
+			int hitMask = 0;
+			int nodesToVisit[MaxDepth];
+			int toVisitNum = 0;
+			int currentNodeIndex = 0;
+			while (true) {
+				const LinearBVHNode& node = nodes[currentNodeIndex];
+				const int laneMask = packetSIMD.mayIntersect(node) ? packetSIMD.intersect(node, packet.tMax) & activeMask : 0;
+				if (laneMask) {
+					if (node.isLeaf()) {
+						hitMask |= intersectLeaf(node.primitiveOffset, (int)node.primitiveNum, packet, laneMask);
+						if (toVisitNum == 0) { break; }
+						currentNodeIndex = nodesToVisit[--toVisitNum];
+					} else {
+						ASSERT(toVisitNum < MaxDepth);
+						if (packetSIMD.dirIsNeg[node.axis]) {
+							nodesToVisit[toVisitNum++] = currentNodeIndex + 1;
+							currentNodeIndex = node.secondChildOffset;
+						} else {
+							nodesToVisit[toVisitNum++] = node.secondChildOffset;
+							currentNodeIndex = currentNodeIndex + 1;
+						}
+					}
+				} else {
+					if (toVisitNum == 0) { break; }
+					currentNodeIndex = nodesToVisit[--toVisitNum];
+				}
+			}
+			return hitMask;
+		}
+
+		// 遮蔽されたレイのビットを立てたマスクを返す
+		// intersectLeaf(offset, num, packet, laneMask) は laneMask のうち遮蔽されたレイのビットを立てたマスクを返す
+		// 全てのレイが遮蔽された時点で打ち切る
+		template<typename F> int traversePacketAny(const RayPacket& packet, int activeMask, const F& intersectLeaf) const {
+			if (nodes.empty() || activeMask == 0) { return 0; }
+
+			const RayPacketSIMD packetSIMD(packet, activeMask);
+
+			int occludedMask = 0;
+			int nodesToVisit[MaxDepth];
+			int toVisitNum = 0;
+			int currentNodeIndex = 0;
+			while (true) {
+				const LinearBVHNode& node = nodes[currentNodeIndex];
+				const int laneMask = packetSIMD.mayIntersect(node) ? packetSIMD.intersect(node, packet.tMax) & activeMask & ~occludedMask : 0;
+				if (laneMask) {
+					if (node.isLeaf()) {
+						occludedMask |= intersectLeaf(node.primitiveOffset, (int)node.primitiveNum, packet, laneMask);
+						if (occludedMask == activeMask) { break; }
+						if (toVisitNum == 0) { break; }
+						currentNodeIndex = nodesToVisit[--toVisitNum];
+					} else {
+						ASSERT(toVisitNum < MaxDepth);
+						if (node.anyHitSecondFirst) {
+							nodesToVisit[toVisitNum++] = currentNodeIndex + 1;
+							currentNodeIndex = node.secondChildOffset;
+						} else {
+							nodesToVisit[toVisitNum++] = node.secondChildOffset;
+							currentNodeIndex = currentNodeIndex + 1;
+						}
+					}
+				} else {
+					if (toVisitNum == 0) { break; }
+					currentNodeIndex = nodesToVisit[--toVisitNum];
+				}
+			}
+			return occludedMask;
+		}
+
+		void refit() override {
+			refit([this](int i) { return primitives[i]->bound(); });
+		}
+
+		// primitiveBound(i) はリーフ内の並びで i 番目のプリミティブの現在の AABB
+		template<typename F> void refit(const F& primitiveBound) {
+			forEachNodeBottomUp([&](int i) {
+				LinearBVHNode& node = nodes[i];
+				Bounds3f bound;
+				if (node.isLeaf()) {
+					for (int k = 0; k < node.primitiveNum; ++k) {
+						bound = merge(bound, primitiveBound(node.primitiveOffset + k));
+					}
+				} else {
+					const Bounds3f firstBound = nodes[i + 1].bound();
+					const Bounds3f secondBound = nodes[node.secondChildOffset].bound();
+					bound = merge(firstBound, secondBound);
+					node.setAnyHitOrder(firstBound, secondBound);
+				}
+				node.setBound(bound);
+				});
+		}
+
+		bool rebuildDegradedSubtree(float threshold) override {
+			return rebuildDegradedSubtree(threshold, [this](int i) { return primitives[i]->bound(); });
+		}
+
+		// 作り直した部分木の範囲ではリーフ内のプリミティブの並びが変わるので、primitiveOrder を参照し直すこと
+		template<typename F> bool rebuildDegradedSubtree(float threshold, const F& primitiveBound) {
+			if (nodes.empty()) { return false; }
+
+			std::vector<float> currentCosts;
+			computeCosts(&currentCosts);
+
+			auto isDegraded = [&](int i) {
+				return builtCosts[i] > 0.0f && currentCosts[i] > builtCosts[i] * threshold;
+			};
+			if (!isDegraded(0)) { return false; }
+
+			// 悪化した部分木が片側の子にしかなければそちらへ降りていき、悪化した部分を全て含む最小の部分木を探す
+			int root = 0;
+			int depth = 0;
+			while (!nodes[root].isLeaf()) {
+				const bool left = isDegraded(root + 1);
+				const bool right = isDegraded(nodes[root].secondChildOffset);
+				if (left == right) { break; }
+				root = left ? root + 1 : nodes[root].secondChildOffset;
+				++depth;
+			}
+
+			rebuildSubtree(root, depth, primitiveBound);
+			return true;
 		}
 
+		// リーフ内の並びで i 番目のプリミティブが、構築時に渡した配列の何番目のものか
+		// 空間分割を行った場合は、同じプリミティブが複数のリーフに現れる
+		const std::vector<int>& primitiveOrder() const { return primitiveIndices; }
+
 	private:
-		BVHNode* nodeRoot;
-		BVHNode* nodes;
-		int nodeCount = 0;
+		template<int Width> friend class _WideBVH;
+		friend class BVHCache;
+
+		// トラバーサル用スタックの大きさ
+		// 構築時にこれを超える深さにならないようにしている
+		static const int MaxDepth = 128;
+		static const int MedianSplitDepth = MaxDepth - 32;
+
+		// この数以上のプリミティブを持つ上位のノードは、ビニングを並列に行いながら分割し、
+		// それより小さい部分木はスレッドごとに独立して構築する
+		// スレッド数ではなくプリミティブ数で切り替えているので、構築結果はスレッド数によらず同じになる
+		static const int ParallelBuildPrimitiveNum = 16 * 1024;
+		static const int ParallelBinningChunkNum = 64;
+
+		// refit などで同じ深さのノードを並列に処理する際の、並列化するノード数の下限
+		static const int ParallelRefitNodeNum = 1024;
+
+		using T_SIMD = simdpp::float32x8;
+		using T_SIMDUINT = simdpp::uint32x8;
+		using T_SIMDMASK = simdpp::mask_float32x8;
+		static_assert(RayPacket::Size == 8, "RayPacket::Size must match the SIMD width");
+
+		// RayPacket の各レイを SIMD レジスタのレーンに展開したもの
+		struct RayPacketSIMD {
+			T_SIMD o[3];
+			T_SIMD invDir[3];
+			T_SIMDMASK dirIsNegMask[3];
+			int dirIsNeg[3]; // 子ノードを辿る順に使う、最初の有効なレイのもの
+
+			// 全ての有効なレイで方向の符号が揃っている場合は、原点と方向の逆数の範囲から
+			// 全てのレイの交差区間を含む区間を求め、どのレイも交差しないノードを SIMD での判定の前に除く
+			bool coherent;
+			float oMin[3], oMax[3];
+			float invDirMin[3], invDirMax[3];
+			float tMaxMax;
+
+			RayPacketSIMD(const RayPacket& packet, int activeMask) {
+				int first = 0;
+				while (!(activeMask & (1 << first))) { ++first; }
+
+				coherent = true;
+				tMaxMax = 0.0f;
+				for (int i = 0; i < RayPacket::Size; ++i) {
+					if (activeMask & (1 << i)) {
+						tMaxMax = std::max(tMaxMax, packet.tMax[i]);
+					}
+				}
+
+				const T_SIMD zero = simdpp::make_zero();
+				for (int axis = 0; axis < 3; ++axis) {
+					float invD[RayPacket::Size];
+					for (int i = 0; i < RayPacket::Size; ++i) {
+						invD[i] = 1.0f / packet.d[axis][i];
+					}
+					o[axis] = simdpp::load_u<T_SIMD>(packet.o[axis]);
+					invDir[axis] = simdpp::load_u<T_SIMD>(invD);
+					dirIsNegMask[axis] = simdpp::cmp_lt(invDir[axis], zero);
+					dirIsNeg[axis] = invD[first] < 0;
+
+					oMin[axis] = oMax[axis] = packet.o[axis][first];
+					invDirMin[axis] = invDirMax[axis] = invD[first];
+					for (int i = 0; i < RayPacket::Size; ++i) {
+						if (!(activeMask & (1 << i))) { continue; }
+						if ((invD[i] < 0) != (bool)dirIsNeg[axis] || fabsf(invD[i]) == Infinity) {
+							coherent = false;
+						}
+						oMin[axis] = std::min(oMin[axis], packet.o[axis][i]);
+						oMax[axis] = std::max(oMax[axis], packet.o[axis][i]);
+						invDirMin[axis] = std::min(invDirMin[axis], invD[i]);
+						invDirMax[axis] = std::max(invDirMax[axis], invD[i]);
+					}
+				}
+			}
+
+			// どのレイとも交差しないことが確定した場合のみ false を返す
+			bool mayIntersect(const LinearBVHNode& node) const {
+				return mayIntersect(node.aabbMin, node.aabbMax);
+			}
+
+			bool mayIntersect(const float* aabbMin, const float* aabbMax) const {
+				if (!coherent) { return true; }
+				const float* bounds[2] = { aabbMin, aabbMax };
+				float t1 = 0;
+				float t2 = tMaxMax;
+				for (int i = 0; i < 3; ++i) {
+					// (境界 - 原点) * 方向の逆数 は原点と方向の逆数について双線形なので、範囲の角で最小値と最大値をとる
+					float nearO[2] = { bounds[dirIsNeg[i]][i] - oMin[i], bounds[dirIsNeg[i]][i] - oMax[i] };
+					float farO[2] = { bounds[1 - dirIsNeg[i]][i] - oMin[i], bounds[1 - dirIsNeg[i]][i] - oMax[i] };
+					float tNearMin = std::min(
+						std::min(nearO[0] * invDirMin[i], nearO[0] * invDirMax[i]),
+						std::min(nearO[1] * invDirMin[i], nearO[1] * invDirMax[i]));
+					float tFarMax = std::max(
+						std::max(farO[0] * invDirMin[i], farO[0] * invDirMax[i]),
+						std::max(farO[1] * invDirMin[i], farO[1] * invDirMax[i]));
+					t1 = tNearMin > t1 ? tNearMin : t1;
+					t2 = tFarMax < t2 ? tFarMax : t2;
+					if (t1 > t2) { return false; }
+				}
+				return true;
+			}
+
+			// ノードと交差したレイのビットを立てたマスクを返す
+			int intersect(const LinearBVHNode& node, const float* tMax) const {
+				return intersect(node.aabbMin, node.aabbMax, tMax);
+			}
+
+			int intersect(const float* aabbMin, const float* aabbMax, const float* tMax) const {
+				T_SIMD t1 = simdpp::make_zero();
+				T_SIMD t2 = simdpp::load_u<T_SIMD>(tMax);
+				for (int axis = 0; axis < 3; ++axis) {
+					T_SIMD lower = simdpp::splat<T_SIMD>(aabbMin[axis]);
+					T_SIMD upper = simdpp::splat<T_SIMD>(aabbMax[axis]);
+					T_SIMD near = simdpp::blend(upper, lower, dirIsNegMask[axis]);
+					T_SIMD far = simdpp::blend(lower, upper, dirIsNegMask[axis]);
+					T_SIMD tNear = simdpp::mul(simdpp::sub(near, o[axis]), invDir[axis]);
+					T_SIMD tFar = simdpp::mul(simdpp::sub(far, o[axis]), invDir[axis]);
+					// NaN になったレーンでは LinearBVHNode::intersect と同じく区間を更新しない
+					t1 = simdpp::max(tNear, t1);
+					t2 = simdpp::min(tFar, t2);
+				}
+
+				uint32_t mask[RayPacket::Size];
+				simdpp::store_u(mask, simdpp::bit_cast<T_SIMDUINT>(simdpp::cmp_le(t1, t2)));
+
+				int hitMask = 0;
+				for (int i = 0; i < RayPacket::Size; ++i) {
+					if (mask[i]) { hitMask |= 1 << i; }
+				}
+				return hitMask;
+			}
+		};
+
+		BVHBuildSettings settings;
+
+		std::vector<LinearBVHNode> nodes;
+
+		// 構築時に渡したプリミティブの数
+		int sourcePrimitiveNum = 0;
+
+		// リーフ内の並びでのプリミティブ
+		// AABB のみから構築した場合、primitives は空になる
+		std::vector<int> primitiveIndices;
+		std::vector<const Geometry*> primitives;
+
+		// 構築時の各ノードの SAH コスト (ノードの表面積で正規化したもの)
+		std::vector<float> builtCosts;
+
+		// ノード番号を深さごとにまとめたもの
+		// 深さ d のノードは levelOrder の levelOffsets[d] から levelOffsets[d+1] の範囲に入っている
+		// 木構造が変わったら空にしておき、必要になった時点で作り直す
+		std::vector<int> levelOrder;
+		std::vector<int> levelOffsets;
 
 		struct GeoBounds {
-			const Geometry* geometry;
+			int index;
 			Bounds3f bound;
 			Vector3f center;
 
-			GeoBounds(const Geometry* geometry, const Bounds3f& bound, const Vector3f& center):
-				geometry(geometry),
+			GeoBounds() {}
+
+			GeoBounds(int index, const Bounds3f& bound, const Vector3f& center):
+				index(index),
 				bound(bound),
 				center(center)
 			{}
 		};
 
-		bool intersectSub(Ray& ray, SurfaceIntersection* isect, BVHNode* node) const {
-			if (!node->aabb.intersect(ray, nullptr, nullptr)) {
-				return false;
-			}
+		using GeoIterator = std::vector<GeoBounds>::iterator;
 
-			if (node->geometry) {
-				return node->geometry->intersect(ray, &ray.tMax, isect);
-			}
+		struct BucketComputation {
+			std::vector<Bounds3f> bucketBounds, boundsRight;
+			std::vector<int> bucketSizes;
 
-			bool hit0, hit1;
-			if (ray.d[node->axis] > 0) {
-				hit0 = intersectSub(ray, isect, node->children[0]);
-				hit1 = intersectSub(ray, isect, node->children[1]);
-			} else {
-				hit1 = intersectSub(ray, isect, node->children[1]);
-				hit0 = intersectSub(ray, isect, node->children[0]);
+			BucketComputation(int binNum) :
+				bucketBounds(binNum),
+				boundsRight(binNum),
+				bucketSizes(binNum)
+			{}
+		};
+
+		// 重心の位置からビンの番号を求める
+		struct BinMapping {
+			int axis;
+			float centerMin;
+			float binScale;
+			int binNum;
+
+			BinMapping(int axis, float centerMin, float centerMax, int binNum) :
+				axis(axis),
+				centerMin(centerMin),
+				binScale(binNum / (centerMax - centerMin)),
+				binNum(binNum)
+			{}
+
+			int operator()(const GeoBounds& g) const {
+				int b = (int)((g.center[axis] - centerMin) * binScale);
+				return clamp(b, 0, binNum - 1);
 			}
-			return hit0 || hit1;
+		};
+
+		// 部分木ごとの構築結果
+		// ノードとプリミティブの位置は部分木内でのものになっている
+		struct BuildOutput {
+			std::vector<LinearBVHNode> nodes;
+			std::vector<int> primitiveIndices;
+		};
+
+		struct SubtreeTask {
+			GeoIterator begin, end;
+			int depth;
+			Bounds3f aabb;
+			BuildOutput output;
+			// 空間分割を行う場合は、参照を複製するので begin, end の代わりにタスクごとに参照の配列を持つ
+			std::vector<GeoBounds> references;
+			int splitBudget = 0;
+		};
+
+		// 並列に分割した上位の階層
+		// 部分木の構築タスクに置き換えられたノードは taskIndices にタスクの番号を持つ (それ以外は -1)
+		struct TopLevel {
+			std::vector<LinearBVHNode> nodes;
+			std::vector<int> taskIndices;
+			std::vector<SubtreeTask> tasks;
+		};
+
+		template<bool CountStatistics> bool intersectPrimitives(Ray& ray, HitRecord* hit, TraversalStatistics* stats) const {
+			return traverse<CountStatistics>(ray, [&](int offset, int num, Ray& leafRay) {
+				bool found = false;
+				for (int i = offset; i < offset + num; ++i) {
+					if (intersectGeometry<CountStatistics>(primitives[i], leafRay, hit, stats)) {
+						found = true;
+					}
+				}
+				return found;
+				}, stats);
 		}
 
-		bool intersectAnySub(const Ray& ray, BVHNode* node) const {
-			if (!node->aabb.intersect(ray, nullptr, nullptr)) {
+		template<bool CountStatistics> bool intersectAnyPrimitives(const Ray& ray, TraversalStatistics* stats) const {
+			return traverseAny<CountStatistics>(ray, [&](int offset, int num, const Ray& leafRay) {
+				for (int i = offset; i < offset + num; ++i) {
+					if (intersectAnyGeometry<CountStatistics>(primitives[i], leafRay, stats)) {
+						return true;
+					}
+				}
 				return false;
-			}
+				}, stats);
+		}
 
-			if (node->geometry) {
-				return node->geometry->intersectAny(ray);
+		void buildTrianglesAndBVH(const Geometry** data, int primNum, const PrimitiveSplitter& splitPrimitive = nullptr) {
+			std::vector<Bounds3f> primitiveBounds(primNum);
+#pragma omp parallel for
+			for (int i = 0; i < primNum; ++i) {
+				primitiveBounds[i] = data[i]->bound();
 			}
 
-			if (ray.d[node->axis] > 0) {
-				if (    intersectAnySub(ray, node->children[0])
-					 || intersectAnySub(ray, node->children[1])){ return true; }
-			} else {
-				if (    intersectAnySub(ray, node->children[1])
-					 || intersectAnySub(ray, node->children[0])){ return true; }
+			buildBVH(primitiveBounds, splitPrimitive);
+
+			primitives.resize(primitiveIndices.size());
+			for (int i = 0; i < (int)primitiveIndices.size(); ++i) {
+				primitives[i] = data[primitiveIndices[i]];
 			}
-			return false;
 		}
 
-		struct BucketComputation {
-			std::vector<Bounds3f> bucketBounds, bucketBounds1, bucketBounds2;
-			std::vector<int> bucketSizes, bucketSizes1, bucketSizes2;
-		};
+		void buildBVH(const std::vector<Bounds3f>& primitiveBounds, const PrimitiveSplitter& splitPrimitive) {
+			nodes.clear();
+			primitiveIndices.clear();
+			primitives.clear();
+			builtCosts.clear();
+			levelOrder.clear();
+			const int primNum = primitiveBounds.size();
+			sourcePrimitiveNum = primNum;
+			if (primNum == 0) { return; }
 
-		void buildTrianglesAndBVH(const Geometry** data, int primNum) {
-			ASSERT(primNum > 0);
-			std::vector<GeoBounds> aabbPrimitives;
-			aabbPrimitives.reserve(primNum);
+			ASSERT(settings.binNum >= 2);
+			ASSERT(settings.maxPrimitivesInLeaf >= 1 && settings.maxPrimitivesInLeaf <= std::numeric_limits<uint16_t>::max());
+
+			std::vector<GeoBounds> aabbPrimitives(primNum);
+#pragma omp parallel for
 			for (int i = 0; i < primNum; ++i) {
-				const Geometry* geo = data[i];
-				Bounds3f bound = geo->bound();
-				aabbPrimitives.push_back(GeoBounds(geo, bound, bound.center()));
+				const Bounds3f& bound = primitiveBounds[i];
+				aabbPrimitives[i] = GeoBounds(i, bound, bound.center());
 			}
 
-			int treeDepth = ceil(log2((float)primNum));
-			nodes = (BVHNode*)calloc(pow(2, treeDepth + 1), sizeof(BVHNode));
+			BuildOutput output =
+				settings.linear ? buildLinearTree(aabbPrimitives, 0) :
+				settings.spatialSplit ? buildSpatialSplitTree(std::move(aabbPrimitives), splitPrimitive) :
+				buildSubtree(aabbPrimitives, 0);
+			nodes = std::move(output.nodes);
+			primitiveIndices = std::move(output.primitiveIndices);
+			nodes.shrink_to_fit();
+			primitiveIndices.shrink_to_fit();
+
+			computeCosts(&builtCosts);
+		}
+
+		// aabbPrimitives を並べ替えながら、それらを含む部分木を構築する
+		// depth は部分木の根の深さ
+		BuildOutput buildSubtree(std::vector<GeoBounds>& aabbPrimitives, int depth) const {
+			const int primNum = aabbPrimitives.size();
+			Bounds3f rootAABB = mergeRange(aabbPrimitives.begin(), aabbPrimitives.end(), true, [](const GeoBounds& g) { return g.bound; });
 
-			nodeRoot = &nodes[nodeCount++];
-			nodeRoot->depth = 0;
+			TopLevel top;
+			BucketComputation bucket(settings.binNum);
+			buildTopSub(aabbPrimitives.begin(), aabbPrimitives.end(), bucket, depth, rootAABB, top);
 
-			nodeRoot->aabb = Bounds3f();
-			for (auto it = aabbPrimitives.begin(); it != aabbPrimitives.end(); ++it) {
-				nodeRoot->aabb = merge(nodeRoot->aabb, it->bound);
+#pragma omp parallel for schedule(dynamic, 1)
+			for (int i = 0; i < (int)top.tasks.size(); ++i) {
+				SubtreeTask& task = top.tasks[i];
+				const int taskPrimNum = (int)(task.end - task.begin);
+				// 二分木なのでノード数は高々 2n-1
+				task.output.nodes.reserve(2 * taskPrimNum - 1);
+				task.output.primitiveIndices.reserve(taskPrimNum);
+				BucketComputation taskBucket(settings.binNum);
+				buildBVHSub(task.begin, task.end, taskBucket, task.depth, task.aabb, task.output);
 			}
 
-			BucketComputation bucket;
+			if (top.tasks.size() == 1) {
+				return std::move(top.tasks[0].output);
+			}
 
-			buildBVHSub(aabbPrimitives.begin(), aabbPrimitives.end(), nodeRoot, bucket);
+			BuildOutput output;
+			output.nodes.reserve(2 * primNum - 1);
+			output.primitiveIndices.reserve(primNum);
+			appendTopSub(top, 0, output);
+			return output;
 		}
 
-		void buildBVHSub(typename std::vector<GeoBounds>::iterator begin, const typename std::vector<GeoBounds>::iterator& end, BVHNode* node, BucketComputation& bucket, int depth = 0, const Bounds3f& aabb = Bounds3f()) {
-
-			if (end - begin == 1) {
-				node->geometry = begin->geometry;
-				node->aabb = begin->bound;
-				return;
-			}
+		// root を根とする部分木を、同じプリミティブで構築し直して置き換える
+		// 部分木のプリミティブはリーフ内の並びで連続しているので、置き換えてもそれ以外のプリミティブの位置は変わらない
+		template<typename F> void rebuildSubtree(int root, int depth, const F& primitiveBound) {
+			int first = root;
+			while (!nodes[first].isLeaf()) { first = first + 1; }
+			int last = root;
+			while (!nodes[last].isLeaf()) { last = nodes[last].secondChildOffset; }
+			const int nodeEnd = last + 1;
+			const int primBegin = nodes[first].primitiveOffset;
+			const int primEnd = nodes[last].primitiveOffset + nodes[last].primitiveNum;
+			const int primNum = primEnd - primBegin;
 
-			if (depth != 0) {
-				node->aabb = aabb;
+			// ここでは部分木内での位置をプリミティブの番号として構築し、後で元の番号に置き換える
+			std::vector<GeoBounds> aabbPrimitives(primNum);
+#pragma omp parallel for
+			for (int i = 0; i < primNum; ++i) {
+				Bounds3f bound = primitiveBound(primBegin + i);
+				aabbPrimitives[i] = GeoBounds(i, bound, bound.center());
 			}
 
-			int axis = node->aabb.size().maxDimension();
-			node->axis = axis;
-			std::sort(begin, end, [axis](const GeoBounds& a, const GeoBounds& b) {
-				return a.center[axis] < b.center[axis];
-				});
+			BuildOutput output = settings.linear ? buildLinearTree(aabbPrimitives, depth) : buildSubtree(aabbPrimitives, depth);
+			const int subtreeNodeNum = output.nodes.size();
 
-			int splitIndex;
-			Bounds3f splitAABB1, splitAABB2;
-			if ((int)(end - begin) <= 8) {
-				const int primNum = (int)(end - begin);
-				splitIndex = primNum / 2;
+			// 部分木の前後のノードが指している位置をずらす
+			const int delta = subtreeNodeNum - (nodeEnd - root);
+			for (int i = 0; i < root; ++i) {
+				if (!nodes[i].isLeaf() && nodes[i].secondChildOffset >= nodeEnd) {
+					nodes[i].secondChildOffset += delta;
+				}
+			}
+			for (int i = nodeEnd; i < (int)nodes.size(); ++i) {
+				if (!nodes[i].isLeaf()) {
+					nodes[i].secondChildOffset += delta;
+				}
+			}
+			for (auto& node : output.nodes) {
+				if (node.isLeaf()) {
+					node.primitiveOffset += primBegin;
+				} else {
+					node.secondChildOffset += root;
+				}
+			}
 
-				splitAABB1 = Bounds3f();
-				for (int i = 0; i < splitIndex; ++i) { splitAABB1 = merge(splitAABB1, (begin + i)->bound); }
-				splitAABB2 = Bounds3f();
-				for (int i = splitIndex; i < primNum; ++i) { splitAABB2 = merge(splitAABB2, (begin + i)->bound); }
+			nodes.erase(nodes.begin() + root, nodes.begin() + nodeEnd);
+			nodes.insert(nodes.begin() + root, output.nodes.begin(), output.nodes.end());
+			const std::vector<int> oldIndices(primitiveIndices.begin() + primBegin, primitiveIndices.begin() + primEnd);
+			for (int i = 0; i < primNum; ++i) {
+				primitiveIndices[primBegin + i] = oldIndices[output.primitiveIndices[i]];
+			}
+			if (!primitives.empty()) {
+				const std::vector<const Geometry*> oldPrimitives(primitives.begin() + primBegin, primitives.begin() + primEnd);
+				for (int i = 0; i < primNum; ++i) {
+					primitives[primBegin + i] = oldPrimitives[output.primitiveIndices[i]];
+				}
+			}
+			levelOrder.clear();
 
-			}else{
-				float bestSAH = Infinity;
-				const int primNum = (int)(end - begin);
+			// 作り直した部分木のみ、構築時のコストを更新する
+			std::vector<float> currentCosts;
+			computeCosts(&currentCosts);
+			builtCosts.erase(builtCosts.begin() + root, builtCosts.begin() + nodeEnd);
+			builtCosts.insert(builtCosts.begin() + root, currentCosts.begin() + root, currentCosts.begin() + root + subtreeNodeNum);
+		}
 
-				static auto calcSAH = [](const Bounds3f& aabb, const Bounds3f& aabb1, const Bounds3f& aabb2, int objNum1, int objNum2) {
-					return  aabb1.surfaceArea() * objNum1 + aabb2.surfaceArea() * objNum2;
-				};
+		void computeLevels() {
+			std::vector<int> depths(nodes.size());
+			int maxDepth = 0;
+			depths[0] = 0;
+			for (int i = 0; i < (int)nodes.size(); ++i) {
+				maxDepth = max(maxDepth, depths[i]);
+				if (!nodes[i].isLeaf()) {
+					depths[i + 1] = depths[i] + 1;
+					depths[nodes[i].secondChildOffset] = depths[i] + 1;
+				}
+			}
 
-				const int BucketNumMax = 8;
+			levelOffsets.assign(maxDepth + 2, 0);
+			for (int d : depths) { ++levelOffsets[d + 1]; }
+			for (int d = 0; d <= maxDepth; ++d) { levelOffsets[d + 1] += levelOffsets[d]; }
 
-				bucket.bucketBounds.clear();
-				bucket.bucketBounds1.clear();
-				bucket.bucketBounds2.clear();
-				bucket.bucketSizes.clear();
-				bucket.bucketSizes1.clear();
-				bucket.bucketSizes2.clear();
+			std::vector<int> counts(levelOffsets.begin(), levelOffsets.end() - 1);
+			levelOrder.resize(nodes.size());
+			for (int i = 0; i < (int)nodes.size(); ++i) {
+				levelOrder[counts[depths[i]]++] = i;
+			}
+		}
 
-				const int bucketNum = min(BucketNumMax, primNum);
+		// 深い方から 1 段ずつ、同じ深さのノードに対して並列に f を呼ぶ
+		// f が呼ばれる時点で、そのノードの子ノードに対する f は全て終わっている
+		template<typename F> void forEachNodeBottomUp(F f) {
+			if (nodes.empty()) { return; }
+			if (levelOrder.empty()) { computeLevels(); }
 
-				int bucketBegin = 0;
-				for (int i = 0; i < bucketNum; ++i) {
-					Bounds3f bound;
-					int bucketEnd = primNum * (i+1) / bucketNum;
-					int bucketSize = bucketEnd - bucketBegin;
-					auto bucketOffset = begin + bucketBegin;
-					for (int k = 0; k < bucketSize; ++k) {
-						bound = merge(bound, (bucketOffset + k)->bound);
-					}
-					bucket.bucketBounds.push_back(bound);
-					bucket.bucketSizes.push_back(bucketSize);
-					bucketBegin = bucketEnd;
+			for (int d = (int)levelOffsets.size() - 2; d >= 0; --d) {
+				const int levelBegin = levelOffsets[d];
+				const int levelEnd = levelOffsets[d + 1];
+#pragma omp parallel for if(levelEnd - levelBegin >= ParallelRefitNodeNum)
+				for (int k = levelBegin; k < levelEnd; ++k) {
+					f(levelOrder[k]);
 				}
+			}
+		}
 
-				for (int i = 0; i < bucketNum - 1; ++i) {
-					bucket.bucketBounds1.push_back(bucket.bucketBounds[i]);
-					bucket.bucketSizes1.push_back(bucket.bucketSizes[i]);
-					if (i > 0) {
-						bucket.bucketBounds1[i] = merge(bucket.bucketBounds1[i], bucket.bucketBounds1[i - 1]);
-						bucket.bucketSizes1[i] += bucket.bucketSizes1[i - 1];
-					}
+		// 各ノードを根とする部分木の SAH コストを、ノードの表面積で正規化して求める
+		void computeCosts(std::vector<float>* normalizedCosts) {
+			std::vector<float> costs(nodes.size());
+			normalizedCosts->resize(nodes.size());
+			forEachNodeBottomUp([&](int i) {
+				const LinearBVHNode& node = nodes[i];
+				const float area = node.bound().surfaceArea();
+				if (node.isLeaf()) {
+					costs[i] = settings.intersectionCost * node.primitiveNum * area;
+				} else {
+					costs[i] = settings.traversalCost * area + costs[i + 1] + costs[node.secondChildOffset];
 				}
+				(*normalizedCosts)[i] = area > 0.0f ? costs[i] / area : 0.0f;
+				});
+		}
 
-				for (int i = 0; i < bucketNum - 1; ++i) {
-					bucket.bucketBounds2.push_back(bucket.bucketBounds[bucketNum - 1 - i]);
-					bucket.bucketSizes2.push_back(bucket.bucketSizes[bucketNum - 1 - i]);
-					if (i > 0) {
-						bucket.bucketBounds2[i] = merge(bucket.bucketBounds2[i], bucket.bucketBounds2[i - 1]);
-						bucket.bucketSizes2[i] += bucket.bucketSizes2[i - 1];
-					}
+		// 範囲内の要素から得られる AABB もしくは点をすべて含む AABB を求める
+		template<typename F> static Bounds3f mergeRange(GeoIterator begin, const GeoIterator& end, bool parallel, F f) {
+			if (!parallel) {
+				Bounds3f res;
+				for (auto it = begin; it != end; ++it) {
+					res = merge(res, f(*it));
 				}
+				return res;
+			}
 
-				int bucketIndex;
-				for (int i = 0; i < bucketNum - 1; i++) {
-					float sah = calcSAH(aabb, bucket.bucketBounds1[i], bucket.bucketBounds2[bucketNum - 2 - i], bucket.bucketSizes1[i], bucket.bucketSizes2[bucketNum - 2 - i]);
-					if (sah < bestSAH) {
-						splitIndex = bucket.bucketSizes1[i];
-						bucketIndex = i;
-						bestSAH = sah;
-					}
+			const int primNum = (int)(end - begin);
+			Bounds3f chunkBounds[ParallelBinningChunkNum];
+#pragma omp parallel for
+			for (int c = 0; c < ParallelBinningChunkNum; ++c) {
+				GeoIterator chunkBegin = begin + (int)((int64_t)primNum * c / ParallelBinningChunkNum);
+				GeoIterator chunkEnd = begin + (int)((int64_t)primNum * (c + 1) / ParallelBinningChunkNum);
+				Bounds3f b;
+				for (auto it = chunkBegin; it != chunkEnd; ++it) {
+					b = merge(b, f(*it));
 				}
-				splitAABB1 = bucket.bucketBounds1[bucketIndex];
-				splitAABB2 = bucket.bucketBounds2[bucketNum - 2 - bucketIndex];
+				chunkBounds[c] = b;
 			}
 
-			node->children[0] = &nodes[nodeCount++];
-			node->children[1] = &nodes[nodeCount++];
-			node->children[0]->depth = node->depth + 1;
-			node->children[1]->depth = node->depth + 1;
-			node->children[0]->parent = node;
-			node->children[1]->parent = node;
-
-			buildBVHSub(begin, begin + splitIndex, node->children[0], bucket, depth + 1, std::move(splitAABB1));
-			buildBVHSub(begin + splitIndex, end, node->children[1], bucket, depth + 1, std::move(splitAABB2));
+			Bounds3f res;
+			for (int c = 0; c < ParallelBinningChunkNum; ++c) {
+				res = merge(res, chunkBounds[c]);
+			}
+			return res;
 		}
 
+		void computeBins(GeoIterator begin, const GeoIterator& end, const BinMapping& binMapping, BucketComputation& bucket, bool parallel) const {
+			const int binNum = settings.binNum;
+			for (int i = 0; i < binNum; ++i) {
+				bucket.bucketBounds[i] = Bounds3f();
+				bucket.bucketSizes[i] = 0;
+			}
+
+			if (!parallel) {
+				for (auto it = begin; it != end; ++it) {
+					int b = binMapping(*it);
+					bucket.bucketBounds[b] = merge(bucket.bucketBounds[b], it->bound);
+					++bucket.bucketSizes[b];
+				}
+				return;
+			}
+
+			// チャンクごとにビンを作ってから足し合わせる
+			const int primNum = (int)(end - begin);
+			std::vector<Bounds3f> chunkBounds(ParallelBinningChunkNum * binNum);
+			std::vector<int> chunkSizes(ParallelBinningChunkNum * binNum, 0);
+#pragma omp parallel for
+			for (int c = 0; c < ParallelBinningChunkNum; ++c) {
+				GeoIterator chunkBegin = begin + (int)((int64_t)primNum * c / ParallelBinningChunkNum);
+				GeoIterator chunkEnd = begin + (int)((int64_t)primNum * (c + 1) / ParallelBinningChunkNum);
+				Bounds3f* bounds = &chunkBounds[c * binNum];
+				int* sizes = &chunkSizes[c * binNum];
+				for (auto it = chunkBegin; it != chunkEnd; ++it) {
+					int b = binMapping(*it);
+					bounds[b] = merge(bounds[b], it->bound);
+					++sizes[b];
+				}
+			}
+
+			for (int c = 0; c < ParallelBinningChunkNum; ++c) {
+				for (int i = 0; i < binNum; ++i) {
+					bucket.bucketBounds[i] = merge(bucket.bucketBounds[i], chunkBounds[c * binNum + i]);
+					bucket.bucketSizes[i] += chunkSizes[c * binNum + i];
+				}
+			}
+		}
+
+		static GeoIterator splitAtMedian(GeoIterator begin, const GeoIterator& end, int axis) {
+			GeoIterator mid = begin + (end - begin) / 2;
+			std::nth_element(begin, mid, end, [axis](const GeoBounds& a, const GeoBounds& b) {
+				return a.center[axis] < b.center[axis];
+				});
+			return mid;
+		}
+
+		// 物体分割の候補
+		struct ObjectSplit {
+			float cost = Infinity;
+			int bin = -1; // このビンまでを左側の子ノードに入れる (分割できる位置がない場合は -1)
+			Bounds3f leftBound, rightBound;
+		};
+
+		// binMapping で分けたビンのうち、SAH コストが最小になる分割位置を求める
+		void findObjectSplit(GeoIterator begin, const GeoIterator& end, const BinMapping& binMapping, BucketComputation& bucket, const Bounds3f& aabb, bool parallel, ObjectSplit* split) const {
+			const int primNum = (int)(end - begin);
+			const int binNum = settings.binNum;
+			computeBins(begin, end, binMapping, bucket, parallel);
+
+			// 右側の累積 AABB を先に求めておき、左から走査しながら各分割位置のコストを評価する
+			Bounds3f right;
+			for (int i = binNum - 1; i > 0; --i) {
+				right = merge(right, bucket.bucketBounds[i]);
+				bucket.boundsRight[i] = right;
+			}
+
+			const float invArea = 1.0f / aabb.surfaceArea();
+			Bounds3f left;
+			int leftNum = 0;
+			for (int i = 0; i < binNum - 1; ++i) {
+				left = merge(left, bucket.bucketBounds[i]);
+				leftNum += bucket.bucketSizes[i];
+				const int rightNum = primNum - leftNum;
+				if (leftNum == 0 || rightNum == 0) { continue; }
+				float cost = settings.traversalCost + settings.intersectionCost *
+					(left.surfaceArea() * leftNum + bucket.boundsRight[i + 1].surfaceArea() * rightNum) * invArea;
+				if (cost < split->cost) {
+					split->cost = cost;
+					split->bin = i;
+					split->leftBound = left;
+					split->rightBound = bucket.boundsRight[i + 1];
+				}
+			}
+		}
+
+		// 分割位置を決めて [begin, end) を並べ替える
+		// リーフにするべき場合は何もせず false を返す
+		bool findSplit(GeoIterator begin, const GeoIterator& end, BucketComputation& bucket, int depth, const Bounds3f& aabb, bool parallel, GeoIterator* mid, int* axis) const {
+			const int primNum = (int)(end - begin);
+			if (primNum == 1) { return false; }
+
+			// 分割軸は重心の分布が最も広い軸にする
+			Bounds3f centerAABB = mergeRange(begin, end, parallel, [](const GeoBounds& g) { return g.center; });
+			*axis = centerAABB.size().maxDimension();
+			const float centerMin = centerAABB.min[*axis];
+			const float centerMax = centerAABB.max[*axis];
+
+			const bool canBeLeaf = primNum <= settings.maxPrimitivesInLeaf;
+
+			if (centerMax <= centerMin) {
+				// 重心が全て重なっていて空間的に分割できない
+				if (canBeLeaf) { return false; }
+				*mid = begin + primNum / 2;
+				return true;
+			}
+
+			if (depth >= MedianSplitDepth) {
+				// スタックが溢れないよう、深くなりすぎたら中央値で分割して木の高さを抑える
+				*mid = splitAtMedian(begin, end, *axis);
+				return true;
+			}
+
+			const BinMapping binMapping(*axis, centerMin, centerMax, settings.binNum);
+			ObjectSplit split;
+			findObjectSplit(begin, end, binMapping, bucket, aabb, parallel, &split);
+
+			// 分割しても得にならない場合はリーフにする
+			const float leafCost = settings.intersectionCost * primNum;
+			if (canBeLeaf && (split.bin < 0 || split.cost >= leafCost)) {
+				return false;
+			}
+
+			if (split.bin < 0) {
+				*mid = splitAtMedian(begin, end, *axis);
+			} else {
+				*mid = std::partition(begin, end, [&](const GeoBounds& g) { return binMapping(g) <= split.bin; });
+			}
+			return true;
+		}
+
+		static int buildLeaf(GeoIterator begin, const GeoIterator& end, int nodeIndex, BuildOutput& output) {
+			output.nodes[nodeIndex].primitiveOffset = output.primitiveIndices.size();
+			output.nodes[nodeIndex].primitiveNum = (uint16_t)(end - begin);
+			for (auto it = begin; it != end; ++it) {
+				output.primitiveIndices.push_back(it->index);
+			}
+			return nodeIndex;
+		}
+
+		int buildBVHSub(GeoIterator begin, const GeoIterator& end, BucketComputation& bucket, int depth, const Bounds3f& aabb, BuildOutput& output) const {
+
+			const int nodeIndex = output.nodes.size();
+			output.nodes.emplace_back();
+			output.nodes[nodeIndex].setBound(aabb);
+			output.nodes[nodeIndex].axis = 0;
+			output.nodes[nodeIndex].anyHitSecondFirst = 0;
+
+			GeoIterator mid;
+			int axis;
+			if (!findSplit(begin, end, bucket, depth, aabb, false, &mid, &axis)) {
+				return buildLeaf(begin, end, nodeIndex, output);
+			}
+
+			output.nodes[nodeIndex].axis = axis;
+			output.nodes[nodeIndex].primitiveNum = 0;
+
+			Bounds3f splitAABB1 = mergeRange(begin, mid, false, [](const GeoBounds& g) { return g.bound; });
+			Bounds3f splitAABB2 = mergeRange(mid, end, false, [](const GeoBounds& g) { return g.bound; });
+
+			output.nodes[nodeIndex].setAnyHitOrder(splitAABB1, splitAABB2);
+
+			buildBVHSub(begin, mid, bucket, depth + 1, splitAABB1, output);
+			output.nodes[nodeIndex].secondChildOffset = buildBVHSub(mid, end, bucket, depth + 1, splitAABB2, output);
+
+			return nodeIndex;
+		}
+
+		// 上位の階層を分割し、十分小さくなった部分木を構築タスクとして切り出す
+		int buildTopSub(GeoIterator begin, const GeoIterator& end, BucketComputation& bucket, int depth, const Bounds3f& aabb, TopLevel& top) const {
+
+			const int nodeIndex = top.nodes.size();
+			top.nodes.emplace_back();
+			top.nodes[nodeIndex].setBound(aabb);
+			top.nodes[nodeIndex].axis = 0;
+			top.nodes[nodeIndex].anyHitSecondFirst = 0;
+			top.nodes[nodeIndex].primitiveNum = 0;
+
+			GeoIterator mid;
+			int axis;
+			if ((int)(end - begin) < ParallelBuildPrimitiveNum || !findSplit(begin, end, bucket, depth, aabb, true, &mid, &axis)) {
+				top.taskIndices.push_back(top.tasks.size());
+				top.tasks.push_back(SubtreeTask{ begin, end, depth, aabb });
+				return nodeIndex;
+			}
+			top.taskIndices.push_back(-1);
+
+			top.nodes[nodeIndex].axis = axis;
+
+			Bounds3f splitAABB1 = mergeRange(begin, mid, true, [](const GeoBounds& g) { return g.bound; });
+			Bounds3f splitAABB2 = mergeRange(mid, end, true, [](const GeoBounds& g) { return g.bound; });
+
+			top.nodes[nodeIndex].setAnyHitOrder(splitAABB1, splitAABB2);
+
+			buildTopSub(begin, mid, bucket, depth + 1, splitAABB1, top);
+			top.nodes[nodeIndex].secondChildOffset = buildTopSub(mid, end, bucket, depth + 1, splitAABB2, top);
+
+			return nodeIndex;
+		}
+
+		// 上位の階層と部分木を深さ優先順に連結する
+		// 直列に構築した場合と全く同じ並びになる
+		static void appendTopSub(const TopLevel& top, int topIndex, BuildOutput& output) {
+			const int taskIndex = top.taskIndices[topIndex];
+			if (taskIndex >= 0) {
+				const BuildOutput& subtree = top.tasks[taskIndex].output;
+				const int nodeOffset = output.nodes.size();
+				const int primitiveOffset = output.primitiveIndices.size();
+				for (LinearBVHNode node : subtree.nodes) {
+					if (node.isLeaf()) {
+						node.primitiveOffset += primitiveOffset;
+					} else {
+						node.secondChildOffset += nodeOffset;
+					}
+					output.nodes.push_back(node);
+				}
+				output.primitiveIndices.insert(output.primitiveIndices.end(), subtree.primitiveIndices.begin(), subtree.primitiveIndices.end());
+				return;
+			}
+
+			const int nodeIndex = output.nodes.size();
+			output.nodes.push_back(top.nodes[topIndex]);
+			appendTopSub(top, topIndex + 1, output);
+			output.nodes[nodeIndex].secondChildOffset = output.nodes.size();
+			appendTopSub(top, top.nodes[topIndex].secondChildOffset, output);
+		}
+
+		//---------------------------------------------------------------
+		// 空間分割を行う構築 (SBVH)
+		// 物体分割の子ノード同士が大きく重なるノードでは、軸に垂直な平面でプリミティブを切り分ける分割も試し、
+		// 平面をまたぐプリミティブは両側の子ノードから参照させる
+
+		struct SpatialSplitContext {
+			float overlapThreshold; // 空間分割を試す、子ノード同士の重なりの表面積の下限
+			const PrimitiveSplitter* splitPrimitive;
+		};
+
+		// 空間分割のビン
+		// entries, exits はそれぞれのビンから始まる参照、終わる参照の数
+		struct SpatialBins {
+			std::vector<Bounds3f> bounds, boundsRight;
+			std::vector<int> entries, exits;
+
+			SpatialBins(int binNum) :
+				bounds(binNum),
+				boundsRight(binNum),
+				entries(binNum),
+				exits(binNum)
+			{}
+		};
+
+		struct SpatialSplit {
+			float cost = Infinity;
+			int axis;
+			float plane;
+			Bounds3f leftBound, rightBound;
+			int leftNum, rightNum;
+		};
+
+		static void splitReference(const GeoBounds& reference, const Bounds3f& bound, int axis, float plane, const SpatialSplitContext& context, Bounds3f* left, Bounds3f* right) {
+			if (*context.splitPrimitive) {
+				(*context.splitPrimitive)(reference.index, bound, axis, plane, left, right);
+				return;
+			}
+			Bounds3f leftBound = bound;
+			Bounds3f rightBound = bound;
+			leftBound.max[axis] = std::min(leftBound.max[axis], plane);
+			rightBound.min[axis] = std::max(rightBound.min[axis], plane);
+			*left = leftBound.isEmpty() ? Bounds3f() : leftBound;
+			*right = rightBound.isEmpty() ? Bounds3f() : rightBound;
+		}
+
+		// 各軸で aabb を等間隔のビンに分け、複製する参照の数が splitBudget 以下の分割のうち SAH コストが最小のものを求める
+		void findSpatialSplit(const std::vector<GeoBounds>& references, int splitBudget, std::vector<SpatialBins>& spatialBins, const Bounds3f& aabb, bool parallel, const SpatialSplitContext& context, SpatialSplit* split) const {
+			const int refNum = references.size();
+			const int binNum = settings.binNum;
+			const float invArea = 1.0f / aabb.surfaceArea();
+
+			SpatialSplit axisSplits[3];
+#pragma omp parallel for if(parallel)
+			for (int axis = 0; axis < 3; ++axis) {
+				const float extent = aabb.max[axis] - aabb.min[axis];
+				if (extent <= 0.0f) { continue; }
+				const float binWidth = extent / binNum;
+				const float binScale = binNum / extent;
+				auto binIndex = [&](float x) { return clamp((int)((x - aabb.min[axis]) * binScale), 0, binNum - 1); };
+
+				SpatialBins& bins = spatialBins[axis];
+				for (int i = 0; i < binNum; ++i) {
+					bins.bounds[i] = Bounds3f();
+					bins.entries[i] = 0;
+					bins.exits[i] = 0;
+				}
+
+				// 参照をビンの境界で切り分けながら、通過するビンの AABB に加える
+				for (const auto& reference : references) {
+					const int first = binIndex(reference.bound.min[axis]);
+					const int last = binIndex(reference.bound.max[axis]);
+					++bins.entries[first];
+					++bins.exits[last];
+					Bounds3f rest = reference.bound;
+					for (int b = first; b < last; ++b) {
+						Bounds3f left, right;
+						splitReference(reference, rest, axis, aabb.min[axis] + binWidth * (b + 1), context, &left, &right);
+						bins.bounds[b] = merge(bins.bounds[b], left);
+						rest = right;
+					}
+					bins.bounds[last] = merge(bins.bounds[last], rest);
+				}
+
+				Bounds3f right;
+				for (int i = binNum - 1; i > 0; --i) {
+					right = merge(right, bins.bounds[i]);
+					bins.boundsRight[i] = right;
+				}
+
+				SpatialSplit& axisSplit = axisSplits[axis];
+				Bounds3f left;
+				int leftNum = 0;
+				int rightNum = refNum;
+				for (int i = 0; i < binNum - 1; ++i) {
+					left = merge(left, bins.bounds[i]);
+					leftNum += bins.entries[i];
+					rightNum -= bins.exits[i];
+					if (leftNum == 0 || rightNum == 0) { continue; }
+					if (leftNum + rightNum - refNum > splitBudget) { continue; }
+					float cost = settings.traversalCost + settings.intersectionCost *
+						(left.surfaceArea() * leftNum + bins.boundsRight[i + 1].surfaceArea() * rightNum) * invArea;
+					if (cost < axisSplit.cost) {
+						axisSplit.cost = cost;
+						axisSplit.axis = axis;
+						axisSplit.plane = aabb.min[axis] + binWidth * (i + 1);
+						axisSplit.leftBound = left;
+						axisSplit.rightBound = bins.boundsRight[i + 1];
+						axisSplit.leftNum = leftNum;
+						axisSplit.rightNum = rightNum;
+					}
+				}
+			}
+
+			for (int axis = 0; axis < 3; ++axis) {
+				if (axisSplits[axis].cost < split->cost) {
+					*split = axisSplits[axis];
+				}
+			}
+		}
+
+		// 平面をまたぐ参照は切り分けて両側に入れる
+		// ただし、切り分けずにどちらか片側に入れた方が SAH コストが小さくなる場合はそうする
+		void applySpatialSplit(const std::vector<GeoBounds>& references, const SpatialSplit& split, const SpatialSplitContext& context, std::vector<GeoBounds>* leftReferences, std::vector<GeoBounds>* rightReferences) const {
+			const int axis = split.axis;
+			Bounds3f leftBound = split.leftBound;
+			Bounds3f rightBound = split.rightBound;
+			int leftNum = split.leftNum;
+			int rightNum = split.rightNum;
+			leftReferences->reserve(leftNum);
+			rightReferences->reserve(rightNum);
+
+			for (const auto& reference : references) {
+				if (reference.bound.max[axis] <= split.plane) {
+					leftReferences->push_back(reference);
+					continue;
+				}
+				if (reference.bound.min[axis] >= split.plane) {
+					rightReferences->push_back(reference);
+					continue;
+				}
+
+				Bounds3f left, right;
+				splitReference(reference, reference.bound, axis, split.plane, context, &left, &right);
+				if (left.isEmpty()) {
+					rightReferences->push_back(GeoBounds(reference.index, right, right.center()));
+					continue;
+				}
+				if (right.isEmpty()) {
+					leftReferences->push_back(GeoBounds(reference.index, left, left.center()));
+					continue;
+				}
+
+				const float splitCost = leftBound.surfaceArea() * leftNum + rightBound.surfaceArea() * rightNum;
+				const Bounds3f leftOnlyBound = merge(leftBound, reference.bound);
+				const Bounds3f rightOnlyBound = merge(rightBound, reference.bound);
+				const float leftOnlyCost = leftOnlyBound.surfaceArea() * leftNum + rightBound.surfaceArea() * (rightNum - 1);
+				const float rightOnlyCost = leftBound.surfaceArea() * (leftNum - 1) + rightOnlyBound.surfaceArea() * rightNum;
+				if (leftOnlyCost < splitCost && leftOnlyCost <= rightOnlyCost) {
+					leftReferences->push_back(reference);
+					leftBound = leftOnlyBound;
+					--rightNum;
+				} else if (rightOnlyCost < splitCost) {
+					rightReferences->push_back(reference);
+					rightBound = rightOnlyBound;
+					--leftNum;
+				} else {
+					leftReferences->push_back(GeoBounds(reference.index, left, left.center()));
+					rightReferences->push_back(GeoBounds(reference.index, right, right.center()));
+				}
+			}
+		}
+
+		// 物体分割と空間分割のうちコストの小さい方で references を左右の子ノードの参照に分ける
+		// リーフにするべき場合は何もせず false を返す
+		bool splitReferences(std::vector<GeoBounds>& references, int splitBudget, BucketComputation& bucket, std::vector<SpatialBins>& spatialBins, int depth, const Bounds3f& aabb, bool parallel, const SpatialSplitContext& context,
+			std::vector<GeoBounds>* leftReferences, std::vector<GeoBounds>* rightReferences, int* axis) const {
+			const int refNum = references.size();
+			if (refNum == 1) { return false; }
+
+			const GeoIterator begin = references.begin();
+			const GeoIterator end = references.end();
+			Bounds3f centerAABB = mergeRange(begin, end, parallel, [](const GeoBounds& g) { return g.center; });
+			const int objectAxis = centerAABB.size().maxDimension();
+			const float centerMin = centerAABB.min[objectAxis];
+			const float centerMax = centerAABB.max[objectAxis];
+			const bool centersOverlap = centerMax <= centerMin;
+			const bool canBeLeaf = refNum <= settings.maxPrimitivesInLeaf;
+
+			const BinMapping binMapping(objectAxis, centerMin, centerMax, settings.binNum);
+			ObjectSplit objectSplit;
+			if (!centersOverlap && depth < MedianSplitDepth) {
+				findObjectSplit(begin, end, binMapping, bucket, aabb, parallel, &objectSplit);
+			}
+
+			SpatialSplit spatialSplit;
+			if (splitBudget > 0 && depth < MedianSplitDepth) {
+				float overlapArea = Infinity;
+				if (objectSplit.bin >= 0) {
+					const Bounds3f overlap = intersection(objectSplit.leftBound, objectSplit.rightBound);
+					overlapArea = overlap.isEmpty() ? 0.0f : overlap.surfaceArea();
+				}
+				if (overlapArea > context.overlapThreshold) {
+					findSpatialSplit(references, splitBudget, spatialBins, aabb, parallel, context, &spatialSplit);
+				}
+			}
+
+			// 分割しても得にならない場合はリーフにする
+			const float leafCost = settings.intersectionCost * refNum;
+			if (canBeLeaf && std::min(objectSplit.cost, spatialSplit.cost) >= leafCost) {
+				return false;
+			}
+
+			if (spatialSplit.cost < objectSplit.cost) {
+				applySpatialSplit(references, spatialSplit, context, leftReferences, rightReferences);
+				if (!leftReferences->empty() && !rightReferences->empty()) {
+					*axis = spatialSplit.axis;
+					return true;
+				}
+				leftReferences->clear();
+				rightReferences->clear();
+			}
+
+			*axis = objectAxis;
+			GeoIterator mid;
+			if (centersOverlap) {
+				mid = begin + refNum / 2;
+			} else if (objectSplit.bin < 0) {
+				mid = splitAtMedian(begin, end, objectAxis);
+			} else {
+				mid = std::partition(begin, end, [&](const GeoBounds& g) { return binMapping(g) <= objectSplit.bin; });
+			}
+			leftReferences->assign(begin, mid);
+			rightReferences->assign(mid, end);
+			return true;
+		}
+
+		// 残りの複製できる参照の数を、子ノードの参照の数に比例して分ける
+		static void distributeSplitBudget(int splitBudget, int refNum, int leftNum, int rightNum, int* leftBudget, int* rightBudget) {
+			const int remaining = std::max(0, splitBudget - (leftNum + rightNum - refNum));
+			*leftBudget = (int)((int64_t)remaining * leftNum / (leftNum + rightNum));
+			*rightBudget = remaining - *leftBudget;
+		}
+
+		BuildOutput buildSpatialSplitTree(std::vector<GeoBounds> references, const PrimitiveSplitter& splitPrimitive) const {
+			const int primNum = references.size();
+			const Bounds3f rootAABB = mergeRange(references.begin(), references.end(), true, [](const GeoBounds& g) { return g.bound; });
+
+			SpatialSplitContext context;
+			context.overlapThreshold = settings.spatialSplitOverlapThreshold * rootAABB.surfaceArea();
+			context.splitPrimitive = &splitPrimitive;
+
+			TopLevel top;
+			BucketComputation bucket(settings.binNum);
+			std::vector<SpatialBins> spatialBins(3, SpatialBins(settings.binNum));
+			const int splitBudget = (int)(primNum * settings.spatialSplitMaxGrowth);
+			buildSpatialSplitTopSub(std::move(references), splitBudget, bucket, spatialBins, 0, rootAABB, context, top);
+
+#pragma omp parallel for schedule(dynamic, 1)
+			for (int i = 0; i < (int)top.tasks.size(); ++i) {
+				SubtreeTask& task = top.tasks[i];
+				BucketComputation taskBucket(settings.binNum);
+				std::vector<SpatialBins> taskSpatialBins(3, SpatialBins(settings.binNum));
+				buildSpatialSplitSub(task.references, task.splitBudget, taskBucket, taskSpatialBins, task.depth, task.aabb, context, task.output);
+			}
+
+			if (top.tasks.size() == 1) {
+				return std::move(top.tasks[0].output);
+			}
+
+			BuildOutput output;
+			appendTopSub(top, 0, output);
+			return output;
+		}
+
+		// 複製できる参照の数は子ノードに分けて渡すので、構築結果はスレッド数によらず同じになる
+		int buildSpatialSplitTopSub(std::vector<GeoBounds> references, int splitBudget, BucketComputation& bucket, std::vector<SpatialBins>& spatialBins, int depth, const Bounds3f& aabb, const SpatialSplitContext& context, TopLevel& top) const {
+
+			const int nodeIndex = top.nodes.size();
+			top.nodes.emplace_back();
+			top.nodes[nodeIndex].setBound(aabb);
+			top.nodes[nodeIndex].axis = 0;
+			top.nodes[nodeIndex].anyHitSecondFirst = 0;
+			top.nodes[nodeIndex].primitiveNum = 0;
+
+			std::vector<GeoBounds> leftReferences, rightReferences;
+			int axis;
+			if ((int)references.size() < ParallelBuildPrimitiveNum ||
+				!splitReferences(references, splitBudget, bucket, spatialBins, depth, aabb, true, context, &leftReferences, &rightReferences, &axis)) {
+				top.taskIndices.push_back(top.tasks.size());
+				top.tasks.emplace_back();
+				SubtreeTask& task = top.tasks.back();
+				task.depth = depth;
+				task.aabb = aabb;
+				task.references = std::move(references);
+				task.splitBudget = splitBudget;
+				return nodeIndex;
+			}
+			top.taskIndices.push_back(-1);
+
+			top.nodes[nodeIndex].axis = axis;
+
+			int leftBudget, rightBudget;
+			distributeSplitBudget(splitBudget, references.size(), leftReferences.size(), rightReferences.size(), &leftBudget, &rightBudget);
+			std::vector<GeoBounds>().swap(references);
+
+			Bounds3f splitAABB1 = mergeRange(leftReferences.begin(), leftReferences.end(), true, [](const GeoBounds& g) { return g.bound; });
+			Bounds3f splitAABB2 = mergeRange(rightReferences.begin(), rightReferences.end(), true, [](const GeoBounds& g) { return g.bound; });
+
+			top.nodes[nodeIndex].setAnyHitOrder(splitAABB1, splitAABB2);
+
+			buildSpatialSplitTopSub(std::move(leftReferences), leftBudget, bucket, spatialBins, depth + 1, splitAABB1, context, top);
+			top.nodes[nodeIndex].secondChildOffset = buildSpatialSplitTopSub(std::move(rightReferences), rightBudget, bucket, spatialBins, depth + 1, splitAABB2, context, top);
+
+			return nodeIndex;
+		}
+
+		int buildSpatialSplitSub(std::vector<GeoBounds>& references, int splitBudget, BucketComputation& bucket, std::vector<SpatialBins>& spatialBins, int depth, const Bounds3f& aabb, const SpatialSplitContext& context, BuildOutput& output) const {
+
+			const int nodeIndex = output.nodes.size();
+			output.nodes.emplace_back();
+			output.nodes[nodeIndex].setBound(aabb);
+			output.nodes[nodeIndex].axis = 0;
+			output.nodes[nodeIndex].anyHitSecondFirst = 0;
+
+			std::vector<GeoBounds> leftReferences, rightReferences;
+			int axis;
+			if (!splitReferences(references, splitBudget, bucket, spatialBins, depth, aabb, false, context, &leftReferences, &rightReferences, &axis)) {
+				return buildLeaf(references.begin(), references.end(), nodeIndex, output);
+			}
+
+			output.nodes[nodeIndex].axis = axis;
+			output.nodes[nodeIndex].primitiveNum = 0;
+
+			int leftBudget, rightBudget;
+			distributeSplitBudget(splitBudget, references.size(), leftReferences.size(), rightReferences.size(), &leftBudget, &rightBudget);
+			std::vector<GeoBounds>().swap(references);
+
+			Bounds3f splitAABB1 = mergeRange(leftReferences.begin(), leftReferences.end(), false, [](const GeoBounds& g) { return g.bound; });
+			Bounds3f splitAABB2 = mergeRange(rightReferences.begin(), rightReferences.end(), false, [](const GeoBounds& g) { return g.bound; });
+
+			output.nodes[nodeIndex].setAnyHitOrder(splitAABB1, splitAABB2);
+
+			buildSpatialSplitSub(leftReferences, leftBudget, bucket, spatialBins, depth + 1, splitAABB1, context, output);
+			output.nodes[nodeIndex].secondChildOffset = buildSpatialSplitSub(rightReferences, rightBudget, bucket, spatialBins, depth + 1, splitAABB2, context, output);
+
+			return nodeIndex;
+		}
+
+
+		//---------------------------------------------------------------
+		// Morton 符号による構築 (LBVH)
+		// 重心を格子に量子化した Morton 符号でプリミティブを並べ替え、符号の上位のビットから順に範囲を分割する
+		// 分割位置は二分探索で求まるので、SAH の評価を行う構築よりずっと速い
+
+		struct MortonPrimitive {
+			uint32_t code;
+			int index; // 並べ替える前の位置
+		};
+
+		// Morton 符号の順に並べたプリミティブと、それぞれの符号
+		struct LinearBuildContext {
+			GeoIterator base;
+			std::vector<uint32_t> codes;
+			int maxPrimitivesInLeaf;
+
+			uint32_t code(const GeoBounds& g) const { return codes[&g - &*base]; }
+		};
+
+		static const int MortonBits = 30;
+		static const int RadixBits = 8;
+
+		// 下位から RadixBits ずつの基数ソートで、Morton 符号の順に安定に並べ替える
+		// チャンクごとのヒストグラムを並列に求め、それぞれのチャンクの書き込み先を決めてから並列に書き込む
+		static void sortMortonPrimitives(std::vector<MortonPrimitive>* mortonPrimitives) {
+			const int primNum = mortonPrimitives->size();
+			const int bucketNum = 1 << RadixBits;
+			const int chunkNum = ParallelBinningChunkNum;
+			const int chunkSize = (primNum + chunkNum - 1) / chunkNum;
+
+			std::vector<MortonPrimitive> tmp(primNum);
+			std::vector<int> offsets(chunkNum * bucketNum);
+			std::vector<MortonPrimitive>* src = mortonPrimitives;
+			std::vector<MortonPrimitive>* dst = &tmp;
+			for (int shift = 0; shift < MortonBits; shift += RadixBits) {
+#pragma omp parallel for
+				for (int c = 0; c < chunkNum; ++c) {
+					int* counts = &offsets[c * bucketNum];
+					std::fill(counts, counts + bucketNum, 0);
+					const int end = std::min(primNum, (c + 1) * chunkSize);
+					for (int i = c * chunkSize; i < end; ++i) {
+						++counts[((*src)[i].code >> shift) & (bucketNum - 1)];
+					}
+				}
+
+				int sum = 0;
+				for (int b = 0; b < bucketNum; ++b) {
+					for (int c = 0; c < chunkNum; ++c) {
+						const int count = offsets[c * bucketNum + b];
+						offsets[c * bucketNum + b] = sum;
+						sum += count;
+					}
+				}
+
+#pragma omp parallel for
+				for (int c = 0; c < chunkNum; ++c) {
+					int* positions = &offsets[c * bucketNum];
+					const int end = std::min(primNum, (c + 1) * chunkSize);
+					for (int i = c * chunkSize; i < end; ++i) {
+						(*dst)[positions[((*src)[i].code >> shift) & (bucketNum - 1)]++] = (*src)[i];
+					}
+				}
+				std::swap(src, dst);
+			}
+			if (src != mortonPrimitives) {
+				mortonPrimitives->swap(tmp);
+			}
+		}
+
+		// [begin, end) を Morton 符号が最初に異なるビットで分け、そのビットが 1 になる最初の位置を返す
+		// 全て同じ符号の場合や深くなりすぎた場合は中央で分割する
+		static GeoIterator splitMorton(GeoIterator begin, const GeoIterator& end, int depth, const LinearBuildContext& context, int* axis) {
+			const uint32_t first = context.code(*begin);
+			const uint32_t last = context.code(*(end - 1));
+			if (first == last || depth >= MedianSplitDepth) {
+				*axis = 0;
+				return begin + (end - begin) / 2;
+			}
+			const int bit = 31 - std::countl_zero(first ^ last);
+			// encodeMorton3 では x, y, z の順に上位のビットに入っている
+			*axis = 2 - bit % 3;
+			return std::partition_point(begin, end, [&](const GeoBounds& g) { return ((context.code(g) >> bit) & 1) == 0; });
+		}
+
+		// aabbPrimitives を Morton 符号の順に並べ替えながら、それらを含む部分木を構築する
+		// depth は部分木の根の深さ
+		BuildOutput buildLinearTree(std::vector<GeoBounds>& aabbPrimitives, int depth) const {
+			const int primNum = aabbPrimitives.size();
+			const Bounds3f centerAABB = mergeRange(aabbPrimitives.begin(), aabbPrimitives.end(), true, [](const GeoBounds& g) { return g.center; });
+
+			// 重心の AABB を各軸 1024 分割した格子で量子化する
+			const int gridSize = 1 << (MortonBits / 3);
+			const Vector3f extent = centerAABB.size();
+			float gridScale[3];
+			for (int i = 0; i < 3; ++i) {
+				gridScale[i] = extent[i] > 0.0f ? gridSize / extent[i] : 0.0f;
+			}
+			std::vector<MortonPrimitive> mortonPrimitives(primNum);
+#pragma omp parallel for
+			for (int i = 0; i < primNum; ++i) {
+				uint32_t q[3];
+				for (int k = 0; k < 3; ++k) {
+					q[k] = clamp((int)((aabbPrimitives[i].center[k] - centerAABB.min[k]) * gridScale[k]), 0, gridSize - 1);
+				}
+				mortonPrimitives[i].code = encodeMorton3(q[0], q[1], q[2]);
+				mortonPrimitives[i].index = i;
+			}
+
+			sortMortonPrimitives(&mortonPrimitives);
+
+			std::vector<GeoBounds> sorted(primNum);
+			LinearBuildContext context;
+			context.codes.resize(primNum);
+#pragma omp parallel for
+			for (int i = 0; i < primNum; ++i) {
+				sorted[i] = aabbPrimitives[mortonPrimitives[i].index];
+				context.codes[i] = mortonPrimitives[i].code;
+			}
+			aabbPrimitives.swap(sorted);
+			std::vector<GeoBounds>().swap(sorted);
+			context.base = aabbPrimitives.begin();
+			// treelet の組み替えを行う場合は、プリミティブ 1 つずつのリーフまで分割しておき、どこをリーフにするかも組み替えの際に決める
+			context.maxPrimitivesInLeaf = settings.treeletOptimizationIterations > 0 ? 1 : settings.maxPrimitivesInLeaf;
+
+			TopLevel top;
+			buildLinearTopSub(aabbPrimitives.begin(), aabbPrimitives.end(), depth, context, top);
+
+#pragma omp parallel for schedule(dynamic, 1)
+			for (int i = 0; i < (int)top.tasks.size(); ++i) {
+				SubtreeTask& task = top.tasks[i];
+				const int taskPrimNum = (int)(task.end - task.begin);
+				task.output.nodes.reserve(2 * taskPrimNum - 1);
+				task.output.primitiveIndices.reserve(taskPrimNum);
+				buildLinearSub(task.begin, task.end, task.depth, context, task.output);
+				if (settings.treeletOptimizationIterations > 0) {
+					optimizeTreelets(task.depth, &task.output);
+				}
+			}
+
+			// 上位の階層のノードの AABB は、部分木を構築してから子ノードのものを合わせて求める
+			// 子ノードは親より後ろにあるので、後ろから順に求めればよい
+			for (int i = (int)top.nodes.size() - 1; i >= 0; --i) {
+				LinearBVHNode& node = top.nodes[i];
+				if (top.taskIndices[i] >= 0) {
+					node.setBound(top.tasks[top.taskIndices[i]].output.nodes[0].bound());
+					continue;
+				}
+				const Bounds3f bound1 = top.nodes[i + 1].bound();
+				const Bounds3f bound2 = top.nodes[node.secondChildOffset].bound();
+				node.setBound(merge(bound1, bound2));
+				node.setAnyHitOrder(bound1, bound2);
+			}
+
+			if (top.tasks.size() == 1) {
+				return std::move(top.tasks[0].output);
+			}
+
+			BuildOutput output;
+			output.nodes.reserve(2 * primNum - 1);
+			output.primitiveIndices.reserve(primNum);
+			appendTopSub(top, 0, output);
+			return output;
+		}
+
+		int buildLinearTopSub(GeoIterator begin, const GeoIterator& end, int depth, const LinearBuildContext& context, TopLevel& top) const {
+
+			const int nodeIndex = top.nodes.size();
+			top.nodes.emplace_back();
+			top.nodes[nodeIndex].axis = 0;
+			top.nodes[nodeIndex].anyHitSecondFirst = 0;
+			top.nodes[nodeIndex].primitiveNum = 0;
+
+			if ((int)(end - begin) < ParallelBuildPrimitiveNum) {
+				top.taskIndices.push_back(top.tasks.size());
+				top.tasks.push_back(SubtreeTask{ begin, end, depth });
+				return nodeIndex;
+			}
+			top.taskIndices.push_back(-1);
+
+			int axis;
+			GeoIterator mid = splitMorton(begin, end, depth, context, &axis);
+			top.nodes[nodeIndex].axis = axis;
+
+			buildLinearTopSub(begin, mid, depth + 1, context, top);
+			top.nodes[nodeIndex].secondChildOffset = buildLinearTopSub(mid, end, depth + 1, context, top);
+
+			return nodeIndex;
+		}
+
+		int buildLinearSub(GeoIterator begin, const GeoIterator& end, int depth, const LinearBuildContext& context, BuildOutput& output) const {
+
+			const int nodeIndex = output.nodes.size();
+			output.nodes.emplace_back();
+			output.nodes[nodeIndex].axis = 0;
+			output.nodes[nodeIndex].anyHitSecondFirst = 0;
+
+			if ((int)(end - begin) <= context.maxPrimitivesInLeaf) {
+				output.nodes[nodeIndex].setBound(mergeRange(begin, end, false, [](const GeoBounds& g) { return g.bound; }));
+				return buildLeaf(begin, end, nodeIndex, output);
+			}
+
+			int axis;
+			GeoIterator mid = splitMorton(begin, end, depth, context, &axis);
+			output.nodes[nodeIndex].axis = axis;
+			output.nodes[nodeIndex].primitiveNum = 0;
+
+			buildLinearSub(begin, mid, depth + 1, context, output);
+			const int secondChild = buildLinearSub(mid, end, depth + 1, context, output);
+			output.nodes[nodeIndex].secondChildOffset = secondChild;
+
+			const Bounds3f bound1 = output.nodes[nodeIndex + 1].bound();
+			const Bounds3f bound2 = output.nodes[secondChild].bound();
+			output.nodes[nodeIndex].setBound(merge(bound1, bound2));
+			output.nodes[nodeIndex].setAnyHitOrder(bound1, bound2);
+
+			return nodeIndex;
+		}
+
+		//---------------------------------------------------------------
+		// treelet の組み替えによる最適化 (Karras and Aila 2013)
+		// 内部ノードを根として、表面積の大きい子から順に展開して最大 TreeletLeafNum 個の部分木を葉とする treelet を作り、
+		// 葉の部分集合ごとに SAH コストが最小になる分け方を動的計画法で求めて組み替える
+		// プリミティブ数が maxPrimitivesInLeaf 以下の部分木は、1 つのリーフにまとめた方がコストが小さければまとめる
+		// 子から親の順に処理するので、部分木ごとに直列に行う
+		// 組み替えるのはプリミティブ数が minPrimitiveNum 以上の部分木のみで、minPrimitiveNum は繰り返すごとに倍にする
+
+		static const int TreeletLeafNum = 7;
+
+		// 組み替えのために、深さ優先順の配列ではなく子ノードの番号で辿れる形にしたもの
+		struct TreeletTree {
+			std::vector<int> children; // [2 * ノード番号 + i] (リーフは -1)
+			std::vector<Bounds3f> bounds;
+			std::vector<float> costs;  // 正規化していない SAH コスト
+			std::vector<int> heights;  // 部分木の高さ (リーフは 0)
+			std::vector<int> primitiveNums;
+			std::vector<uint8_t> collapsed; // 1 なら部分木全体を 1 つのリーフにまとめる
+
+			bool isLeaf(int node) const { return children[2 * node] < 0; }
+		};
+
+		// 内部ノードとリーフにまとめた場合のうち、小さい方のコスト
+		float treeletCost(float area, int primitiveNum, float childCost, bool* collapsed) const {
+			const float cost = settings.traversalCost * area + childCost;
+			const float leafCost = settings.intersectionCost * area * primitiveNum;
+			*collapsed = primitiveNum <= settings.maxPrimitivesInLeaf && leafCost <= cost;
+			return *collapsed ? leafCost : cost;
+		}
+
+		void updateTreeletNode(TreeletTree& tree, int node) const {
+			const int child1 = tree.children[2 * node];
+			const int child2 = tree.children[2 * node + 1];
+			tree.bounds[node] = merge(tree.bounds[child1], tree.bounds[child2]);
+			tree.primitiveNums[node] = tree.primitiveNums[child1] + tree.primitiveNums[child2];
+			bool collapsed;
+			tree.costs[node] = treeletCost(tree.bounds[node].surfaceArea(), tree.primitiveNums[node], tree.costs[child1] + tree.costs[child2], &collapsed);
+			tree.collapsed[node] = collapsed ? 1 : 0;
+			tree.heights[node] = 1 + std::max(tree.heights[child1], tree.heights[child2]);
+		}
+
+		void optimizeTreelets(int rootDepth, BuildOutput* output) const {
+			const int nodeNum = output->nodes.size();
+			TreeletTree tree;
+			tree.children.resize(2 * nodeNum);
+			tree.bounds.resize(nodeNum);
+			tree.costs.resize(nodeNum);
+			tree.heights.resize(nodeNum);
+			tree.primitiveNums.resize(nodeNum);
+			tree.collapsed.resize(nodeNum);
+			for (int i = nodeNum - 1; i >= 0; --i) {
+				const LinearBVHNode& node = output->nodes[i];
+				if (node.isLeaf()) {
+					tree.children[2 * i] = tree.children[2 * i + 1] = -1;
+					tree.bounds[i] = node.bound();
+					tree.costs[i] = settings.intersectionCost * node.primitiveNum * tree.bounds[i].surfaceArea();
+					tree.heights[i] = 0;
+					tree.primitiveNums[i] = node.primitiveNum;
+					tree.collapsed[i] = 0;
+				} else {
+					tree.children[2 * i] = i + 1;
+					tree.children[2 * i + 1] = node.secondChildOffset;
+					updateTreeletNode(tree, i);
+				}
+			}
+
+			for (int iteration = 0; iteration < settings.treeletOptimizationIterations; ++iteration) {
+				optimizeTreeletSub(tree, 0, rootDepth, TreeletLeafNum << iteration);
+			}
+
+			// 組み替えた木を深さ優先順に並べ直す
+			BuildOutput optimized;
+			optimized.nodes.reserve(nodeNum);
+			optimized.primitiveIndices.reserve(output->primitiveIndices.size());
+			appendTreeletSub(tree, *output, 0, optimized);
+			*output = std::move(optimized);
+		}
+
+		void optimizeTreeletSub(TreeletTree& tree, int node, int depth, int minPrimitiveNum) const {
+			if (tree.isLeaf(node)) { return; }
+			optimizeTreeletSub(tree, tree.children[2 * node], depth + 1, minPrimitiveNum);
+			optimizeTreeletSub(tree, tree.children[2 * node + 1], depth + 1, minPrimitiveNum);
+			updateTreeletNode(tree, node);
+			if (tree.primitiveNums[node] >= minPrimitiveNum) {
+				restructureTreelet(tree, node, depth);
+			}
+		}
+
+		void restructureTreelet(TreeletTree& tree, int root, int depth) const {
+			int leaves[TreeletLeafNum] = { tree.children[2 * root], tree.children[2 * root + 1] };
+			int internals[TreeletLeafNum - 1] = { root };
+			int leafNum = 2;
+			int internalNum = 1;
+			while (leafNum < TreeletLeafNum) {
+				int expanded = -1;
+				float maxArea = -1.0f;
+				for (int i = 0; i < leafNum; ++i) {
+					if (tree.isLeaf(leaves[i])) { continue; }
+					const float area = tree.bounds[leaves[i]].surfaceArea();
+					if (area > maxArea) {
+						maxArea = area;
+						expanded = i;
+					}
+				}
+				if (expanded < 0) { break; }
+				const int node = leaves[expanded];
+				internals[internalNum++] = node;
+				leaves[expanded] = tree.children[2 * node];
+				leaves[leafNum++] = tree.children[2 * node + 1];
+			}
+			// 葉が 2 つの treelet は組み替えようがない
+			if (leafNum <= 2) { return; }
+
+			// 葉の部分集合をビットで表し、それぞれを 1 つの部分木にまとめた場合の最小のコストを小さい集合から順に求める
+			const int subsetNum = 1 << leafNum;
+			Bounds3f subsetBounds[1 << TreeletLeafNum];
+			float subsetCosts[1 << TreeletLeafNum];
+			int subsetHeights[1 << TreeletLeafNum];
+			int subsetPrimitiveNums[1 << TreeletLeafNum];
+			int partitions[1 << TreeletLeafNum];
+			for (int s = 1; s < subsetNum; ++s) {
+				const int lowest = std::countr_zero((uint32_t)s);
+				if (s == (1 << lowest)) {
+					subsetBounds[s] = tree.bounds[leaves[lowest]];
+					subsetCosts[s] = tree.costs[leaves[lowest]];
+					subsetHeights[s] = tree.heights[leaves[lowest]];
+					subsetPrimitiveNums[s] = tree.primitiveNums[leaves[lowest]];
+					continue;
+				}
+				subsetBounds[s] = merge(subsetBounds[s & (s - 1)], tree.bounds[leaves[lowest]]);
+				subsetPrimitiveNums[s] = subsetPrimitiveNums[s & (s - 1)] + tree.primitiveNums[leaves[lowest]];
+
+				// 同じ分け方を 2 度調べないよう、最下位の葉を含む側を p とする
+				// (最下位の葉以外の部分集合 q を列挙し、p = q + 最下位の葉 とする)
+				const int rest = s & (s - 1);
+				float bestCost = Infinity;
+				int bestPartition = 0;
+				for (int q = (rest - 1) & rest; ; q = (q - 1) & rest) {
+					const int p = q | (1 << lowest);
+					const float cost = subsetCosts[p] + subsetCosts[s ^ p];
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestPartition = p;
+					}
+					if (q == 0) { break; }
+				}
+				bool collapsed;
+				subsetCosts[s] = treeletCost(subsetBounds[s].surfaceArea(), subsetPrimitiveNums[s], bestCost, &collapsed);
+				subsetHeights[s] = 1 + std::max(subsetHeights[bestPartition], subsetHeights[s ^ bestPartition]);
+				partitions[s] = bestPartition;
+			}
+
+			// 改善しない場合や、トラバーサル用のスタックを超える深さになる場合は組み替えない
+			const int all = subsetNum - 1;
+			if (subsetCosts[all] >= tree.costs[root] * 0.9999f || depth + subsetHeights[all] >= MaxDepth) { return; }
+
+			// treelet の内部ノードを使い回して組み替える (根は root のまま)
+			int nextInternal = 0;
+			rebuildTreelet(tree, all, leaves, internals, partitions, &nextInternal);
+		}
+
+		// 部分集合 s の葉をまとめた部分木を partitions の分け方で作り、その根を返す
+		int rebuildTreelet(TreeletTree& tree, int s, const int* leaves, const int* internals, const int* partitions, int* nextInternal) const {
+			if ((s & (s - 1)) == 0) { return leaves[std::countr_zero((uint32_t)s)]; }
+			const int node = internals[(*nextInternal)++];
+			const int p = partitions[s];
+			tree.children[2 * node] = rebuildTreelet(tree, p, leaves, internals, partitions, nextInternal);
+			tree.children[2 * node + 1] = rebuildTreelet(tree, s ^ p, leaves, internals, partitions, nextInternal);
+			updateTreeletNode(tree, node);
+			return node;
+		}
+
+		static void appendTreeletPrimitives(const TreeletTree& tree, const BuildOutput& source, int node, BuildOutput& output) {
+			if (tree.isLeaf(node)) {
+				const int offset = source.nodes[node].primitiveOffset;
+				output.primitiveIndices.insert(output.primitiveIndices.end(),
+					source.primitiveIndices.begin() + offset, source.primitiveIndices.begin() + offset + source.nodes[node].primitiveNum);
+				return;
+			}
+			appendTreeletPrimitives(tree, source, tree.children[2 * node], output);
+			appendTreeletPrimitives(tree, source, tree.children[2 * node + 1], output);
+		}
+
+		static void appendTreeletSub(const TreeletTree& tree, const BuildOutput& source, int node, BuildOutput& output) {
+			const int nodeIndex = output.nodes.size();
+			LinearBVHNode linearNode = source.nodes[node];
+			linearNode.setBound(tree.bounds[node]);
+			if (tree.isLeaf(node) || tree.collapsed[node]) {
+				linearNode.primitiveOffset = output.primitiveIndices.size();
+				linearNode.primitiveNum = (uint16_t)tree.primitiveNums[node];
+				linearNode.axis = 0;
+				linearNode.anyHitSecondFirst = 0;
+				output.nodes.push_back(linearNode);
+				appendTreeletPrimitives(tree, source, node, output);
+				return;
+			}
+
+			// 分割軸は子ノードの中心が最も離れている軸とする
+			const Bounds3f& bound1 = tree.bounds[tree.children[2 * node]];
+			const Bounds3f& bound2 = tree.bounds[tree.children[2 * node + 1]];
+			const Vector3f d = bound2.center() - bound1.center();
+			linearNode.axis = Vector3f(fabsf(d.x), fabsf(d.y), fabsf(d.z)).maxDimension();
+			linearNode.setAnyHitOrder(bound1, bound2);
+			output.nodes.push_back(linearNode);
+
+			appendTreeletSub(tree, source, tree.children[2 * node], output);
+			output.nodes[nodeIndex].secondChildOffset = output.nodes.size();
+			appendTreeletSub(tree, source, tree.children[2 * node + 1], output);
+		}
+
+	};
+
+	//---------------------------------------------------
+
+	// 二分木の BVH を Width 分木に畳み込んだもの
+	// 子ノードの AABB を SoA で持ち、全ての子ノードとの交差判定を SIMD でまとめて行う
+	template<int Width> struct alignas(32) WideBVHNode {
+		float aabb[2][3][Width]; // [min/max][軸][子ノード]
+		int children[Width];      // 内部ノードならノード番号、リーフならプリミティブのオフセット
+		int primitiveNums[Width]; // 0 なら内部ノード
+
+		WideBVHNode() {
+			for (int i = 0; i < Width; ++i) {
+				for (int axis = 0; axis < 3; ++axis) {
+					// 空きスロットはどのレイとも交差しないようにしておく
+					aabb[0][axis][i] = Infinity;
+					aabb[1][axis][i] = -Infinity;
+				}
+				children[i] = -1;
+				primitiveNums[i] = 0;
+			}
+		}
+
+		bool isEmpty(int i) const { return children[i] < 0; }
+		bool isLeaf(int i) const { return primitiveNums[i] > 0; }
+
+		void setBound(int i, const LinearBVHNode& node) {
+			for (int axis = 0; axis < 3; ++axis) {
+				aabb[0][axis][i] = node.aabbMin[axis];
+				aabb[1][axis][i] = node.aabbMax[axis];
+			}
+		}
+
+		void setBound(int i, const Bounds3f& b) {
+			for (int axis = 0; axis < 3; ++axis) {
+				aabb[0][axis][i] = b.min[axis];
+				aabb[1][axis][i] = b.max[axis];
+			}
+		}
+
+		Bounds3f bound(int i) const {
+			return Bounds3f(
+				Vector3f(aabb[0][0][i], aabb[0][1][i], aabb[0][2][i]),
+				Vector3f(aabb[1][0][i], aabb[1][1][i], aabb[1][2][i]));
+		}
+
+		// 全ての子ノードを含む AABB
+		Bounds3f bound() const {
+			Bounds3f res;
+			for (int i = 0; i < Width; ++i) {
+				if (isEmpty(i)) { continue; }
+				res = merge(res, bound(i));
+			}
+			return res;
+		}
+	};
+
+	template<int Width> class _WideBVH : public _AccelerationStructure {
+	public:
+		static_assert(Width == 4 || Width == 8, "_WideBVH supports only 4 or 8 children");
+
+		_WideBVH(const std::vector<TriangleIndexed*>& primitives, const BVHBuildSettings& settings = BVHBuildSettings()) { collapse(_BVH(primitives, settings)); }
+		_WideBVH(const std::vector<Object*>& objects, const BVHBuildSettings& settings = BVHBuildSettings()) { collapse(_BVH(objects, settings)); }
+		_WideBVH(const std::vector<Shape*>& shapes, const BVHBuildSettings& settings = BVHBuildSettings()) { collapse(_BVH(shapes, settings)); }
+
+		// _BVH と同じく、プリミティブの AABB のみから構築する
+		_WideBVH(const std::vector<Bounds3f>& primitiveBounds, const BVHBuildSettings& settings = BVHBuildSettings(), const _BVH::PrimitiveSplitter& splitPrimitive = nullptr) { collapse(_BVH(primitiveBounds, settings, splitPrimitive)); }
+
+		// 構築済みの二分木を畳み込む
+		// BVHCache は _BVH を保存するので、読み込んだものはこれで変換する
+		explicit _WideBVH(const _BVH& bvh) { collapse(bvh); }
+
+		bool intersect(Ray& ray, HitRecord* hit) const override {
+			return intersectPrimitives<false>(ray, hit, nullptr);
+		}
+
+		bool intersectAny(const Ray& ray) const override {
+			return intersectAnyPrimitives<false>(ray, nullptr);
+		}
+
+		// _BVH::traverse と同じく、リーフ内の [offset, offset + num) 番目のプリミティブとの判定を intersectLeaf で行う
+		// 交差した子ノードのうちリーフは手前から順に判定し、内部ノードは手前のものから辿る
+		template<bool CountStatistics = false, typename F> bool traverse(Ray& ray, const F& intersectLeaf, TraversalStatistics* stats = nullptr) const {
+			if (nodes.empty()) { return false; }
+
+			const RaySIMD raySIMD(ray);
+
+			bool found = false;
+			StackEntry stack[StackSize];
+			int stackNum = 0;
+			stack[stackNum++] = StackEntry{ 0, 0.0f };
+			while (stackNum > 0) {
+				const StackEntry entry = stack[--stackNum];
+				if (entry.tNear > ray.tMax) { continue; }
+
+				const WideBVHNode<Width>& node = nodes[entry.nodeIndex];
+				if constexpr (CountStatistics) { ++stats->nodesVisited; }
+
+				float tNear[Width];
+				int order[Width];
+				int hitNum = intersectChildren(node, raySIMD, ray.tMax, tNear, order);
+
+				// 手前から順に並べる
+				for (int i = 1; i < hitNum; ++i) {
+					int c = order[i];
+					int k = i;
+					for (; k > 0 && tNear[order[k - 1]] > tNear[c]; --k) {
+						order[k] = order[k - 1];
+					}
+					order[k] = c;
+				}
+
+				// リーフはその場で手前から判定し、内部ノードは手前のものが先に取り出されるよう奥から積む
+				for (int i = 0; i < hitNum; ++i) {
+					int c = order[i];
+					if (!node.isLeaf(c) || tNear[c] > ray.tMax) { continue; }
+					if (intersectLeaf(node.children[c], node.primitiveNums[c], ray)) {
+						found = true;
+					}
+				}
+				for (int i = hitNum - 1; i >= 0; --i) {
+					int c = order[i];
+					if (node.isLeaf(c)) { continue; }
+					ASSERT(stackNum < StackSize);
+					stack[stackNum++] = StackEntry{ node.children[c], tNear[c] };
+				}
+			}
+			return found;
+		}
+
+		// intersectLeaf(offset, num, ray) が true を返した時点で打ち切る
+		template<bool CountStatistics = false, typename F> bool traverseAny(const Ray& ray, const F& intersectLeaf, TraversalStatistics* stats = nullptr) const {
+			if (nodes.empty()) { return false; }
+
+			const RaySIMD raySIMD(ray);
+
+			int stack[StackSize];
+			int stackNum = 0;
+			stack[stackNum++] = 0;
+			while (stackNum > 0) {
+				const WideBVHNode<Width>& node = nodes[stack[--stackNum]];
+				if constexpr (CountStatistics) { ++stats->nodesVisited; }
+
+				float tNear[Width];
+				int order[Width];
+				int hitNum = intersectChildren(node, raySIMD, ray.tMax, tNear, order);
+
+				// 子ノードは表面積の大きい順に並んでいるので、距離によらずその順に辿る
+				// リーフを先に判定し、内部ノードは先頭のものが先に取り出されるよう後ろから積む
+				for (int i = 0; i < hitNum; ++i) {
+					int c = order[i];
+					if (!node.isLeaf(c)) { continue; }
+					if (intersectLeaf(node.children[c], node.primitiveNums[c], ray)) {
+						return true;
+					}
+				}
+				for (int i = hitNum - 1; i >= 0; --i) {
+					int c = order[i];
+					if (node.isLeaf(c)) { continue; }
+					ASSERT(stackNum < StackSize);
+					stack[stackNum++] = node.children[c];
+				}
+			}
+			return false;
+		}
+
+		// _BVH::traversePacket と同じ
+		// 子ノードごとにパケットの全てのレイとの判定を SIMD で行い、先頭の有効なレイの方向に沿って手前の子ノードから辿る
+		template<typename F> int traversePacket(RayPacket& packet, int activeMask, const F& intersectLeaf) const {
+			if (nodes.empty() || activeMask == 0) { return 0; }
+
+			const _BVH::RayPacketSIMD packetSIMD(packet, activeMask);
+			const Vector3f dir = packetDirection(packet, activeMask);
+
+			int hitMask = 0;
+			int stack[StackSize];
+			int stackNum = 0;
+			stack[stackNum++] = 0;
+			while (stackNum > 0) {
+				const WideBVHNode<Width>& node = nodes[stack[--stackNum]];
+
+				int laneMasks[Width];
+				float keys[Width];
+				int order[Width];
+				int hitNum = intersectChildren(node, packetSIMD, packet.tMax, activeMask, laneMasks, order);
+				for (int i = 0; i < hitNum; ++i) {
+					keys[order[i]] = dot(node.bound(order[i]).center(), dir);
+				}
+				for (int i = 1; i < hitNum; ++i) {
+					int c = order[i];
+					int k = i;
+					for (; k > 0 && keys[order[k - 1]] > keys[c]; --k) {
+						order[k] = order[k - 1];
+					}
+					order[k] = c;
+				}
+
+				for (int i = 0; i < hitNum; ++i) {
+					int c = order[i];
+					if (!node.isLeaf(c)) { continue; }
+					hitMask |= intersectLeaf(node.children[c], node.primitiveNums[c], packet, laneMasks[c]);
+				}
+				for (int i = hitNum - 1; i >= 0; --i) {
+					int c = order[i];
+					if (node.isLeaf(c)) { continue; }
+					ASSERT(stackNum < StackSize);
+					stack[stackNum++] = node.children[c];
+				}
+			}
+			return hitMask;
+		}
+
+		// 遮蔽されたレイのビットを立てたマスクを返す
+		// 全てのレイが遮蔽された時点で打ち切る
+		template<typename F> int traversePacketAny(const RayPacket& packet, int activeMask, const F& intersectLeaf) const {
+			if (nodes.empty() || activeMask == 0) { return 0; }
+
+			const _BVH::RayPacketSIMD packetSIMD(packet, activeMask);
+
+			int occludedMask = 0;
+			int stack[StackSize];
+			int stackNum = 0;
+			stack[stackNum++] = 0;
+			while (stackNum > 0) {
+				const WideBVHNode<Width>& node = nodes[stack[--stackNum]];
+
+				int laneMasks[Width];
+				int order[Width];
+				int hitNum = intersectChildren(node, packetSIMD, packet.tMax, activeMask & ~occludedMask, laneMasks, order);
+
+				for (int i = 0; i < hitNum; ++i) {
+					int c = order[i];
+					if (!node.isLeaf(c)) { continue; }
+					const int laneMask = laneMasks[c] & ~occludedMask;
+					if (laneMask == 0) { continue; }
+					occludedMask |= intersectLeaf(node.children[c], node.primitiveNums[c], packet, laneMask);
+					if (occludedMask == activeMask) { return occludedMask; }
+				}
+				for (int i = hitNum - 1; i >= 0; --i) {
+					int c = order[i];
+					if (node.isLeaf(c)) { continue; }
+					ASSERT(stackNum < StackSize);
+					stack[stackNum++] = node.children[c];
+				}
+			}
+			return occludedMask;
+		}
+
+		bool intersectWithStatistics(Ray& ray, HitRecord* hit, TraversalStatistics* stats) const override {
+			return intersectPrimitives<true>(ray, hit, stats);
+		}
+
+		bool intersectAnyWithStatistics(const Ray& ray, TraversalStatistics* stats) const override {
+			return intersectAnyPrimitives<true>(ray, stats);
+		}
+
+		// 子ノードの AABB の判定は SIMD でまとめて行うので、コストは内部ノード 1 つあたり 1 とする
+		// 子ノードのうちリーフのものはそれぞれ 1 つのリーフとして数える
+		AccelerationStructureStatistics statistics() const override {
+			AccelerationStructureStatistics stats;
+			if (nodes.empty()) { return stats; }
+
+			struct NodeEntry {
+				int nodeIndex;
+				int depth;
+			};
+			std::vector<NodeEntry> stack;
+			stack.push_back(NodeEntry{ 0, 0 });
+			while (!stack.empty()) {
+				const NodeEntry entry = stack.back();
+				stack.pop_back();
+				const WideBVHNode<Width>& node = nodes[entry.nodeIndex];
+
+				Bounds3f children[Width];
+				int childNum = 0;
+				for (int c = 0; c < Width; ++c) {
+					if (node.isEmpty(c)) { continue; }
+					children[childNum++] = node.bound(c);
+					if (node.isLeaf(c)) {
+						stats.addLeaf(node.bound(c), entry.depth + 1, node.primitiveNums[c], 1.0f);
+					} else {
+						stack.push_back(NodeEntry{ node.children[c], entry.depth + 1 });
+					}
+				}
+				stats.addInterior(node.bound(), entry.depth, children, childNum, 1.0f);
+			}
+
+			stats.memoryBytes =
+				sizeof(WideBVHNode<Width>) * nodes.size() +
+				sizeof(int) * primitiveIndices.size() +
+				sizeof(const Geometry*) * primitives.size();
+			stats.finish(nodes[0].bound());
+			return stats;
+		}
+
+		void refit() override {
+			refit([this](int i) { return primitives[i]->bound(); });
+		}
+
+		// primitiveBound(i) はリーフ内の並びで i 番目のプリミティブの現在の AABB
+		template<typename F> void refit(const F& primitiveBound) {
+			forEachNodeBottomUp([&](int i) {
+				WideBVHNode<Width>& node = nodes[i];
+				for (int c = 0; c < Width; ++c) {
+					if (node.isEmpty(c)) { continue; }
+					Bounds3f bound;
+					if (node.isLeaf(c)) {
+						for (int k = 0; k < node.primitiveNums[c]; ++k) {
+							bound = merge(bound, primitiveBound(node.children[c] + k));
+						}
+					} else {
+						bound = nodes[node.children[c]].bound();
+					}
+					node.setBound(c, bound);
+				}
+				});
+		}
+
+		bool rebuildDegradedSubtree(float threshold) override {
+			return rebuildDegradedSubtree(threshold, [this](int i) { return primitives[i]->bound(); });
+		}
+
+		// 畳み込んだ後は部分木の SAH コストを持たないので、木全体のコストが構築時の threshold 倍より悪化した場合に全体を作り直す
+		// リーフ内のプリミティブの並びが変わるので、primitiveOrder を参照し直すこと
+		template<typename F> bool rebuildDegradedSubtree(float threshold, const F& primitiveBound) {
+			if (nodes.empty() || !(sahCost() > builtCost * threshold)) { return false; }
+
+			// リーフ内の並びの各要素を 1 つのプリミティブとして構築し直す
+			// 空間分割で複製されたものは既に別々の要素になっているので、これ以上は分割しない
+			const int num = primitiveIndices.size();
+			std::vector<Bounds3f> bounds(num);
+#pragma omp parallel for
+			for (int i = 0; i < num; ++i) {
+				bounds[i] = primitiveBound(i);
+			}
+			const BVHBuildSettings builtSettings = settings;
+			BVHBuildSettings rebuildSettings = settings;
+			rebuildSettings.spatialSplit = false;
+			const _BVH bvh(bounds, rebuildSettings);
+
+			std::vector<int> indices(num);
+			std::vector<const Geometry*> geometries(primitives.empty() ? 0 : num);
+			for (int i = 0; i < num; ++i) {
+				const int k = bvh.primitiveIndices[i];
+				indices[i] = primitiveIndices[k];
+				if (!primitives.empty()) { geometries[i] = primitives[k]; }
+			}
+			collapse(bvh);
+			settings = builtSettings;
+			primitiveIndices = std::move(indices);
+			primitives = std::move(geometries);
+			return true;
+		}
+
+		// _BVH::primitiveOrder と同じ
+		const std::vector<int>& primitiveOrder() const { return primitiveIndices; }
+
+	private:
+		using T_SIMD = typename std::conditional<Width == 8, simdpp::float32x8, simdpp::float32x4>::type;
+		using T_SIMDUINT = typename std::conditional<Width == 8, simdpp::uint32x8, simdpp::uint32x4>::type;
+
+		static const int StackSize = _BVH::MaxDepth * (Width - 1) + 1;
+
+		BVHBuildSettings settings;
+
+		std::vector<WideBVHNode<Width>> nodes;
+
+		// _BVH と同じく、リーフ内の並びでのプリミティブ (AABB のみから構築した場合、primitives は空になる)
+		std::vector<int> primitiveIndices;
+		std::vector<const Geometry*> primitives;
+
+		// 構築時の木全体の SAH コスト (sahCost)
+		float builtCost = 0.0f;
+
+		// _BVH と同じく、ノード番号を深さごとにまとめたもの
+		// 畳み込み直したら空にしておき、必要になった時点で作り直す
+		std::vector<int> levelOrder;
+		std::vector<int> levelOffsets;
+
+		struct StackEntry {
+			int nodeIndex;
+			float tNear;
+		};
+
+		// レイの情報を SIMD レジスタ幅に展開しておいたもの
+		struct RaySIMD {
+			T_SIMD o[3];
+			T_SIMD invDir[3];
+			int dirIsNeg[3];
+
+			RaySIMD(const Ray& ray) {
+				for (int axis = 0; axis < 3; ++axis) {
+					float invD = 1.0f / ray.d[axis];
+					o[axis] = simdpp::splat<T_SIMD>(ray.o[axis]);
+					invDir[axis] = simdpp::splat<T_SIMD>(invD);
+					dirIsNeg[axis] = invD < 0;
+				}
+			}
+		};
+
+		template<bool CountStatistics> bool intersectPrimitives(Ray& ray, HitRecord* hit, TraversalStatistics* stats) const {
+			return traverse<CountStatistics>(ray, [&](int offset, int num, Ray& leafRay) {
+				bool found = false;
+				for (int i = offset; i < offset + num; ++i) {
+					if (intersectGeometry<CountStatistics>(primitives[i], leafRay, hit, stats)) {
+						found = true;
+					}
+				}
+				return found;
+				}, stats);
+		}
+
+		template<bool CountStatistics> bool intersectAnyPrimitives(const Ray& ray, TraversalStatistics* stats) const {
+			return traverseAny<CountStatistics>(ray, [&](int offset, int num, const Ray& leafRay) {
+				for (int i = offset; i < offset + num; ++i) {
+					if (intersectAnyGeometry<CountStatistics>(primitives[i], leafRay, stats)) {
+						return true;
+					}
+				}
+				return false;
+				}, stats);
+		}
+
+		// 全ての子ノードの AABB との交差判定を一度に行い、交差した子ノードの番号を order に詰める
+		int intersectChildren(const WideBVHNode<Width>& node, const RaySIMD& ray, float tMax, float* tNear, int* order) const {
+			T_SIMD t1 = simdpp::make_zero();
+			T_SIMD t2 = simdpp::splat<T_SIMD>(tMax);
+			for (int axis = 0; axis < 3; ++axis) {
+				T_SIMD near = simdpp::load_u<T_SIMD>(node.aabb[ray.dirIsNeg[axis]][axis]);
+				T_SIMD far = simdpp::load_u<T_SIMD>(node.aabb[1 - ray.dirIsNeg[axis]][axis]);
+				T_SIMD tNearAxis = simdpp::mul(simdpp::sub(near, ray.o[axis]), ray.invDir[axis]);
+				T_SIMD tFarAxis = simdpp::mul(simdpp::sub(far, ray.o[axis]), ray.invDir[axis]);
+				// 原点が AABB の面上にあり方向の成分が 0 の軸では 0 * inf で NaN になるので、
+				// NaN のレーンでは _BVH と同じく区間を更新しないように、前の区間を 2 番目の引数にする
+				t1 = simdpp::max(tNearAxis, t1);
+				t2 = simdpp::min(tFarAxis, t2);
+			}
+
+			uint32_t mask[Width];
+			simdpp::store_u(tNear, t1);
+			simdpp::store_u(mask, simdpp::bit_cast<T_SIMDUINT>(simdpp::cmp_le(t1, t2)));
+
+			int hitNum = 0;
+			for (int i = 0; i < Width; ++i) {
+				if (mask[i]) { order[hitNum++] = i; }
+			}
+			return hitNum;
+		}
+
+		// 子ノードごとにパケットの activeMask のレイとの交差判定を行い、交差したレイのマスクを laneMasks に、交差した子ノードの番号を order に詰める
+		int intersectChildren(const WideBVHNode<Width>& node, const _BVH::RayPacketSIMD& packet, const float* tMax, int activeMask, int* laneMasks, int* order) const {
+			int hitNum = 0;
+			for (int c = 0; c < Width; ++c) {
+				if (node.isEmpty(c)) { continue; }
+				float aabbMin[3], aabbMax[3];
+				for (int axis = 0; axis < 3; ++axis) {
+					aabbMin[axis] = node.aabb[0][axis][c];
+					aabbMax[axis] = node.aabb[1][axis][c];
+				}
+				if (!packet.mayIntersect(aabbMin, aabbMax)) { continue; }
+				laneMasks[c] = packet.intersect(aabbMin, aabbMax, tMax) & activeMask;
+				if (laneMasks[c]) { order[hitNum++] = c; }
+			}
+			return hitNum;
+		}
+
+		// 子ノードを辿る順に使う、先頭の有効なレイの方向
+		static Vector3f packetDirection(const RayPacket& packet, int activeMask) {
+			int first = 0;
+			while (!(activeMask & (1 << first))) { ++first; }
+			return Vector3f(packet.d[0][first], packet.d[1][first], packet.d[2][first]);
+		}
+
+		void collapse(const _BVH& bvh) {
+			collapseNodes(bvh);
+			levelOrder.clear();
+			builtCost = sahCost();
+		}
+
+		// statistics().sahCost と同じ値 (足す順序による誤差を除く) を、ヒストグラムや体積の重なりを求めずに計算する
+		// updatePositions のたびに rebuildDegradedSubtree から呼ばれるので、ノードを 1 回なめるだけで済ませる
+		float sahCost() const {
+			if (nodes.empty()) { return 0.0f; }
+			double sum = 0.0;
+			for (const WideBVHNode<Width>& node : nodes) {
+				sum += node.bound().surfaceArea();
+				for (int c = 0; c < Width; ++c) {
+					if (node.isLeaf(c)) {
+						sum += node.primitiveNums[c] * node.bound(c).surfaceArea();
+					}
+				}
+			}
+			const float rootArea = nodes[0].bound().surfaceArea();
+			return rootArea > 0.0f ? sum / rootArea : 0.0f;
+		}
+
+		void computeLevels() {
+			std::vector<int> depths(nodes.size());
+			int maxDepth = 0;
+			depths[0] = 0;
+			for (int i = 0; i < (int)nodes.size(); ++i) {
+				maxDepth = max(maxDepth, depths[i]);
+				for (int c = 0; c < Width; ++c) {
+					if (nodes[i].isEmpty(c) || nodes[i].isLeaf(c)) { continue; }
+					depths[nodes[i].children[c]] = depths[i] + 1;
+				}
+			}
+
+			levelOffsets.assign(maxDepth + 2, 0);
+			for (int d : depths) { ++levelOffsets[d + 1]; }
+			for (int d = 0; d <= maxDepth; ++d) { levelOffsets[d + 1] += levelOffsets[d]; }
+
+			std::vector<int> counts(levelOffsets.begin(), levelOffsets.end() - 1);
+			levelOrder.resize(nodes.size());
+			for (int i = 0; i < (int)nodes.size(); ++i) {
+				levelOrder[counts[depths[i]]++] = i;
+			}
+		}
+
+		// _BVH::forEachNodeBottomUp と同じく、深い方から 1 段ずつ、同じ深さのノードに対して並列に f を呼ぶ
+		template<typename F> void forEachNodeBottomUp(F f) {
+			if (nodes.empty()) { return; }
+			if (levelOrder.empty()) { computeLevels(); }
+
+			for (int d = (int)levelOffsets.size() - 2; d >= 0; --d) {
+				const int levelBegin = levelOffsets[d];
+				const int levelEnd = levelOffsets[d + 1];
+#pragma omp parallel for if(levelEnd - levelBegin >= _BVH::ParallelRefitNodeNum)
+				for (int k = levelBegin; k < levelEnd; ++k) {
+					f(levelOrder[k]);
+				}
+			}
+		}
+
+		void collapseNodes(const _BVH& bvh) {
+			nodes.clear();
+			settings = bvh.settings;
+			primitiveIndices = bvh.primitiveIndices;
+			primitives = bvh.primitives;
+			if (bvh.nodes.empty()) { return; }
+
+			// 二分木のノード数から畳み込み後のノード数の上限を見積もっておく
+			nodes.reserve((bvh.nodes.size() + Width - 2) / (Width - 1) + 1);
+
+			if (bvh.nodes[0].isLeaf()) {
+				nodes.emplace_back();
+				nodes[0].setBound(0, bvh.nodes[0]);
+				nodes[0].children[0] = bvh.nodes[0].primitiveOffset;
+				nodes[0].primitiveNums[0] = bvh.nodes[0].primitiveNum;
+				return;
+			}
+
+			collapseSub(bvh, 0);
+		}
+
+		int collapseSub(const _BVH& bvh, int binaryIndex) {
+			const int nodeIndex = nodes.size();
+			nodes.emplace_back();
+
+			// 表面積の大きい内部ノードから順に、子ノードで置き換えて展開していく
+			int candidates[Width];
+			int candidateNum = 0;
+			candidates[candidateNum++] = binaryIndex + 1;
+			candidates[candidateNum++] = bvh.nodes[binaryIndex].secondChildOffset;
+			while (candidateNum < Width) {
+				int best = -1;
+				float bestArea = -Infinity;
+				for (int i = 0; i < candidateNum; ++i) {
+					const LinearBVHNode& candidate = bvh.nodes[candidates[i]];
+					if (candidate.isLeaf()) { continue; }
+					float area = candidate.bound().surfaceArea();
+					if (area > bestArea) {
+						best = i;
+						bestArea = area;
+					}
+				}
+				if (best < 0) { break; }
+
+				int expanded = candidates[best];
+				candidates[best] = expanded + 1;
+				candidates[candidateNum++] = bvh.nodes[expanded].secondChildOffset;
+			}
+
+			// intersectAny で遮蔽物を早く見つけられるよう、表面積の大きい子ノードから並べておく
+			std::stable_sort(candidates, candidates + candidateNum, [&](int a, int b) {
+				return bvh.nodes[a].bound().surfaceArea() > bvh.nodes[b].bound().surfaceArea();
+				});
+
+			for (int i = 0; i < candidateNum; ++i) {
+				const LinearBVHNode& child = bvh.nodes[candidates[i]];
+				nodes[nodeIndex].setBound(i, child);
+				if (child.isLeaf()) {
+					nodes[nodeIndex].children[i] = child.primitiveOffset;
+					nodes[nodeIndex].primitiveNums[i] = child.primitiveNum;
+				} else {
+					int childIndex = collapseSub(bvh, candidates[i]);
+					nodes[nodeIndex].children[i] = childIndex;
+					nodes[nodeIndex].primitiveNums[i] = 0;
+				}
+			}
+
+			return nodeIndex;
+		}
 	};
 
 }
@@ -0,0 +1,86 @@
+﻿#pragma once
+
+#include "Sampler.h"
+#include "Utils.h"
+
+namespace xitils {
+
+	// ウェイトに比例した確率で整数値を O(1) でサンプリングするためのテーブル (Walker のエイリアス法)
+	// Sampler::randiAlongWeights と同じ分布だが、構築時に O(n) かかる代わりにサンプリングごとの走査がない
+	// 光源や三角形の選択のように、同じウェイトで何度もサンプリングする場合に使う
+	class AliasTable {
+	public:
+
+		AliasTable() {}
+
+		// ウェイトは負でないこと
+		// ウェイトの合計が 0 の場合 (と NaN を含む場合) は等確率にする
+		AliasTable(const std::vector<float>& weights) {
+			const int n = weights.size();
+			if (n == 0) { return; }
+
+			double weightSum = 0.0;
+			for (float w : weights) {
+				ASSERT(!(w < 0.0f));
+				weightSum += w;
+			}
+			const bool uniform = !(weightSum > 0.0) || !std::isfinite(weightSum);
+
+			probabilities.resize(n);
+			pmfs.resize(n);
+			aliases.resize(n);
+
+			// 各区画の確率の n 倍を 1 より小さいものと大きいものに分け、小さい区画の余りを大きい区画で埋めていく (Vose の方法)
+			std::vector<double> scaled(n);
+			std::vector<int> small, large;
+			for (int i = 0; i < n; ++i) {
+				pmfs[i] = uniform ? 1.0f / n : (float)(weights[i] / weightSum);
+				scaled[i] = uniform ? 1.0 : weights[i] / weightSum * n;
+				aliases[i] = i;
+				(scaled[i] < 1.0 ? small : large).push_back(i);
+			}
+			while (!small.empty() && !large.empty()) {
+				const int s = small.back();
+				small.pop_back();
+				const int l = large.back();
+				probabilities[s] = (float)scaled[s];
+				aliases[s] = l;
+				scaled[l] -= 1.0 - scaled[s];
+				if (scaled[l] < 1.0) {
+					large.pop_back();
+					small.push_back(l);
+				}
+			}
+			// 誤差で残ったものは自身だけを選ぶ
+			for (int i : small) { probabilities[i] = 1.0f; }
+			for (int i : large) { probabilities[i] = 1.0f; }
+		}
+
+		bool empty() const { return pmfs.empty(); }
+		int size() const { return pmfs.size(); }
+
+		// ウェイトに比例した確率で番号を選ぶ
+		// 1 つの乱数を区画の選択と区画内のエイリアスの選択の両方に使う
+		int sample(Sampler& sampler) const {
+			ASSERT(!empty());
+			const float u = sampler.randf() * size();
+			const int i = std::min((int)u, size() - 1);
+			return u - i < probabilities[i] ? i : aliases[i];
+		}
+
+		// i が選ばれる確率
+		float pmf(int i) const {
+			return pmfs[i];
+		}
+
+		size_t memoryBytes() const {
+			return sizeof(float) * (probabilities.size() + pmfs.size()) + sizeof(int) * aliases.size();
+		}
+
+	private:
+		std::vector<float> probabilities; // 区画 i で i 自身を選ぶ確率
+		std::vector<int> aliases;         // 区画 i で i を選ばなかった場合に選ぶ番号
+		std::vector<float> pmfs;
+	};
+
+}
@@ -0,0 +1,204 @@
+﻿#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+#include "AccelerationStructure.h"
+
+namespace xitils {
+
+	// 構築済みの _BVH をディレクトリ内のファイルに保存しておき、次回以降の構築を省略するためのもの
+	// ファイルはキー (頂点位置、インデックス、構築時のパラメータなどから求めたハッシュ値) ごとに作られる
+	// キーには構築アルゴリズム自体は含まれないので、構築結果やノードの形式が変わる変更をした場合は Version を上げること
+	class BVHCache {
+	public:
+
+		static const uint32_t Version = 2;
+
+		BVHCache(const std::string& directory):
+			directory(directory)
+		{
+			std::error_code error;
+			std::filesystem::create_directories(directory, error);
+		}
+
+		// FNV-1a を 8 バイト単位で行うハッシュ値
+		// 複数のデータから 1 つのキーを作る場合は、前のハッシュ値を hash に渡して繋げる
+		static uint64_t hash(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+			const uint8_t* bytes = (const uint8_t*)data;
+			size_t i = 0;
+			for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+				uint64_t word;
+				memcpy(&word, bytes + i, sizeof(uint64_t));
+				hash = (hash ^ word) * 1099511628211ull;
+			}
+			for (; i < size; ++i) {
+				hash = (hash ^ bytes[i]) * 1099511628211ull;
+			}
+			return hash;
+		}
+
+		static uint64_t hash(const BVHBuildSettings& settings, uint64_t h) {
+			h = hash(&settings.binNum, sizeof(settings.binNum), h);
+			h = hash(&settings.traversalCost, sizeof(settings.traversalCost), h);
+			h = hash(&settings.intersectionCost, sizeof(settings.intersectionCost), h);
+			h = hash(&settings.maxPrimitivesInLeaf, sizeof(settings.maxPrimitivesInLeaf), h);
+			h = hash(&settings.spatialSplit, sizeof(settings.spatialSplit), h);
+			h = hash(&settings.spatialSplitOverlapThreshold, sizeof(settings.spatialSplitOverlapThreshold), h);
+			h = hash(&settings.spatialSplitMaxGrowth, sizeof(settings.spatialSplitMaxGrowth), h);
+			h = hash(&settings.linear, sizeof(settings.linear), h);
+			h = hash(&settings.treeletOptimizationIterations, sizeof(settings.treeletOptimizationIterations), h);
+			return h;
+		}
+
+		// キャッシュがあれば bvh をその内容で置き換えて true を返す
+		// primitiveNum はプリミティブ数で、キャッシュの内容と一致しない場合は読み込まない
+		// 読み込んだノードと添字が木として正しくない (ファイルが壊れている) 場合も読み込まず、呼び出し側で構築し直す
+		// _BVH は refit などでノードを書き換えるので、ファイルマッピングのビューを直接辿ることはできず、
+		// いずれにせよ std::vector へのコピーが要るため、マッピングせずに fread で直接読み込む
+		bool load(uint64_t key, int primitiveNum, _BVH* bvh) const {
+			const std::string filePath = path(key);
+			FILE* fp = fopen(filePath.c_str(), "rb");
+			if (fp == nullptr) { return false; }
+
+			std::vector<LinearBVHNode> nodes;
+			std::vector<float> builtCosts;
+			std::vector<int> primitiveIndices;
+			Header header;
+			bool succeeded = fread(&header, sizeof(Header), 1, fp) == 1;
+			succeeded = succeeded &&
+				memcmp(header.magic, Magic, sizeof(header.magic)) == 0 &&
+				header.version == Version &&
+				header.nodeSize == sizeof(LinearBVHNode) &&
+				header.key == key &&
+				header.primitiveNum == (uint32_t)primitiveNum &&
+				header.nodeNum <= (uint32_t)std::numeric_limits<int>::max() &&
+				header.referenceNum <= (uint32_t)std::numeric_limits<int>::max();
+			if (succeeded) {
+				const size_t expectedSize = sizeof(Header)
+					+ (size_t)header.nodeNum * (sizeof(LinearBVHNode) + sizeof(float))
+					+ (size_t)header.referenceNum * sizeof(int);
+				std::error_code error;
+				const uintmax_t fileSize = std::filesystem::file_size(filePath, error);
+				succeeded = !error && fileSize == expectedSize;
+			}
+			if (succeeded) {
+				nodes.resize(header.nodeNum);
+				builtCosts.resize(header.nodeNum);
+				primitiveIndices.resize(header.referenceNum);
+				succeeded =
+					fread(nodes.data(), sizeof(LinearBVHNode), header.nodeNum, fp) == header.nodeNum &&
+					fread(builtCosts.data(), sizeof(float), header.nodeNum, fp) == header.nodeNum &&
+					fread(primitiveIndices.data(), sizeof(int), header.referenceNum, fp) == header.referenceNum;
+			}
+			fclose(fp);
+			if (!succeeded || !isValid(nodes, primitiveIndices, primitiveNum)) { return false; }
+
+			bvh->nodes = std::move(nodes);
+			bvh->builtCosts = std::move(builtCosts);
+			bvh->primitiveIndices = std::move(primitiveIndices);
+			bvh->sourcePrimitiveNum = primitiveNum;
+
+			bvh->primitives.clear();
+			bvh->levelOrder.clear();
+			return true;
+		}
+
+		// 同じキャッシュを複数のプロセスから同時に使っても壊れないように、一時ファイルに書き出してから置き換える
+		void store(uint64_t key, const _BVH& bvh) const {
+			Header header;
+			memcpy(header.magic, Magic, sizeof(header.magic));
+			header.version = Version;
+			header.nodeSize = sizeof(LinearBVHNode);
+			header.key = key;
+			header.nodeNum = bvh.nodes.size();
+			header.primitiveNum = bvh.sourcePrimitiveNum;
+			header.referenceNum = bvh.primitiveIndices.size();
+
+			const std::string filePath = path(key);
+			const std::string tmpPath = filePath + "." + std::to_string(std::random_device()()) + ".tmp";
+			FILE* fp = fopen(tmpPath.c_str(), "wb");
+			if (fp == nullptr) { return; }
+			bool succeeded =
+				fwrite(&header, sizeof(Header), 1, fp) == 1 &&
+				fwrite(bvh.nodes.data(), sizeof(LinearBVHNode), header.nodeNum, fp) == header.nodeNum &&
+				fwrite(bvh.builtCosts.data(), sizeof(float), header.nodeNum, fp) == header.nodeNum &&
+				fwrite(bvh.primitiveIndices.data(), sizeof(int), header.referenceNum, fp) == header.referenceNum;
+			succeeded = fclose(fp) == 0 && succeeded;
+
+			std::error_code error;
+			if (succeeded) {
+				std::filesystem::rename(tmpPath, filePath, error);
+			}
+			if (!succeeded || error) {
+				std::filesystem::remove(tmpPath, error);
+			}
+		}
+
+	private:
+
+		static constexpr char Magic[4] = { 'X', 'B', 'V', 'H' };
+
+		struct Header {
+			char magic[4];
+			uint32_t version;
+			uint32_t nodeSize;
+			uint32_t nodeNum;
+			uint64_t key;
+			uint32_t primitiveNum;
+			uint32_t referenceNum; // 空間分割で複製した参照を含む数
+		};
+		static_assert(sizeof(Header) == 32, "BVHCache::Header must be 32 bytes");
+
+		std::string directory;
+
+		// ノードが深さ優先の順に並んだ木になっていて、トラバーサルのスタックに収まる深さであり、
+		// リーフの範囲と primitiveIndices の値がそれぞれの配列に収まっているかを調べる
+		// 深さ優先の順に辿って、訪れるノードの添字が 0, 1, 2, ... と 1 つずつ進むなら、各ノードはちょうど 1 回ずつ現れる
+		static bool isValid(const std::vector<LinearBVHNode>& nodes, const std::vector<int>& primitiveIndices, int primitiveNum) {
+			for (int index : primitiveIndices) {
+				if (index < 0 || index >= primitiveNum) { return false; }
+			}
+			if (nodes.empty()) { return primitiveIndices.empty(); }
+
+			const int nodeNum = nodes.size();
+			const int referenceNum = primitiveIndices.size();
+			struct NodeEntry {
+				int nodeIndex;
+				int depth;
+			};
+			std::vector<NodeEntry> stack;
+			stack.push_back(NodeEntry{ 0, 0 });
+			int visitedNum = 0;
+			while (!stack.empty()) {
+				const NodeEntry entry = stack.back();
+				stack.pop_back();
+				if (entry.nodeIndex != visitedNum) { return false; }
+				++visitedNum;
+
+				const LinearBVHNode& node = nodes[entry.nodeIndex];
+				if (node.isLeaf()) {
+					if (node.primitiveOffset < 0 || node.primitiveOffset > referenceNum - node.primitiveNum) { return false; }
+				} else {
+					if (entry.depth >= _BVH::MaxDepth) { return false; }
+					if (node.secondChildOffset <= entry.nodeIndex + 1 || node.secondChildOffset >= nodeNum) { return false; }
+					stack.push_back(NodeEntry{ node.secondChildOffset, entry.depth + 1 });
+					stack.push_back(NodeEntry{ entry.nodeIndex + 1, entry.depth + 1 });
+				}
+			}
+			return visitedNum == nodeNum;
+		}
+
+		std::string path(uint64_t key) const {
+			char name[32];
+			snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+			return (std::filesystem::path(directory) / name).string();
+		}
+	};
+
+}
@@ -143,7 +143,7 @@ namespace xitils {
 
 		T surfaceArea() const {
 			_V s = size();
-			return 2 * s.x * s.y * s.z;
+			return 2 * (s.x * s.y + s.y * s.z + s.z * s.x);
 		}
 
 		T volume() const {
@@ -151,6 +151,11 @@ namespace xitils {
 			return s.x * s.y * s.z;
 		}
 
+		// 点を 1 つも含まない場合 (既定のコンストラクタで作ったものなど) は true
+		bool isEmpty() const {
+			return min.x > max.x || min.y > max.y || min.z > max.z;
+		}
+
 		int maximumExtent() const {
 			_V s = size();
 			if (s.x > s.y) { return 0; }
@@ -202,10 +207,12 @@ namespace xitils {
 
 	//--------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
+	// 2 点から作るコンストラクタは min と max を並べ替えるので、空の Bounds 同士を結合しても空のままになるよう直接代入する
 	template<typename B> B _merge(const B& b1, const B& b2) {
-		return B(
-			xitils::min(b1.min, b2.min),
-			xitils::max(b1.max, b2.max));
+		B res;
+		res.min = xitils::min(b1.min, b2.min);
+		res.max = xitils::max(b1.max, b2.max);
+		return res;
 	}
 
 	template <typename T, typename T_SIMD, typename T_SIMDMASK> Bounds2<T, T_SIMD, T_SIMDMASK> merge(const Bounds2<T, T_SIMD, T_SIMDMASK>& b1, const Bounds2<T, T_SIMD, T_SIMDMASK>& b2) { return _merge(b1, b2); }
@@ -220,6 +227,15 @@ namespace xitils {
 	template <typename T, typename T_SIMD, typename T_SIMDMASK> Bounds2<T, T_SIMD, T_SIMDMASK> merge(const Bounds2<T, T_SIMD, T_SIMDMASK>& b, const Vector2<T, T_SIMD, T_SIMDMASK>& p) { return _merge(b, p); }
 	template <typename T, typename T_SIMD, typename T_SIMDMASK> Bounds3<T, T_SIMD, T_SIMDMASK> merge(const Bounds3<T, T_SIMD, T_SIMDMASK>& b, const Vector3<T, T_SIMD, T_SIMDMASK>& p) { return _merge(b, p); }
 
+	// 重なりがない場合は空の Bounds を返す
+	template <typename T, typename T_SIMD, typename T_SIMDMASK> Bounds3<T, T_SIMD, T_SIMDMASK> intersection(const Bounds3<T, T_SIMD, T_SIMDMASK>& b1, const Bounds3<T, T_SIMD, T_SIMDMASK>& b2) {
+		Bounds3<T, T_SIMD, T_SIMDMASK> res;
+		res.min = xitils::max(b1.min, b2.min);
+		res.max = xitils::min(b1.max, b2.max);
+		if (res.isEmpty()) { return Bounds3<T, T_SIMD, T_SIMDMASK>(); }
+		return res;
+	}
+
 
 	template <typename T, typename T_SIMD, typename T_SIMDMASK> bool overlap(const Bounds2<T, T_SIMD, T_SIMDMASK>& b1, const Bounds2<T, T_SIMD, T_SIMDMASK>& b2) {
 		return b1.max.x >= b2.min.x && b1.min.x <= b2.max.x &&
@@ -0,0 +1,446 @@
+﻿#pragma once
+
+#include "Shape.h"
+#include "AccelerationStructure.h"
+#include "AliasTable.h"
+#include "GeometryCache.h"
+#include "MinMaxMipmap.h"
+#include "Texture.h"
+#include "TriangleBuffer.h"
+
+namespace xitils {
+
+	// DisplacedTriangleMesh の元の三角形 1 つ (パッチ) を細かく分割して変位を適用したもの
+	struct DisplacedPatch {
+		std::unique_ptr<_BVH> accel;
+		TriangleBuffer triangles; // faceIndex は DisplacedTriangleMesh::microTriangleCode
+		size_t bytes = 0;
+
+		size_t memoryBytes() const { return bytes; }
+	};
+
+	using DisplacedPatchCache = GeometryCache<DisplacedPatch>;
+
+	// ディスプレイスメントマッピングを、レイの当たったパッチだけをその場で細かく分割して行うメッシュ
+	// TriangleMesh::setGeometry(mesh, displacement, scale) と違い、元のメッシュを事前に細分化しておく必要はない
+	// パッチは元の三角形の各辺を dicingRate 等分した三角形に分割し、頂点を補間した法線の方向に変位させる
+	// (TriangleMesh のシェルマッピングの各レイヤーと同じく、法線は正規化せずに補間したものを使う)
+	// 分割したパッチとその BVH は最初にレイが当たった時点で作り、DisplacedPatchCache にメモリ使用量の上限まで保持する
+	// 上位の BVH はパッチの変位の範囲を MinMaxMipmap で求めて、その範囲で押し出したプリズムの AABB から構築する
+	// TriangleMesh と同じく、交差判定の前に buildAccelerationStructure で上位の BVH を構築しておくこと
+	class DisplacedTriangleMesh : public Shape {
+	public:
+
+		// cache を指定しなければ DefaultCacheBudget のキャッシュを作る
+		// 複数のメッシュで 1 つのキャッシュを共有してメモリ使用量の上限をまとめて決めてもよい
+		inline static const size_t DefaultCacheBudget = (size_t)256 << 20;
+
+		void setGeometry(const cinder::TriMesh& mesh, std::shared_ptr<const Texture> displacement, float displacementScale, int dicingRate, std::shared_ptr<DisplacedPatchCache> cache = nullptr) {
+			std::shared_ptr <cinder::TriMesh> tmpMesh((cinder::TriMesh*)mesh.clone());
+
+			positions.resize(tmpMesh->getNumVertices());
+			for (int i = 0; i < positions.size(); ++i) {
+				positions[i] = Vector3f(tmpMesh->getPositions<3>()[i]);
+			}
+			normals.resize(tmpMesh->getNumVertices());
+			for (int i = 0; i < normals.size(); ++i) {
+				normals[i] = Vector3f(tmpMesh->getNormals()[i]);
+			}
+			texCoords.resize(tmpMesh->getNumVertices());
+			for (int i = 0; i < texCoords.size(); ++i) {
+				texCoords[i] = Vector2f(tmpMesh->getTexCoords0<2>()[i]);
+			}
+
+			tmpMesh->recalculateTangents();
+			tmpMesh->recalculateBitangents();
+
+			tangents.resize(tmpMesh->getTangents().size());
+			for (int i = 0; i < tangents.size(); ++i) {
+				tangents[i] = Vector3f(tmpMesh->getTangents()[i]);
+			}
+			bitangents.resize(tmpMesh->getBitangents().size());
+			for (int i = 0; i < bitangents.size(); ++i) {
+				bitangents[i] = Vector3f(tmpMesh->getBitangents()[i]);
+			}
+
+			indices.resize(tmpMesh->getNumTriangles() * 3);
+			for (int i = 0; i < indices.size(); i += 3) {
+				indices[i + 0] = tmpMesh->getIndices()[i + 0];
+				indices[i + 1] = tmpMesh->getIndices()[i + 1];
+				indices[i + 2] = tmpMesh->getIndices()[i + 2];
+			}
+
+			setDisplacement(displacement, displacementScale, dicingRate, cache);
+		}
+
+		void setGeometry(int vertexNum, const Vector3f* positions, const Vector2f* texCoords, const Vector3f* normals, const Vector3f* tangents, const Vector3f* bitangents, int indexNum, int* indexData, std::shared_ptr<const Texture> displacement, float displacementScale, int dicingRate, std::shared_ptr<DisplacedPatchCache> cache = nullptr) {
+			ASSERT(texCoords != nullptr && normals != nullptr);
+			this->positions.assign(positions, positions + vertexNum);
+			this->texCoords.assign(texCoords, texCoords + vertexNum);
+			this->normals.assign(normals, normals + vertexNum);
+			this->tangents.clear();
+			this->bitangents.clear();
+			if (tangents != nullptr) { this->tangents.assign(tangents, tangents + vertexNum); }
+			if (bitangents != nullptr) { this->bitangents.assign(bitangents, bitangents + vertexNum); }
+			indices.assign(indexData, indexData + indexNum);
+
+			setDisplacement(displacement, displacementScale, dicingRate, cache);
+		}
+
+		int triangleNum() const { return indices.size() / 3; }
+
+		// パッチ 1 つあたりの三角形の数
+		int microTriangleNum() const { return dicingRate * dicingRate; }
+
+		const DisplacedPatchCache& patchCache() const { return *cache; }
+		DisplacedPatchCache& patchCache() { return *cache; }
+
+		// 上位の BVH はパッチの AABB のみから構築し、パッチは交差判定の際に作る
+		// 上位の BVH はパッチの数が元の三角形の数なので構築が軽く、BVHCache は使わない
+		void buildAccelerationStructure(const BVHCache* bvhCache = nullptr) override {
+			if (accel) { return; }
+
+			BVHBuildSettings settings;
+			settings.maxPrimitivesInLeaf = 1;
+			accel = std::make_unique<_BVH>(patchBounds, settings);
+		}
+
+		int accelerationStructurePrimitiveNum() const override {
+			return triangleNum();
+		}
+
+		Bounds3f bound() const override {
+			return aabb;
+		}
+
+		// 変位による面積の変化は考慮しない
+		float surfaceArea() const override {
+			return area;
+		}
+
+		float surfaceAreaScaling(const Transform& t) const override {
+			float scaledArea = 0.0f;
+			for (int i = 0; i < triangleNum(); ++i) {
+				TriangleIndexed tri = triangle(i);
+				scaledArea += tri.surfaceArea() * tri.surfaceAreaScaling(t);
+			}
+			return scaledArea / area;
+		}
+
+		bool intersect(const Ray& ray, float* tHit, HitRecord* hit) const override {
+			checkAccelerationStructure();
+			return intersectPatches(ray, tHit, hit);
+		}
+
+		bool intersectAny(const Ray& ray) const override {
+			checkAccelerationStructure();
+			return intersectAnyPatches(ray);
+		}
+
+		// パッチの BVH のノードと三角形も数える
+		bool intersectWithStatistics(const Ray& ray, float* tHit, HitRecord* hit, TraversalStatistics* stats) const override {
+			checkAccelerationStructure();
+			return intersectPatches<true>(ray, tHit, hit, stats);
+		}
+
+		bool intersectAnyWithStatistics(const Ray& ray, TraversalStatistics* stats) const override {
+			checkAccelerationStructure();
+			return intersectAnyPatches<true>(ray, stats);
+		}
+
+		// 交差した三角形は元の三角形の番号と、その上の重心座標で表す
+		// 法線は交差した細かい三角形の面の法線、シェーディング法線は変位の勾配で元の法線を傾けたものにする
+		void computeSurfaceIntersection(const Ray& ray, const HitRecord& hit, SurfaceIntersection* isect) const override {
+			TriangleIndexedWithShellMapping(
+				positions.data(),
+				texCoords.data(),
+				normals.data(),
+				!tangents.empty() ? tangents.data() : nullptr,
+				!bitangents.empty() ? bitangents.data() : nullptr,
+				indices.data(), hit.triangleIndex,
+				displacementMap.get(), displacementScale, 0.0f).computeSurfaceIntersection(ray, hit, isect);
+
+			isect->p = ray(hit.t);
+
+			// 重心座標から交差した細かい三角形を求め直す
+			const float u = hit.b1 * dicingRate;
+			const float v = (1.0f - hit.b0 - hit.b1) * dicingRate;
+			const int i = clamp((int)floorf(u), 0, dicingRate - 1);
+			const int j = clamp((int)floorf(v), 0, dicingRate - 1 - i);
+			const bool upper = (u - i) + (v - j) > 1.0f && i + j < dicingRate - 1;
+			Vector3f p[3];
+			for (int k = 0; k < 3; ++k) {
+				const Vector2i vertex = microTriangleVertex(i, j, upper, k);
+				p[k] = displacedPosition(hit.triangleIndex, vertex.x, vertex.y);
+			}
+			const Vector3f n = cross(p[1] - p[0], p[2] - p[0]);
+			if (!n.isZero()) {
+				isect->n = faceForward(n.normalize(), isect->n);
+			}
+
+			isect->shape = this;
+			isect->layer = 0;
+		}
+
+		// 元の三角形を面積に比例した確率で選んで一様にサンプリングし、変位させた点を返す
+		// 変位による面積の変化は考慮しないので、発光させる場合は近似になる
+		SampledSurface sampleSurface(Sampler& sampler, float* pdf) const override {
+			const int face = triangleSampler.sample(sampler);
+			auto sampled = triangle(face).sampleSurface(sampler, pdf);
+			*pdf *= triangleSampler.pmf(face);
+
+			const int* index = &indices[face * 3];
+			const Vector3f& p0 = positions[index[0]];
+			const Vector3f& p1 = positions[index[1]];
+			const Vector3f& p2 = positions[index[2]];
+			const Vector3f e1 = p1 - p0;
+			const Vector3f e2 = p2 - p0;
+			const Vector3f b = sampled.p - p0;
+			const Vector3f c = cross(e1, e2);
+			const float b1 = dot(cross(b, e2), c) / c.lengthSq();
+			const float b2 = dot(cross(e1, b), c) / c.lengthSq();
+			const float b0 = 1.0f - b1 - b2;
+			const Vector2f texCoord = lerp(texCoords[index[0]], texCoords[index[1]], texCoords[index[2]], b0, b1);
+			const Vector3f n = lerp(normals[index[0]], normals[index[1]], normals[index[2]], b0, b1);
+
+			SampledSurface res;
+			res.shape = this;
+			res.triangleIndex = face;
+			res.p = sampled.p + displacementScale * displacementMap->rgb(texCoord).x * n;
+			res.n = sampled.n;
+			res.shadingN = sampled.shadingN;
+			return res;
+		}
+
+		float surfacePDF(const Vector3f& p, int triangleIndex) const override {
+			return triangle(triangleIndex).surfacePDF(p) * triangleSampler.pmf(triangleIndex);
+		}
+
+	private:
+		std::vector<Vector3f> positions;
+		std::vector<Vector3f> normals;
+		std::vector<Vector2f> texCoords;
+		std::vector<Vector3f> tangents;
+		std::vector<Vector3f> bitangents;
+		std::vector<int> indices;
+
+		std::shared_ptr<const Texture> displacementMap;
+		float displacementScale;
+		int dicingRate;
+
+		std::vector<Bounds3f> patchBounds;
+		std::unique_ptr<_BVH> accel;
+		std::shared_ptr<DisplacedPatchCache> cache;
+		uint32_t cacheOwnerId;
+
+		Bounds3f aabb;
+		float area;
+		AliasTable triangleSampler;
+
+		void checkAccelerationStructure() const {
+			if (!accel) { throw "DisplacedTriangleMesh: buildAccelerationStructure has not been called"; }
+		}
+
+		void setDisplacement(std::shared_ptr<const Texture> displacement, float displacementScale, int dicingRate, std::shared_ptr<DisplacedPatchCache> cache) {
+			ASSERT(dicingRate >= 1);
+			this->displacementMap = displacement;
+			this->displacementScale = displacementScale;
+			this->dicingRate = dicingRate;
+			this->cache = cache ? cache : std::make_shared<DisplacedPatchCache>(DefaultCacheBudget);
+			cacheOwnerId = this->cache->newOwnerId();
+			accel.reset();
+
+			// 各パッチの変位の範囲で、元の三角形を法線方向に押し出したプリズムの AABB を求める
+			const MinMaxMipmap mipmap(*displacement);
+			const int faceNum = triangleNum();
+			patchBounds.resize(faceNum);
+#pragma omp parallel for
+			for (int face = 0; face < faceNum; ++face) {
+				const int* index = &indices[face * 3];
+				const Vector2f uvMin = min(texCoords[index[0]], texCoords[index[1]], texCoords[index[2]]);
+				const Vector2f uvMax = max(texCoords[index[0]], texCoords[index[1]], texCoords[index[2]]);
+				float minValue, maxValue;
+				mipmap.range(uvMin, uvMax, &minValue, &maxValue);
+				// Texture::rgb の補間による丸め誤差の分だけ保守的に広げる
+				minValue -= MinMaxMipmap::Epsilon;
+				maxValue += MinMaxMipmap::Epsilon;
+				Bounds3f bound;
+				for (int k = 0; k < 3; ++k) {
+					bound = merge(bound, positions[index[k]] + displacementScale * minValue * normals[index[k]]);
+					bound = merge(bound, positions[index[k]] + displacementScale * maxValue * normals[index[k]]);
+				}
+				patchBounds[face] = bound;
+			}
+
+			aabb = Bounds3f();
+			area = 0.0f;
+			std::vector<float> triangleAreas(faceNum);
+			for (int face = 0; face < faceNum; ++face) {
+				aabb = merge(aabb, patchBounds[face]);
+				triangleAreas[face] = triangle(face).surfaceArea();
+				area += triangleAreas[face];
+			}
+			triangleSampler = AliasTable(triangleAreas);
+		}
+
+		TriangleIndexed triangle(int face) const {
+			return TriangleIndexed(
+				positions.data(),
+				texCoords.data(),
+				normals.data(),
+				!tangents.empty() ? tangents.data() : nullptr,
+				!bitangents.empty() ? bitangents.data() : nullptr,
+				indices.data(), face);
+		}
+
+		// パッチの頂点 (i, j) は元の三角形の重心座標 (1 - (i + j) / dicingRate, i / dicingRate, j / dicingRate) の点
+		// 辺上の頂点は隣のパッチと同じ位置になるように、辺の両端の頂点だけから補間する
+		Vector3f displacedPosition(int face, int i, int j) const {
+			const int* index = &indices[face * 3];
+			const int k = dicingRate - i - j;
+			float w[3] = { (float)k / dicingRate, (float)i / dicingRate, (float)j / dicingRate };
+			Vector3f p, n;
+			Vector2f texCoord;
+			for (int c = 0; c < 3; ++c) {
+				if (w[c] == 0.0f) { continue; }
+				p += w[c] * positions[index[c]];
+				n += w[c] * normals[index[c]];
+				texCoord += w[c] * texCoords[index[c]];
+			}
+			return p + displacementScale * displacementMap->rgb(texCoord).x * n;
+		}
+
+		// (i, j) の区画の下側 (upper が false) または上側の三角形の k 番目の頂点
+		static Vector2i microTriangleVertex(int i, int j, bool upper, int k) {
+			if (!upper) {
+				const Vector2i vertices[3] = { Vector2i(i, j), Vector2i(i + 1, j), Vector2i(i, j + 1) };
+				return vertices[k];
+			}
+			const Vector2i vertices[3] = { Vector2i(i + 1, j), Vector2i(i + 1, j + 1), Vector2i(i, j + 1) };
+			return vertices[k];
+		}
+
+		// パッチ内の三角形の番号 ((i, j) の区画の下側か上側か)
+		int microTriangleCode(int i, int j, bool upper) const {
+			return (j * dicingRate + i) * 2 + (upper ? 1 : 0);
+		}
+
+		std::shared_ptr<const DisplacedPatch> dice(int face) const {
+			const int n = dicingRate;
+			std::vector<Vector3f> vertices((n + 1) * (n + 1));
+			for (int j = 0; j <= n; ++j) {
+				for (int i = 0; i <= n - j; ++i) {
+					vertices[j * (n + 1) + i] = displacedPosition(face, i, j);
+				}
+			}
+
+			// TriangleBuffer からは microTriangleCode で参照するので、存在しない上側の三角形の分も indices を確保しておく
+			std::vector<int> microIndices(n * n * 2 * 3);
+			std::vector<int> codes;
+			std::vector<Bounds3f> bounds;
+			codes.reserve(n * n);
+			bounds.reserve(n * n);
+			for (int j = 0; j < n; ++j) {
+				for (int i = 0; i < n - j; ++i) {
+					for (int upper = 0; upper < 2; ++upper) {
+						if (upper && i + j == n - 1) { continue; }
+						const int code = microTriangleCode(i, j, upper);
+						for (int k = 0; k < 3; ++k) {
+							const Vector2i vertex = microTriangleVertex(i, j, upper, k);
+							microIndices[code * 3 + k] = vertex.y * (n + 1) + vertex.x;
+						}
+						codes.push_back(code);
+						bounds.push_back(Bounds3f(vertices[microIndices[code * 3 + 0]], vertices[microIndices[code * 3 + 1]], vertices[microIndices[code * 3 + 2]]));
+					}
+				}
+			}
+
+			BVHBuildSettings settings;
+			settings.maxPrimitivesInLeaf = TriangleBuffer::SIMDWidth;
+			settings.intersectionCost = 0.25f;
+
+			auto patch = std::make_shared<DisplacedPatch>();
+			patch->accel = std::make_unique<_BVH>(bounds, settings);
+			std::vector<int> order(codes.size());
+			for (int i = 0; i < order.size(); ++i) {
+				order[i] = codes[patch->accel->primitiveOrder()[i]];
+			}
+			patch->triangles.build(vertices.data(), microIndices.data(), order);
+			patch->bytes = sizeof(DisplacedPatch) + patch->accel->statistics().memoryBytes + patch->triangles.memoryBytes();
+			return patch;
+		}
+
+		// 返したパッチは次に acquirePatch を呼ぶまでに使い終えること
+		const DisplacedPatch* acquirePatch(int face) const {
+			return cache->getThreadLocal(((uint64_t)cacheOwnerId << 32) | (uint32_t)face, [&]() { return dice(face); });
+		}
+
+		// パッチ内の三角形の番号と重心座標を、元の三角形の重心座標に直す
+		void toPatchBarycentric(int code, float b0, float b1, float* patchB0, float* patchB1) const {
+			const int cell = code / 2;
+			const Vector2i v0 = microTriangleVertex(cell % dicingRate, cell / dicingRate, code % 2, 0);
+			const Vector2i v1 = microTriangleVertex(cell % dicingRate, cell / dicingRate, code % 2, 1);
+			const Vector2i v2 = microTriangleVertex(cell % dicingRate, cell / dicingRate, code % 2, 2);
+			const float b2 = 1.0f - b0 - b1;
+			const float u = (b0 * v0.x + b1 * v1.x + b2 * v2.x) / dicingRate;
+			const float v = (b0 * v0.y + b1 * v1.y + b2 * v2.y) / dicingRate;
+			*patchB0 = 1.0f - u - v;
+			*patchB1 = u;
+		}
+
+		template<bool CountStatistics = false> bool intersectPatches(const Ray& ray, float* tHit, HitRecord* hit, TraversalStatistics* stats = nullptr) const {
+			const TriangleBuffer::RaySIMD raySIMD(ray);
+			const auto noDiscard = [](int i, float b0, float b1) { return false; };
+			Ray rayTmp = Ray(ray);
+			int hitFace = -1;
+			int hitCode;
+			float b0Hit, b1Hit;
+			accel->traverse<CountStatistics>(rayTmp, [&](int offset, int num, Ray& leafRay) {
+				bool found = false;
+				for (int i = offset; i < offset + num; ++i) {
+					const int face = accel->primitiveOrder()[i];
+					const auto patch = acquirePatch(face);
+					const bool patchFound = patch->accel->traverse<CountStatistics>(leafRay, [&](int patchOffset, int patchNum, Ray& patchRay) {
+						if constexpr (CountStatistics) { stats->primitivesTested += patchNum; }
+						int hitTriangle;
+						if (!patch->triangles.intersect(patchOffset, patchNum, raySIMD, patchRay.tMax, &hitTriangle, &patchRay.tMax, &b0Hit, &b1Hit, noDiscard)) {
+							return false;
+						}
+						hitCode = patch->triangles.faceIndex(hitTriangle);
+						return true;
+						}, stats);
+					if (patchFound) {
+						hitFace = face;
+						found = true;
+					}
+				}
+				return found;
+				}, stats);
+			if (hitFace < 0) { return false; }
+
+			*tHit = rayTmp.tMax;
+			hit->t = rayTmp.tMax;
+			toPatchBarycentric(hitCode, b0Hit, b1Hit, &hit->b0, &hit->b1);
+			hit->shape = this;
+			hit->triangleIndex = hitFace;
+			return true;
+		}
+
+		template<bool CountStatistics = false> bool intersectAnyPatches(const Ray& ray, TraversalStatistics* stats = nullptr) const {
+			const TriangleBuffer::RaySIMD raySIMD(ray);
+			const auto noDiscard = [](int i, float b0, float b1) { return false; };
+			return accel->traverseAny<CountStatistics>(ray, [&](int offset, int num, const Ray& leafRay) {
+				for (int i = offset; i < offset + num; ++i) {
+					const auto patch = acquirePatch(accel->primitiveOrder()[i]);
+					const bool occluded = patch->accel->traverseAny<CountStatistics>(leafRay, [&](int patchOffset, int patchNum, const Ray& patchRay) {
+						if constexpr (CountStatistics) { stats->primitivesTested += patchNum; }
+						return patch->triangles.intersectAny(patchOffset, patchNum, raySIMD, patchRay.tMax, noDiscard);
+						}, stats);
+					if (occluded) { return true; }
+				}
+				return false;
+				}, stats);
+		}
+	};
+
+}
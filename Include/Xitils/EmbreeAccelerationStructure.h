@@ -0,0 +1,377 @@
+﻿#pragma once
+
+#ifdef XITILS_USE_EMBREE
+
+#include <embree3/rtcore.h>
+#include <embree3/rtcore_ray.h>
+
+#include "AccelerationStructure.h"
+#include "TriangleMesh.h"
+
+namespace xitils {
+
+	// Embree のデバイスと、TriangleMesh ごとの Embree のシーン
+	// Scene が上位のシーンを作り直しても (updateAccelerationStructure(true)) 引き継ぎ、三角形のシーンは作り直さない
+	class EmbreeMeshScenes {
+	public:
+
+		EmbreeMeshScenes() {
+			device = rtcNewDevice(nullptr);
+			if (device == nullptr) { throw "EmbreeMeshScenes: failed to create an Embree device"; }
+		}
+
+		EmbreeMeshScenes(const EmbreeMeshScenes&) = delete;
+		EmbreeMeshScenes& operator=(const EmbreeMeshScenes&) = delete;
+
+		~EmbreeMeshScenes() {
+			for (auto& meshScene : meshScenes) {
+				rtcReleaseScene(meshScene.second.scene);
+			}
+			rtcReleaseDevice(device);
+		}
+
+		RTCDevice embreeDevice() const { return device; }
+
+		// 初めて使う mesh ならシーンを作る
+		RTCScene get(const std::shared_ptr<const TriangleMesh>& mesh) {
+			auto it = meshScenes.find(mesh.get());
+			if (it != meshScenes.end()) { return it->second.scene; }
+
+			MeshScene res;
+			res.mesh = mesh;
+			res.positionsRevision = mesh->positionsRevision();
+			res.scene = rtcNewScene(device);
+			res.geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+			// update での頂点の変更は BVH の AABB の更新で済ませる
+			rtcSetGeometryBuildQuality(res.geometry, RTC_BUILD_QUALITY_REFIT);
+
+			// 頂点は Embree の要求する末尾のパディングを確保するためにコピーして渡す
+			Vector3f* positions = (Vector3f*)rtcSetNewGeometryBuffer(res.geometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, sizeof(Vector3f), mesh->vertexNum());
+			memcpy(positions, mesh->positionData(), sizeof(Vector3f) * mesh->vertexNum());
+			int* indices = (int*)rtcSetNewGeometryBuffer(res.geometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, sizeof(int) * 3, mesh->triangleNum());
+			memcpy(indices, mesh->indexData(), sizeof(int) * 3 * mesh->triangleNum());
+
+			if (mesh->hasShellMapping()) {
+				rtcSetGeometryUserData(res.geometry, (void*)mesh.get());
+				rtcSetGeometryIntersectFilterFunction(res.geometry, filterShellMapping);
+				rtcSetGeometryOccludedFilterFunction(res.geometry, filterShellMapping);
+			}
+
+			rtcCommitGeometry(res.geometry);
+			rtcAttachGeometry(res.scene, res.geometry);
+			rtcReleaseGeometry(res.geometry);
+			rtcCommitScene(res.scene);
+
+			meshScenes[mesh.get()] = res;
+			return res.scene;
+		}
+
+		// 前回から TriangleMesh::updatePositions で頂点が変わったメッシュのシーンだけを更新する
+		void update() {
+			for (auto& meshScene : meshScenes) {
+				MeshScene& res = meshScene.second;
+				if (res.positionsRevision == res.mesh->positionsRevision()) { continue; }
+				res.positionsRevision = res.mesh->positionsRevision();
+
+				Vector3f* positions = (Vector3f*)rtcGetGeometryBufferData(res.geometry, RTC_BUFFER_TYPE_VERTEX, 0);
+				memcpy(positions, res.mesh->positionData(), sizeof(Vector3f) * res.mesh->vertexNum());
+				rtcUpdateGeometryBuffer(res.geometry, RTC_BUFFER_TYPE_VERTEX, 0);
+				rtcCommitGeometry(res.geometry);
+				rtcCommitScene(res.scene);
+			}
+		}
+
+	private:
+
+		struct MeshScene {
+			std::shared_ptr<const TriangleMesh> mesh; // 解放されたメッシュのアドレスが別のメッシュに使われないように持っておく
+			int positionsRevision;
+			RTCScene scene;
+			RTCGeometry geometry;
+		};
+
+		RTCDevice device;
+		std::unordered_map<const TriangleMesh*, MeshScene> meshScenes; // 複数の Object から共有されている Shape は 1 つのシーンにまとめる
+
+		// シェルマッピングのアルファによる棄却
+		static void filterShellMapping(const RTCFilterFunctionNArguments* args) {
+			const TriangleMesh* mesh = (const TriangleMesh*)args->geometryUserPtr;
+			for (int i = 0; i < args->N; ++i) {
+				if (args->valid[i] == 0) { continue; }
+				const float u = RTCHitN_u(args->hit, args->N, i);
+				const float v = RTCHitN_v(args->hit, args->N, i);
+				const int face = RTCHitN_primID(args->hit, args->N, i);
+				if (mesh->discardByAlpha(face, 1.0f - u - v, u)) {
+					args->valid[i] = 0;
+				}
+			}
+		}
+	};
+
+	// Embree を使った AccelerationStructure
+	// XITILS_USE_EMBREE を定義してビルドすると Scene の AccelerationStructure がこれに置き換わる
+	// TriangleMesh は Shape ごとに Embree のシーンを作って Object ごとにインスタンスとして配置し、
+	// それ以外の Shape (とプリズムによるシェルマッピングを行う TriangleMesh) はワールド空間のユーザー定義ジオメトリとして Object::intersect をそのまま呼ぶ
+	class _EmbreeAccelerationStructure : public _AccelerationStructure {
+	public:
+
+		// settings のうち linear のみを使い、有効な場合は上位のシーンを Embree の低品質 (Morton 符号による) 構築で作る
+		// meshScenes に前の _EmbreeAccelerationStructure のものを渡すと、デバイスと三角形のシーンを引き継ぐ
+		_EmbreeAccelerationStructure(const std::vector<Object*>& objects, const BVHBuildSettings& settings = BVHBuildSettings(), std::shared_ptr<EmbreeMeshScenes> meshScenes = nullptr) :
+			objects(objects),
+			meshScenes(meshScenes ? meshScenes : std::make_shared<EmbreeMeshScenes>())
+		{
+			this->meshScenes->update();
+			const RTCDevice device = this->meshScenes->embreeDevice();
+			scene = rtcNewScene(device);
+			if (settings.linear) {
+				rtcSetSceneBuildQuality(scene, RTC_BUILD_QUALITY_LOW);
+			}
+
+			isMeshInstance.resize(objects.size());
+			for (int i = 0; i < objects.size(); ++i) {
+				const Object* obj = objects[i];
+				const bool mesh = usesEmbreeTriangles(obj->shape.get());
+
+				RTCGeometry geometry;
+				if (mesh) {
+					geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
+					rtcSetGeometryInstancedScene(geometry, this->meshScenes->get(std::static_pointer_cast<const TriangleMesh>(obj->shape)));
+					setInstanceTransform(geometry, obj->transform());
+				} else {
+					geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_USER);
+					rtcSetGeometryUserPrimitiveCount(geometry, 1);
+					rtcSetGeometryUserData(geometry, (void*)obj);
+					rtcSetGeometryBoundsFunction(geometry, boundsObject, nullptr);
+					rtcSetGeometryIntersectFunction(geometry, intersectObject);
+					rtcSetGeometryOccludedFunction(geometry, occludedObject);
+				}
+				rtcCommitGeometry(geometry);
+				rtcAttachGeometryByID(scene, geometry, i);
+				rtcReleaseGeometry(geometry);
+				isMeshInstance[i] = mesh;
+			}
+
+			rtcCommitScene(scene);
+		}
+
+		_EmbreeAccelerationStructure(const _EmbreeAccelerationStructure&) = delete;
+		_EmbreeAccelerationStructure& operator=(const _EmbreeAccelerationStructure&) = delete;
+
+		~_EmbreeAccelerationStructure() {
+			rtcReleaseScene(scene);
+		}
+
+		// Embree に三角形をそのまま渡す Shape
+		// これらは Shape 自身の AccelerationStructure を使わないので、Scene::buildAccelerationStructure でも構築しない
+		// プリズムによるシェルマッピングは三角形として渡せないので、TriangleMesh 自身の BVH を使う
+		static bool usesEmbreeTriangles(const Shape* shape) {
+			const TriangleMesh* mesh = dynamic_cast<const TriangleMesh*>(shape);
+			return mesh != nullptr && !mesh->hasPrismShellMapping();
+		}
+
+		const std::shared_ptr<EmbreeMeshScenes>& embreeMeshScenes() const { return meshScenes; }
+
+		bool intersect(Ray& ray, HitRecord* hit) const override {
+			RTCIntersectContext context;
+			rtcInitIntersectContext(&context);
+
+			RTCRayHit rayHit;
+			setRay(ray, &rayHit.ray);
+			rayHit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+			rayHit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+
+			rtcIntersect1(scene, &context, &rayHit);
+			if (rayHit.hit.geomID == RTC_INVALID_GEOMETRY_ID) { return false; }
+
+			ray.tMax = rayHit.ray.tfar;
+			setHitRecord(rayHit.ray.tfar, rayHit.hit.u, rayHit.hit.v, rayHit.hit.Ng_x, rayHit.hit.Ng_y, rayHit.hit.primID, rayHit.hit.geomID, rayHit.hit.instID[0], hit);
+			return true;
+		}
+
+		bool intersectAny(const Ray& ray) const override {
+			RTCIntersectContext context;
+			rtcInitIntersectContext(&context);
+
+			RTCRay rtcRay;
+			setRay(ray, &rtcRay);
+			rtcOccluded1(scene, &context, &rtcRay);
+			// 遮蔽されていると tfar が -inf になる
+			return rtcRay.tfar < 0.0f;
+		}
+
+		int intersectPacket(RayPacket& packet, int activeMask, HitRecord* hits) const override {
+			RTCIntersectContext context;
+			rtcInitIntersectContext(&context);
+			context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+			alignas(32) int valid[RayPacket::Size];
+			alignas(32) RTCRayHit8 rayHit;
+			setRayPacket(packet, activeMask, valid, &rayHit.ray);
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				rayHit.hit.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+				rayHit.hit.instID[0][i] = RTC_INVALID_GEOMETRY_ID;
+			}
+
+			rtcIntersect8(valid, scene, &context, &rayHit);
+
+			int hitMask = 0;
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				if (!valid[i] || rayHit.hit.geomID[i] == RTC_INVALID_GEOMETRY_ID) { continue; }
+				packet.tMax[i] = rayHit.ray.tfar[i];
+				setHitRecord(rayHit.ray.tfar[i], rayHit.hit.u[i], rayHit.hit.v[i], rayHit.hit.Ng_x[i], rayHit.hit.Ng_y[i], rayHit.hit.primID[i], rayHit.hit.geomID[i], rayHit.hit.instID[0][i], &hits[i]);
+				hitMask |= 1 << i;
+			}
+			return hitMask;
+		}
+
+		int intersectAnyPacket(const RayPacket& packet, int activeMask) const override {
+			RTCIntersectContext context;
+			rtcInitIntersectContext(&context);
+			context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+			alignas(32) int valid[RayPacket::Size];
+			alignas(32) RTCRay8 rtcRay;
+			setRayPacket(packet, activeMask, valid, &rtcRay);
+
+			rtcOccluded8(valid, scene, &context, &rtcRay);
+
+			int occludedMask = 0;
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				if (valid[i] && rtcRay.tfar[i] < 0.0f) {
+					occludedMask |= 1 << i;
+				}
+			}
+			return occludedMask;
+		}
+
+		// Object の配置と TriangleMesh の頂点位置 (TriangleMesh::updatePositions による変更) を反映する
+		// Embree 側では上位のシーンは作り直しになるが、三角形のシーンは頂点が変わったものだけを既存の BVH の AABB 更新で済ませる
+		void refit() override {
+			meshScenes->update();
+			for (int i = 0; i < objects.size(); ++i) {
+				RTCGeometry geometry = rtcGetGeometry(scene, i);
+				if (isMeshInstance[i]) {
+					setInstanceTransform(geometry, objects[i]->transform());
+				}
+				rtcCommitGeometry(geometry);
+			}
+			rtcCommitScene(scene);
+		}
+
+	private:
+
+		RTCScene scene;
+		std::vector<Object*> objects; // geomID (インスタンスの場合は instID) がそのまま添字になる
+		std::vector<bool> isMeshInstance;
+		std::shared_ptr<EmbreeMeshScenes> meshScenes;
+
+		static void setInstanceTransform(RTCGeometry geometry, const Transform& objectToWorld) {
+			// Matrix4x4 は行優先なので先頭 3 行がそのまま 3x4 行列になる
+			rtcSetGeometryTransform(geometry, 0, RTC_FORMAT_FLOAT3X4_ROW_MAJOR, &objectToWorld.mat.m[0][0]);
+		}
+
+		static void setRay(const Ray& ray, RTCRay* rtcRay) {
+			rtcRay->org_x = ray.o.x;
+			rtcRay->org_y = ray.o.y;
+			rtcRay->org_z = ray.o.z;
+			rtcRay->dir_x = ray.d.x;
+			rtcRay->dir_y = ray.d.y;
+			rtcRay->dir_z = ray.d.z;
+			rtcRay->tnear = 0.0f;
+			rtcRay->tfar = ray.tMax;
+			rtcRay->time = 0.0f;
+			rtcRay->mask = -1;
+			rtcRay->flags = 0;
+		}
+
+		static void setRayPacket(const RayPacket& packet, int activeMask, int* valid, RTCRay8* rtcRay) {
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				valid[i] = (activeMask & (1 << i)) ? -1 : 0;
+				rtcRay->org_x[i] = packet.o[0][i];
+				rtcRay->org_y[i] = packet.o[1][i];
+				rtcRay->org_z[i] = packet.o[2][i];
+				rtcRay->dir_x[i] = packet.d[0][i];
+				rtcRay->dir_y[i] = packet.d[1][i];
+				rtcRay->dir_z[i] = packet.d[2][i];
+				rtcRay->tnear[i] = 0.0f;
+				rtcRay->tfar[i] = packet.tMax[i];
+				rtcRay->time[i] = 0.0f;
+				rtcRay->mask[i] = -1;
+				rtcRay->flags[i] = 0;
+			}
+		}
+
+		// Embree の重心座標 (u, v) は p0 + u * (p1 - p0) + v * (p2 - p0) の形なので、Xitils の (b0, b1) に直す
+		// ユーザー定義ジオメトリでは HitRecord::back を Ng_x の符号に、HitRecord::layer を Ng_y に入れてある (三角形のシーンでは使わない)
+		// 三角形のシーンの primID はシェルマッピングで複製した三角形の番号なので、TriangleMesh に底面の番号とレイヤーに分けてもらう
+		void setHitRecord(float t, float u, float v, float ngX, float ngY, unsigned int primID, unsigned int geomID, unsigned int instID, HitRecord* hit) const {
+			const bool mesh = instID != RTC_INVALID_GEOMETRY_ID;
+			const Object* obj = objects[mesh ? instID : geomID];
+			hit->t = t;
+			hit->b0 = 1.0f - u - v;
+			hit->b1 = u;
+			hit->object = obj;
+			hit->shape = obj->shape.get();
+			if (mesh) {
+				static_cast<const TriangleMesh*>(hit->shape)->setHitTriangle((int)primID, hit);
+			} else {
+				hit->triangleIndex = (int)primID;
+				hit->layer = (int)ngY;
+			}
+			hit->back = !mesh && ngX < 0.0f;
+		}
+
+		static void boundsObject(const RTCBoundsFunctionArguments* args) {
+			const Object* obj = (const Object*)args->geometryUserPtr;
+			const Bounds3f b = obj->bound();
+			args->bounds_o->lower_x = b.min.x;
+			args->bounds_o->lower_y = b.min.y;
+			args->bounds_o->lower_z = b.min.z;
+			args->bounds_o->upper_x = b.max.x;
+			args->bounds_o->upper_y = b.max.y;
+			args->bounds_o->upper_z = b.max.z;
+		}
+
+		static Ray rayFromRTCRayN(RTCRayN* rtcRay, unsigned int N, int i) {
+			return Ray(
+				Vector3f(RTCRayN_org_x(rtcRay, N, i), RTCRayN_org_y(rtcRay, N, i), RTCRayN_org_z(rtcRay, N, i)),
+				Vector3f(RTCRayN_dir_x(rtcRay, N, i), RTCRayN_dir_y(rtcRay, N, i), RTCRayN_dir_z(rtcRay, N, i)),
+				RTCRayN_tfar(rtcRay, N, i));
+		}
+
+		static void intersectObject(const RTCIntersectFunctionNArguments* args) {
+			const Object* obj = (const Object*)args->geometryUserPtr;
+			RTCRayN* rtcRay = RTCRayHitN_RayN(args->rayhit, args->N);
+			RTCHitN* rtcHit = RTCRayHitN_HitN(args->rayhit, args->N);
+			for (int i = 0; i < args->N; ++i) {
+				if (args->valid[i] == 0) { continue; }
+				float tHit;
+				HitRecord hit;
+				if (!obj->intersect(rayFromRTCRayN(rtcRay, args->N, i), &tHit, &hit)) { continue; }
+				// setHitRecord で元の (b0, b1) に戻るように (u, v) を詰める
+				RTCRayN_tfar(rtcRay, args->N, i) = tHit;
+				RTCHitN_u(rtcHit, args->N, i) = hit.b1;
+				RTCHitN_v(rtcHit, args->N, i) = 1.0f - hit.b0 - hit.b1;
+				RTCHitN_Ng_x(rtcHit, args->N, i) = hit.back ? -1.0f : 1.0f;
+				RTCHitN_Ng_y(rtcHit, args->N, i) = (float)hit.layer;
+				RTCHitN_primID(rtcHit, args->N, i) = (unsigned int)hit.triangleIndex;
+				RTCHitN_geomID(rtcHit, args->N, i) = args->geomID;
+				RTCHitN_instID(rtcHit, args->N, i, 0) = args->context->instID[0];
+			}
+		}
+
+		static void occludedObject(const RTCOccludedFunctionNArguments* args) {
+			const Object* obj = (const Object*)args->geometryUserPtr;
+			for (int i = 0; i < args->N; ++i) {
+				if (args->valid[i] == 0) { continue; }
+				if (obj->intersectAny(rayFromRTCRayN(args->ray, args->N, i))) {
+					RTCRayN_tfar(args->ray, args->N, i) = -Infinity;
+				}
+			}
+		}
+	};
+
+}
+
+#endif
@@ -5,9 +5,23 @@
 #include "Vector.h"
 #include "Bounds.h"
 #include "Interaction.h"
+#include "Ray.h"
 
 namespace xitils {
 
+	// レイ 1 本ごとのトラバーサルの統計
+	// intersectWithStatistics などに渡すと、辿った BVH のノード数と交差判定を行ったプリミティブ数が加算される
+	struct TraversalStatistics {
+		uint64_t nodesVisited = 0;
+		uint64_t primitivesTested = 0;
+
+		TraversalStatistics& operator+=(const TraversalStatistics& s) {
+			nodesVisited += s.nodesVisited;
+			primitivesTested += s.primitivesTested;
+			return *this;
+		}
+	};
+
 	class Geometry {
 	public:
 
@@ -15,12 +29,53 @@ namespace xitils {
 
 		virtual float surfaceArea() const = 0;
 
-		virtual bool intersect(const Ray& ray, float* tHit, SurfaceIntersection* isect) const = 0;
+		// 交差判定のみを行い、交差点の法線や UV などは計算しない
+		virtual bool intersect(const Ray& ray, float* tHit, HitRecord* hit) const = 0;
 		virtual bool intersectAny(const Ray& ray) const {
 			float tHit;
-			SurfaceIntersection isect;
-			return intersect(ray, &tHit, &isect);
+			HitRecord hit;
+			return intersect(ray, &tHit, &hit);
+		}
+
+		// intersect, intersectAny と同じ判定を行い、その際のノード数とプリミティブ数を stats に加える
+		// 内部に高速化構造を持たないものは、それ自身を 1 つのプリミティブとして数える
+		virtual bool intersectWithStatistics(const Ray& ray, float* tHit, HitRecord* hit, TraversalStatistics* stats) const {
+			++stats->primitivesTested;
+			return intersect(ray, tHit, hit);
 		}
+		virtual bool intersectAnyWithStatistics(const Ray& ray, TraversalStatistics* stats) const {
+			++stats->primitivesTested;
+			return intersectAny(ray);
+		}
+
+		// packet のうち activeMask のビットが立っているレイについて intersect を行い、交差したレイのビットを立てたマスクを返す
+		// hits と packet.tMax はレイごとに intersect と同じように更新する
+		virtual int intersectPacket(RayPacket& packet, int activeMask, HitRecord* hits) const {
+			int hitMask = 0;
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				if (!(activeMask & (1 << i))) { continue; }
+				if (intersect(packet.ray(i), &packet.tMax[i], &hits[i])) {
+					hitMask |= 1 << i;
+				}
+			}
+			return hitMask;
+		}
+
+		// 遮蔽されたレイのビットを立てたマスクを返す
+		virtual int intersectAnyPacket(const RayPacket& packet, int activeMask) const {
+			int occludedMask = 0;
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				if (!(activeMask & (1 << i))) { continue; }
+				if (intersectAny(packet.ray(i))) {
+					occludedMask |= 1 << i;
+				}
+			}
+			return occludedMask;
+		}
+
+		// intersect で得た交差点の情報を計算する
+		// ray は intersect に渡したものと同じもの
+		virtual void computeSurfaceIntersection(const Ray& ray, const HitRecord& hit, SurfaceIntersection* isect) const = 0;
 
 	};
 
@@ -0,0 +1,165 @@
+﻿#pragma once
+
+#include "Utils.h"
+
+#include <array>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace xitils {
+
+	// レイが最初に当たった時点で作るジオメトリ (テッセレーションしたパッチなど) を、メモリ使用量の上限まで保持する LRU キャッシュ
+	// T は保持に必要なバイト数を返す memoryBytes() を持つこと
+	// 複数のスレッドから同時に検索と追加を行ってよく、キーのハッシュで分けた ShardNum 個の区画ごとにロックする
+	// 取り出したものは shared_ptr で返すので、使用中に追い出されても使い終わるまでは解放されない
+	template<typename T> class GeometryCache {
+	public:
+
+		static const int ShardNum = 16;
+		static const int ThreadLocalSlotNum = 64;
+
+		struct Statistics {
+			uint64_t hitNum = 0; // getThreadLocal のスレッドごとのキャッシュで見つかったものは含まない
+			uint64_t missNum = 0;
+			uint64_t evictionNum = 0;
+			int entryNum = 0;
+			size_t memoryBytes = 0;
+		};
+
+		// memoryBudget は全体で保持するバイト数の上限 (区画ごとに等分する)
+		GeometryCache(size_t memoryBudget) :
+			memoryBudget(memoryBudget),
+			cacheId(nextCacheId++)
+		{}
+
+		GeometryCache(const GeometryCache&) = delete;
+		GeometryCache& operator=(const GeometryCache&) = delete;
+
+		// 複数のメッシュで 1 つのキャッシュを共有する場合に、キーの上位 32 ビットに入れてメッシュを区別するための番号
+		uint32_t newOwnerId() {
+			return nextOwnerId++;
+		}
+
+		// key に対応するものを返し、なければ create() で作って追加する
+		// create はロックの外で呼ぶので、同じ key を複数のスレッドが同時に作ることがあるが、その場合は先に追加されたものを使う
+		template<typename F> std::shared_ptr<const T> get(uint64_t key, const F& create) {
+			Shard& shard = shards[shardIndex(key)];
+			{
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				auto it = shard.entries.find(key);
+				if (it != shard.entries.end()) {
+					shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+					++hitNum;
+					return it->second->second;
+				}
+			}
+
+			++missNum;
+			std::shared_ptr<const T> created = create();
+			const size_t bytes = created->memoryBytes();
+
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.entries.find(key);
+			if (it != shard.entries.end()) {
+				shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+				return it->second->second;
+			}
+			shard.lru.emplace_front(key, created);
+			shard.entries[key] = shard.lru.begin();
+			shard.memoryBytes += bytes;
+
+			// 追加したもの自身は追い出さない
+			const size_t shardBudget = memoryBudget / ShardNum;
+			while (shard.memoryBytes > shardBudget && shard.lru.size() > 1) {
+				auto& last = shard.lru.back();
+				shard.memoryBytes -= last.second->memoryBytes();
+				shard.entries.erase(last.first);
+				shard.lru.pop_back();
+				++evictionNum;
+			}
+			return created;
+		}
+
+		// get の前に、スレッドごとの ThreadLocalSlotNum 個の直接マップのキャッシュを引く
+		// 当たった場合はロックも shared_ptr の参照カウントの操作もしない
+		// 返したポインタは、同じスレッドが次に getThreadLocal を呼ぶまで有効
+		// スレッドごとのキャッシュにあるものは、追い出しや clear の後も上書きされるまでは解放されない
+		template<typename F> const T* getThreadLocal(uint64_t key, const F& create) {
+			struct Slot {
+				uint64_t cacheId = 0;
+				uint64_t key;
+				std::shared_ptr<const T> value;
+			};
+			thread_local std::array<Slot, ThreadLocalSlotNum> slots;
+
+			Slot& slot = slots[mix(key) % ThreadLocalSlotNum];
+			const uint64_t id = cacheId.load(std::memory_order_relaxed);
+			if (slot.cacheId != id || slot.key != key) {
+				slot.value = get(key, create);
+				slot.cacheId = id;
+				slot.key = key;
+			}
+			return slot.value.get();
+		}
+
+		void clear() {
+			// スレッドごとのキャッシュに残っているものも使われないようにする
+			cacheId = nextCacheId++;
+			for (auto& shard : shards) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				shard.lru.clear();
+				shard.entries.clear();
+				shard.memoryBytes = 0;
+			}
+		}
+
+		size_t getMemoryBudget() const { return memoryBudget; }
+
+		Statistics statistics() {
+			Statistics stats;
+			stats.hitNum = hitNum;
+			stats.missNum = missNum;
+			stats.evictionNum = evictionNum;
+			for (auto& shard : shards) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				stats.entryNum += shard.lru.size();
+				stats.memoryBytes += shard.memoryBytes;
+			}
+			return stats;
+		}
+
+	private:
+
+		struct Shard {
+			std::mutex mutex;
+			std::list<std::pair<uint64_t, std::shared_ptr<const T>>> lru; // 先頭ほど最近使ったもの
+			std::unordered_map<uint64_t, typename std::list<std::pair<uint64_t, std::shared_ptr<const T>>>::iterator> entries;
+			size_t memoryBytes = 0;
+		};
+
+		const size_t memoryBudget;
+		std::array<Shard, ShardNum> shards;
+		std::atomic<uint32_t> nextOwnerId = 0;
+		std::atomic<uint64_t> hitNum = 0;
+		std::atomic<uint64_t> missNum = 0;
+		std::atomic<uint64_t> evictionNum = 0;
+		std::atomic<uint64_t> cacheId; // スレッドごとのキャッシュで、他の GeometryCache と clear する前のものを区別する
+
+		inline static std::atomic<uint64_t> nextCacheId = 1;
+
+		// 同じメッシュの隣り合うパッチが別の区画に散らばるように、キーを混ぜてから区画を選ぶ
+		static int shardIndex(uint64_t key) {
+			return (int)(mix(key) % ShardNum);
+		}
+
+		static uint64_t mix(uint64_t key) {
+			key ^= key >> 33;
+			key *= 0xff51afd7ed558ccdULL;
+			key ^= key >> 33;
+			return key;
+		}
+	};
+
+}
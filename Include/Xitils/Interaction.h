@@ -7,7 +7,6 @@ namespace xitils {
 
 	class Object;
 	class Shape;
-	class TriangleIndexed;
 
 	class Interaction {
 	public:
@@ -22,7 +21,8 @@ namespace xitils {
 		Vector3f tangent, bitangent;
 		const Object* object = nullptr;
 		const Shape* shape = nullptr;
-		const TriangleIndexed* tri = nullptr;
+		int triangleIndex = -1; // TriangleMesh の何番目の三角形か (シェルマッピングの場合は底面の三角形の番号)
+		int layer = 0; // シェルマッピングの場合に交差したレイヤー
 
 		struct Shading {
 			Vector3f n;
@@ -31,4 +31,17 @@ namespace xitils {
 		Shading shading;
 	};
 
+	// 交差判定の途中で記録する、交差点を特定するための最小限の情報
+	// SurfaceIntersection は最も近い交差点が確定した後に、これを元に一度だけ計算する
+	class HitRecord {
+	public:
+		float t = 0.0f;
+		float b0 = 0.0f, b1 = 0.0f; // 三角形の重心座標
+		const Object* object = nullptr;
+		const Shape* shape = nullptr;
+		int triangleIndex = -1; // SurfaceIntersection と同じ
+		int layer = 0;
+		bool back = false; // 内側から当たったか (Sphere のように、解き直さないと分からない形状が使う)
+	};
+
 }
\ No newline at end of file
@@ -0,0 +1,410 @@
+﻿#pragma once
+
+#include "Bounds.h"
+#include "Object.h"
+#include "Sampler.h"
+#include "Utils.h"
+#include "Vector.h"
+
+namespace xitils {
+
+	// 方向の範囲を表す円錐 (axis を中心とした、余弦が cosTheta 以上の範囲)
+	struct DirectionCone {
+		Vector3f axis;
+		float cosTheta = Infinity; // Infinity なら空
+
+		DirectionCone() {}
+		DirectionCone(const Vector3f& axis, float cosTheta) : axis(axis), cosTheta(cosTheta) {}
+
+		static DirectionCone entireSphere() { return DirectionCone(Vector3f(0, 0, 1), -1.0f); }
+
+		bool isEmpty() const { return cosTheta == Infinity; }
+	};
+
+	// 2 つの円錐を含む最小の円錐
+	inline DirectionCone merge(const DirectionCone& a, const DirectionCone& b) {
+		if (a.isEmpty()) { return b; }
+		if (b.isEmpty()) { return a; }
+
+		const float thetaA = acosf(clamp(a.cosTheta, -1.0f, 1.0f));
+		const float thetaB = acosf(clamp(b.cosTheta, -1.0f, 1.0f));
+		const float thetaD = acosf(clamp(dot(a.axis, b.axis), -1.0f, 1.0f));
+		if (std::min(thetaD + thetaB, Pi) <= thetaA) { return a; }
+		if (std::min(thetaD + thetaA, Pi) <= thetaB) { return b; }
+
+		const float thetaO = (thetaA + thetaD + thetaB) / 2;
+		if (thetaO >= Pi) { return DirectionCone::entireSphere(); }
+
+		// a の軸を b の軸の方へ thetaO - thetaA だけ回す
+		const Vector3f toB = b.axis - dot(a.axis, b.axis) * a.axis;
+		if (toB.lengthSq() == 0.0f) { return DirectionCone::entireSphere(); }
+		const float thetaR = thetaO - thetaA;
+		const Vector3f axis = cosf(thetaR) * a.axis + sinf(thetaR) * normalize(toB);
+		return DirectionCone(normalize(axis), cosf(thetaO));
+	}
+
+	// 光源 (またはその集まり) の位置、放射の向き、パワーの範囲
+	// 各点は cone の範囲の法線を持ち、法線から cosThetaE の角度までの方向に放射する
+	struct LightBounds {
+		Bounds3f bounds;
+		DirectionCone cone;
+		float cosThetaE = 1.0f;
+		float power = 0.0f;
+
+		// 点 p (法線 n) に届く寄与の大きさの見積もり
+		// 実際の寄与が 0 になりうるのはこれが 0 の場合のみ
+		// n が 0 ならシェーディング点側のコサイン項は考慮しない
+		float importance(const Vector3f& p, const Vector3f& n) const {
+			const Vector3f center = bounds.center();
+			const Vector3f d = p - center;
+			const float centerDistSq = d.lengthSq();
+			const float radiusSq = (bounds.max - center).lengthSq();
+			// 光源に近い点で発散しないように、距離の 2 乗を AABB の大きさで下から抑える
+			const float distSq = std::max(centerDistSq, sqrtf(radiusSq));
+
+			// cosA, sinA の角度から cosB, sinB の角度を引いたもの (0 以上に切り詰める)
+			auto cosSubClamped = [](float sinA, float cosA, float sinB, float cosB) {
+				return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+			};
+			auto sinSubClamped = [](float sinA, float cosA, float sinB, float cosB) {
+				return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+			};
+
+			const Vector3f wi = centerDistSq > 0.0f ? d / sqrtf(centerDistSq) : d;
+			const float cosThetaW = dot(cone.axis, wi);
+			const float sinThetaW = safeSqrt(1.0f - cosThetaW * cosThetaW);
+
+			// AABB を囲む球が p から見込む角度
+			const float cosThetaB = centerDistSq > radiusSq ? safeSqrt(1.0f - radiusSq / centerDistSq) : -1.0f;
+			const float sinThetaB = safeSqrt(1.0f - cosThetaB * cosThetaB);
+
+			const float cosThetaO = cone.cosTheta;
+			const float sinThetaO = safeSqrt(1.0f - cosThetaO * cosThetaO);
+			const float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+			const float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+			const float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+			if (cosThetaP <= cosThetaE) { return 0.0f; }
+
+			float res = power * cosThetaP / distSq;
+
+			if (!n.isZero()) {
+				const float cosThetaI = fabsf(dot(wi, n));
+				const float sinThetaI = safeSqrt(1.0f - cosThetaI * cosThetaI);
+				res *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+			}
+
+			return std::max(res, 0.0f);
+		}
+	};
+
+	inline LightBounds merge(const LightBounds& a, const LightBounds& b) {
+		if (a.power == 0.0f) { return b; }
+		if (b.power == 0.0f) { return a; }
+		LightBounds res;
+		res.bounds = merge(a.bounds, b.bounds);
+		res.cone = merge(a.cone, b.cone);
+		res.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+		res.power = a.power + b.power;
+		return res;
+	}
+
+	// 光源の階層
+	// 光源の Object を三角形ごと (Shape::lightTriangleNum が 0 の場合は Object ごと) に分けたものを葉とし、
+	// 各ノードに LightBounds を持つ
+	// シェーディング点ごとに、子の LightBounds::importance に比例した確率で根から辿って光源を 1 つ選ぶ
+	// 選んだ経路はビット列で記録しておき、pdf ではそれを辿り直して同じ確率を求める
+	class LightBVH {
+	public:
+
+		// 分割のコスト (SAOH) を比べる際のビンの数
+		static const int BinNum = 12;
+
+		// この深さより下は中央値で分割する (経路のビット列を 64 ビットに収めるため)
+		static const int MedianSplitDepth = 32;
+
+		LightBVH() {}
+
+		// lights は LightBVH より長く生存していること
+		LightBVH(const std::vector<std::shared_ptr<Object>>& lights) {
+			lightOffsets.resize(lights.size() + 1);
+			lightOffsets[0] = 0;
+			for (int i = 0; i < lights.size(); ++i) {
+				const Object& light = *lights[i];
+				lightIndices[&light] = i;
+				this->lights.push_back(&light);
+				lightOffsets[i + 1] = lightOffsets[i] + std::max(light.shape->lightTriangleNum(), 1);
+			}
+
+			primitiveIndices.resize(lightOffsets.back(), -1);
+			for (int i = 0; i < lights.size(); ++i) {
+				const Object& light = *lights[i];
+				const Vector3f emission = light.material->averageEmission();
+				const float radiance = clampPositive((emission.x + emission.y + emission.z) / 3.0f);
+				const int triangleNum = light.shape->lightTriangleNum();
+
+				if (triangleNum == 0) {
+					Primitive primitive;
+					primitive.lightIndex = i;
+					primitive.triangleIndex = -1;
+					primitive.area = light.surfaceArea();
+					primitive.bounds.bounds = light.bound();
+					primitive.bounds.cone = DirectionCone::entireSphere();
+					primitive.bounds.cosThetaE = 0.0f;
+					primitive.bounds.power = radiance * primitive.area;
+					addPrimitive(primitive);
+					continue;
+				}
+
+				for (int t = 0; t < triangleNum; ++t) {
+					Vector3f p[3];
+					light.shape->lightTriangle(t, &p[0], &p[1], &p[2]);
+					// サンプリングした点の法線 (Object::sampleLightTriangle) と同じ向きにする
+					const Vector3f n = light.transform().asNormal(cross(p[1] - p[0], p[2] - p[0]));
+					for (int k = 0; k < 3; ++k) {
+						p[k] = light.transform()(p[k]);
+					}
+
+					Primitive primitive;
+					primitive.lightIndex = i;
+					primitive.triangleIndex = t;
+					primitive.area = cross(p[1] - p[0], p[2] - p[0]).length() / 2;
+					primitive.bounds.bounds = Bounds3f(p[0], p[1], p[2]);
+					primitive.bounds.cone = DirectionCone(n.isZero() ? Vector3f(0, 0, 1) : normalize(n), 1.0f);
+					primitive.bounds.cosThetaE = 0.0f;
+					primitive.bounds.power = radiance * primitive.area;
+					addPrimitive(primitive);
+				}
+			}
+
+			if (primitives.empty()) { return; }
+
+			std::vector<int> order(primitives.size());
+			std::iota(order.begin(), order.end(), 0);
+			trails.resize(primitives.size());
+			nodes.reserve(2 * primitives.size() - 1);
+			build(order.data(), order.size(), 0, 0);
+		}
+
+		bool empty() const { return nodes.empty(); }
+		int nodeNum() const { return nodes.size(); }
+
+		size_t memoryBytes() const {
+			return sizeof(Node) * nodes.size() + sizeof(Primitive) * primitives.size() + sizeof(uint64_t) * trails.size() + sizeof(int) * (primitiveIndices.size() + lightOffsets.size());
+		}
+
+		// 点 p (法線 n) への寄与の見積もりに比例した確率で光源を選び、その上の点をサンプリングする
+		// pdf は光源上の面積に関する確率密度で、どの光源も寄与しえない場合は 0 になる
+		Object::SampledSurface sample(const Vector3f& p, const Vector3f& n, Sampler& sampler, float* pdf) const {
+			*pdf = 0.0f;
+			if (empty()) { return Object::SampledSurface(); }
+
+			int nodeIndex = 0;
+			float pmf = 1.0f;
+			while (nodes[nodeIndex].primitive < 0) {
+				const int child0 = nodeIndex + 1;
+				const int child1 = nodes[nodeIndex].secondChild;
+				const float importance0 = nodes[child0].bounds.importance(p, n);
+				const float importance1 = nodes[child1].bounds.importance(p, n);
+				if (importance0 == 0.0f && importance1 == 0.0f) { return Object::SampledSurface(); }
+
+				const float prob0 = importance0 / (importance0 + importance1);
+				if (sampler.randf() < prob0) {
+					nodeIndex = child0;
+					pmf *= prob0;
+				} else {
+					nodeIndex = child1;
+					pmf *= 1.0f - prob0;
+				}
+			}
+			if (nodes[nodeIndex].bounds.importance(p, n) == 0.0f) { return Object::SampledSurface(); }
+
+			const Primitive& primitive = primitives[nodes[nodeIndex].primitive];
+			const Object& light = *lights[primitive.lightIndex];
+			if (primitive.triangleIndex < 0) {
+				auto res = light.sampleSurface(sampler, pdf);
+				*pdf *= pmf;
+				return res;
+			}
+			*pdf = pmf / primitive.area;
+			return light.sampleLightTriangle(primitive.triangleIndex, sampler);
+		}
+
+		// sample で点 p (法線 n) から光源 object 上の点 lightP を選ぶ確率密度
+		float pdf(const Vector3f& p, const Vector3f& n, const Vector3f& lightP, const Object* object, const Shape* shape, int triangleIndex) const {
+			auto it = lightIndices.find(object);
+			if (it == lightIndices.end()) { return 0.0f; }
+			const int lightIndex = it->second;
+			const int triangleNum = object->shape->lightTriangleNum();
+			if (triangleNum > 0 && !(0 <= triangleIndex && triangleIndex < triangleNum)) { return 0.0f; }
+
+			const int primitiveIndex = primitiveIndices[lightOffsets[lightIndex] + (triangleNum > 0 ? triangleIndex : 0)];
+			if (primitiveIndex < 0) { return 0.0f; }
+
+			// 根から記録した経路を辿り、各分岐で sample と同じ確率を掛ける
+			const uint64_t trail = trails[primitiveIndex];
+			int nodeIndex = 0;
+			float pmf = 1.0f;
+			for (int depth = 0; nodes[nodeIndex].primitive < 0; ++depth) {
+				const int child0 = nodeIndex + 1;
+				const int child1 = nodes[nodeIndex].secondChild;
+				const float importance0 = nodes[child0].bounds.importance(p, n);
+				const float importance1 = nodes[child1].bounds.importance(p, n);
+				if (importance0 == 0.0f && importance1 == 0.0f) { return 0.0f; }
+
+				const float prob0 = importance0 / (importance0 + importance1);
+				if (trail & ((uint64_t)1 << depth)) {
+					nodeIndex = child1;
+					pmf *= 1.0f - prob0;
+				} else {
+					nodeIndex = child0;
+					pmf *= prob0;
+				}
+			}
+			ASSERT(nodes[nodeIndex].primitive == primitiveIndex);
+			if (nodes[nodeIndex].bounds.importance(p, n) == 0.0f) { return 0.0f; }
+
+			const Primitive& primitive = primitives[primitiveIndex];
+			if (primitive.triangleIndex < 0) {
+				return pmf * object->surfacePDF(lightP, shape, triangleIndex);
+			}
+			return pmf / primitive.area;
+		}
+
+	private:
+
+		// 光源の Object 全体、またはその中の三角形 1 つ
+		struct Primitive {
+			int lightIndex;
+			int triangleIndex; // Object 全体なら -1
+			float area;        // ワールド座標での面積
+			LightBounds bounds;
+		};
+
+		// 内部ノードの 1 つ目の子は直後のノード
+		struct Node {
+			LightBounds bounds;
+			int secondChild;
+			int primitive; // 内部ノードなら -1
+		};
+
+		std::vector<const Object*> lights;
+		std::unordered_map<const Object*, int> lightIndices;
+		std::vector<int> lightOffsets;     // 光源ごとの primitiveIndices の先頭
+		std::vector<int> primitiveIndices; // (光源, 三角形) ごとの primitives の番号 (パワーが 0 で除いたものは -1)
+		std::vector<Primitive> primitives;
+		std::vector<uint64_t> trails;      // primitives ごとの根からの経路 (depth 番目のビットが 1 なら 2 つ目の子)
+		std::vector<Node> nodes;
+
+		void addPrimitive(const Primitive& primitive) {
+			// パワーが 0 のものは選ばれることがないので入れない
+			if (!(primitive.bounds.power > 0.0f)) { return; }
+			primitiveIndices[lightOffsets[primitive.lightIndex] + std::max(primitive.triangleIndex, 0)] = primitives.size();
+			primitives.push_back(primitive);
+		}
+
+		// 方向の範囲による分割のコストの重み (円錐から放射される方向の立体角の広さ)
+		static float orientationMeasure(const LightBounds& b) {
+			const float thetaO = acosf(clamp(b.cone.cosTheta, -1.0f, 1.0f));
+			const float thetaE = acosf(clamp(b.cosThetaE, -1.0f, 1.0f));
+			const float thetaW = std::min(thetaO + thetaE, Pi);
+			const float sinThetaO = safeSqrt(1.0f - b.cone.cosTheta * b.cone.cosTheta);
+			return 2 * Pi * (1 - b.cone.cosTheta) + Pi / 2 * (2 * thetaW * sinThetaO - cosf(thetaO - 2 * thetaW) - 2 * thetaO * sinThetaO + b.cone.cosTheta);
+		}
+
+		int build(int* order, int num, int depth, uint64_t trail) {
+			const int nodeIndex = nodes.size();
+			nodes.emplace_back();
+
+			if (num == 1) {
+				nodes[nodeIndex].bounds = primitives[order[0]].bounds;
+				nodes[nodeIndex].secondChild = -1;
+				nodes[nodeIndex].primitive = order[0];
+				trails[order[0]] = trail;
+				return nodeIndex;
+			}
+
+			LightBounds bounds;
+			Bounds3f centroidBounds;
+			for (int i = 0; i < num; ++i) {
+				bounds = merge(bounds, primitives[order[i]].bounds);
+				centroidBounds = merge(centroidBounds, primitives[order[i]].bounds.bounds.center());
+			}
+
+			const int mid = split(order, num, depth, bounds, centroidBounds);
+			build(order, mid, depth + 1, trail);
+			const int secondChild = build(order + mid, num - mid, depth + 1, trail | ((uint64_t)1 << depth));
+
+			nodes[nodeIndex].bounds = bounds;
+			nodes[nodeIndex].secondChild = secondChild;
+			nodes[nodeIndex].primitive = -1;
+			return nodeIndex;
+		}
+
+		// order を並べ替えて 2 つに分け、1 つ目の数を返す
+		int split(int* order, int num, int depth, const LightBounds& bounds, const Bounds3f& centroidBounds) {
+			const Vector3f centroidSize = centroidBounds.size();
+			auto centroid = [&](int i) { return primitives[order[i]].bounds.bounds.center(); };
+
+			int bestAxis = -1;
+			int bestBin = -1;
+			float bestCost = Infinity;
+			if (depth < MedianSplitDepth) {
+				const Vector3f size = bounds.bounds.size();
+				const float maxSize = std::max(size.x, std::max(size.y, size.z));
+				for (int axis = 0; axis < 3; ++axis) {
+					if (!(centroidSize[axis] > 0.0f)) { continue; }
+
+					LightBounds bins[BinNum];
+					for (int i = 0; i < num; ++i) {
+						const int bin = clamp((int)(BinNum * (centroid(i)[axis] - centroidBounds.min[axis]) / centroidSize[axis]), 0, BinNum - 1);
+						bins[bin] = merge(bins[bin], primitives[order[i]].bounds);
+					}
+
+					// 細長いノードを分割しないと損になるように、分割する軸の長さで重みを付ける
+					const float kr = size[axis] > 0.0f ? maxSize / size[axis] : 1.0f;
+					auto cost = [&](const LightBounds& b) {
+						return b.power == 0.0f ? 0.0f : b.power * orientationMeasure(b) * b.bounds.surfaceArea();
+					};
+
+					LightBounds above[BinNum];
+					above[BinNum - 1] = bins[BinNum - 1];
+					for (int bin = BinNum - 2; bin >= 0; --bin) {
+						above[bin] = merge(bins[bin], above[bin + 1]);
+					}
+					LightBounds below;
+					for (int bin = 0; bin < BinNum - 1; ++bin) {
+						below = merge(below, bins[bin]);
+						const float c = kr * (cost(below) + cost(above[bin + 1]));
+						if (c < bestCost) {
+							bestCost = c;
+							bestAxis = axis;
+							bestBin = bin;
+						}
+					}
+				}
+			}
+
+			if (bestAxis >= 0) {
+				const int axis = bestAxis;
+				const int bin = bestBin;
+				int* middle = std::partition(order, order + num, [&](int primitive) {
+					const Vector3f c = primitives[primitive].bounds.bounds.center();
+					return clamp((int)(BinNum * (c[axis] - centroidBounds.min[axis]) / centroidSize[axis]), 0, BinNum - 1) <= bin;
+				});
+				const int mid = middle - order;
+				if (mid > 0 && mid < num) { return mid; }
+			}
+
+			// 重心がすべて同じ場合や深くなりすぎた場合は、重心の範囲が最も長い軸の中央値で分ける
+			int axis = 0;
+			if (centroidSize.y > centroidSize[axis]) { axis = 1; }
+			if (centroidSize.z > centroidSize[axis]) { axis = 2; }
+			const int mid = num / 2;
+			std::nth_element(order, order + mid, order + num, [&](int a, int b) {
+				return primitives[a].bounds.bounds.center()[axis] < primitives[b].bounds.bounds.center()[axis];
+			});
+			return mid;
+		}
+	};
+
+}
@@ -39,12 +39,36 @@ namespace xitils {
 			return Vector3f();
 		}
 
+		// 表面全体での輝度の代表値
+		// LightBVH が葉 (光源の三角形、または Object) のパワーを (この値) * (面積) として求めるのに使う
+		virtual Vector3f averageEmission() const {
+			return Vector3f(1.0f);
+		}
+
 		// アルベドを返す
 		// デノイザ用
 		virtual Vector3f getAlbedo(const SurfaceIntersection& isect) const
 		{
 			return Vector3f();
 		}
+
+		// 以下は同じマテリアルの交差点をまとめてシェーディングするためのもの
+		// 既定では 1 つずつ呼ぶので、まとめて計算した方が速いマテリアルでのみ実装し直す
+
+		// isects[k] (k < num) について evalAndSample を行う
+		virtual void evalAndSampleBatch(const SurfaceIntersection* const* isects, int num, Sampler& sampler, Vector3f* wis, float* pdfs, Vector3f* evals) const {
+			for (int k = 0; k < num; ++k) {
+				evals[k] = evalAndSample(*isects[k], sampler, &wis[k], &pdfs[k]);
+			}
+		}
+
+		// isects[k] と wis[k] (k < num) について bsdfCos と getPDF の値を求める
+		virtual void bsdfCosAndPDFBatch(const SurfaceIntersection* const* isects, const Vector3f* wis, int num, Sampler& sampler, Vector3f* bsdfCos, float* pdfs) const {
+			for (int k = 0; k < num; ++k) {
+				bsdfCos[k] = this->bsdfCos(*isects[k], sampler, wis[k]);
+				pdfs[k] = getPDF(*isects[k], wis[k]);
+			}
+		}
 	};
 
 	class Diffuse : public Material {
@@ -83,6 +107,14 @@ namespace xitils {
 		Vector3f getAlbedo(const SurfaceIntersection& isect) const override {
 			return texture == nullptr ? albedo : albedo * texture->rgb(isect.texCoord);;
 		}
+
+		void bsdfCosAndPDFBatch(const SurfaceIntersection* const* isects, const Vector3f* wis, int num, Sampler& sampler, Vector3f* bsdfCos, float* pdfs) const override {
+			for (int k = 0; k < num; ++k) {
+				const float cos = clampPositive(dot(isects[k]->shading.n, wis[k]));
+				bsdfCos[k] = (texture == nullptr ? albedo : albedo * texture->rgb(isects[k]->texCoord)) / M_PI * cos;
+				pdfs[k] = cos / M_PI;
+			}
+		}
 	};
 
 	struct Glossy : public Material {
@@ -381,6 +413,102 @@ namespace xitils {
 			return f0;
 		}
 
+		// 方向のサンプリングは 1 つずつ行い、BSDF の値は bsdfCosAndPDFBatch でまとめて求める
+		void evalAndSampleBatch(const SurfaceIntersection* const* isects, int num, Sampler& sampler, Vector3f* wis, float* pdfs, Vector3f* evals) const override {
+			for (int k = 0; k < num; ++k) {
+				const auto& wo = isects[k]->wo;
+				auto h = sampleGGXVNDF(wo, isects[k]->shading.n, sampler);
+				wis[k] = 2 * dot(wo, h) * h - wo;
+			}
+
+			bsdfCosAndPDFBatch(isects, wis, num, sampler, evals, pdfs);
+			for (int k = 0; k < num; ++k) {
+				evals[k] /= pdfs[k];
+			}
+		}
+
+		// bsdfCos と getPDF と同じ計算を SIMD の各レーンで行う
+		void bsdfCosAndPDFBatch(const SurfaceIntersection* const* isects, const Vector3f* wis, int num, Sampler& sampler, Vector3f* bsdfCos, float* pdfs) const override {
+			for (int begin = 0; begin < num; begin += SIMDWidth) {
+				const int laneNum = std::min((int)SIMDWidth, num - begin);
+
+				// 余ったレーンには先頭のものを入れておき、結果は使わない
+				float wo[3][SIMDWidth], n[3][SIMDWidth], wi[3][SIMDWidth];
+				for (int k = 0; k < SIMDWidth; ++k) {
+					const int i = begin + (k < laneNum ? k : 0);
+					for (int axis = 0; axis < 3; ++axis) {
+						wo[axis][k] = isects[i]->wo[axis];
+						n[axis][k] = isects[i]->shading.n[axis];
+						wi[axis][k] = wis[i][axis];
+					}
+				}
+
+				float fresnel[SIMDWidth], dg[SIMDWidth], pdf[SIMDWidth];
+				evalGGXSIMD(wo, n, wi, fresnel, dg, pdf);
+
+				for (int k = 0; k < laneNum; ++k) {
+					bsdfCos[begin + k] = (f0 + (Vector3f(1.0f) - f0) * fresnel[k]) * dg[k];
+					pdfs[begin + k] = pdf[k];
+				}
+			}
+		}
+
+	private:
+		static const int SIMDWidth = 8;
+		using T_SIMD = simdpp::float32x8;
+
+		// F_Reflection の (1 - dot(eye, h))^5 の部分、D_GGX * G_Smith / (4 * dot(wo, n))、getPDF の値を求める
+		void evalGGXSIMD(const float wo[3][SIMDWidth], const float n[3][SIMDWidth], const float wi[3][SIMDWidth], float* fresnel, float* dg, float* pdf) const {
+			const T_SIMD zero = simdpp::make_zero();
+			const T_SIMD one = simdpp::splat<T_SIMD>(1.0f);
+			const T_SIMD alpha2 = simdpp::splat<T_SIMD>(alpha * alpha);
+
+			T_SIMD vwo[3], vn[3], vwi[3], h[3];
+			for (int axis = 0; axis < 3; ++axis) {
+				vwo[axis] = simdpp::load_u<T_SIMD>(wo[axis]);
+				vn[axis] = simdpp::load_u<T_SIMD>(n[axis]);
+				vwi[axis] = simdpp::load_u<T_SIMD>(wi[axis]);
+				h[axis] = simdpp::add(vwi[axis], vwo[axis]);
+			}
+			auto dot3 = [](const T_SIMD* a, const T_SIMD* b) {
+				return simdpp::add(simdpp::add(simdpp::mul(a[0], b[0]), simdpp::mul(a[1], b[1])), simdpp::mul(a[2], b[2]));
+			};
+			const T_SIMD invHLength = simdpp::div(one, simdpp::sqrt(dot3(h, h)));
+			for (int axis = 0; axis < 3; ++axis) {
+				h[axis] = simdpp::mul(h[axis], invHLength);
+			}
+
+			const T_SIMD dotWoN = dot3(vwo, vn);
+			const T_SIMD dotWiN = dot3(vwi, vn);
+			const T_SIMD dotNH = dot3(vn, h);
+			const T_SIMD dotWoH = dot3(vwo, h);
+
+			// D_GGX
+			const T_SIMD cosThetaH2 = simdpp::mul(dotNH, dotNH);
+			const T_SIMD alpha2PlusTan2 = simdpp::add(alpha2, simdpp::sub(simdpp::div(one, cosThetaH2), one));
+			T_SIMD D = simdpp::div(alpha2, simdpp::mul(simdpp::mul(simdpp::splat<T_SIMD>(Pi), simdpp::mul(cosThetaH2, cosThetaH2)), simdpp::mul(alpha2PlusTan2, alpha2PlusTan2)));
+			D = simdpp::blend(D, zero, simdpp::cmp_gt(dotNH, zero));
+
+			// G1_Smith
+			auto G1 = [&](const T_SIMD& cosTheta) {
+				const T_SIMD tanTheta2 = simdpp::sub(simdpp::div(one, simdpp::mul(cosTheta, cosTheta)), one);
+				const T_SIMD lambda = simdpp::mul(simdpp::sub(simdpp::sqrt(simdpp::max(zero, simdpp::add(one, simdpp::mul(alpha2, tanTheta2)))), one), simdpp::splat<T_SIMD>(0.5f));
+				return simdpp::div(one, simdpp::add(one, lambda));
+			};
+			const T_SIMD G1o = G1(dotWoN);
+			const T_SIMD G = simdpp::mul(G1(dotWiN), G1o);
+
+			const T_SIMD four = simdpp::splat<T_SIMD>(4.0f);
+			const T_SIMD x = simdpp::sub(one, dotWoH);
+			const T_SIMD x2 = simdpp::mul(x, x);
+			simdpp::store_u(fresnel, simdpp::mul(simdpp::mul(x2, x2), x));
+			simdpp::store_u(dg, simdpp::div(simdpp::mul(D, G), simdpp::max(zero, simdpp::mul(four, dotWoN))));
+
+			// D_V_GGX / (4 * dot(wo, h))
+			const T_SIMD DV = simdpp::div(simdpp::mul(simdpp::mul(G1o, simdpp::max(zero, dotWoH)), D), dotWoN);
+			simdpp::store_u(pdf, simdpp::div(DV, simdpp::mul(four, dotWoH)));
+		}
+
 	};
 
 	class Emission : public Material {
@@ -408,6 +536,10 @@ namespace xitils {
 		Vector3f getEmission(const Vector3f& wo, const Vector3f& n, const Vector3f& shadingN) const override {
 			return dot(wo,n) > 0.0f ? power : Vector3f();
 		}
+
+		Vector3f averageEmission() const override {
+			return power;
+		}
 	};
 
 }
\ No newline at end of file
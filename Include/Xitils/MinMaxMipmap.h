@@ -0,0 +1,162 @@
+﻿#pragma once
+
+#include "Utils.h"
+#include "Vector.h"
+#include "Texture.h"
+
+namespace xitils {
+
+	// 高さ場として使うテクスチャ (rgb の x 成分を高さとする) の、テクセルの最小値と最大値を 2x2 ずつまとめていったミップマップ
+	// uv の矩形内で Texture::rgb が返しうる高さの範囲を、テクスチャを直接参照せずに保守的に求めるのに使う
+	// シェルマッピングのトラバーサルで、変位の届かないレイヤーをまとめて棄却したり、確実に変位の下にあるレイヤーを参照なしで採用したりする
+	class MinMaxMipmap {
+	public:
+
+		// Texture::rgb の補間による丸め誤差を吸収するための余裕
+		// range の結果と比べて棄却・採用を判断する際は、この分だけ保守的にすること
+		inline static const float Epsilon = 1e-5f;
+
+		// テクスチャのラップの方法 (warpClamp) と補間の有無 (filter) は構築時のものを使う
+		MinMaxMipmap(const Texture& texture) :
+			warpClamp(texture.warpClamp),
+			filter(texture.filter)
+		{
+			Level base;
+			base.width = texture.getWidth();
+			base.height = texture.getHeight();
+			base.minValues.resize(base.width * base.height);
+			base.maxValues.resize(base.width * base.height);
+#pragma omp parallel for
+			for (int y = 0; y < base.height; ++y) {
+				for (int x = 0; x < base.width; ++x) {
+					const float value = texture.r(x, y);
+					base.minValues[x + y * base.width] = value;
+					base.maxValues[x + y * base.width] = value;
+				}
+			}
+			levels.push_back(std::move(base));
+
+			// 1x1 になるまで縮小する
+			// 奇数の幅の場合は端のテクセルを 1 つだけでまとめるので、level 段目のテクセル i は元のテクセル [i << level, (i + 1) << level) を表す
+			while (levels.back().width > 1 || levels.back().height > 1) {
+				const Level& fine = levels.back();
+				Level coarse;
+				coarse.width = (fine.width + 1) / 2;
+				coarse.height = (fine.height + 1) / 2;
+				coarse.minValues.resize(coarse.width * coarse.height);
+				coarse.maxValues.resize(coarse.width * coarse.height);
+#pragma omp parallel for
+				for (int y = 0; y < coarse.height; ++y) {
+					for (int x = 0; x < coarse.width; ++x) {
+						float minValue = Infinity;
+						float maxValue = -Infinity;
+						for (int fy = 2 * y; fy < std::min(2 * y + 2, fine.height); ++fy) {
+							for (int fx = 2 * x; fx < std::min(2 * x + 2, fine.width); ++fx) {
+								minValue = std::min(minValue, fine.minValues[fx + fy * fine.width]);
+								maxValue = std::max(maxValue, fine.maxValues[fx + fy * fine.width]);
+							}
+						}
+						coarse.minValues[x + y * coarse.width] = minValue;
+						coarse.maxValues[x + y * coarse.width] = maxValue;
+					}
+				}
+				levels.push_back(std::move(coarse));
+			}
+		}
+
+		int levelNum() const { return levels.size(); }
+
+		size_t memoryBytes() const {
+			size_t res = 0;
+			for (const auto& level : levels) {
+				res += sizeof(float) * (level.minValues.size() + level.maxValues.size());
+			}
+			return res;
+		}
+
+		// uv の矩形 [uvMin, uvMax] 内の点で Texture::rgb(uv).x が取りうる値の範囲
+		// 補間で参照される周囲のテクセルも含めるので保守的な範囲になる
+		void range(const Vector2f& uvMin, const Vector2f& uvMax, float* minValue, float* maxValue) const {
+			int rangesX[2][2], rangesY[2][2];
+			const int numX = texelRanges(uvMin.u, uvMax.u, levels[0].width, rangesX);
+			const int numY = texelRanges(uvMin.v, uvMax.v, levels[0].height, rangesY);
+			*minValue = Infinity;
+			*maxValue = -Infinity;
+			for (int j = 0; j < numY; ++j) {
+				for (int i = 0; i < numX; ++i) {
+					texelRange(rangesX[i][0], rangesX[i][1], rangesY[j][0], rangesY[j][1], minValue, maxValue);
+				}
+			}
+		}
+
+	private:
+
+		struct Level {
+			int width, height;
+			std::vector<float> minValues;
+			std::vector<float> maxValues;
+		};
+
+		std::vector<Level> levels;
+		bool warpClamp;
+		bool filter;
+
+		// uv の区間 [uMin, uMax] で参照されうるテクセルの区間を、Texture::warp によるラップ後の区間 (繰り返しの場合は最大 2 つ) で求める
+		int texelRanges(float uMin, float uMax, int size, int ranges[2][2]) const {
+			float fMin = uMin * size;
+			float fMax = uMax * size;
+			if (filter) {
+				fMin -= 0.5f;
+				fMax -= 0.5f;
+			}
+			// 区間がテクスチャ全体を覆う場合 (と NaN の場合) は全体
+			if (!(fMax - fMin < size && fMin > -1e8f && fMax < 1e8f)) {
+				ranges[0][0] = 0;
+				ranges[0][1] = size - 1;
+				return 1;
+			}
+			// 補間では隣のテクセルも参照し、補間しない場合は 0 への切り捨てで負の側に 1 つずれうるので、どちらも 1 つ広げる
+			const int t0 = (int)floorf(fMin);
+			const int t1 = (int)floorf(fMax) + 1;
+			if (warpClamp) {
+				ranges[0][0] = clamp(t0, 0, size - 1);
+				ranges[0][1] = clamp(t1, 0, size - 1);
+				return 1;
+			}
+			if (t1 - t0 + 1 >= size) {
+				ranges[0][0] = 0;
+				ranges[0][1] = size - 1;
+				return 1;
+			}
+			int begin = t0 % size;
+			if (begin < 0) { begin += size; }
+			const int end = begin + (t1 - t0);
+			if (end < size) {
+				ranges[0][0] = begin;
+				ranges[0][1] = end;
+				return 1;
+			}
+			ranges[0][0] = begin;
+			ranges[0][1] = size - 1;
+			ranges[1][0] = 0;
+			ranges[1][1] = end - size;
+			return 2;
+		}
+
+		// 元のテクセルの矩形 [x0, x1] x [y0, y1] を各軸 2 テクセル以内で覆える段まで上がって、その段の高々 2x2 のテクセルを参照する
+		void texelRange(int x0, int x1, int y0, int y1, float* minValue, float* maxValue) const {
+			int level = 0;
+			while ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1) {
+				++level;
+			}
+			const Level& l = levels[level];
+			for (int y = y0 >> level; y <= (y1 >> level); ++y) {
+				for (int x = x0 >> level; x <= (x1 >> level); ++x) {
+					*minValue = std::min(*minValue, l.minValues[x + y * l.width]);
+					*maxValue = std::max(*maxValue, l.maxValues[x + y * l.width]);
+				}
+			}
+		}
+	};
+
+}
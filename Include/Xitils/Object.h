@@ -19,20 +19,29 @@ namespace xitils {
 		struct SampledSurface {
 			const Object* object;
 			const Shape* shape;
-			const TriangleIndexed* tri;
+			int triangleIndex;
 			Vector3f p;
 			Vector3f n;
 			Vector3f shadingN;
 		};
 
-		Transform objectToWorld;
 		std::shared_ptr<Shape> shape;
 		std::shared_ptr<Material> material;
 
 		Object(std::shared_ptr<Shape> shape, std::shared_ptr<Material> material, const Transform& objectToWorld):
-			shape(shape), material(material), objectToWorld(objectToWorld)
+			shape(shape), material(material), objectToWorld(objectToWorld), worldToObject(objectToWorld.matInv)
 		{}
 
+		// オブジェクト座標からワールド座標への変換
+		const Transform& transform() const { return objectToWorld; }
+
+		// 逆変換も合わせて更新する
+		// シーンに追加済みの場合は Scene::setObjectTransform を使うこと
+		void setTransform(const Transform& t) {
+			objectToWorld = t;
+			worldToObject = AffineTransform(t.matInv);
+		}
+
 		Bounds3f bound() const override {
 			return objectToWorld(shape->bound());
 		}
@@ -41,51 +50,84 @@ namespace xitils {
 			return shape->surfaceArea() * shape->surfaceAreaScaling(objectToWorld);
 		}
 
-		bool intersect(const Ray& ray, float* tHit, SurfaceIntersection* isect) const override {
-			if (shape->intersect(objectToWorld.inverse(ray), tHit, isect)) {
-				isect->p = objectToWorld(isect->p);
-				
-				isect->n = objectToWorld.asNormal(isect->n);
-				if (!isect->tangent.isZero()) {
-					isect->tangent = objectToWorld.asNormal(isect->tangent);
-				}
-				if (!isect->bitangent.isZero()) {
-					isect->bitangent = objectToWorld.asNormal(isect->bitangent);
-				}
-
-				isect->wo = objectToWorld.asNormal(isect->wo);
-
-				// �m�[�}���}�b�v���ݒ肳��Ă����ꍇ�����K�p
-				if (material->normalmap != nullptr) {
-					// shading.n �͕ω������邪�Atangnet �� bitangent �͕ω������Ȃ��̂Œ���
-
-					Vector3f n = material->normalmap->rgb(isect->texCoord) * 2 - Vector3f(1.0f);
-					isect->shading.n =
-						(     n.b * isect->shading.n
-							+ n.r * isect->shading.tangent
-							+ n.g * isect->shading.bitangent
-						).normalize();
-				}
-
-				isect->shading.n = objectToWorld.asNormal(isect->shading.n);
-				if (!isect->shading.tangent.isZero()) {
-					isect->shading.tangent = objectToWorld.asNormal(isect->shading.tangent);
-				}
-				if (!isect->shading.bitangent.isZero()) {
-					isect->shading.bitangent = objectToWorld.asNormal(isect->shading.bitangent);
-				}
-
-				// texCoord, tHit �͕ϊ����Ȃ��Ă悢
-
-				isect->object = this;
-
+		bool intersect(const Ray& ray, float* tHit, HitRecord* hit) const override {
+			if (shape->intersect(worldToObject(ray), tHit, hit)) {
+				hit->object = this;
 				return true;
 			}
 			return false;
 		}
 
+		void computeSurfaceIntersection(const Ray& ray, const HitRecord& hit, SurfaceIntersection* isect) const override {
+			shape->computeSurfaceIntersection(worldToObject(ray), hit, isect);
+
+			isect->p = objectToWorld(isect->p);
+			
+			isect->n = objectToWorld.asNormal(isect->n);
+			if (!isect->tangent.isZero()) {
+				isect->tangent = objectToWorld.asNormal(isect->tangent);
+			}
+			if (!isect->bitangent.isZero()) {
+				isect->bitangent = objectToWorld.asNormal(isect->bitangent);
+			}
+
+			isect->wo = objectToWorld.asNormal(isect->wo);
+
+			// �m�[�}���}�b�v���ݒ肳��Ă����ꍇ�����K�p
+			if (material->normalmap != nullptr) {
+				// shading.n �͕ω������邪�Atangnet �� bitangent �͕ω������Ȃ��̂Œ���
+
+				Vector3f n = material->normalmap->rgb(isect->texCoord) * 2 - Vector3f(1.0f);
+				isect->shading.n =
+					(     n.b * isect->shading.n
+						+ n.r * isect->shading.tangent
+						+ n.g * isect->shading.bitangent
+					).normalize();
+			}
+
+			isect->shading.n = objectToWorld.asNormal(isect->shading.n);
+			if (!isect->shading.tangent.isZero()) {
+				isect->shading.tangent = objectToWorld.asNormal(isect->shading.tangent);
+			}
+			if (!isect->shading.bitangent.isZero()) {
+				isect->shading.bitangent = objectToWorld.asNormal(isect->shading.bitangent);
+			}
+
+			// texCoord, tHit �͕ϊ����Ȃ��Ă悢
+
+			isect->object = this;
+		}
+
 		bool intersectAny(const Ray& ray) const override {
-			return shape->intersectAny(objectToWorld.inverse(ray));
+			return shape->intersectAny(worldToObject(ray));
+		}
+
+		bool intersectWithStatistics(const Ray& ray, float* tHit, HitRecord* hit, TraversalStatistics* stats) const override {
+			if (shape->intersectWithStatistics(worldToObject(ray), tHit, hit, stats)) {
+				hit->object = this;
+				return true;
+			}
+			return false;
+		}
+
+		bool intersectAnyWithStatistics(const Ray& ray, TraversalStatistics* stats) const override {
+			return shape->intersectAnyWithStatistics(worldToObject(ray), stats);
+		}
+
+		// パケットのレイは全てのレーンをまとめてオブジェクト座標に変換する
+		int intersectPacket(RayPacket& packet, int activeMask, HitRecord* hits) const override {
+			RayPacket localPacket = worldToObject(packet);
+			const int hitMask = shape->intersectPacket(localPacket, activeMask, hits);
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				if (!(hitMask & (1 << i))) { continue; }
+				packet.tMax[i] = localPacket.tMax[i];
+				hits[i].object = this;
+			}
+			return hitMask;
+		}
+
+		int intersectAnyPacket(const RayPacket& packet, int activeMask) const override {
+			return shape->intersectAnyPacket(worldToObject(packet), activeMask);
 		}
 
 		SampledSurface sampleSurface(Sampler& sampler, float* pdf) const {
@@ -93,22 +135,37 @@ namespace xitils {
 
 			*pdf /= shape->surfaceAreaScaling(objectToWorld);
 
+			return toWorld(sampled);
+		}
+
+		// Shape::sampleLightTriangle をワールド座標にしたもの
+		// 確率密度はワールド座標での三角形の面積の逆数になる
+		SampledSurface sampleLightTriangle(int i, Sampler& sampler) const {
+			return toWorld(shape->sampleLightTriangle(i, sampler));
+		}
+
+		float surfacePDF(const Vector3f& p, const Shape* shape, int triangleIndex) const {
+			Vector3f scaling = objectToWorld.getScaling();
+			return shape->surfacePDF(objectToWorld.inverse(p), triangleIndex) / shape->surfaceAreaScaling(objectToWorld);
+		}
+
+	private:
+		// 2 つが食い違わないように setTransform でのみ変更する
+		Transform objectToWorld;
+		// レイの変換に使う objectToWorld の逆変換
+		AffineTransform worldToObject;
+
+		SampledSurface toWorld(const Shape::SampledSurface& sampled) const {
 			SampledSurface res;
 			res.object = this;
 			res.shape = sampled.shape;
-			res.tri = sampled.tri;
+			res.triangleIndex = sampled.triangleIndex;
 			res.p = objectToWorld(sampled.p);
 			res.n = objectToWorld.asNormal(sampled.n);
 			res.shadingN = objectToWorld.asNormal(sampled.shadingN);
 
 			return res;
 		}
-
-		float surfacePDF(const Vector3f& p, const Shape* shape, const TriangleIndexed* tri) const {
-			Vector3f scaling = objectToWorld.getScaling();
-			return shape->surfacePDF(objectToWorld.inverse(p), tri) / shape->surfaceAreaScaling(objectToWorld);
-		}
-
 	};
 
 }
\ No newline at end of file
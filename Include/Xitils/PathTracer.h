@@ -6,6 +6,9 @@
 #include "Scene.h"
 #include "Utils.h"
 
+#include <atomic>
+#include <chrono>
+
 namespace xitils {
 
 	struct PathTracerEvalResult
@@ -15,9 +18,37 @@ namespace xitils {
 		Vector3f normal;
 	};
 
+	// 1 本のレイの評価にかかったコスト
+	struct RayCost
+	{
+		TraversalStatistics traversal;
+		float shadingTime = 0.0f; // 交差点の SurfaceIntersection の計算と f の実行にかかった時間 [us]
+	};
+
 	class PathTracer {
 	public:
 		virtual PathTracerEvalResult eval(const Scene& scene, Sampler& sampler, const Ray& ray) const = 0;
+
+		// rays の先頭 rayNum 本のレイをまとめて評価する
+		// 既定では eval を 1 本ずつ呼ぶ
+		virtual void evalPacket(const Scene& scene, Sampler& sampler, const RayPacket& rays, int rayNum, PathTracerEvalResult* results) const {
+			for (int i = 0; i < rayNum; ++i) {
+				results[i] = eval(scene, sampler, rays.ray(i));
+			}
+		}
+
+		// rays の rayNum 本のレイをまとめて評価する
+		// 既定では RayPacket::Size 本ずつ evalPacket に渡す
+		virtual void evalBatch(const Scene& scene, Sampler& sampler, const Ray* rays, int rayNum, PathTracerEvalResult* results) const {
+			for (int begin = 0; begin < rayNum; begin += RayPacket::Size) {
+				const int num = std::min((int)RayPacket::Size, rayNum - begin);
+				RayPacket packet;
+				for (int i = 0; i < num; ++i) {
+					packet.setRay(i, rays[begin + i]);
+				}
+				evalPacket(scene, sampler, packet, num, results + begin);
+			}
+		}
 	};
 
 	class DebugRayCaster : public PathTracer {
@@ -40,6 +71,41 @@ namespace xitils {
 			return res;
 		}
 
+		void evalPacket(const Scene& scene, Sampler& sampler, const RayPacket& rays, int rayNum, PathTracerEvalResult* results) const override {
+			RayPacket tmpRays(rays);
+			HitRecord hits[RayPacket::Size];
+			const int hitMask = scene.intersectPacket(tmpRays, (1 << rayNum) - 1, hits);
+
+			for (int i = 0; i < rayNum; ++i) {
+				results[i] = PathTracerEvalResult();
+				if (!(hitMask & (1 << i))) { continue; }
+
+				SurfaceIntersection isect;
+				scene.computeSurfaceIntersection(tmpRays.ray(i), hits[i], &isect);
+				results[i] = f(isect, sampler);
+			}
+		}
+
+		// eval と同じ結果を返し、トラバーサルで辿ったノード数、判定したプリミティブ数とシェーディングの時間を cost に記録する
+		// パケットでは数えられないので 1 本ずつ判定する
+		PathTracerEvalResult evalWithCost(const Scene& scene, Sampler& sampler, const Ray& ray, RayCost* cost) const {
+			*cost = RayCost();
+
+			PathTracerEvalResult res;
+			HitRecord hit;
+
+			Ray tmpRay(ray);
+			if (scene.intersectWithStatistics(tmpRay, &hit, &cost->traversal)) {
+				auto start = std::chrono::steady_clock::now();
+				SurfaceIntersection isect;
+				scene.computeSurfaceIntersection(tmpRay, hit, &isect);
+				res = f(isect, sampler);
+				cost->shadingTime = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count();
+			}
+
+			return res;
+		}
+
 	private:
 		std::function<PathTracerEvalResult(const SurfaceIntersection&, Sampler&)> f;
 	};
@@ -117,144 +183,610 @@ namespace xitils {
 		PathTracerEvalResult eval(const Scene& scene, Sampler& sampler, const Ray& ray) const override {
 
 			PathTracerEvalResult res;
-			Vector3f& radiance = res.color;
-			Vector3f& albedo = res.albedo;
-			Vector3f& normal = res.normal;
-
-			Vector3f weight(1.0f);
 
 			Ray currentRay = ray;
-			Ray shadowRay;
-			SurfaceIntersection isect;
-			SurfaceIntersection nextIsect;
+			PathState state;
 
-			int pathLength = 1;
-
-			if (!scene.intersect(currentRay, &isect)) {
+			if (!scene.intersect(currentRay, &state.isect)) {
 				if (scene.skySphere) {
-					radiance += weight * scene.skySphere->getRadiance(currentRay.d);
+					res.color += state.weight * scene.skySphere->getRadiance(currentRay.d);
 				}
-			}else{
-				albedo += isect.object->material->getAlbedo(isect);
-				normal += isect.n;
+				return res;
+			}
 
-				++pathLength;
+			addFirstHit(currentRay, state, &res);
+			tracePath(scene, sampler, state, &res);
 
-				if (isect.object->material->emissive) {
-					radiance += weight * isect.object->material->getEmission(-currentRay.d, isect.n, isect.shading.n);
-				}
-				
-				while (true) {
+			return res;
+		}
 
-					if (pathLength > russianRouletteLengthMin) {
-						if (sampler.randf() >= russianRouletteProb) {
-							break;
-						} else {
-							weight /= russianRouletteProb;
-						}
+		// カメラレイと最初の交差点からのシャドウレイは RayPacket でまとめて判定する
+		// それ以降はレイの向きが揃わないので、1 本ずつ eval と同じように辿る
+		void evalPacket(const Scene& scene, Sampler& sampler, const RayPacket& rays, int rayNum, PathTracerEvalResult* results) const override {
+			const int activeMask = (1 << rayNum) - 1;
+
+			RayPacket cameraRays(rays);
+			HitRecord hits[RayPacket::Size];
+			const int hitMask = scene.intersectPacket(cameraRays, activeMask, hits);
+
+			PathState states[RayPacket::Size];
+			Bounce bounces[RayPacket::Size];
+			RayPacket shadowRays;
+			int aliveMask = 0;
+			int shadowMask = 0;
+			for (int i = 0; i < rayNum; ++i) {
+				results[i] = PathTracerEvalResult();
+				const Ray cameraRay = cameraRays.ray(i);
+
+				if (!(hitMask & (1 << i))) {
+					if (scene.skySphere) {
+						results[i].color += states[i].weight * scene.skySphere->getRadiance(cameraRay.d);
 					}
+					continue;
+				}
 
-					//-------------------------------------
+				scene.computeSurfaceIntersection(cameraRay, hits[i], &states[i].isect);
+				addFirstHit(cameraRay, states[i], &results[i]);
 
-					bool nextSampled = true;
+				if (!beginBounce(scene, sampler, states[i], &bounces[i], &results[i])) { continue; }
+				aliveMask |= 1 << i;
+				if (bounces[i].lightSampled) {
+					shadowRays.setRay(i, bounces[i].shadowRay);
+					shadowMask |= 1 << i;
+				}
+			}
 
-					float pdf_bsdf_x_bsdf;
-					Vector3f material_eval;
-					material_eval = isect.object->material->evalAndSample(isect, sampler, &currentRay.d, &pdf_bsdf_x_bsdf);
+			const int visibleMask = shadowMask & ~scene.intersectAnyPacket(shadowRays, shadowMask);
 
-					if (!material_eval.isZero()) {
-						currentRay.o = isect.p + rayOriginOffset * currentRay.d;
-						currentRay.tMax = Infinity;
+			for (int i = 0; i < rayNum; ++i) {
+				if (!(aliveMask & (1 << i))) { continue; }
+				if (visibleMask & (1 << i)) {
+					addLightContribution(sampler, states[i], bounces[i], &results[i]);
+				}
+				if (endBounce(states[i], bounces[i])) {
+					tracePath(scene, sampler, states[i], &results[i]);
+				}
+			}
+		}
 
-						if (scene.intersect(currentRay, &nextIsect)) {
+	private:
+		float rayOriginOffset = 0.00001f;
+		int russianRouletteLengthMin = 5;
+		float russianRouletteProb = 0.9f;
+		float shadowRayMargin = 0.0001f;
 
-							if (nextIsect.object->material->emissive) {
-								float misWeight;
-								if (pdf_bsdf_x_bsdf >= 0.0f && scene.canSampleLight()) {
-									float pdf_light_x_bsdf = scene.surfacePDF(nextIsect.p, nextIsect.object, nextIsect.shape, nextIsect.tri);
-									float cosLight = fabsf(dot(currentRay.d, nextIsect.shading.n));
-									float distSq = powf(currentRay.tMax, 2.0f);
-									pdf_light_x_bsdf *= distSq / cosLight;
-									misWeight = powf(pdf_bsdf_x_bsdf, 2.0f) / (powf(pdf_bsdf_x_bsdf, 2.0f) + powf(pdf_light_x_bsdf, 2.0f));
-								} else {
-									misWeight = 1.0f;
-								}
+		struct PathState {
+			Vector3f weight = Vector3f(1.0f);
+			SurfaceIntersection isect;
+			int pathLength = 1;
+		};
 
-								if (misWeight > 0.0f) {
-									radiance += weight * misWeight
-										* material_eval
-										* nextIsect.object->material->getEmission(-currentRay.d, nextIsect.n, nextIsect.shading.n)
-										;
-								}
+		// 1 回の反射で BSDF と光源からサンプリングしたもの
+		struct Bounce {
+			bool nextSampled;
+			float pdf_bsdf_x_bsdf;
+			Vector3f material_eval;
+			SurfaceIntersection nextIsect;
 
-							}
+			// シャドウレイが遮蔽されていなければ addLightContribution を呼ぶ
+			bool lightSampled;
+			Ray shadowRay;
+			Object::SampledSurface sampledLightSurface;
+			float pdf_light_x_light;
+			float sampledLightSurfaceDist;
+		};
 
-						} else {
-							if (scene.skySphere) {
-								radiance += weight * material_eval * scene.skySphere->getRadiance(currentRay.d);
-							}
-							nextSampled = false;
-						}
-					}
+		void addFirstHit(const Ray& ray, PathState& state, PathTracerEvalResult* res) const {
+			const SurfaceIntersection& isect = state.isect;
+			res->albedo += isect.object->material->getAlbedo(isect);
+			res->normal += isect.n;
 
-					//-------------------------------------
-
-					if (scene.canSampleLight()) {
-						float pdf_light_x_light;
-						const auto& sampledLightSurface = scene.sampleSurface(sampler, &pdf_light_x_light);
-						float sampledLightSurfaceDist = (sampledLightSurface.p - isect.p).length();
-						shadowRay.d = (sampledLightSurface.p - isect.p) / sampledLightSurfaceDist;
-						shadowRay.o = isect.p + rayOriginOffset * shadowRay.d;
-						shadowRay.tMax = sampledLightSurfaceDist - shadowRayMargin;
-						if (dot(shadowRay.d, sampledLightSurface.n) < 0 && !scene.intersectAny(shadowRay)) {
-							float misWeight;
-							float pdf_bsdf_x_light;
-							float distSq = powf(sampledLightSurfaceDist, 2.0f);
-							if (pdf_bsdf_x_bsdf >= 0.0f) {
-								pdf_bsdf_x_light = isect.object->material->getPDF(isect, shadowRay.d);
-								float cosLight = fabsf(dot(-shadowRay.d, sampledLightSurface.shadingN));
-								pdf_bsdf_x_light *= cosLight / distSq;
-
-								misWeight = powf(pdf_light_x_light, 2.0f) / (powf(pdf_bsdf_x_light, 2.0f) + powf(pdf_light_x_light, 2.0f));
-							} else {
-								misWeight = 0.0f;
-							}
-
-							if (misWeight > 0.0f) {
-								float G = fabs(dot(-shadowRay.d, sampledLightSurface.shadingN)) / distSq; // bsdfCos にオブジェクト側のコサイン項は既に含まれている
-								radiance +=
-									weight * misWeight
-									* isect.object->material->bsdfCos(isect, sampler, shadowRay.d)
-									* sampledLightSurface.object->material->getEmission(-shadowRay.d, sampledLightSurface.n, sampledLightSurface.shadingN)
-									* G / pdf_light_x_light;
-							}
+			++state.pathLength;
 
+			if (isect.object->material->emissive) {
+				res->color += state.weight * isect.object->material->getEmission(-ray.d, isect.n, isect.shading.n);
+			}
+		}
+
+		void tracePath(const Scene& scene, Sampler& sampler, PathState& state, PathTracerEvalResult* res) const {
+			Bounce bounce;
+			while (beginBounce(scene, sampler, state, &bounce, res)) {
+				if (bounce.lightSampled && !scene.intersectAny(bounce.shadowRay)) {
+					addLightContribution(sampler, state, bounce, res);
+				}
+				if (!endBounce(state, bounce)) { break; }
+			}
+		}
+
+		// BSDF でサンプリングした方向の寄与を加え、光源上の点をサンプリングしてシャドウレイを作る
+		// ロシアンルーレットで打ち切られた場合は false を返す
+		bool beginBounce(const Scene& scene, Sampler& sampler, PathState& state, Bounce* bounce, PathTracerEvalResult* res) const {
+
+			if (state.pathLength > russianRouletteLengthMin) {
+				if (sampler.randf() >= russianRouletteProb) {
+					return false;
+				} else {
+					state.weight /= russianRouletteProb;
+				}
+			}
+
+			const SurfaceIntersection& isect = state.isect;
+			const Vector3f& weight = state.weight;
+			Vector3f& radiance = res->color;
+
+			//-------------------------------------
+
+			bounce->nextSampled = true;
+
+			Ray currentRay;
+			bounce->material_eval = isect.object->material->evalAndSample(isect, sampler, &currentRay.d, &bounce->pdf_bsdf_x_bsdf);
+			const Vector3f& material_eval = bounce->material_eval;
+			const float pdf_bsdf_x_bsdf = bounce->pdf_bsdf_x_bsdf;
+			SurfaceIntersection& nextIsect = bounce->nextIsect;
+
+			if (!material_eval.isZero()) {
+				currentRay.o = isect.p + rayOriginOffset * currentRay.d;
+				currentRay.tMax = Infinity;
+
+				if (scene.intersect(currentRay, &nextIsect)) {
+
+					if (nextIsect.object->material->emissive) {
+						float misWeight;
+						if (pdf_bsdf_x_bsdf >= 0.0f && scene.canSampleLight()) {
+							float pdf_light_x_bsdf = scene.lightPDF(isect.p, isect.shading.n, nextIsect.p, nextIsect.object, nextIsect.shape, nextIsect.triangleIndex);
+							float cosLight = fabsf(dot(currentRay.d, nextIsect.shading.n));
+							float distSq = powf(currentRay.tMax, 2.0f);
+							pdf_light_x_bsdf *= distSq / cosLight;
+							misWeight = powf(pdf_bsdf_x_bsdf, 2.0f) / (powf(pdf_bsdf_x_bsdf, 2.0f) + powf(pdf_light_x_bsdf, 2.0f));
+						} else {
+							misWeight = 1.0f;
 						}
-					}
 
-					//-------------------------------------
-					
-					if (!nextSampled) { break; }
+						if (misWeight > 0.0f) {
+							radiance += weight * misWeight
+								* material_eval
+								* nextIsect.object->material->getEmission(-currentRay.d, nextIsect.n, nextIsect.shading.n)
+								;
+						}
 
-					isect = nextIsect;
-					weight *= material_eval;
-					++pathLength;
+					}
 
-					if (weight.isZero()) {
-						break;
+				} else {
+					if (scene.skySphere) {
+						radiance += weight * material_eval * scene.skySphere->getRadiance(currentRay.d);
 					}
+					bounce->nextSampled = false;
 				}
+			}
+
+			//-------------------------------------
+
+			bounce->lightSampled = false;
+			if (scene.canSampleLight()) {
+				bounce->sampledLightSurface = scene.sampleLight(isect.p, isect.shading.n, sampler, &bounce->pdf_light_x_light);
+				if (bounce->pdf_light_x_light == 0.0f) { return true; }
+				const auto& sampledLightSurface = bounce->sampledLightSurface;
+				Ray& shadowRay = bounce->shadowRay;
+				bounce->sampledLightSurfaceDist = (sampledLightSurface.p - isect.p).length();
+				shadowRay.d = (sampledLightSurface.p - isect.p) / bounce->sampledLightSurfaceDist;
+				shadowRay.o = isect.p + rayOriginOffset * shadowRay.d;
+				shadowRay.tMax = bounce->sampledLightSurfaceDist - shadowRayMargin;
+				bounce->lightSampled = dot(shadowRay.d, sampledLightSurface.n) < 0;
+			}
+
+			return true;
+		}
 
+		// 遮蔽されていなかったシャドウレイの寄与を加える
+		void addLightContribution(Sampler& sampler, const PathState& state, const Bounce& bounce, PathTracerEvalResult* res) const {
+			const SurfaceIntersection& isect = state.isect;
+			const Ray& shadowRay = bounce.shadowRay;
+			const auto& sampledLightSurface = bounce.sampledLightSurface;
+			const float pdf_bsdf_x_bsdf = bounce.pdf_bsdf_x_bsdf;
+			const float pdf_light_x_light = bounce.pdf_light_x_light;
+
+			float misWeight;
+			float pdf_bsdf_x_light;
+			float distSq = powf(bounce.sampledLightSurfaceDist, 2.0f);
+			if (pdf_bsdf_x_bsdf >= 0.0f) {
+				pdf_bsdf_x_light = isect.object->material->getPDF(isect, shadowRay.d);
+				float cosLight = fabsf(dot(-shadowRay.d, sampledLightSurface.shadingN));
+				pdf_bsdf_x_light *= cosLight / distSq;
+
+				misWeight = powf(pdf_light_x_light, 2.0f) / (powf(pdf_bsdf_x_light, 2.0f) + powf(pdf_light_x_light, 2.0f));
+			} else {
+				misWeight = 0.0f;
 			}
 
+			if (misWeight > 0.0f) {
+				float G = fabs(dot(-shadowRay.d, sampledLightSurface.shadingN)) / distSq; // bsdfCos にオブジェクト側のコサイン項は既に含まれている
+				res->color +=
+					state.weight * misWeight
+					* isect.object->material->bsdfCos(isect, sampler, shadowRay.d)
+					* sampledLightSurface.object->material->getEmission(-shadowRay.d, sampledLightSurface.n, sampledLightSurface.shadingN)
+					* G / pdf_light_x_light;
+			}
+		}
+
+		// 次の交差点へ進む
+		// パスが続かない場合は false を返す
+		bool endBounce(PathState& state, const Bounce& bounce) const {
+			if (!bounce.nextSampled) { return false; }
+
+			state.isect = bounce.nextIsect;
+			state.weight *= bounce.material_eval;
+			++state.pathLength;
+
+			return !state.weight.isZero();
+		}
+	};
+
+	// 多数の経路の状態をキューに持ち、反射 1 回ごとに全ての経路を段階的にまとめて処理するパストレーサー
+	// 計算する値は StandardPathTracer と同じ (NEE と BRDF サンプリングの MIS)
+	// 交差判定、ロシアンルーレット、シェーディング、シャドウレイの判定をそれぞれ続いている全ての経路に対して行い、
+	// 終了した経路はその都度キューから取り除く
+	class WavefrontPathTracer : public PathTracer {
+	public:
+
+		// sortSecondaryRays が true なら、反射後のレイを sortRays で並べ替えてから交差判定する
+		// 近いレイが続けて辿られてメモリアクセスがまとまるが、並べ替え自体にも時間がかかるので、
+		// シーンが小さい場合や一度に評価するレイが少ない場合は遅くなることがある
+		WavefrontPathTracer(bool sortSecondaryRays = false) :
+			sortSecondaryRays(sortSecondaryRays)
+		{}
+
+		PathTracerEvalResult eval(const Scene& scene, Sampler& sampler, const Ray& ray) const override {
+			PathTracerEvalResult res;
+			evalBatch(scene, sampler, &ray, 1, &res);
 			return res;
 		}
 
+		void evalPacket(const Scene& scene, Sampler& sampler, const RayPacket& rays, int rayNum, PathTracerEvalResult* results) const override {
+			Ray tmpRays[RayPacket::Size];
+			for (int i = 0; i < rayNum; ++i) {
+				tmpRays[i] = rays.ray(i);
+			}
+			evalBatch(scene, sampler, tmpRays, rayNum, results);
+		}
+
+		// sortSecondaryRays が true の場合に、これまでの evalBatch で反射後のレイの並べ替えにかかった時間 (全スレッドの合計)
+		double sortMilliseconds() const {
+			return sortNanoseconds / 1e6;
+		}
+
+		void evalBatch(const Scene& scene, Sampler& sampler, const Ray* rays, int rayNum, PathTracerEvalResult* results) const override {
+			for (int i = 0; i < rayNum; ++i) {
+				results[i] = PathTracerEvalResult();
+			}
+
+			PathQueue paths(rays, rayNum);
+			ShadowQueue shadows;
+
+			extend(scene, paths, results, true);
+			while (!paths.active.empty()) {
+				russianRoulette(sampler, paths);
+				shade(scene, sampler, paths, &shadows);
+				traceShadows(scene, shadows, results);
+				if (sortSecondaryRays) {
+					auto start = std::chrono::steady_clock::now();
+					sortRays(paths.rays.data(), paths.active.data(), paths.active.size());
+					sortNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+				}
+				extend(scene, paths, results, false);
+			}
+		}
+
 	private:
 		float rayOriginOffset = 0.00001f;
 		int russianRouletteLengthMin = 5;
 		float russianRouletteProb = 0.9f;
 		float shadowRayMargin = 0.0001f;
+		bool sortSecondaryRays;
+		mutable std::atomic<uint64_t> sortNanoseconds = 0;
+
+		// 光源上でサンプリングした点と、そこへのシャドウレイ
+		struct LightSample {
+			int shadingIndex; // shade で処理しているマテリアルの経路のうち何番目のものか
+			Object::SampledSurface surface;
+			float pdf_light_x_light;
+			float dist;
+			Ray shadowRay;
+		};
+
+		// 経路の状態を要素ごとの配列で持つ
+		// 経路の番号は evalBatch に渡したレイの番号と同じで、結果は results の同じ番号に加える
+		struct PathQueue {
+			std::vector<Ray> rays;
+			std::vector<Vector3f> weights;
+			std::vector<int> pathLengths;
+			std::vector<float> pdf_bsdf_x_bsdf; // 直前の頂点で BSDF から rays の方向をサンプリングした確率密度
+			std::vector<Vector3f> prevPositions; // 直前の頂点の位置とシェーディング法線 (MIS で光源の選択確率を求めるのに使う)
+			std::vector<Vector3f> prevNormals;
+			std::vector<SurfaceIntersection> isects;
+
+			// 続いている経路の番号
+			std::vector<int> active;
+			std::vector<int> sorted;
+			std::vector<int> groups;
+
+			// shade で 1 つのマテリアルの経路をまとめて処理する際の作業領域
+			std::vector<const SurfaceIntersection*> shadingIsects;
+			std::vector<Vector3f> shadingWis;
+			std::vector<float> shadingPdfs;
+			std::vector<Vector3f> shadingEvals;
+			std::vector<LightSample> lightSamples;
+			std::vector<const SurfaceIntersection*> lightIsects;
+			std::vector<Vector3f> lightWis;
+			std::vector<Vector3f> lightBsdfCos;
+			std::vector<float> lightPdfs;
+
+			PathQueue(const Ray* initialRays, int rayNum) :
+				rays(initialRays, initialRays + rayNum),
+				weights(rayNum, Vector3f(1.0f)),
+				pathLengths(rayNum, 1),
+				pdf_bsdf_x_bsdf(rayNum, 0.0f),
+				prevPositions(rayNum),
+				prevNormals(rayNum),
+				isects(rayNum),
+				active(rayNum),
+				sorted(rayNum)
+			{
+				std::iota(active.begin(), active.end(), 0);
+			}
+		};
+
+		// シャドウレイと、遮蔽されていなかった場合に加える寄与
+		struct ShadowQueue {
+			std::vector<int> pathIndices;
+			std::vector<Ray> rays;
+			std::vector<Vector3f> contributions;
+
+			void clear() {
+				pathIndices.clear();
+				rays.clear();
+				contributions.clear();
+			}
+		};
+
+		// 続いている経路のレイの交差判定を行い、交差しなかった経路を終了させる
+		// カメラレイは隣接するピクセルのものが並んでいるので、RayPacket でまとめて判定する
+		void extend(const Scene& scene, PathQueue& paths, PathTracerEvalResult* results, bool cameraRay) const {
+			const int activeNum = paths.active.size();
+			int writeNum = 0;
+			for (int begin = 0; begin < activeNum; begin += RayPacket::Size) {
+				const int num = std::min((int)RayPacket::Size, activeNum - begin);
+				int indices[RayPacket::Size];
+				for (int k = 0; k < num; ++k) {
+					indices[k] = paths.active[begin + k];
+				}
+
+				HitRecord hits[RayPacket::Size];
+				int hitMask = 0;
+				if (cameraRay) {
+					RayPacket packet;
+					for (int k = 0; k < num; ++k) {
+						packet.setRay(k, paths.rays[indices[k]]);
+					}
+					hitMask = scene.intersectPacket(packet, (1 << num) - 1, hits);
+					for (int k = 0; k < num; ++k) {
+						paths.rays[indices[k]].tMax = packet.tMax[k];
+					}
+				} else {
+					for (int k = 0; k < num; ++k) {
+						if (scene.intersect(paths.rays[indices[k]], &hits[k])) {
+							hitMask |= 1 << k;
+						}
+					}
+				}
+
+				for (int k = 0; k < num; ++k) {
+					const int i = indices[k];
+					const Ray& ray = paths.rays[i];
+					if (!(hitMask & (1 << k))) {
+						if (scene.skySphere) {
+							results[i].color += paths.weights[i] * scene.skySphere->getRadiance(ray.d);
+						}
+						continue;
+					}
+
+					SurfaceIntersection& isect = paths.isects[i];
+					scene.computeSurfaceIntersection(ray, hits[k], &isect);
+					if (cameraRay) {
+						results[i].albedo += isect.object->material->getAlbedo(isect);
+						results[i].normal += isect.n;
+					}
+					if (isect.object->material->emissive) {
+						results[i].color += paths.weights[i] * emissionMISWeight(scene, ray, isect, paths.prevPositions[i], paths.prevNormals[i], paths.pdf_bsdf_x_bsdf[i], cameraRay)
+							* isect.object->material->getEmission(-ray.d, isect.n, isect.shading.n);
+					}
+
+					++paths.pathLengths[i];
+					paths.active[writeNum++] = i;
+				}
+			}
+			paths.active.resize(writeNum);
+		}
+
+		// BSDF でサンプリングした方向で光源に当たった場合の MIS の重み
+		// prevP, prevN は BSDF でサンプリングした直前の頂点の位置と法線
+		float emissionMISWeight(const Scene& scene, const Ray& ray, const SurfaceIntersection& isect, const Vector3f& prevP, const Vector3f& prevN, float pdf_bsdf_x_bsdf, bool cameraRay) const {
+			if (cameraRay || pdf_bsdf_x_bsdf < 0.0f || !scene.canSampleLight()) { return 1.0f; }
+
+			float pdf_light_x_bsdf = scene.lightPDF(prevP, prevN, isect.p, isect.object, isect.shape, isect.triangleIndex);
+			float cosLight = fabsf(dot(ray.d, isect.shading.n));
+			float distSq = powf(ray.tMax, 2.0f);
+			pdf_light_x_bsdf *= distSq / cosLight;
+			return powf(pdf_bsdf_x_bsdf, 2.0f) / (powf(pdf_bsdf_x_bsdf, 2.0f) + powf(pdf_light_x_bsdf, 2.0f));
+		}
+
+		void russianRoulette(Sampler& sampler, PathQueue& paths) const {
+			int writeNum = 0;
+			for (int k = 0; k < (int)paths.active.size(); ++k) {
+				const int i = paths.active[k];
+				if (paths.pathLengths[i] > russianRouletteLengthMin) {
+					if (sampler.randf() >= russianRouletteProb) { continue; }
+					paths.weights[i] /= russianRouletteProb;
+				}
+				paths.active[writeNum++] = i;
+			}
+			paths.active.resize(writeNum);
+		}
+
+		// 同じマテリアルの経路が続けて並ぶように、キューを安定に並べ替える
+		// マテリアルはキュー内で最初に現れた順に並べるので、結果はアドレスによらない
+		// g 番目のマテリアルの経路はキューの [groupOffsets[g], groupOffsets[g + 1]) の範囲に入る
+		void sortByMaterial(PathQueue& paths, std::vector<int>* groupOffsets) const {
+			const int activeNum = paths.active.size();
+			std::unordered_map<const Material*, int> groupIndices;
+			std::vector<int>& groups = paths.groups;
+			groups.resize(activeNum);
+			groupOffsets->clear();
+			for (int k = 0; k < activeNum; ++k) {
+				const Material* material = paths.isects[paths.active[k]].object->material.get();
+				auto it = groupIndices.emplace(material, (int)groupOffsets->size()).first;
+				if (it->second == (int)groupOffsets->size()) { groupOffsets->push_back(0); }
+				groups[k] = it->second;
+				++(*groupOffsets)[it->second];
+			}
+
+			int offset = 0;
+			for (auto& groupOffset : *groupOffsets) {
+				const int num = groupOffset;
+				groupOffset = offset;
+				offset += num;
+			}
+			groupOffsets->push_back(activeNum);
+			if (groupOffsets->size() <= 2) { return; }
+
+			std::vector<int> writeOffsets(groupOffsets->begin(), groupOffsets->end() - 1);
+			for (int k = 0; k < activeNum; ++k) {
+				paths.sorted[writeOffsets[groups[k]]++] = paths.active[k];
+			}
+			std::copy(paths.sorted.begin(), paths.sorted.begin() + activeNum, paths.active.begin());
+		}
+
+		// マテリアルごとにまとめて、BSDF による次の方向のサンプリングと光源上の点のサンプリングを行う
+		// BSDF の計算は Material の *Batch 関数でマテリアルごとにまとめて行う
+		// 光源からの寄与はシャドウレイとともに shadows に積んでおき、遮蔽の判定は traceShadows でまとめて行う
+		void shade(const Scene& scene, Sampler& sampler, PathQueue& paths, ShadowQueue* shadows) const {
+			std::vector<int> groupOffsets;
+			sortByMaterial(paths, &groupOffsets);
+			shadows->clear();
+
+			const int activeNum = paths.active.size();
+			paths.shadingIsects.resize(activeNum);
+			paths.shadingWis.resize(activeNum);
+			paths.shadingPdfs.resize(activeNum);
+			paths.shadingEvals.resize(activeNum);
+
+			int writeNum = 0;
+			for (int g = 0; g + 1 < (int)groupOffsets.size(); ++g) {
+				const int begin = groupOffsets[g];
+				const int num = groupOffsets[g + 1] - begin;
+				const int* indices = &paths.active[begin];
+				const Material* material = paths.isects[indices[0]].object->material.get();
+
+				for (int k = 0; k < num; ++k) {
+					paths.shadingIsects[k] = &paths.isects[indices[k]];
+				}
+				material->evalAndSampleBatch(paths.shadingIsects.data(), num, sampler, paths.shadingWis.data(), paths.shadingPdfs.data(), paths.shadingEvals.data());
+
+				if (scene.canSampleLight()) {
+					sampleLights(scene, sampler, paths, material, indices, num, shadows);
+				}
+
+				for (int k = 0; k < num; ++k) {
+					const int i = indices[k];
+					const Vector3f& material_eval = paths.shadingEvals[k];
+					if (material_eval.isZero()) { continue; }
+					paths.weights[i] *= material_eval;
+					if (paths.weights[i].isZero()) { continue; }
+
+					const Vector3f& wi = paths.shadingWis[k];
+					paths.rays[i] = Ray(paths.isects[i].p + rayOriginOffset * wi, wi);
+					paths.pdf_bsdf_x_bsdf[i] = paths.shadingPdfs[k];
+					paths.prevPositions[i] = paths.isects[i].p;
+					paths.prevNormals[i] = paths.isects[i].shading.n;
+					paths.active[writeNum++] = i;
+				}
+			}
+			paths.active.resize(writeNum);
+		}
+
+		// 同じマテリアルの経路について光源上の点をサンプリングする
+		// MIS に必要な BSDF の値は、遮蔽されうるものも含めて material でまとめて求める
+		void sampleLights(const Scene& scene, Sampler& sampler, PathQueue& paths, const Material* material, const int* indices, int num, ShadowQueue* shadows) const {
+			std::vector<LightSample>& lightSamples = paths.lightSamples;
+			lightSamples.clear();
+			for (int k = 0; k < num; ++k) {
+				const SurfaceIntersection& isect = paths.isects[indices[k]];
+
+				LightSample sample;
+				sample.shadingIndex = k;
+				sample.surface = scene.sampleLight(isect.p, isect.shading.n, sampler, &sample.pdf_light_x_light);
+				if (sample.pdf_light_x_light == 0.0f) { continue; }
+				sample.dist = (sample.surface.p - isect.p).length();
+				sample.shadowRay.d = (sample.surface.p - isect.p) / sample.dist;
+				sample.shadowRay.o = isect.p + rayOriginOffset * sample.shadowRay.d;
+				sample.shadowRay.tMax = sample.dist - shadowRayMargin;
+				if (dot(sample.shadowRay.d, sample.surface.n) >= 0) { continue; }
+
+				// スペキュラの場合は MIS の重みが 0 になる
+				if (paths.shadingPdfs[k] < 0.0f) { continue; }
+
+				lightSamples.push_back(sample);
+			}
+
+			const int lightNum = lightSamples.size();
+			if (lightNum == 0) { return; }
+
+			std::vector<const SurfaceIntersection*>& isects = paths.lightIsects;
+			std::vector<Vector3f>& wis = paths.lightWis;
+			isects.resize(lightNum);
+			wis.resize(lightNum);
+			paths.lightBsdfCos.resize(lightNum);
+			paths.lightPdfs.resize(lightNum);
+			for (int j = 0; j < lightNum; ++j) {
+				isects[j] = paths.shadingIsects[lightSamples[j].shadingIndex];
+				wis[j] = lightSamples[j].shadowRay.d;
+			}
+			material->bsdfCosAndPDFBatch(isects.data(), wis.data(), lightNum, sampler, paths.lightBsdfCos.data(), paths.lightPdfs.data());
+
+			for (int j = 0; j < lightNum; ++j) {
+				const LightSample& sample = lightSamples[j];
+				const int i = indices[sample.shadingIndex];
+				const Ray& shadowRay = sample.shadowRay;
+				const auto& sampledLightSurface = sample.surface;
+				const float pdf_light_x_light = sample.pdf_light_x_light;
+
+				float distSq = powf(sample.dist, 2.0f);
+				float pdf_bsdf_x_light = paths.lightPdfs[j];
+				float cosLight = fabsf(dot(-shadowRay.d, sampledLightSurface.shadingN));
+				pdf_bsdf_x_light *= cosLight / distSq;
+				float misWeight = powf(pdf_light_x_light, 2.0f) / (powf(pdf_bsdf_x_light, 2.0f) + powf(pdf_light_x_light, 2.0f));
+				if (misWeight <= 0.0f) { continue; }
+
+				float G = fabs(dot(-shadowRay.d, sampledLightSurface.shadingN)) / distSq; // bsdfCos にオブジェクト側のコサイン項は既に含まれている
+				const Vector3f contribution =
+					paths.weights[i] * misWeight
+					* paths.lightBsdfCos[j]
+					* sampledLightSurface.object->material->getEmission(-shadowRay.d, sampledLightSurface.n, sampledLightSurface.shadingN)
+					* G / pdf_light_x_light;
+				if (contribution.isZero()) { continue; }
+
+				shadows->pathIndices.push_back(i);
+				shadows->rays.push_back(shadowRay);
+				shadows->contributions.push_back(contribution);
+			}
+		}
+
+		void traceShadows(const Scene& scene, const ShadowQueue& shadows, PathTracerEvalResult* results) const {
+			for (int k = 0; k < (int)shadows.rays.size(); ++k) {
+				if (!scene.intersectAny(shadows.rays[k])) {
+					results[shadows.pathIndices[k]].color += shadows.contributions[k];
+				}
+			}
+		}
 	};
 
 	// シングルスキャッタリングのみ表示
@@ -32,4 +32,75 @@ namespace xitils {
 
 	};
 
+	// まとめて交差判定を行う RayPacket::Size 本のレイ
+	// 各成分を SoA で持ち、判定の対象にするレイはビットマスクで指定する
+	class RayPacket {
+	public:
+		static const int Size = 8;
+
+		float o[3][Size];
+		float d[3][Size];
+		float tMax[Size];
+
+		RayPacket() {
+			memset(o, 0, sizeof(o));
+			memset(d, 0, sizeof(d));
+			memset(tMax, 0, sizeof(tMax));
+		}
+
+		Ray ray(int i) const {
+			return Ray(Vector3f(o[0][i], o[1][i], o[2][i]), Vector3f(d[0][i], d[1][i], d[2][i]), tMax[i]);
+		}
+
+		void setRay(int i, const Ray& ray) {
+			for (int k = 0; k < 3; ++k) {
+				o[k][i] = ray.o[k];
+				d[k][i] = ray.d[k];
+			}
+			tMax[i] = ray.tMax;
+		}
+	};
+
+	// indices が指す num 本のレイを、向きの象限と原点のモートン符号の順に並べ替える
+	// 向きと原点の近いレイが続けて並ぶので、続けて交差判定すると同じノードや三角形を辿りやすくなる
+	// 原点の位置はこれらのレイの原点を含む AABB の中で量子化する
+	inline void sortRays(const Ray* rays, int* indices, int num) {
+		if (num <= 1) { return; }
+
+		Vector3f originMin(Infinity), originMax(-Infinity);
+		for (int k = 0; k < num; ++k) {
+			const Vector3f& o = rays[indices[k]].o;
+			for (int axis = 0; axis < 3; ++axis) {
+				originMin[axis] = std::min(originMin[axis], o[axis]);
+				originMax[axis] = std::max(originMax[axis], o[axis]);
+			}
+		}
+		float scale[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			const float extent = originMax[axis] - originMin[axis];
+			scale[axis] = extent > 0.0f ? 1023.0f / extent : 0.0f;
+		}
+
+		// 上位 3 ビットが象限、下位 30 ビットがモートン符号
+		// 同じ値のものは元の順を保つように、indices 中の位置 k と組にして並べる
+		std::vector<std::pair<uint64_t, int>> keys(num);
+		for (int k = 0; k < num; ++k) {
+			const Ray& ray = rays[indices[k]];
+			uint32_t octant = 0;
+			uint32_t q[3];
+			for (int axis = 0; axis < 3; ++axis) {
+				if (ray.d[axis] < 0) { octant |= 1 << axis; }
+				q[axis] = (uint32_t)clamp((ray.o[axis] - originMin[axis]) * scale[axis], 0.0f, 1023.0f);
+			}
+			keys[k] = std::make_pair(((uint64_t)octant << 30) | encodeMorton3(q[0], q[1], q[2]), k);
+		}
+		std::sort(keys.begin(), keys.end());
+
+		std::vector<int> sorted(num);
+		for (int k = 0; k < num; ++k) {
+			sorted[k] = indices[keys[k].second];
+		}
+		std::copy(sorted.begin(), sorted.end(), indices);
+	}
+
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 ﻿#pragma once
 
+#include "Ray.h"
 #include "Utils.h"
 #include "Vector.h"
 
@@ -26,11 +27,28 @@ namespace xitils {
 			return data[p.x + p.y * width];
 		}
 
+		const T& operator[](const Vector2i& p) const {
+			return data[p.x + p.y * width];
+		}
+
 		void clear() {
 			memset(data.data(), 0, width * height * sizeof(T));
 		}
 
 		void render(const Scene& scene, int sampleNum, std::function<void(const Vector2f&, Sampler&, T&)> f);
+
+		// 隣接する PacketWidth x PacketHeight のピクセルをまとめて f に渡す
+		// f にはフィルム上の位置と書き込み先のピクセルが num 個ずつ渡される (画像の端では num が RayPacket::Size より小さくなる)
+		static const int PacketWidth = 4;
+		static const int PacketHeight = 2;
+		void renderPacket(const Scene& scene, int sampleNum, std::function<void(const Vector2f*, int num, Sampler&, T**)> f);
+
+		// タイル内の全てのピクセルを複数サンプル分まとめて f に渡す
+		// 同じピクセルがサンプル数だけ繰り返し渡される
+		// 一度に渡す数がおおよそ MaxBatchSize 以下になるように、サンプルを分けて f を呼ぶ
+		static const int MaxBatchSize = 4096;
+		void renderBatch(const Scene& scene, int sampleNum, std::function<void(const Vector2f*, int num, Sampler&, T**)> f);
+
 		void map(std::function<void(T&)> f) {
 #pragma omp parallel for schedule(dynamic, 1)
 			for (int y = 0; y < height; ++y) {
@@ -126,6 +144,73 @@ namespace xitils {
 		}
 	}
 
+	template<typename T>
+	void RenderTarget<T>::renderPacket(const Scene& scene, int sampleNum, std::function<void(const Vector2f*, int num, Sampler&, T**)> f) {
+		static_assert(PacketWidth * PacketHeight == RayPacket::Size, "packet size must match RayPacket::Size");
+		static_assert(RenderTargetTile<T>::Width % PacketWidth == 0 && RenderTargetTile<T>::Height % PacketHeight == 0, "tile size must be a multiple of packet size");
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int i = 0; i < tiles->size(); ++i) {
+			auto& tile = (*tiles)[i];
+			for (int s = 0; s < sampleNum; ++s) {
+				for (int py = 0; py < RenderTargetTile<T>::Height; py += PacketHeight) {
+					for (int px = 0; px < RenderTargetTile<T>::Width; px += PacketWidth) {
+
+						Vector2f pFilms[RayPacket::Size];
+						T* pixels[RayPacket::Size];
+						int num = 0;
+						for (int ly = py; ly < py + PacketHeight; ++ly) {
+							if (tile.offset.y + ly >= height) { continue; }
+							for (int lx = px; lx < px + PacketWidth; ++lx) {
+								if (tile.offset.x + lx >= width) { continue; }
+
+								Vector2i localPos = Vector2i(lx, ly);
+								pFilms[num] = tile.GenerateFilmPosition(localPos, true);
+								pixels[num] = &(*this)[tile.ImagePosition(localPos)];
+								++num;
+							}
+						}
+
+						if (num > 0) {
+							f(pFilms, num, *tile.sampler, pixels);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	template<typename T>
+	void RenderTarget<T>::renderBatch(const Scene& scene, int sampleNum, std::function<void(const Vector2f*, int num, Sampler&, T**)> f) {
+		const int batchSampleNum = std::max(1, MaxBatchSize / (RenderTargetTile<T>::Width * RenderTargetTile<T>::Height));
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int i = 0; i < tiles->size(); ++i) {
+			auto& tile = (*tiles)[i];
+			std::vector<Vector2f> pFilms;
+			std::vector<T*> pixels;
+			for (int sBegin = 0; sBegin < sampleNum; sBegin += batchSampleNum) {
+				pFilms.clear();
+				pixels.clear();
+				const int sEnd = std::min(sampleNum, sBegin + batchSampleNum);
+				for (int s = sBegin; s < sEnd; ++s) {
+					for (int ly = 0; ly < RenderTargetTile<T>::Height; ++ly) {
+						if (tile.offset.y + ly >= height) { continue; }
+						for (int lx = 0; lx < RenderTargetTile<T>::Width; ++lx) {
+							if (tile.offset.x + lx >= width) { continue; }
+
+							Vector2i localPos = Vector2i(lx, ly);
+							pFilms.push_back(tile.GenerateFilmPosition(localPos, true));
+							pixels.push_back(&(*this)[tile.ImagePosition(localPos)]);
+						}
+					}
+				}
+
+				if (!pFilms.empty()) {
+					f(pFilms.data(), pFilms.size(), *tile.sampler, pixels.data());
+				}
+			}
+		}
+	}
+
 	using SimpleRenderTarget = RenderTarget<Vector3f>;
 
 	struct DenoisableRenderTargetPixel
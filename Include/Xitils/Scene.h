@@ -1,11 +1,17 @@
 ﻿#pragma once
 
 #include "AccelerationStructure.h"
+#include "BVHCache.h"
 #include "Camera.h"
+#include "LightBVH.h"
 #include "Shape.h"
 #include "SkySphere.h"
 #include "Utils.h"
 
+#ifdef XITILS_USE_EMBREE
+#include "EmbreeAccelerationStructure.h"
+#endif
+
 namespace xitils {
 
 	class Scene {
@@ -14,6 +20,13 @@ namespace xitils {
 		std::shared_ptr<Camera> camera;
 		std::shared_ptr<SkySphere> skySphere;
 
+		// 設定されていれば、Shape の AccelerationStructure をこのキャッシュから読み込む (なければ構築して保存する)
+		std::shared_ptr<BVHCache> accelerationStructureCache;
+
+		// Object を束ねる上位の AccelerationStructure の構築パラメータ
+		// Object を毎フレーム動かして updateAccelerationStructure(true) で作り直す場合は、linear を true にすると構築が速くなる
+		BVHBuildSettings topLevelBuildSettings;
+
 		void addObject(std::shared_ptr<Object> object) {
 			objects.push_back(object);
 			if (object->material->emissive) {
@@ -21,43 +34,141 @@ namespace xitils {
 			}
 		}
 
+		// プリミティブ数がこれ以上の Shape は、Shape の中の構築の並列化に任せて 1 つずつ構築する
+		static const int ParallelShapeBuildPrimitiveNum = 16 * 1024;
+
 		void buildAccelerationStructure() {
-			std::vector<Object*> tmp;
-			map<std::shared_ptr<Object>, Object*>(objects, &tmp, [](const std::shared_ptr<Object>& obj) { return obj.get(); });
-			accel = std::make_shared<AccelerationStructure>(tmp);
+			// 複数の Object から共有されている Shape もあるので、重複を除いてから構築する
+			// 大きな Shape は 1 つずつ構築して、Shape の中の構築を全てのスレッドで並列に行う
+			// (入れ子の並列化が無効な環境 (MSVC の /openmp など) では、並列ループの中から構築すると 1 スレッドになるため)
+			// 小さな Shape は Shape ごとに並列に構築する
+			std::vector<Shape*> largeShapes;
+			std::vector<Shape*> smallShapes;
+			std::unordered_set<Shape*> shapeSet;
+			for (const auto& obj : objects) {
+#ifdef XITILS_USE_EMBREE
+				// Embree に三角形を渡す TriangleMesh は自身の BVH を使わない
+				if (_EmbreeAccelerationStructure::usesEmbreeTriangles(obj->shape.get())) { continue; }
+#endif
+				if (shapeSet.insert(obj->shape.get()).second) {
+					(obj->shape->accelerationStructurePrimitiveNum() >= ParallelShapeBuildPrimitiveNum ? largeShapes : smallShapes).push_back(obj->shape.get());
+				}
+			}
+			for (Shape* shape : largeShapes) {
+				shape->buildAccelerationStructure(accelerationStructureCache.get());
+			}
+#pragma omp parallel for schedule(dynamic, 1)
+			for (int i = 0; i < (int)smallShapes.size(); ++i) {
+				smallShapes[i]->buildAccelerationStructure(accelerationStructureCache.get());
+			}
+
+			// Embree を使う場合も三角形のシーンを含めて作り直す
+			accel.reset();
+			buildTopLevelAccelerationStructure();
+			lightBVH = LightBVH(lights);
+		}
+
+		// Object の配置だけを変更する
+		// Shape の AccelerationStructure はそのまま使い回され、updateAccelerationStructure を呼ぶまでは交差判定に反映されない
+		void setObjectTransform(const std::shared_ptr<Object>& object, const Transform& objectToWorld) {
+			object->setTransform(objectToWorld);
+		}
+
+		// setObjectTransform や TriangleMesh::updatePositions の後に呼ぶ
+		// rebuild が false なら Object を束ねる上位の AccelerationStructure の AABB を更新するだけにする
+		// 大きく動いた Object がある場合は rebuild を true にした方がトラバーサルが速くなる
+		void updateAccelerationStructure(bool rebuild = false) {
+			ASSERT(accel);
+			if (rebuild) {
+				buildTopLevelAccelerationStructure();
+			} else {
+				accel->refit();
+			}
+			// 光源の位置や面積が変わるので光源の選択に使うものも作り直す
+			lightBVH = LightBVH(lights);
 		}
 
 		bool intersect(Ray& ray, SurfaceIntersection* isect) const {
-			return accel->intersect(ray, isect);
+			HitRecord hit;
+			if (!accel->intersect(ray, &hit)) { return false; }
+			computeSurfaceIntersection(ray, hit, isect);
+			return true;
+		}
+
+		// 交差判定のみを行う
+		// SurfaceIntersection が必要になった時点で computeSurfaceIntersection を呼ぶ
+		bool intersect(Ray& ray, HitRecord* hit) const {
+			return accel->intersect(ray, hit);
+		}
+
+		void computeSurfaceIntersection(const Ray& ray, const HitRecord& hit, SurfaceIntersection* isect) const {
+			hit.object->computeSurfaceIntersection(ray, hit, isect);
 		}
 
 		bool intersectAny(const Ray& ray) const {
 			return accel->intersectAny(ray);
 		}
 
-		bool canSampleLight() const { return !lights.empty(); }
+		// intersect, intersectAny と同じ判定を行い、辿ったノード数と判定したプリミティブ数を stats に加える
+		// Object を束ねる上位の階層と、各 Shape の内部の階層の両方を数える
+		bool intersectWithStatistics(Ray& ray, HitRecord* hit, TraversalStatistics* stats) const {
+			return accel->intersectWithStatistics(ray, hit, stats);
+		}
 
-		Object::SampledSurface sampleSurface(Sampler& sampler, float* pdf) const {
-			// TODO: すべての Object から等確率でサンプリングしているが、
-			//       本当は面積に比例した確率で選ぶべき
-			auto& light = sampler.select(lights);
-			auto res = light->sampleSurface(sampler, pdf);
-			*pdf /= lights.size();
-			return res;
+		bool intersectAnyWithStatistics(const Ray& ray, TraversalStatistics* stats) const {
+			return accel->intersectAnyWithStatistics(ray, stats);
 		}
 
-		float surfacePDF(const Vector3f& p, const Object* object, const Shape* shape, const TriangleIndexed* tri) const {
-			// TODO: 上記を直したらこちらも直す
+		// Object を束ねる上位の AccelerationStructure の統計
+		// TriangleMesh の BVH の統計は TriangleMesh::accelerationStructureStatistics で得る
+		AccelerationStructureStatistics accelerationStructureStatistics() const {
+			return accel->statistics();
+		}
 
-			if (lights.empty()) { return 0.0f; }
+		// packet のうち activeMask のビットが立っているレイについてまとめて交差判定を行い、交差したレイのビットを立てたマスクを返す
+		int intersectPacket(RayPacket& packet, int activeMask, HitRecord* hits) const {
+			return accel->intersectPacket(packet, activeMask, hits);
+		}
 
-			return object->surfacePDF(p, shape, tri) / lights.size();
+		// 遮蔽されたレイのビットを立てたマスクを返す
+		int intersectAnyPacket(const RayPacket& packet, int activeMask) const {
+			return accel->intersectAnyPacket(packet, activeMask);
 		}
 
+		bool canSampleLight() const { return !lights.empty(); }
+
+		// シェーディング点 p (法線 n) への寄与の見積もりに比例した確率で、LightBVH を辿って光源上の点をサンプリングする
+		// 光源は三角形ごとに選ぶので、光源の三角形が多い場合や光源が多い場合も分散が小さい
+		// どの光源も寄与しえない場合は pdf が 0 になる
+		Object::SampledSurface sampleLight(const Vector3f& p, const Vector3f& n, Sampler& sampler, float* pdf) const {
+			return lightBVH.sample(p, n, sampler, pdf);
+		}
+
+		// sampleLight で p (法線 n) から光源 object 上の点 lightP を選ぶ確率密度
+		float lightPDF(const Vector3f& p, const Vector3f& n, const Vector3f& lightP, const Object* object, const Shape* shape, int triangleIndex) const {
+			return lightBVH.pdf(p, n, lightP, object, shape, triangleIndex);
+		}
+
+		const LightBVH& lightHierarchy() const { return lightBVH; }
+
 	private:
+		// Object を束ねる上位の AccelerationStructure
+		// 各 Object の Shape が持つ下位の AccelerationStructure は Object 間で共有される
 		std::shared_ptr<AccelerationStructure> accel;
 		std::vector<std::shared_ptr<Object>> objects;
 		std::vector<std::shared_ptr<Object>> lights;
+		LightBVH lightBVH;
+
+		void buildTopLevelAccelerationStructure() {
+			std::vector<Object*> tmp;
+			map<std::shared_ptr<Object>, Object*>(objects, &tmp, [](const std::shared_ptr<Object>& obj) { return obj.get(); });
+#ifdef XITILS_USE_EMBREE
+			// 作り直す場合は Embree のデバイスと TriangleMesh ごとのシーンを前のものから引き継ぐ
+			accel = std::make_shared<AccelerationStructure>(tmp, topLevelBuildSettings, accel ? accel->embreeMeshScenes() : nullptr);
+#else
+			accel = std::make_shared<AccelerationStructure>(tmp, topLevelBuildSettings);
+#endif
+		}
 	};
 
 }
\ No newline at end of file
@@ -10,12 +10,14 @@
 
 namespace xitils {
 
+	class BVHCache;
+
 	class Shape : public Geometry {
 	public:
 
 		struct SampledSurface {
 			const Shape* shape;
-			const TriangleIndexed* tri;
+			int triangleIndex;
 			Vector3f p;
 			Vector3f n;
 			Vector3f shadingN;
@@ -24,7 +26,30 @@ namespace xitils {
 		virtual float surfaceAreaScaling(const Transform& t) const = 0;
 
 		virtual SampledSurface sampleSurface(Sampler& sampler, float* pdf) const = 0;
-		virtual float surfacePDF(const Vector3f& p, const TriangleIndexed* tri) const = 0;
+		virtual float surfacePDF(const Vector3f& p, int triangleIndex) const = 0;
+
+		// LightBVH で光源を三角形ごとに分けて選ぶためのもの
+		// 0 を返す Shape は全体を 1 つの光源として sampleSurface でサンプリングする
+		// 三角形の番号は交差判定の triangleIndex と同じものにすること
+		virtual int lightTriangleNum() const { return 0; }
+
+		virtual void lightTriangle(int i, Vector3f* p0, Vector3f* p1, Vector3f* p2) const {
+			NOT_IMPLEMENTED;
+		}
+
+		// i 番目の三角形上で一様にサンプリングする (確率密度は三角形の面積の逆数)
+		virtual SampledSurface sampleLightTriangle(int i, Sampler& sampler) const {
+			NOT_IMPLEMENTED;
+			return SampledSurface();
+		}
+
+		// 内部に交差判定の高速化構造を持つ形状はここで構築する
+		// Scene::buildAccelerationStructure から、小さな Shape は異なる Shape に対して並列に、大きな Shape は 1 つずつ呼ばれる
+		// cache が指定されていれば、同じ内容で構築済みのものがあればそれを読み込み、なければ構築してから保存する
+		virtual void buildAccelerationStructure(const BVHCache* cache = nullptr) {}
+
+		// buildAccelerationStructure で構築するもののプリミティブ数 (Scene が構築の並列化の仕方を選ぶのに使う)
+		virtual int accelerationStructurePrimitiveNum() const { return 0; }
 	};
 
 	class Sphere : public Shape {
@@ -44,36 +69,39 @@ namespace xitils {
 			return 4 * M_PI;
 		}
 
+		// 拡大縮小が一様でない場合 (楕円体) は Knud Thomsen の近似式による
 		float surfaceAreaScaling(const Transform& t) const {
-			// TODO
-			NOT_IMPLEMENTED;
-
-			return 0.0f;
+			const float a = t.asVector(Vector3f(1, 0, 0)).length();
+			const float b = t.asVector(Vector3f(0, 1, 0)).length();
+			const float c = t.asVector(Vector3f(0, 0, 1)).length();
+			const float p = 1.6075f;
+			return powf((powf(a * b, p) + powf(b * c, p) + powf(c * a, p)) / 3.0f, 1.0f / p);
 		}
 
-		bool intersect(const Ray& ray, float* tHit, SurfaceIntersection* isect) const override {
-
-			float A = ray.d.lengthSq();
-			float B = dot(ray.d, ray.o);
-			float C = ray.o.lengthSq() - 1;
-
-			float discriminant = B * B - A * C;
-			if (discriminant < 0.0f) {
+		bool intersect(const Ray& ray, float* tHit, HitRecord* hit) const override {
+			bool back;
+			float t;
+			if (!solve(ray, &t, &back)) {
 				return false;
 			}
 
-			bool back = false;
-			float t = (-B - sqrtf(discriminant)) / A;
-			if (t < 0.0f) {
-				t = (-B + sqrtf(discriminant)) / A;
-				if (t < 0.0f) {
-					return false;
-				}
-				back = true;
-			}
-
 			*tHit = t;
-			isect->p = ray(t).normalize();
+			hit->t = t;
+			hit->shape = this;
+			hit->triangleIndex = -1;
+			hit->back = back;
+
+			return true;
+		}
+
+		bool intersectAny(const Ray& ray) const override {
+			bool back;
+			float t;
+			return solve(ray, &t, &back);
+		}
+
+		void computeSurfaceIntersection(const Ray& ray, const HitRecord& hit, SurfaceIntersection* isect) const override {
+			isect->p = ray(hit.t).normalize();
 			isect->n = isect->p;
 
 			isect->wo = normalize(-ray.d);
@@ -93,12 +121,11 @@ namespace xitils {
 			isect->shading.bitangent = isect->bitangent;
 
 			isect->shading.n = isect->n;
-			if (back) { isect->shading.n *= -1; }
+			if (hit.back) { isect->shading.n *= -1; }
 
 			isect->shape = this;
-			isect->tri = nullptr;
-
-			return true;
+			isect->triangleIndex = -1;
+			isect->layer = 0;
 		}
 
 		SampledSurface sampleSurface(Sampler& sampler, float* pdf) const override {
@@ -106,19 +133,51 @@ namespace xitils {
 			float r2 = sampler.randf();
 			SampledSurface sample;
 			sample.p.x = 2.0f * 1 * cosf(2.0f * M_PI * r1) * sqrtf(r2 * (1.0f - r2));
-			sample.p.y = 2.0f * 1 * (1.0f - 2.0f * r2);
+			sample.p.y = 1.0f - 2.0f * r2;
 			sample.p.z = 2.0f * 1 * sinf(2.0f * M_PI * r1) * sqrtf(r2 * (1.0f - r2));
 			sample.n = normalize(sample.p);
 			sample.shadingN = sample.n;
+			sample.shape = this;
+			sample.triangleIndex = -1;
 			*pdf = 1.0f / surfaceArea();
 			return sample;
 		}
 
-		float surfacePDF(const Vector3f& p, const TriangleIndexed* tri) const override {
-			// tri �͎g�p���Ȃ�
+		float surfacePDF(const Vector3f& p, int triangleIndex) const override {
+			// triangleIndex は使用しない
 			return 1.0f / surfaceArea();
 		}
 
+	private:
+
+		// レイと球の交点を求める。back はレイの始点が球の内側にある場合に true になる
+		bool solve(const Ray& ray, float* tHit, bool* back) const {
+			float A = ray.d.lengthSq();
+			float B = dot(ray.d, ray.o);
+			float C = ray.o.lengthSq() - 1;
+
+			float discriminant = B * B - A * C;
+			if (discriminant < 0.0f) {
+				return false;
+			}
+
+			*back = false;
+			float t = (-B - sqrtf(discriminant)) / A;
+			if (t < 0.0f) {
+				t = (-B + sqrtf(discriminant)) / A;
+				if (t < 0.0f) {
+					return false;
+				}
+				*back = true;
+			}
+			if (t > ray.tMax) {
+				return false;
+			}
+
+			*tHit = t;
+			return true;
+		}
+
 	};
 
 }
\ No newline at end of file
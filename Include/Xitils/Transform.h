@@ -212,6 +212,76 @@ namespace xitils {
 		
 	};
 
+	// 射影成分を持たない変換を 3x4 行列として保持したもの
+	// Transform より小さく、w による除算も行わないので、交差判定のたびにレイを変換する用途に使う
+	class AffineTransform {
+	public:
+
+		float m[3][4];
+
+		AffineTransform():
+			m{
+				{ 1, 0, 0, 0 },
+				{ 0, 1, 0, 0 },
+				{ 0, 0, 1, 0 }
+			}
+		{}
+
+		explicit AffineTransform(const Matrix4x4& mat):
+			m{
+				{ mat.m[0][0], mat.m[0][1], mat.m[0][2], mat.m[0][3] },
+				{ mat.m[1][0], mat.m[1][1], mat.m[1][2], mat.m[1][3] },
+				{ mat.m[2][0], mat.m[2][1], mat.m[2][2], mat.m[2][3] }
+			}
+		{
+			ASSERT(mat.m[3][0] == 0 && mat.m[3][1] == 0 && mat.m[3][2] == 0 && mat.m[3][3] == 1);
+		}
+
+		Vector3f operator()(const Vector3f& v) const {
+			return Vector3f(
+				m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2] + m[0][3],
+				m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2] + m[1][3],
+				m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2] + m[2][3]);
+		}
+
+		Vector3f asVector(const Vector3f& v) const {
+			return Vector3f(
+				m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+				m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+				m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+		}
+
+		Ray operator()(const Ray& r) const {
+			return Ray((*this)(r.o), asVector(r.d), r.tMax);
+		}
+
+		// パケットの全てのレイを SIMD の各レーンでまとめて変換する
+		// 演算の順序は 1 本ずつ変換する場合と同じなので、結果も一致する
+		RayPacket operator()(const RayPacket& packet) const {
+			using T_SIMD = simdpp::float32x8;
+			static_assert(RayPacket::Size == 8, "RayPacket::Size must match the SIMD width");
+
+			T_SIMD o[3], d[3];
+			for (int k = 0; k < 3; ++k) {
+				o[k] = simdpp::load_u<T_SIMD>(packet.o[k]);
+				d[k] = simdpp::load_u<T_SIMD>(packet.d[k]);
+			}
+
+			RayPacket res;
+			for (int r = 0; r < 3; ++r) {
+				const T_SIMD m0 = simdpp::splat<T_SIMD>(m[r][0]);
+				const T_SIMD m1 = simdpp::splat<T_SIMD>(m[r][1]);
+				const T_SIMD m2 = simdpp::splat<T_SIMD>(m[r][2]);
+				T_SIMD resO = simdpp::add(simdpp::add(simdpp::add(simdpp::mul(m0, o[0]), simdpp::mul(m1, o[1])), simdpp::mul(m2, o[2])), simdpp::splat<T_SIMD>(m[r][3]));
+				T_SIMD resD = simdpp::add(simdpp::add(simdpp::mul(m0, d[0]), simdpp::mul(m1, d[1])), simdpp::mul(m2, d[2]));
+				simdpp::store_u(res.o[r], resO);
+				simdpp::store_u(res.d[r], resD);
+			}
+			memcpy(res.tMax, packet.tMax, sizeof(res.tMax));
+			return res;
+		}
+	};
+
 	//--------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 	Transform transpose(const Transform& t) {
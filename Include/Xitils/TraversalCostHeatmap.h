@@ -0,0 +1,160 @@
+﻿#pragma once
+
+#include "PathTracer.h"
+#include "RenderTarget.h"
+#include "Utils.h"
+
+#include <cstdio>
+#include <string>
+
+#pragma warning(push)
+#pragma warning(disable:4067)
+#pragma warning(disable:4715)
+#include <tinycolormap.hpp>
+#pragma warning(pop)
+
+namespace xitils {
+
+	// DebugRayCaster::evalWithCost で得た RayCost をピクセルごとに足し合わせる
+	struct TraversalCostRenderTargetPixel
+	{
+		enum Channel {
+			NodesVisited,
+			PrimitivesTested,
+			ShadingTime,
+			ChannelNum
+		};
+
+		Vector3f color;
+		float nodesVisited;
+		float primitivesTested;
+		float shadingTime;
+		int sampleNum;
+
+		void add(const PathTracerEvalResult& res, const RayCost& cost) {
+			color += res.color;
+			nodesVisited += cost.traversal.nodesVisited;
+			primitivesTested += cost.traversal.primitivesTested;
+			shadingTime += cost.shadingTime;
+			++sampleNum;
+		}
+
+		// サンプルあたりの平均
+		float value(Channel channel) const {
+			if (sampleNum == 0) { return 0.0f; }
+			switch (channel) {
+			case NodesVisited: return nodesVisited / sampleNum;
+			case PrimitivesTested: return primitivesTested / sampleNum;
+			case ShadingTime: return shadingTime / sampleNum;
+			default: NOT_IMPLEMENTED; return 0.0f;
+			}
+		}
+
+		static const char* channelName(Channel channel) {
+			const char* names[ChannelNum] = { "nodes", "primitives", "shading [us]" };
+			return names[channel];
+		}
+	};
+	using TraversalCostRenderTarget = RenderTarget<TraversalCostRenderTargetPixel>;
+
+	// value を [0, maxValue] で Jet のカラーマップに割り当てる
+	inline ci::ColorA8u traversalCostToColor(float value, float maxValue) {
+		const float t = maxValue > 0.0f ? value / maxValue : 0.0f;
+		tinycolormap::Color color = tinycolormap::GetColor(clamp01(t), tinycolormap::ColormapType::Jet);
+		ci::ColorA8u colA8u;
+		colA8u.r = xitils::clamp<int>(color.r() * 255, 0, 255);
+		colA8u.g = xitils::clamp<int>(color.g() * 255, 0, 255);
+		colA8u.b = xitils::clamp<int>(color.b() * 255, 0, 255);
+		colA8u.a = 255;
+		return colA8u;
+	}
+
+	// 画面を regionSize x regionSize の領域に区切り、コストの平均が大きい領域を並べる
+	struct TraversalCostSummary
+	{
+		struct Region {
+			Vector2i offset; // 領域の左上のピクセル
+			Vector2i size;
+			float values[TraversalCostRenderTargetPixel::ChannelNum]; // 領域内のピクセルの平均
+		};
+
+		TraversalCostRenderTargetPixel::Channel channel;
+		float average[TraversalCostRenderTargetPixel::ChannelNum]; // 画面全体の平均
+		float maximum[TraversalCostRenderTargetPixel::ChannelNum]; // 1 ピクセルでの最大
+		std::vector<Region> hotspots; // channel の値の大きい順
+
+		std::string report() const {
+			std::string res;
+			char line[256];
+			auto append = [&](const char* format, auto... args) {
+				snprintf(line, sizeof(line), format, args...);
+				res += line;
+			};
+			for (int c = 0; c < TraversalCostRenderTargetPixel::ChannelNum; ++c) {
+				auto ch = (TraversalCostRenderTargetPixel::Channel)c;
+				append("%-13s: average %.2f, max %.2f\n", TraversalCostRenderTargetPixel::channelName(ch), average[c], maximum[c]);
+			}
+			append("hotspots by %s\n", TraversalCostRenderTargetPixel::channelName(channel));
+			for (const auto& region : hotspots) {
+				append("  (%4d, %4d) - (%4d, %4d) : nodes %8.2f, primitives %8.2f, shading %8.2f us (x%.2f)\n",
+					region.offset.x, region.offset.y, region.offset.x + region.size.x, region.offset.y + region.size.y,
+					region.values[TraversalCostRenderTargetPixel::NodesVisited],
+					region.values[TraversalCostRenderTargetPixel::PrimitivesTested],
+					region.values[TraversalCostRenderTargetPixel::ShadingTime],
+					average[channel] > 0.0f ? region.values[channel] / average[channel] : 0.0f);
+			}
+			return res;
+		}
+	};
+
+	inline TraversalCostSummary summarizeTraversalCost(const TraversalCostRenderTarget& target, TraversalCostRenderTargetPixel::Channel channel, int hotspotNum = 8, int regionSize = 32) {
+		using Pixel = TraversalCostRenderTargetPixel;
+
+		TraversalCostSummary summary;
+		summary.channel = channel;
+
+		const int regionX = (target.width + regionSize - 1) / regionSize;
+		const int regionY = (target.height + regionSize - 1) / regionSize;
+		std::vector<TraversalCostSummary::Region> regions(regionX * regionY);
+
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int i = 0; i < regionX * regionY; ++i) {
+			auto& region = regions[i];
+			region.offset = Vector2i(i % regionX * regionSize, i / regionX * regionSize);
+			region.size = Vector2i(std::min(regionSize, target.width - region.offset.x), std::min(regionSize, target.height - region.offset.y));
+			double sums[Pixel::ChannelNum] = {};
+			for (int y = region.offset.y; y < region.offset.y + region.size.y; ++y) {
+				for (int x = region.offset.x; x < region.offset.x + region.size.x; ++x) {
+					const Pixel& pixel = target[Vector2i(x, y)];
+					for (int c = 0; c < Pixel::ChannelNum; ++c) {
+						sums[c] += pixel.value((Pixel::Channel)c);
+					}
+				}
+			}
+			for (int c = 0; c < Pixel::ChannelNum; ++c) {
+				region.values[c] = (float)(sums[c] / (region.size.x * region.size.y));
+			}
+		}
+
+		for (int c = 0; c < Pixel::ChannelNum; ++c) {
+			double sum = 0.0;
+			float maxValue = 0.0f;
+			for (const auto& pixel : target.data) {
+				const float value = pixel.value((Pixel::Channel)c);
+				sum += value;
+				maxValue = std::max(maxValue, value);
+			}
+			summary.average[c] = (float)(sum / target.data.size());
+			summary.maximum[c] = maxValue;
+		}
+
+		hotspotNum = std::min(hotspotNum, (int)regions.size());
+		std::partial_sort(regions.begin(), regions.begin() + hotspotNum, regions.end(), [channel](const auto& a, const auto& b) {
+			return a.values[channel] > b.values[channel];
+			});
+		summary.hotspots.assign(regions.begin(), regions.begin() + hotspotNum);
+
+		return summary;
+	}
+
+}
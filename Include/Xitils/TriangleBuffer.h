@@ -0,0 +1,327 @@
+﻿#pragma once
+
+#include <bit>
+
+#include "Utils.h"
+#include "Vector.h"
+#include "Bounds.h"
+#include "Ray.h"
+#include "TriangleIndexed.h"
+
+namespace xitils {
+
+	// メッシュの三角形の頂点位置を、BVH のリーフ内のプリミティブの並びで SoA にして持つもの
+	// 三角形ごとにオブジェクトを作らず、BVH のリーフからは番号で直接参照する
+	// リーフ内の三角形は SIMDWidth 個ずつまとめて判定する
+	class TriangleBuffer {
+	public:
+
+		static const int SIMDWidth = 8;
+		using T_SIMD = simdpp::float32x8;
+		using T_SIMDUINT = simdpp::uint32x8;
+		using T_SIMDMASK = simdpp::mask_float32x8;
+
+		// レイの情報を SIMD レジスタ幅に展開しておいたもの
+		// TriangleIndexed::intersectTriangle と同じく、レイの向きの成分が最大の軸を z として座標軸を入れ替える
+		struct RaySIMD {
+			int k[3]; // 入れ替え後の x, y, z 軸が元のどの軸か
+			T_SIMD o[3];
+			T_SIMD sx, sy, sz;
+
+			RaySIMD() {}
+
+			RaySIMD(const Ray& ray) {
+				k[2] = abs(ray.d).maxDimension();
+				k[0] = k[2] + 1; if (k[0] == 3) { k[0] = 0; }
+				k[1] = k[0] + 1; if (k[1] == 3) { k[1] = 0; }
+				auto d = permute(ray.d, k[0], k[1], k[2]);
+				for (int axis = 0; axis < 3; ++axis) {
+					o[axis] = simdpp::splat<T_SIMD>(ray.o[k[axis]]);
+				}
+				sx = simdpp::splat<T_SIMD>(-d.x / d.z);
+				sy = simdpp::splat<T_SIMD>(-d.y / d.z);
+				sz = simdpp::splat<T_SIMD>(1.0f / d.z);
+			}
+		};
+
+		// パケットの各レイを SIMD の各レーンに入れたもの
+		// 三角形 1 つとパケットの全てのレイとの判定を一度に行うのに使う
+		// 座標軸の入れ替えはレイごとに RaySIMD と同じものを行う
+		struct RayPacketSIMD {
+			T_SIMDMASK kIsX[3], kIsY[3]; // 入れ替え後の各軸が元の x 軸か、y 軸か (どちらでもなければ z 軸)
+			T_SIMD o[3];
+			T_SIMD sx, sy, sz;
+
+			RayPacketSIMD(const RayPacket& packet, int activeMask) {
+				static_assert(RayPacket::Size == SIMDWidth, "RayPacket::Size must match TriangleBuffer::SIMDWidth");
+				int k[3][SIMDWidth];
+				float oPermuted[3][SIMDWidth];
+				float sxLanes[SIMDWidth], syLanes[SIMDWidth], szLanes[SIMDWidth];
+				for (int i = 0; i < SIMDWidth; ++i) {
+					// 無効なレーンは z 軸向きのレイにしておく
+					const Ray ray = (activeMask & (1 << i)) ? packet.ray(i) : Ray(Vector3f(0.0f), Vector3f(0, 0, 1));
+					k[2][i] = abs(ray.d).maxDimension();
+					k[0][i] = k[2][i] + 1; if (k[0][i] == 3) { k[0][i] = 0; }
+					k[1][i] = k[0][i] + 1; if (k[1][i] == 3) { k[1][i] = 0; }
+					auto d = permute(ray.d, k[0][i], k[1][i], k[2][i]);
+					for (int axis = 0; axis < 3; ++axis) {
+						oPermuted[axis][i] = ray.o[k[axis][i]];
+					}
+					sxLanes[i] = -d.x / d.z;
+					syLanes[i] = -d.y / d.z;
+					szLanes[i] = 1.0f / d.z;
+				}
+
+				const T_SIMD one = simdpp::splat<T_SIMD>(1.0f);
+				for (int axis = 0; axis < 3; ++axis) {
+					float isX[SIMDWidth], isY[SIMDWidth];
+					for (int i = 0; i < SIMDWidth; ++i) {
+						isX[i] = k[axis][i] == 0 ? 1.0f : 0.0f;
+						isY[i] = k[axis][i] == 1 ? 1.0f : 0.0f;
+					}
+					kIsX[axis] = simdpp::cmp_eq(simdpp::load_u<T_SIMD>(isX), one);
+					kIsY[axis] = simdpp::cmp_eq(simdpp::load_u<T_SIMD>(isY), one);
+					o[axis] = simdpp::load_u<T_SIMD>(oPermuted[axis]);
+				}
+				sx = simdpp::load_u<T_SIMD>(sxLanes);
+				sy = simdpp::load_u<T_SIMD>(syLanes);
+				sz = simdpp::load_u<T_SIMD>(szLanes);
+			}
+		};
+
+		int size() const { return faceIndices.size(); }
+
+		// i 番目の三角形がメッシュの何番目の面か
+		int faceIndex(int i) const { return faceIndices[i]; }
+
+		Vector3f vertex(int i, int k) const {
+			return Vector3f(vertices[k][0][i], vertices[k][1][i], vertices[k][2][i]);
+		}
+
+		Bounds3f bound(int i) const {
+			return Bounds3f(vertex(i, 0), vertex(i, 1), vertex(i, 2));
+		}
+
+		// [offset, offset + num) の三角形のうち最も近いものとの交差判定を行う
+		// discard(i, b0, b1) が true を返した交差は棄却する (シェルマッピングのアルファによる棄却など)
+		template<typename F> bool intersect(int offset, int num, const RaySIMD& ray, float tMax, int* hitIndex, float* tHit, float* b0Hit, float* b1Hit, const F& discard) const {
+			bool found = false;
+			for (int begin = offset; begin < offset + num; begin += SIMDWidth) {
+				float t[SIMDWidth], b0[SIMDWidth], b1[SIMDWidth];
+				uint32_t mask[SIMDWidth];
+				intersectSIMD(begin, min(SIMDWidth, offset + num - begin), ray, tMax, t, b0, b1, mask);
+
+				// 手前のものから順に棄却されないかを調べる
+				// 距離が等しい場合は、1 つずつ判定した場合と同じく後ろのものを優先する
+				while (true) {
+					int best = -1;
+					for (int i = 0; i < SIMDWidth; ++i) {
+						if (mask[i] && (best < 0 || t[i] <= t[best])) { best = i; }
+					}
+					if (best < 0) { break; }
+					if (!discard(begin + best, b0[best], b1[best])) {
+						tMax = t[best];
+						*hitIndex = begin + best;
+						*tHit = t[best];
+						*b0Hit = b0[best];
+						*b1Hit = b1[best];
+						found = true;
+						break;
+					}
+					mask[best] = 0;
+				}
+			}
+			return found;
+		}
+
+		template<typename F> bool intersectAny(int offset, int num, const RaySIMD& ray, float tMax, const F& discard) const {
+			for (int begin = offset; begin < offset + num; begin += SIMDWidth) {
+				float t[SIMDWidth], b0[SIMDWidth], b1[SIMDWidth];
+				uint32_t mask[SIMDWidth];
+				intersectSIMD(begin, min(SIMDWidth, offset + num - begin), ray, tMax, t, b0, b1, mask);
+				for (int i = 0; i < SIMDWidth; ++i) {
+					if (mask[i] && !discard(begin + i, b0[i], b1[i])) { return true; }
+				}
+			}
+			return false;
+		}
+
+		// packet の laneMask のレイそれぞれについて、[offset, offset + num) の三角形のうち最も近いものとの交差判定を行う
+		// 三角形を 1 つずつ取り出し、パケットの全てのレイとの判定を SIMD でまとめて行う
+		// 交差したレイの tMax, hitIndices, b0Hit, b1Hit を更新し、それらのビットを立てたマスクを返す
+		// 距離が等しい場合は intersect と同じく後ろの三角形を優先する
+		template<typename F> int intersectPacket(int offset, int num, const RayPacketSIMD& rays, int laneMask, float* tMax, int* hitIndices, float* b0Hit, float* b1Hit, const F& discard) const {
+			int hitMask = 0;
+			for (int i = offset; i < offset + num; ++i) {
+				float t[SIMDWidth], b0[SIMDWidth], b1[SIMDWidth];
+				int mask = intersectPacketSIMD(i, rays, tMax, t, b0, b1) & laneMask;
+				while (mask) {
+					const int lane = std::countr_zero((unsigned int)mask);
+					mask &= mask - 1;
+					if (discard(i, b0[lane], b1[lane])) { continue; }
+					tMax[lane] = t[lane];
+					hitIndices[lane] = i;
+					b0Hit[lane] = b0[lane];
+					b1Hit[lane] = b1[lane];
+					hitMask |= 1 << lane;
+				}
+			}
+			return hitMask;
+		}
+
+		// 遮蔽されたレイのビットを立てたマスクを返す
+		template<typename F> int intersectAnyPacket(int offset, int num, const RayPacketSIMD& rays, int laneMask, const float* tMax, const F& discard) const {
+			int occludedMask = 0;
+			for (int i = offset; i < offset + num && occludedMask != laneMask; ++i) {
+				float t[SIMDWidth], b0[SIMDWidth], b1[SIMDWidth];
+				int mask = intersectPacketSIMD(i, rays, tMax, t, b0, b1) & laneMask & ~occludedMask;
+				while (mask) {
+					const int lane = std::countr_zero((unsigned int)mask);
+					mask &= mask - 1;
+					if (!discard(i, b0[lane], b1[lane])) { occludedMask |= 1 << lane; }
+				}
+			}
+			return occludedMask;
+		}
+
+		// faceOrder[i] 番目の面を i 番目に置く
+		void build(const Vector3f* positions, const int* indices, const std::vector<int>& faceOrder) {
+			faceIndices = faceOrder;
+			// 末尾の三角形からもレジスタ幅分を読み込めるよう、面積 0 の三角形で埋めておく
+			for (int k = 0; k < 3; ++k) {
+				for (int axis = 0; axis < 3; ++axis) {
+					vertices[k][axis].assign(faceIndices.size() + SIMDWidth - 1, 0.0f);
+				}
+			}
+			updatePositions(positions, indices);
+		}
+
+		// 面の並びはそのままに、頂点位置のみを読み直す
+		void updatePositions(const Vector3f* positions, const int* indices) {
+			const int triNum = size();
+#pragma omp parallel for
+			for (int i = 0; i < triNum; ++i) {
+				const int* index = &indices[faceIndices[i] * 3];
+				for (int k = 0; k < 3; ++k) {
+					const Vector3f& p = positions[index[k]];
+					vertices[k][0][i] = p.x;
+					vertices[k][1][i] = p.y;
+					vertices[k][2][i] = p.z;
+				}
+			}
+		}
+
+		size_t memoryBytes() const {
+			return sizeof(float) * 9 * vertices[0][0].size() + sizeof(int) * faceIndices.size();
+		}
+
+		void clear() {
+			faceIndices.clear();
+			for (int k = 0; k < 3; ++k) {
+				for (int axis = 0; axis < 3; ++axis) {
+					vertices[k][axis].clear();
+				}
+			}
+		}
+
+	private:
+		std::vector<float> vertices[3][3]; // [頂点][軸][三角形]
+		std::vector<int> faceIndices;
+
+		// begin から laneNum 個の三角形との交差判定を一度に行い、交差したものの mask を 0 以外にする
+		// 判定の内容は TriangleIndexed::intersectTriangle と同じ
+		void intersectSIMD(int begin, int laneNum, const RaySIMD& ray, float tMax, float* tHit, float* b0Hit, float* b1Hit, uint32_t* hitMask) const {
+			T_SIMD p[3][3]; // [頂点][入れ替え後の軸]
+			for (int v = 0; v < 3; ++v) {
+				for (int axis = 0; axis < 3; ++axis) {
+					p[v][axis] = simdpp::sub(simdpp::load_u<T_SIMD>(&vertices[v][ray.k[axis]][begin]), ray.o[axis]);
+				}
+				p[v][0] = simdpp::add(p[v][0], simdpp::mul(ray.sx, p[v][2]));
+				p[v][1] = simdpp::add(p[v][1], simdpp::mul(ray.sy, p[v][2]));
+			}
+
+			T_SIMD e0 = simdpp::sub(simdpp::mul(p[1][0], p[2][1]), simdpp::mul(p[1][1], p[2][0]));
+			T_SIMD e1 = simdpp::sub(simdpp::mul(p[2][0], p[0][1]), simdpp::mul(p[2][1], p[0][0]));
+			T_SIMD e2 = simdpp::sub(simdpp::mul(p[0][0], p[1][1]), simdpp::mul(p[0][1], p[1][0]));
+
+			const T_SIMD zero = simdpp::make_zero();
+			T_SIMDMASK hasNegative = simdpp::bit_or(simdpp::bit_or(simdpp::cmp_lt(e0, zero), simdpp::cmp_lt(e1, zero)), simdpp::cmp_lt(e2, zero));
+			T_SIMDMASK hasPositive = simdpp::bit_or(simdpp::bit_or(simdpp::cmp_gt(e0, zero), simdpp::cmp_gt(e1, zero)), simdpp::cmp_gt(e2, zero));
+
+			T_SIMD det = simdpp::add(simdpp::add(e0, e1), e2);
+
+			T_SIMD tScaled = simdpp::add(simdpp::add(
+				simdpp::mul(e0, simdpp::mul(p[0][2], ray.sz)),
+				simdpp::mul(e1, simdpp::mul(p[1][2], ray.sz))),
+				simdpp::mul(e2, simdpp::mul(p[2][2], ray.sz)));
+			T_SIMD tMaxDet = simdpp::mul(simdpp::splat<T_SIMD>(tMax), det);
+
+			// det の符号ごとに、交点がレイの範囲内にあるかを調べる (det が 0 ならどちらにも当てはまらない)
+			T_SIMDMASK negativeInRange = simdpp::bit_and(simdpp::bit_and(simdpp::cmp_lt(det, zero), simdpp::cmp_lt(tScaled, zero)), simdpp::cmp_ge(tScaled, tMaxDet));
+			T_SIMDMASK positiveInRange = simdpp::bit_and(simdpp::bit_and(simdpp::cmp_gt(det, zero), simdpp::cmp_gt(tScaled, zero)), simdpp::cmp_le(tScaled, tMaxDet));
+
+			T_SIMDMASK hit = simdpp::bit_andnot(simdpp::bit_or(negativeInRange, positiveInRange), simdpp::bit_and(hasNegative, hasPositive));
+
+			T_SIMD invDet = simdpp::div(simdpp::splat<T_SIMD>(1.0f), det);
+			simdpp::store_u(tHit, simdpp::mul(tScaled, invDet));
+			simdpp::store_u(b0Hit, simdpp::mul(e0, invDet));
+			simdpp::store_u(b1Hit, simdpp::mul(e1, invDet));
+			simdpp::store_u(hitMask, simdpp::bit_cast<T_SIMDUINT>(hit));
+			for (int i = laneNum; i < SIMDWidth; ++i) {
+				hitMask[i] = 0;
+			}
+		}
+
+		// i 番目の三角形とパケットの全てのレイとの交差判定を一度に行い、交差したレイのビットを立てたマスクを返す
+		// intersectSIMD とは三角形とレイの役割を入れ替えただけで、レーンごとの演算は同じ
+		int intersectPacketSIMD(int i, const RayPacketSIMD& ray, const float* tMax, float* tHit, float* b0Hit, float* b1Hit) const {
+			T_SIMD p[3][3]; // [頂点][入れ替え後の軸]
+			for (int v = 0; v < 3; ++v) {
+				const T_SIMD x = simdpp::splat<T_SIMD>(vertices[v][0][i]);
+				const T_SIMD y = simdpp::splat<T_SIMD>(vertices[v][1][i]);
+				const T_SIMD z = simdpp::splat<T_SIMD>(vertices[v][2][i]);
+				for (int axis = 0; axis < 3; ++axis) {
+					const T_SIMD permuted = simdpp::blend(x, simdpp::blend(y, z, ray.kIsY[axis]), ray.kIsX[axis]);
+					p[v][axis] = simdpp::sub(permuted, ray.o[axis]);
+				}
+				p[v][0] = simdpp::add(p[v][0], simdpp::mul(ray.sx, p[v][2]));
+				p[v][1] = simdpp::add(p[v][1], simdpp::mul(ray.sy, p[v][2]));
+			}
+
+			T_SIMD e0 = simdpp::sub(simdpp::mul(p[1][0], p[2][1]), simdpp::mul(p[1][1], p[2][0]));
+			T_SIMD e1 = simdpp::sub(simdpp::mul(p[2][0], p[0][1]), simdpp::mul(p[2][1], p[0][0]));
+			T_SIMD e2 = simdpp::sub(simdpp::mul(p[0][0], p[1][1]), simdpp::mul(p[0][1], p[1][0]));
+
+			const T_SIMD zero = simdpp::make_zero();
+			T_SIMDMASK hasNegative = simdpp::bit_or(simdpp::bit_or(simdpp::cmp_lt(e0, zero), simdpp::cmp_lt(e1, zero)), simdpp::cmp_lt(e2, zero));
+			T_SIMDMASK hasPositive = simdpp::bit_or(simdpp::bit_or(simdpp::cmp_gt(e0, zero), simdpp::cmp_gt(e1, zero)), simdpp::cmp_gt(e2, zero));
+
+			T_SIMD det = simdpp::add(simdpp::add(e0, e1), e2);
+
+			T_SIMD tScaled = simdpp::add(simdpp::add(
+				simdpp::mul(e0, simdpp::mul(p[0][2], ray.sz)),
+				simdpp::mul(e1, simdpp::mul(p[1][2], ray.sz))),
+				simdpp::mul(e2, simdpp::mul(p[2][2], ray.sz)));
+			T_SIMD tMaxDet = simdpp::mul(simdpp::load_u<T_SIMD>(tMax), det);
+
+			T_SIMDMASK negativeInRange = simdpp::bit_and(simdpp::bit_and(simdpp::cmp_lt(det, zero), simdpp::cmp_lt(tScaled, zero)), simdpp::cmp_ge(tScaled, tMaxDet));
+			T_SIMDMASK positiveInRange = simdpp::bit_and(simdpp::bit_and(simdpp::cmp_gt(det, zero), simdpp::cmp_gt(tScaled, zero)), simdpp::cmp_le(tScaled, tMaxDet));
+
+			T_SIMDMASK hit = simdpp::bit_andnot(simdpp::bit_or(negativeInRange, positiveInRange), simdpp::bit_and(hasNegative, hasPositive));
+
+			T_SIMD invDet = simdpp::div(simdpp::splat<T_SIMD>(1.0f), det);
+			simdpp::store_u(tHit, simdpp::mul(tScaled, invDet));
+			simdpp::store_u(b0Hit, simdpp::mul(e0, invDet));
+			simdpp::store_u(b1Hit, simdpp::mul(e1, invDet));
+
+			uint32_t mask[SIMDWidth];
+			simdpp::store_u(mask, simdpp::bit_cast<T_SIMDUINT>(hit));
+			int hitMask = 0;
+			for (int lane = 0; lane < SIMDWidth; ++lane) {
+				if (mask[lane]) { hitMask |= 1 << lane; }
+			}
+			return hitMask;
+		}
+	};
+
+}
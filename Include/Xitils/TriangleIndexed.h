@@ -16,7 +16,7 @@ namespace xitils {
 	public:
 
 		struct SampledSurface {
-			const TriangleIndexed* tri;
+			int triangleIndex;
 			Vector3f p;
 			Vector3f n;
 			Vector3f shadingN;
@@ -53,6 +53,32 @@ namespace xitils {
 			return Bounds3f(p0, p1, p2);
 		}
 
+		// 三角形のうち bound 内にある部分を、axis 軸に垂直な plane の位置の平面で分割したそれぞれの側の AABB を求める
+		// 空間分割を行う BVH の構築 (BVHBuildSettings::spatialSplit) で使う
+		void splitBound(const Bounds3f& bound, int axis, float plane, Bounds3f* left, Bounds3f* right) const {
+			Bounds3f leftTriangle, rightTriangle;
+			for (int i = 0; i < 3; ++i) {
+				const Vector3f& p0 = position(i);
+				const Vector3f& p1 = position((i + 1) % 3);
+				if (p0[axis] <= plane) { leftTriangle = merge(leftTriangle, p0); }
+				if (p0[axis] >= plane) { rightTriangle = merge(rightTriangle, p0); }
+				// 平面と交わる辺は交点を両側に加える
+				if ((p0[axis] < plane && p1[axis] > plane) || (p0[axis] > plane && p1[axis] < plane)) {
+					Vector3f p = lerp(p0, p1, (plane - p0[axis]) / (p1[axis] - p0[axis]));
+					p[axis] = plane;
+					leftTriangle = merge(leftTriangle, p);
+					rightTriangle = merge(rightTriangle, p);
+				}
+			}
+
+			Bounds3f leftBound = bound;
+			Bounds3f rightBound = bound;
+			leftBound.max[axis] = std::min(leftBound.max[axis], plane);
+			rightBound.min[axis] = std::max(rightBound.min[axis], plane);
+			*left = intersection(leftTriangle, leftBound);
+			*right = intersection(rightTriangle, rightBound);
+		}
+
 		float surfaceArea() const override {
 			const auto& p0 = position(0);
 			const auto& p1 = position(1);
@@ -72,15 +98,13 @@ namespace xitils {
 			return cross(v01, v02).length() / 2.0f / surfaceArea();
 		}
 
-		bool intersect(const Ray& ray, float* tHit, SurfaceIntersection* isect) const override {
+		// 頂点位置のみを使った交差判定
+		// 三角形ごとのオブジェクトを持たない TriangleBuffer からも使う
+		static bool intersectTriangle(const Ray& ray, const Vector3f& p0, const Vector3f& p1, const Vector3f& p2, float* tHit, float* b0Hit, float* b1Hit) {
 
 			// PBRT �̎�����Q�l�ɂ���
 			// http://www.pbr-book.org/3ed-2018/Shapes/Triangle_Meshes.html
 
-			const auto& p0 = position(0);
-			const auto& p1 = position(1);
-			const auto& p2 = position(2);
-
 			auto p0t = p0 - ray.o;
 			auto p1t = p1 - ray.o;
 			auto p2t = p2 - ray.o;
@@ -130,20 +154,47 @@ namespace xitils {
 			float b2 = e2 * invDet;
 			float t = tScaled * invDet;
 
-			Vector2f texCoordTmp;
-			if (texCoords != nullptr) {
-				texCoordTmp = lerp(texCoord(0), texCoord(1), texCoord(2), b0, b1);
-			} else {
-				texCoordTmp = Vector2f();
-			}
+			*tHit = t;
+			*b0Hit = b0;
+			*b1Hit = b1;
+
+			return true;
+		}
 
-			if (discardByAlpha(texCoordTmp)) {
+		bool intersect(const Ray& ray, float* tHit, HitRecord* hit) const override {
+			float t, b0, b1;
+			if (!intersectWithAlpha(ray, &t, &b0, &b1)) {
 				return false;
 			}
 
-			isect->texCoord = texCoordTmp;
-
 			*tHit = t;
+			hit->t = t;
+			hit->b0 = b0;
+			hit->b1 = b1;
+			hit->triangleIndex = index;
+
+			return true;
+		}
+
+		// 遮蔽の判定のみを行う
+		bool intersectAny(const Ray& ray) const override {
+			float t, b0, b1;
+			return intersectWithAlpha(ray, &t, &b0, &b1);
+		}
+
+		void computeSurfaceIntersection(const Ray& ray, const HitRecord& hit, SurfaceIntersection* isect) const override {
+			const auto& p0 = position(0);
+			const auto& p1 = position(1);
+			const auto& p2 = position(2);
+			const float b0 = hit.b0;
+			const float b1 = hit.b1;
+
+			if (texCoords != nullptr) {
+				isect->texCoord = lerp(texCoord(0), texCoord(1), texCoord(2), b0, b1);
+			} else {
+				isect->texCoord = Vector2f();
+			}
+
 			isect->p = lerp(p0, p1, p2, b0, b1);
 
 			isect->wo = normalize(-ray.d);
@@ -169,27 +220,16 @@ namespace xitils {
 
 			isect->shading.n = faceForward(isect->shading.n, isect->wo);
 
-			isect->tri = this;
+			isect->triangleIndex = index;
 
 			perturbIntersection(*isect);
-
-			return true;
 		}
 
+		// 面積に関して一様にサンプリングする
 		SampledSurface sampleSurface(Sampler& sampler, float* pdf) const {
-			float t0;
-			float t1;
-			float t2;
-			float s;
-			do {
-				t0 = sampler.randf();
-				t1 = sampler.randf();
-				t2 = sampler.randf();
-				s = t0 + t1 + t2;
-			} while (s == 0.0f);
-			float inv = 1.0f / s;
-			t0 *= inv;
-			t1 *= inv;
+			const float su = sqrtf(sampler.randf());
+			const float t0 = 1.0f - su;
+			const float t1 = sampler.randf() * su;
 
 			*pdf = 1.0f / surfaceArea();
 
@@ -204,7 +244,7 @@ namespace xitils {
 			} else {
 				res.shadingN = lerp(normal(0), normal(1), normal(2), t0, t1).normalize();
 			}
-			res.tri = this;
+			res.triangleIndex = index;
 			return res;
 		}
 
@@ -213,6 +253,24 @@ namespace xitils {
 		}
 
 	protected:
+		// 交差判定の本体
+		// 重心座標はアルファによる棄却のためにも必要になる
+		bool intersectWithAlpha(const Ray& ray, float* tHit, float* b0Hit, float* b1Hit) const {
+			if (!intersectTriangle(ray, position(0), position(1), position(2), tHit, b0Hit, b1Hit)) {
+				return false;
+			}
+
+			// アルファによる棄却だけはここで行う必要がある
+			Vector2f texCoordTmp;
+			if (texCoords != nullptr) {
+				texCoordTmp = lerp(texCoord(0), texCoord(1), texCoord(2), *b0Hit, *b1Hit);
+			} else {
+				texCoordTmp = Vector2f();
+			}
+
+			return !discardByAlpha(texCoordTmp);
+		}
+
 		virtual bool discardByAlpha(const Vector2f& texCoord) const { return false; }
 		virtual void perturbIntersection(SurfaceIntersection& isect) const {}
 	};
@@ -2,18 +2,18 @@
 
 #include "Shape.h"
 #include "AccelerationStructure.h"
+#include "AliasTable.h"
+#include "BVHCache.h"
+#include "MinMaxMipmap.h"
+#include "TriangleBuffer.h"
 
 namespace xitils {
 
+	// 交差判定の前に buildAccelerationStructure (通常は Scene::buildAccelerationStructure から呼ばれる) で BVH を構築しておくこと
+	// setGeometry 系の関数は BVH を破棄するので、その後にも構築し直す必要がある
 	class TriangleMesh : public Shape {
 	public:
 
-		~TriangleMesh(){
-			for (auto* tri : triangles) {
-				delete tri;
-			}
-		}
-
 		void setGeometry(const cinder::TriMesh& mesh) {
 			std::shared_ptr <cinder::TriMesh> tmpMesh((cinder::TriMesh*)mesh.clone());
 
@@ -50,8 +50,8 @@ namespace xitils {
 				indices[i + 2] = tmpMesh->getIndices()[i + 2];
 			}
 
-			buildTriangles();
-			buildBVH();
+			resetAccelerationStructure();
+			calcBound();
 			calcSurfaceArea();
 		}
 
@@ -60,7 +60,7 @@ namespace xitils {
 			std::shared_ptr <cinder::TriMesh> tmpMesh((cinder::TriMesh*)mesh.clone());
 
 			this->displacementMap = displacement;
-			this->displacementScale = displacementScale;
+			this->displacementScale = displacemntScale;
 			for (int i = 0; i < tmpMesh->getNumVertices(); ++i) {
 				tmpMesh->getPositions<3>()[i] +=
 					displacemntScale * displacement->rgb(Vector2f(tmpMesh->getTexCoords0<2>()[i])).x * tmpMesh->getNormals()[i];
@@ -99,8 +99,8 @@ namespace xitils {
 				indices[i + 2] = tmpMesh->getIndices()[i + 2];
 			}
 
-			buildTriangles();
-			buildBVH();
+			resetAccelerationStructure();
+			calcBound();
 			calcSurfaceArea();
 		}
 
@@ -109,7 +109,7 @@ namespace xitils {
 			std::shared_ptr <cinder::TriMesh> tmpMesh((cinder::TriMesh*)mesh.clone());
 
 			this->displacementMap = displacement;
-			this->displacementScale = displacementScale;
+			this->displacementScale = displacemntScale;
 
 			positions.resize(tmpMesh->getNumVertices());
 			for (int i = 0; i < positions.size(); ++i) {
@@ -143,8 +143,8 @@ namespace xitils {
 				indices[i + 2] = tmpMesh->getIndices()[i + 2];
 			}
 
-			buildTrianglesWithShellMapping(displacement.get(), displacemntScale, layerNum);
-			buildBVH();
+			buildTrianglesWithShellMapping(displacemntScale, layerNum);
+			calcBound();
 			calcSurfaceArea();
 		}
 
@@ -155,8 +155,8 @@ namespace xitils {
 			if (tangents != nullptr) { setTangents(tangents, vertexNum); }
 			if (bitangents != nullptr) { setBitangents(bitangents, vertexNum); }
 			setIndices(indexData, indexNum);
-			buildTriangles();
-			buildBVH();
+			resetAccelerationStructure();
+			calcBound();
 			calcSurfaceArea();
 		}
 
@@ -169,21 +169,187 @@ namespace xitils {
 			setIndices(indexData, indexNum);
 
 			this->displacementMap = displacement;
-			this->displacementScale = displacementScale;
+			this->displacementScale = displacemntScale;
 
-			buildTrianglesWithShellMapping(displacement.get(), displacemntScale, layerNum);
-			buildBVH();
+			buildTrianglesWithShellMapping(displacemntScale, layerNum);
+			calcBound();
 			calcSurfaceArea();
 		}
 
-		int triangleNum() const { return triangles.size(); }
+		// setGeometryWithShellMapping と同じ見た目になるシェルマッピングを、三角形を複製せずに行う
+		// 底面の三角形ごとに法線方向へ displacemntScale だけ押し出したプリズムを 1 つの BVH のプリミティブとし、
+		// 交差判定ではプリズム内の各レイヤーの三角形をその場で作って、レイの進む向きにレイヤーを辿る
+		// メモリ使用量は layerNum によらない
+		void setGeometryWithPrismShellMapping(const cinder::TriMesh& mesh, std::shared_ptr<const Texture> displacement, float displacemntScale, int layerNum) {
+			setGeometry(mesh);
+			setPrismShellMapping(displacement, displacemntScale, layerNum);
+		}
 
-		Bounds3f bound() const override {
-			Bounds3f res;
-			for (const auto& p : positions) {
-				res = merge(res, p);
+		void setGeometryWithPrismShellMapping(int vertexNum, const Vector3f* positions, const Vector2f* texCoords, const Vector3f* normals, const Vector3f* tangents, const Vector3f* bitangents, int indexNum, int* indexData, std::shared_ptr<const Texture> displacement, float displacemntScale, int layerNum) {
+			setGeometry(vertexNum, positions, texCoords, normals, tangents, bitangents, indexNum, indexData);
+			setPrismShellMapping(displacement, displacemntScale, layerNum);
+		}
+
+		// 頂点の位置 (と、指定されていれば法線や接ベクトル) だけを書き換える
+		// 三角形の接続関係は変わらないものとし、AccelerationStructure は作り直さずに AABB の更新のみを行う
+		// 更新によって SAH コストが構築時の rebuildThreshold 倍より悪化した場合は、その部分だけを作り直す
+		// ディスプレイスメントやシェルマッピングを適用したメッシュには使えない (例外を投げる)
+		// 更新したメッシュを使う Object の AABB は変わるので、シーンに追加済みの場合はこの後に Scene::updateAccelerationStructure を呼ぶこと
+		// (呼ぶまでは Object を束ねる上位の AccelerationStructure と光源の選択に古い位置が使われる)
+		void updatePositions(int vertexNum, const Vector3f* positions, const Vector3f* normals = nullptr, const Vector3f* tangents = nullptr, const Vector3f* bitangents = nullptr, float rebuildThreshold = Infinity) {
+			if (displacementMap != nullptr) { throw "TriangleMesh: updatePositions cannot be used with displacement or shell mapping"; }
+			if (vertexNum != this->positions.size()) { throw "TriangleMesh: updatePositions cannot change the number of vertices"; }
+
+			memcpy(this->positions.data(), positions, sizeof(Vector3f) * vertexNum);
+			if (normals != nullptr) {
+				ASSERT(vertexNum == this->normals.size());
+				memcpy(this->normals.data(), normals, sizeof(Vector3f) * vertexNum);
 			}
-			return res;
+			if (tangents != nullptr) {
+				ASSERT(vertexNum == this->tangents.size());
+				memcpy(this->tangents.data(), tangents, sizeof(Vector3f) * vertexNum);
+			}
+			if (bitangents != nullptr) {
+				ASSERT(vertexNum == this->bitangents.size());
+				memcpy(this->bitangents.data(), bitangents, sizeof(Vector3f) * vertexNum);
+			}
+
+			calcBound();
+			calcSurfaceArea();
+			++revision;
+
+			if (accel) {
+				triangles.updatePositions(this->positions.data(), indices.data());
+				auto triangleBound = [this](int i) { return triangles.bound(i); };
+				accel->refit(triangleBound);
+				if (rebuildThreshold < Infinity && accel->rebuildDegradedSubtree(rebuildThreshold, triangleBound)) {
+					triangles.build(this->positions.data(), indices.data(), accel->primitiveOrder());
+				}
+			}
+		}
+
+		int triangleNum() const { return indices.size() / 3; }
+
+		// Embree など外部の AccelerationStructure に頂点と三角形を渡すためのもの
+		int vertexNum() const { return positions.size(); }
+		const Vector3f* positionData() const { return positions.data(); }
+		const int* indexData() const { return indices.data(); }
+		// updatePositions を呼ぶたびに増える
+		int positionsRevision() const { return revision; }
+		bool hasShellMapping() const { return shellLayerNum > 0; }
+		// プリズムによるシェルマッピングでは三角形だけを外部に渡しても交差判定ができない
+		bool hasPrismShellMapping() const { return prismShellMapping; }
+
+		// 交差判定で求めた face 番目の三角形を、HitRecord の triangleIndex (底面の三角形の番号) と layer に分けて記録する
+		// face はシェルマッピングの場合 (レイヤー) * (底面の三角形の数) + (底面の番号) で、Embree のように外部で判定した場合もこれを使う
+		void setHitTriangle(int face, HitRecord* hit) const {
+			const int baseNum = baseTriangleNum();
+			hit->triangleIndex = face % baseNum;
+			hit->layer = face / baseNum;
+		}
+
+		// TriangleIndexedWithShellMapping::discardByAlpha と同じ判定を面の番号から行う
+		bool discardByAlpha(int face, float b0, float b1) const {
+			if (shellLayerNum == 0) { return false; }
+			Vector2f texCoord;
+			if (!texCoords.empty()) {
+				const int* index = &indices[shellBaseFace(face) * 3];
+				texCoord = lerp(texCoords[index[0]], texCoords[index[1]], texCoords[index[2]], b0, b1);
+			}
+			return displacementMap->rgb(texCoord).x < shellHeight(face);
+		}
+
+		// 細長い三角形や重なり合う三角形が多いメッシュ向けに、BVH の構築で空間分割 (SBVH) を使う
+		// overlapThreshold, maxGrowth は BVHBuildSettings::spatialSplitOverlapThreshold, spatialSplitMaxGrowth
+		// buildAccelerationStructure より前に呼ぶこと
+		void setSpatialSplit(bool enabled, float overlapThreshold = 1e-5f, float maxGrowth = 0.3f) {
+			ASSERT(!accel);
+			spatialSplit = enabled;
+			spatialSplitOverlapThreshold = overlapThreshold;
+			spatialSplitMaxGrowth = maxGrowth;
+		}
+
+		// BVH を Morton 符号による LBVH で構築する
+		// SAH による構築より木の質は落ちるが構築が速いので、rebuildAccelerationStructure で毎フレーム作り直す場合に向く
+		// treeletOptimizationIterations は BVHBuildSettings::treeletOptimizationIterations
+		// buildAccelerationStructure より前に呼ぶこと (setSpatialSplit よりも優先される)
+		void setLinearBuild(bool enabled, int treeletOptimizationIterations = 0) {
+			ASSERT(!accel);
+			linearBuild = enabled;
+			this->treeletOptimizationIterations = treeletOptimizationIterations;
+		}
+
+		// 現在の頂点位置から AccelerationStructure を作り直す (キャッシュは使わない)
+		// updatePositions で頂点を大きく動かし、AABB の更新や部分的な作り直しでは BVH の質が保てない場合に使う
+		void rebuildAccelerationStructure() {
+			accel.reset();
+			buildAccelerationStructure();
+		}
+
+		// プリズムによるシェルマッピングの場合はプリズムの数
+		int accelerationStructurePrimitiveNum() const override {
+			return triangleNum();
+		}
+
+		// 構築済みであれば何もしない
+		// 構築せずに intersect などを呼んだ場合は例外を投げる
+		void buildAccelerationStructure(const BVHCache* cache = nullptr) override {
+			if (accel) { return; }
+
+			// リーフ内の三角形は SIMD でまとめて判定するので、三角形 1 つあたりの判定コストを低く見積もってリーフを大きめにする
+			BVHBuildSettings settings;
+			settings.maxPrimitivesInLeaf = TriangleBuffer::SIMDWidth;
+			settings.intersectionCost = 0.25f;
+			settings.spatialSplit = spatialSplit;
+			settings.spatialSplitOverlapThreshold = spatialSplitOverlapThreshold;
+			settings.spatialSplitMaxGrowth = spatialSplitMaxGrowth;
+			settings.linear = linearBuild;
+			settings.treeletOptimizationIterations = treeletOptimizationIterations;
+			if (prismShellMapping) {
+				// プリズム 1 つの判定はレイヤー数だけの三角形の判定になるので、リーフにはプリズムを 1 つずつ入れる
+				settings.maxPrimitivesInLeaf = 1;
+				settings.intersectionCost = 0.25f * shellLayerNum;
+			}
+
+			const int faceNum = triangleNum();
+			uint64_t cacheKey = 0;
+			if (cache != nullptr) {
+				cacheKey = BVHCache::hash(positions.data(), sizeof(Vector3f) * positions.size());
+				cacheKey = BVHCache::hash(indices.data(), sizeof(int) * indices.size(), cacheKey);
+				cacheKey = BVHCache::hash(settings, cacheKey);
+				if (prismShellMapping) {
+					cacheKey = BVHCache::hash(normals.data(), sizeof(Vector3f) * normals.size(), cacheKey);
+					cacheKey = BVHCache::hash(&displacementScale, sizeof(float), cacheKey);
+					cacheKey = BVHCache::hash(prismTopLayers.data(), sizeof(int) * prismTopLayers.size(), cacheKey);
+				}
+				auto bvh = std::make_unique<_BVH>(settings);
+				if (cache->load(cacheKey, faceNum, bvh.get())) {
+					accel = toMeshAccelerationStructure(std::move(bvh));
+				}
+			}
+
+			if (!accel) {
+				std::vector<Bounds3f> faceBounds(faceNum);
+#pragma omp parallel for
+				for (int i = 0; i < faceNum; ++i) {
+					faceBounds[i] = prismShellMapping ? prismBound(i) : triangle(i).bound();
+				}
+				auto splitTriangle = [this](int index, const Bounds3f& bound, int axis, float plane, Bounds3f* left, Bounds3f* right) {
+					triangle(index).splitBound(bound, axis, plane, left, right);
+				};
+				// プリズムは空間分割で AABB をそのまま切り分ける
+				auto bvh = std::make_unique<_BVH>(faceBounds, settings, prismShellMapping ? _BVH::PrimitiveSplitter() : _BVH::PrimitiveSplitter(splitTriangle));
+				if (cache != nullptr) {
+					cache->store(cacheKey, *bvh);
+				}
+				accel = toMeshAccelerationStructure(std::move(bvh));
+			}
+
+			triangles.build(positions.data(), indices.data(), accel->primitiveOrder());
+		}
+
+		Bounds3f bound() const override {
+			return aabb;
 		}
 
 		float surfaceArea() const override {
@@ -193,45 +359,148 @@ namespace xitils {
 		float surfaceAreaScaling(const Transform& t)  const override {
 			// TODO: ������
 			float scaledArea = 0.0f;
-			for (const auto& tri : triangles) {
-				scaledArea += tri->surfaceArea() * tri->surfaceAreaScaling(t);
+			for (int i = 0; i < baseTriangleNum(); ++i) {
+				TriangleIndexed tri = triangle(i);
+				scaledArea += tri.surfaceArea() * tri.surfaceAreaScaling(t);
 			}
 			return scaledArea / area;
 		}
 
-		bool intersect(const Ray& ray, float* tHit, SurfaceIntersection* isect) const override {
-			Ray rayTmp = Ray(ray);
-			if (accel->intersect(rayTmp, isect)) {
-				isect->shape = this;
-				*tHit = rayTmp.tMax;
-				return true;
+		bool intersect(const Ray& ray, float* tHit, HitRecord* hit) const override {
+			checkAccelerationStructure();
+			if (prismShellMapping) {
+				return intersectPrisms(ray, tHit, hit);
+			}
+			if (shellLayerNum > 0) {
+				return intersectTriangles(ray, tHit, hit, [this](int i, float b0, float b1) { return discardByAlpha(triangles.faceIndex(i), b0, b1); });
+			}
+			return intersectTriangles(ray, tHit, hit, [](int i, float b0, float b1) { return false; });
+		}
+
+		bool intersectWithStatistics(const Ray& ray, float* tHit, HitRecord* hit, TraversalStatistics* stats) const override {
+			checkAccelerationStructure();
+			if (prismShellMapping) {
+				return intersectPrisms<true>(ray, tHit, hit, stats);
+			}
+			if (shellLayerNum > 0) {
+				return intersectTriangles<true>(ray, tHit, hit, [this](int i, float b0, float b1) { return discardByAlpha(triangles.faceIndex(i), b0, b1); }, stats);
+			}
+			return intersectTriangles<true>(ray, tHit, hit, [](int i, float b0, float b1) { return false; }, stats);
+		}
+
+		bool intersectAnyWithStatistics(const Ray& ray, TraversalStatistics* stats) const override {
+			checkAccelerationStructure();
+			if (prismShellMapping) {
+				return intersectAnyPrisms<true>(ray, stats);
 			}
-			return false;
+			if (shellLayerNum > 0) {
+				return intersectAnyTriangles<true>(ray, [this](int i, float b0, float b1) { return discardByAlpha(triangles.faceIndex(i), b0, b1); }, stats);
+			}
+			return intersectAnyTriangles<true>(ray, [](int i, float b0, float b1) { return false; }, stats);
+		}
+
+		// メッシュの BVH の統計
+		// memoryBytes には TriangleBuffer の分も含める
+		AccelerationStructureStatistics accelerationStructureStatistics() const {
+			checkAccelerationStructure();
+			AccelerationStructureStatistics stats = accel->statistics();
+			stats.memoryBytes += triangles.memoryBytes();
+			return stats;
+		}
+
+		void computeSurfaceIntersection(const Ray& ray, const HitRecord& hit, SurfaceIntersection* isect) const override {
+			const int face = hit.layer * baseTriangleNum() + hit.triangleIndex;
+			if (prismShellMapping) {
+				shellTriangle(face).computeSurfaceIntersection(ray, hit, isect);
+				// 底面の三角形上の点を、交差したレイヤーの高さまで補間した法線の方向に押し出す
+				const int* index = &indices[hit.triangleIndex * 3];
+				const Vector3f n = lerp(normals[index[0]], normals[index[1]], normals[index[2]], hit.b0, hit.b1);
+				isect->p += displacementScale * shellHeight(face) * n;
+			} else if (shellLayerNum > 0) {
+				shellTriangle(face).computeSurfaceIntersection(ray, hit, isect);
+			} else {
+				triangle(face).computeSurfaceIntersection(ray, hit, isect);
+			}
+			isect->shape = this;
+			isect->triangleIndex = hit.triangleIndex;
+			isect->layer = hit.layer;
 		}
 
 		bool intersectAny(const Ray& ray) const override {
-			return accel->intersectAny(ray);
+			checkAccelerationStructure();
+			if (prismShellMapping) {
+				return intersectAnyPrisms(ray);
+			}
+			if (shellLayerNum > 0) {
+				return intersectAnyTriangles(ray, [this](int i, float b0, float b1) { return discardByAlpha(triangles.faceIndex(i), b0, b1); });
+			}
+			return intersectAnyTriangles(ray, [](int i, float b0, float b1) { return false; });
 		}
 
+		int intersectPacket(RayPacket& packet, int activeMask, HitRecord* hits) const override {
+			checkAccelerationStructure();
+			if (prismShellMapping) {
+				return intersectPrismsPacket(packet, activeMask, hits);
+			}
+			if (shellLayerNum > 0) {
+				return intersectTrianglesPacket(packet, activeMask, hits, [this](int i, float b0, float b1) { return discardByAlpha(triangles.faceIndex(i), b0, b1); });
+			}
+			return intersectTrianglesPacket(packet, activeMask, hits, [](int i, float b0, float b1) { return false; });
+		}
+
+		int intersectAnyPacket(const RayPacket& packet, int activeMask) const override {
+			checkAccelerationStructure();
+			if (prismShellMapping) {
+				return intersectAnyPrismsPacket(packet, activeMask);
+			}
+			if (shellLayerNum > 0) {
+				return intersectAnyTrianglesPacket(packet, activeMask, [this](int i, float b0, float b1) { return discardByAlpha(triangles.faceIndex(i), b0, b1); });
+			}
+			return intersectAnyTrianglesPacket(packet, activeMask, [](int i, float b0, float b1) { return false; });
+		}
+
+		// 三角形を面積に比例した確率で選ぶので、メッシュ全体で一様なサンプリングになる
 		SampledSurface sampleSurface(Sampler& sampler, float* pdf) const override {
-			// TODO: ���ׂĂ� Triangle ���瓙�m���ŃT���v�����O���Ă��邪�A
-			//       �{���͖ʐςɔ�Ⴕ���m���őI�Ԃׂ�
-			auto& tri = sampler.select(triangles);
-			auto sampled = tri->sampleSurface(sampler, pdf);
-			*pdf /= triangleNum();
+			const int face = triangleSampler.sample(sampler);
+			auto sampled = triangle(face).sampleSurface(sampler, pdf);
+			*pdf *= triangleSampler.pmf(face);
 
 			SampledSurface res;
 			res.shape = this;
-			res.tri = sampled.tri;
+			res.triangleIndex = sampled.triangleIndex;
 			res.p = sampled.p;
 			res.n = sampled.n;
 			res.shadingN = sampled.shadingN;
 			return res;
 		}
 
-		float surfacePDF(const Vector3f& p, const TriangleIndexed* tri) const override {
-			// TODO: ��L�𒼂����炱��������
-			return tri->surfacePDF(p) / triangleNum();
+		float surfacePDF(const Vector3f& p, int triangleIndex) const override {
+			return triangle(triangleIndex).surfacePDF(p) * triangleSampler.pmf(triangleIndex);
+		}
+
+		// シェルマッピングの場合はアルファで欠ける部分があるので、三角形ごとには分けない
+		int lightTriangleNum() const override {
+			return prismShellMapping || shellLayerNum > 0 ? 0 : triangleNum();
+		}
+
+		void lightTriangle(int i, Vector3f* p0, Vector3f* p1, Vector3f* p2) const override {
+			const TriangleIndexed tri = triangle(i);
+			*p0 = tri.position(0);
+			*p1 = tri.position(1);
+			*p2 = tri.position(2);
+		}
+
+		SampledSurface sampleLightTriangle(int i, Sampler& sampler) const override {
+			float pdf;
+			auto sampled = triangle(i).sampleSurface(sampler, &pdf);
+
+			SampledSurface res;
+			res.shape = this;
+			res.triangleIndex = sampled.triangleIndex;
+			res.p = sampled.p;
+			res.n = sampled.n;
+			res.shadingN = sampled.shadingN;
+			return res;
 		}
 
 	private:
@@ -241,47 +510,453 @@ namespace xitils {
 		std::vector<Vector3f> tangents;
 		std::vector<Vector3f> bitangents;
 		std::vector<int> indices;
-		std::vector<TriangleIndexed*> triangles;
+		int revision = 0;
 
-		std::unique_ptr<AccelerationStructure> accel;
+		// BVH は三角形の AABB のみから構築し、リーフからは triangles を番号で参照する
+		std::unique_ptr<MeshAccelerationStructure> accel;
+		TriangleBuffer triangles;
+		bool spatialSplit = false;
+		float spatialSplitOverlapThreshold = 1e-5f;
+		float spatialSplitMaxGrowth = 0.3f;
+		bool linearBuild = false;
+		int treeletOptimizationIterations = 0;
 
 		std::shared_ptr<const Texture> displacementMap;
 		float displacementScale;
+		int shellLayerNum = 0; // シェルマッピングを行わない場合は 0
+		bool prismShellMapping = false; // true ならシェルマッピングの三角形は複製しない
+		std::shared_ptr<const MinMaxMipmap> displacementMipmap; // プリズムによるシェルマッピングの場合のみ
+		std::vector<int> prismTopLayers; // 面ごとの変位が届きうる最も上のレイヤー
 
+		Bounds3f aabb;
 		float area;
+		AliasTable triangleSampler; // 三角形を面積に比例した確率で選ぶ
 
+		void calcBound() {
+			aabb = Bounds3f();
+			for (const auto& p : positions) {
+				aabb = merge(aabb, p);
+			}
+			if (prismShellMapping) {
+				for (int i = 0; i < positions.size(); ++i) {
+					aabb = merge(aabb, positions[i] + displacementScale * normals[i]);
+				}
+			}
+		}
+
+		// シェルマッピングの場合は底面の三角形のみを使う
 		void calcSurfaceArea() {
+			std::vector<float> triangleAreas(baseTriangleNum());
 			area = 0.0f;
-			for (const auto& tri : triangles) {
-				area += tri->surfaceArea();
+			for (int i = 0; i < baseTriangleNum(); ++i) {
+				triangleAreas[i] = triangle(i).surfaceArea();
+				area += triangleAreas[i];
 			}
+			triangleSampler = AliasTable(triangleAreas);
+		}
+
+		// face 番目の三角形を参照するもの
+		// 交差判定には triangles を使い、こちらは交差点の計算やサンプリングにのみ使う
+		TriangleIndexed triangle(int face) const {
+			return TriangleIndexed(
+				positions.data(),
+				!texCoords.empty() ? texCoords.data() : nullptr,
+				!normals.empty() ? normals.data() : nullptr,
+				!tangents.empty() ? tangents.data() : nullptr,
+				!bitangents.empty() ? bitangents.data() : nullptr,
+				indices.data(), face);
+		}
+
+		TriangleIndexedWithShellMapping shellTriangle(int face) const {
+			return TriangleIndexedWithShellMapping(
+				positions.data(),
+				!texCoords.empty() ? texCoords.data() : nullptr,
+				!normals.empty() ? normals.data() : nullptr,
+				!tangents.empty() ? tangents.data() : nullptr,
+				!bitangents.empty() ? bitangents.data() : nullptr,
+				indices.data(), shellBaseFace(face),
+				displacementMap.get(), displacementScale, shellHeight(face));
+		}
+
+		// シェルマッピングで複製する前の三角形の数
+		// 複製した三角形は (レイヤー) * baseTriangleNum() + (底面の番号) 番目になり、プリズムの場合も同じ番号で交差判定の結果を表す
+		int baseTriangleNum() const {
+			return shellLayerNum > 0 && !prismShellMapping ? triangleNum() / shellLayerNum : triangleNum();
 		}
 
-		void buildTriangles() {
+		// シェルマッピングの face 番目の三角形が属するレイヤーの高さ ([0,1] の範囲)
+		float shellHeight(int face) const {
+			const int layer = face / baseTriangleNum();
+			return (float)layer / (shellLayerNum - 1);
+		}
 
-			int faceNum = indices.size() / 3;
+		// シェルマッピングの face 番目の三角形の頂点を参照する indices 上の三角形の番号
+		int shellBaseFace(int face) const {
+			return prismShellMapping ? face % triangleNum() : face;
+		}
 
+		// face 番目の三角形を底面とするプリズムの AABB
+		// 変位が届きうる最も上のレイヤー (prismTopLayers) までで囲む
+		Bounds3f prismBound(int face) const {
+			const int* index = &indices[face * 3];
+			const float d = displacementScale * prismTopLayers[face] / (shellLayerNum - 1);
+			Bounds3f res;
+			for (int k = 0; k < 3; ++k) {
+				res = merge(res, positions[index[k]]);
+				res = merge(res, positions[index[k]] + d * normals[index[k]]);
+			}
+			return res;
+		}
+
+		// face 番目の三角形の uv の範囲で変位が届きうる最も上のレイヤー
+		int prismTopLayer(int face) const {
+			Vector2f uvMin, uvMax;
+			if (!texCoords.empty()) {
+				const int* index = &indices[face * 3];
+				uvMin = min(texCoords[index[0]], texCoords[index[1]], texCoords[index[2]]);
+				uvMax = max(texCoords[index[0]], texCoords[index[1]], texCoords[index[2]]);
+			}
+			float minValue, maxValue;
+			displacementMipmap->range(uvMin, uvMax, &minValue, &maxValue);
+			const float top = floorf((maxValue + MinMaxMipmap::Epsilon) * (shellLayerNum - 1));
+			return (int)clamp(top, 0.0f, (float)(shellLayerNum - 1));
+		}
+
+		// プリズム内のレイヤーの三角形との幾何的な交差
+		struct PrismLayerHit {
+			int layer;
+			float height;
+			float t;
+			float b0, b1;
+			Vector2f texCoord;
+		};
+		// 幾何的な交差をこの数ずつ集めてから、まとめてアルファによる棄却を行う
+		static const int PrismLayerHitChunkSize = 16;
+
+		// face 番目のプリズムとの交差判定
+		// 各レイヤーの三角形は buildTrianglesWithShellMapping で複製したものと同じく、頂点を法線方向に押し出したものになる
+		// TriangleIndexed::intersectTriangle と同じくレイの向きを z 軸とする空間に移すと、押し出しの高さ d に対して頂点は線形、
+		// 辺の関数は d の 2 次式になるので、係数をプリズムごとに 1 度だけ求めて各レイヤーでは 2 次式の評価だけで判定する
+		// レイが底面に向かう場合は上のレイヤーから、そうでない場合は下のレイヤーから順に辿る
+		// 変位の届かない prismTopLayers より上のレイヤーは判定せず、アルファによる棄却は resolvePrismLayerHits でまとめて行う
+		// AnyHit が true なら棄却されない交差が見つかった時点で打ち切る
+		template<bool AnyHit> bool intersectPrism(int face, const Ray& ray, float* tMax, int* hitFace, float* b0Hit, float* b1Hit) const {
+			const int* index = &indices[face * 3];
+
+			int kz = abs(ray.d).maxDimension();
+			int kx = kz + 1; if (kx == 3) { kx = 0; }
+			int ky = kx + 1; if (ky == 3) { ky = 0; }
+			const auto d = permute(ray.d, kx, ky, kz);
+			const float sx = -d.x / d.z;
+			const float sy = -d.y / d.z;
+			const float sz = 1.0f / d.z;
+
+			// 底面の頂点 p と法線 n をレイの空間に移す (n は平行移動しない)
+			Vector3f p[3], n[3];
+			for (int k = 0; k < 3; ++k) {
+				p[k] = permute(positions[index[k]] - ray.o, kx, ky, kz);
+				p[k].x += sx * p[k].z;
+				p[k].y += sy * p[k].z;
+				n[k] = permute(normals[index[k]], kx, ky, kz);
+				n[k].x += sx * n[k].z;
+				n[k].y += sy * n[k].z;
+			}
+
+			// 辺の関数 e_k(d) = a_k d^2 + b_k d + c_k
+			float ea[3], eb[3], ec[3];
+			for (int k = 0; k < 3; ++k) {
+				const int i = k == 2 ? 0 : k + 1;
+				const int j = i == 2 ? 0 : i + 1;
+				ec[k] = p[i].x * p[j].y - p[i].y * p[j].x;
+				eb[k] = (p[i].x * n[j].y - p[i].y * n[j].x) + (n[i].x * p[j].y - n[i].y * p[j].x);
+				ea[k] = n[i].x * n[j].y - n[i].y * n[j].x;
+			}
+
+			const Vector3f& p0 = positions[index[0]];
+			const bool downward = dot(ray.d, cross(positions[index[1]] - p0, positions[index[2]] - p0)) < 0.0f;
+			const int topLayer = prismTopLayers[face];
+			PrismLayerHit hits[PrismLayerHitChunkSize];
+			int hitNum = 0;
+			bool found = false;
+			for (int l = 0; l <= topLayer; ++l) {
+				if (hitNum == PrismLayerHitChunkSize) {
+					if (resolvePrismLayerHits<AnyHit>(face, hits, 0, hitNum, tMax, hitFace, b0Hit, b1Hit)) {
+						found = true;
+						if constexpr (AnyHit) { return true; }
+					}
+					hitNum = 0;
+				}
+
+				const int layer = downward ? topLayer - l : l;
+				const float height = (float)layer / (shellLayerNum - 1);
+				const float h = displacementScale * height;
+
+				const float e0 = ec[0] + h * (eb[0] + h * ea[0]);
+				const float e1 = ec[1] + h * (eb[1] + h * ea[1]);
+				const float e2 = ec[2] + h * (eb[2] + h * ea[2]);
+				if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) { continue; }
+				const float det = e0 + e1 + e2;
+				if (det == 0) { continue; }
+
+				const float tScaled = e0 * (p[0].z + h * n[0].z) * sz + e1 * (p[1].z + h * n[1].z) * sz + e2 * (p[2].z + h * n[2].z) * sz;
+				if (det < 0 && (tScaled >= 0 || tScaled < *tMax * det)) { continue; }
+				if (det > 0 && (tScaled <= 0 || tScaled > *tMax * det)) { continue; }
+
+				const float invDet = 1 / det;
+				PrismLayerHit& hit = hits[hitNum++];
+				hit.layer = layer;
+				hit.height = height;
+				hit.t = tScaled * invDet;
+				hit.b0 = e0 * invDet;
+				hit.b1 = e1 * invDet;
+				if (!texCoords.empty()) {
+					hit.texCoord = lerp(texCoords[index[0]], texCoords[index[1]], texCoords[index[2]], hit.b0, hit.b1);
+				} else {
+					hit.texCoord = Vector2f();
+				}
+			}
+			if (hitNum > 0 && resolvePrismLayerHits<AnyHit>(face, hits, 0, hitNum, tMax, hitFace, b0Hit, b1Hit)) {
+				found = true;
+			}
+			return found;
+		}
+
+		// hits の [begin, end) の交差をレイの進む順にアルファで棄却し、残ったもののうち最も近いものを採る
+		// 交差点の uv を囲む矩形での変位の範囲を MinMaxMipmap で求め、変位が全てのレイヤーより低ければまとめて棄却する
+		// そうでなければ半分に分けて辿り、交差 1 つでは変位がレイヤーより確実に高ければテクスチャを参照せずに採用する
+		template<bool AnyHit> bool resolvePrismLayerHits(int face, const PrismLayerHit* hits, int begin, int end, float* tMax, int* hitFace, float* b0Hit, float* b1Hit) const {
+			Vector2f uvMin(Infinity), uvMax(-Infinity);
+			float heightMin = Infinity;
+			for (int i = begin; i < end; ++i) {
+				// 先に採用した交差より遠いもの
+				if (hits[i].t > *tMax) { continue; }
+				uvMin = min(uvMin, hits[i].texCoord);
+				uvMax = max(uvMax, hits[i].texCoord);
+				heightMin = std::min(heightMin, hits[i].height);
+			}
+			if (heightMin == Infinity) { return false; }
+
+			float minValue, maxValue;
+			displacementMipmap->range(uvMin, uvMax, &minValue, &maxValue);
+			if (maxValue + MinMaxMipmap::Epsilon < heightMin) { return false; }
+
+			if (end - begin == 1) {
+				const PrismLayerHit& hit = hits[begin];
+				if (minValue - MinMaxMipmap::Epsilon < hit.height && displacementMap->rgb(hit.texCoord).x < hit.height) {
+					return false;
+				}
+				if constexpr (!AnyHit) {
+					*tMax = hit.t;
+					*hitFace = hit.layer * baseTriangleNum() + face;
+					*b0Hit = hit.b0;
+					*b1Hit = hit.b1;
+				}
+				return true;
+			}
+
+			const int mid = (begin + end) / 2;
+			bool found = resolvePrismLayerHits<AnyHit>(face, hits, begin, mid, tMax, hitFace, b0Hit, b1Hit);
+			if constexpr (AnyHit) {
+				if (found) { return true; }
+			}
+			if (resolvePrismLayerHits<AnyHit>(face, hits, mid, end, tMax, hitFace, b0Hit, b1Hit)) {
+				found = true;
+			}
+			return found;
+		}
+
+		// リーフ内のプリズムを順に判定する
+		template<bool AnyHit> bool intersectPrismLeaf(int offset, int num, const Ray& ray, float* tMax, int* hitFace, float* b0Hit, float* b1Hit) const {
+			bool found = false;
+			for (int i = offset; i < offset + num; ++i) {
+				if (intersectPrism<AnyHit>(triangles.faceIndex(i), ray, tMax, hitFace, b0Hit, b1Hit)) {
+					found = true;
+					if constexpr (AnyHit) { break; }
+				}
+			}
+			return found;
+		}
+
+		// CountStatistics が true なら、三角形の数としてプリズムの数とレイヤー数の積を数える
+		template<bool CountStatistics = false> bool intersectPrisms(const Ray& ray, float* tHit, HitRecord* hit, TraversalStatistics* stats = nullptr) const {
+			Ray rayTmp = Ray(ray);
+			int hitFace = -1;
+			float b0Hit, b1Hit;
+			accel->traverse<CountStatistics>(rayTmp, [&](int offset, int num, Ray& leafRay) {
+				if constexpr (CountStatistics) { stats->primitivesTested += num * shellLayerNum; }
+				return intersectPrismLeaf<false>(offset, num, leafRay, &leafRay.tMax, &hitFace, &b0Hit, &b1Hit);
+				}, stats);
+			if (hitFace < 0) { return false; }
+
+			*tHit = rayTmp.tMax;
+			hit->t = rayTmp.tMax;
+			hit->b0 = b0Hit;
+			hit->b1 = b1Hit;
+			hit->shape = this;
+			setHitTriangle(hitFace, hit);
+			return true;
+		}
+
+		template<bool CountStatistics = false> bool intersectAnyPrisms(const Ray& ray, TraversalStatistics* stats = nullptr) const {
+			return accel->traverseAny<CountStatistics>(ray, [&](int offset, int num, const Ray& leafRay) {
+				if constexpr (CountStatistics) { stats->primitivesTested += num * shellLayerNum; }
+				float tMax = leafRay.tMax;
+				int hitFace;
+				float b0, b1;
+				return intersectPrismLeaf<true>(offset, num, leafRay, &tMax, &hitFace, &b0, &b1);
+				}, stats);
+		}
+
+		int intersectPrismsPacket(RayPacket& packet, int activeMask, HitRecord* hits) const {
+			int hitFaces[RayPacket::Size];
+			float b0Hit[RayPacket::Size], b1Hit[RayPacket::Size];
+
+			const int hitMask = accel->traversePacket(packet, activeMask, [&](int offset, int num, RayPacket& leafPacket, int laneMask) {
+				int leafHitMask = 0;
+				for (int i = 0; i < RayPacket::Size; ++i) {
+					if (!(laneMask & (1 << i))) { continue; }
+					if (intersectPrismLeaf<false>(offset, num, leafPacket.ray(i), &leafPacket.tMax[i], &hitFaces[i], &b0Hit[i], &b1Hit[i])) {
+						leafHitMask |= 1 << i;
+					}
+				}
+				return leafHitMask;
+				});
+
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				if (!(hitMask & (1 << i))) { continue; }
+				hits[i].t = packet.tMax[i];
+				hits[i].b0 = b0Hit[i];
+				hits[i].b1 = b1Hit[i];
+				hits[i].shape = this;
+				setHitTriangle(hitFaces[i], &hits[i]);
+			}
+			return hitMask;
+		}
+
+		int intersectAnyPrismsPacket(const RayPacket& packet, int activeMask) const {
+			return accel->traversePacketAny(packet, activeMask, [&](int offset, int num, const RayPacket& leafPacket, int laneMask) {
+				int occludedMask = 0;
+				for (int i = 0; i < RayPacket::Size; ++i) {
+					if (!(laneMask & (1 << i))) { continue; }
+					float tMax = leafPacket.tMax[i];
+					int hitFace;
+					float b0, b1;
+					if (intersectPrismLeaf<true>(offset, num, leafPacket.ray(i), &tMax, &hitFace, &b0, &b1)) {
+						occludedMask |= 1 << i;
+					}
+				}
+				return occludedMask;
+				});
+		}
+
+		// リーフ内の三角形は TriangleBuffer でまとめて判定する
+		// discard はシェルマッピングの場合のみアルファによる棄却を行い、それ以外では常に false を返すもの
+		// CountStatistics が true なら stats にノード数と三角形数を加える (リーフ内の三角形は SIMD でまとめて判定するので全て数える)
+		template<bool CountStatistics = false, typename F> bool intersectTriangles(const Ray& ray, float* tHit, HitRecord* hit, const F& discard, TraversalStatistics* stats = nullptr) const {
+			const TriangleBuffer::RaySIMD raySIMD(ray);
+			Ray rayTmp = Ray(ray);
+			int hitTriangle = -1;
+			float b0Hit, b1Hit;
+			accel->traverse<CountStatistics>(rayTmp, [&](int offset, int num, Ray& leafRay) {
+				if constexpr (CountStatistics) { stats->primitivesTested += num; }
+				return triangles.intersect(offset, num, raySIMD, leafRay.tMax, &hitTriangle, &leafRay.tMax, &b0Hit, &b1Hit, discard);
+				}, stats);
+			if (hitTriangle < 0) { return false; }
+
+			*tHit = rayTmp.tMax;
+			hit->t = rayTmp.tMax;
+			hit->b0 = b0Hit;
+			hit->b1 = b1Hit;
+			hit->shape = this;
+			setHitTriangle(triangles.faceIndex(hitTriangle), hit);
+			return true;
+		}
+
+		template<bool CountStatistics = false, typename F> bool intersectAnyTriangles(const Ray& ray, const F& discard, TraversalStatistics* stats = nullptr) const {
+			const TriangleBuffer::RaySIMD raySIMD(ray);
+			return accel->traverseAny<CountStatistics>(ray, [&](int offset, int num, const Ray& leafRay) {
+				if constexpr (CountStatistics) { stats->primitivesTested += num; }
+				return triangles.intersectAny(offset, num, raySIMD, leafRay.tMax, discard);
+				}, stats);
+		}
+
+		// BVH のトラバーサルはパケット単位で行い、リーフでは三角形を 1 つずつ、リーフに届いたパケットのレイとまとめて SIMD で判定する
+		template<typename F> int intersectTrianglesPacket(RayPacket& packet, int activeMask, HitRecord* hits, const F& discard) const {
+			const TriangleBuffer::RayPacketSIMD raySIMD(packet, activeMask);
+			int hitTriangles[RayPacket::Size];
+			float b0Hit[RayPacket::Size], b1Hit[RayPacket::Size];
+
+			const int hitMask = accel->traversePacket(packet, activeMask, [&](int offset, int num, RayPacket& leafPacket, int laneMask) {
+				return triangles.intersectPacket(offset, num, raySIMD, laneMask, leafPacket.tMax, hitTriangles, b0Hit, b1Hit, discard);
+				});
+
+			for (int i = 0; i < RayPacket::Size; ++i) {
+				if (!(hitMask & (1 << i))) { continue; }
+				hits[i].t = packet.tMax[i];
+				hits[i].b0 = b0Hit[i];
+				hits[i].b1 = b1Hit[i];
+				hits[i].shape = this;
+				setHitTriangle(triangles.faceIndex(hitTriangles[i]), &hits[i]);
+			}
+			return hitMask;
+		}
+
+		template<typename F> int intersectAnyTrianglesPacket(const RayPacket& packet, int activeMask, const F& discard) const {
+			const TriangleBuffer::RayPacketSIMD raySIMD(packet, activeMask);
+			return accel->traversePacketAny(packet, activeMask, [&](int offset, int num, const RayPacket& leafPacket, int laneMask) {
+				return triangles.intersectAnyPacket(offset, num, raySIMD, laneMask, leafPacket.tMax, discard);
+				});
+		}
+
+		// 構築と BVHCache は二分木の _BVH で行い、MeshAccelerationStructure が別のものであれば変換する
+		template<typename T = MeshAccelerationStructure> static std::unique_ptr<T> toMeshAccelerationStructure(std::unique_ptr<_BVH> bvh) {
+			if constexpr (std::is_same_v<T, _BVH>) {
+				return bvh;
+			} else {
+				return std::make_unique<T>(*bvh);
+			}
+		}
+
+		// ASSERT はリリースビルドで消えるので、構築し忘れによる null の参照を防ぐために常に確かめる
+		void checkAccelerationStructure() const {
+			if (!accel) { throw "TriangleMesh: buildAccelerationStructure has not been called"; }
+		}
+
+		void resetAccelerationStructure() {
+			accel.reset();
 			triangles.clear();
-			triangles.resize(faceNum);
+			shellLayerNum = 0;
+			prismShellMapping = false;
+			displacementMipmap.reset();
+			prismTopLayers.clear();
+		}
 
+		// 三角形は複製せず、交差判定の際にプリズム内のレイヤーを作る
+		void setPrismShellMapping(std::shared_ptr<const Texture> displacement, float displacemntScale, int layerNum) {
+			ASSERT(layerNum >= 2);
+			ASSERT(!normals.empty());
+			this->displacementMap = displacement;
+			this->displacementScale = displacemntScale;
+			shellLayerNum = layerNum;
+			prismShellMapping = true;
+
+			// 変位の範囲は読み込み時にミップマップから求めておき、プリズムの AABB とトラバーサルで辿るレイヤーを絞る
+			displacementMipmap = std::make_shared<MinMaxMipmap>(*displacement);
+			const int faceNum = triangleNum();
+			prismTopLayers.resize(faceNum);
+#pragma omp parallel for
 			for (int i = 0; i < faceNum; ++i) {
-				triangles[i] =
-					new TriangleIndexed(
-						positions.data(),
-						!texCoords.empty() ? texCoords.data() : nullptr,
-						!normals.empty() ? normals.data() : nullptr,
-						!tangents.empty() ? tangents.data() : nullptr,
-						!bitangents.empty() ? bitangents.data() : nullptr,
-						indices.data(), i);
+				prismTopLayers[i] = prismTopLayer(i);
 			}
+			calcBound();
 		}
 
-		void buildTrianglesWithShellMapping(const Texture* displacement, float displacemntScale, int layerNum) {
+		void buildTrianglesWithShellMapping(float displacemntScale, int layerNum) {
 
 			int origFaceNum = indices.size() / 3;
 
-			triangles.clear();
-			triangles.resize(origFaceNum * layerNum);
+			resetAccelerationStructure();
+			shellLayerNum = layerNum;
 
 			int origVertNum = positions.size();
 
@@ -305,27 +980,6 @@ namespace xitils {
 					indices[layer * origFaceNum * 3 + i] = indices[i] + layer * origVertNum;
 				}
 			}
-
-			for (int layer = 0; layer < layerNum; ++layer) {
-				for (int i = 0; i < origFaceNum; ++i) {
-					int index = layer * origFaceNum + i;
-					triangles[index] =
-						new TriangleIndexedWithShellMapping(
-							positions.data(),
-							!texCoords.empty() ? texCoords.data() : nullptr,
-							!normals.empty() ? normals.data() : nullptr,
-							!tangents.empty() ? tangents.data() : nullptr,
-							!bitangents.empty() ? bitangents.data() : nullptr,
-							indices.data(), index,
-							displacement, displacemntScale, (float)layer / (layerNum-1)
-							);
-				}
-			}
-		}
-
-
-		void buildBVH() {
-			accel = std::make_unique<AccelerationStructure>(triangles);
 		}
 
 		void setPositions(const Vector3f* data, int num){
@@ -14,6 +14,9 @@
 #include <glm/glm.hpp>
 #include <simdpp/simd.h>
 #include <iterator>
+#include <algorithm>
+#include <unordered_set>
+#include <unordered_map>
 
 #undef INFINITY
 
@@ -47,6 +50,20 @@ namespace xitils {
 	inline bool inRange(float x, float minVal, float maxVal) { return minVal <= x && x <= maxVal; }
 	inline bool inRange01(float x) { return inRange(x, 0.0f, 1.0f); }
 
+	// 10 ビットの整数の各ビットの間に 2 ビットずつ 0 を挟む
+	inline uint32_t expandBits3(uint32_t x) {
+		x = (x | (x << 16)) & 0x030000FF;
+		x = (x | (x << 8)) & 0x0300F00F;
+		x = (x | (x << 4)) & 0x030C30C3;
+		x = (x | (x << 2)) & 0x09249249;
+		return x;
+	}
+
+	// 各軸 10 ビットの整数座標から 30 ビットのモートン符号を求める
+	inline uint32_t encodeMorton3(uint32_t x, uint32_t y, uint32_t z) {
+		return (expandBits3(x) << 2) | (expandBits3(y) << 1) | expandBits3(z);
+	}
+
 	template <typename T, typename U> void map(const std::vector<T>& src, std::vector<U>* dest, const std::function<U(const T&)>& f) {
 		dest->clear();
 		dest->resize(src.size());
@@ -0,0 +1,493 @@
+﻿#include <Xitils/AccelerationStructure.h>
+#include <Xitils/PathTracer.h>
+#include <Xitils/Scene.h>
+#include <Xitils/TriangleMesh.h>
+
+#include <omp.h>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+
+using namespace xitils;
+
+// BVH の構築時間をスレッド数を変えながら計測する
+// 後半では BVH の更新やキャッシュからの読み込みにかかる時間、レイの並べ替えの効果、構築した階層の統計、空間分割 (SBVH) の効果、
+// Morton 符号による構築 (LBVH) の速さと木の質も計測する
+
+namespace {
+
+	struct GridMeshData {
+		std::vector<Vector3f> positions;
+		std::vector<int> indices;
+	};
+
+	// 起伏のある格子状のメッシュ
+	GridMeshData createGridMeshData(int resolution, uint32_t seed) {
+		GridMeshData data;
+		std::mt19937 rng(seed);
+		std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+
+		const int vertNum = resolution + 1;
+		data.positions.resize(vertNum * vertNum);
+		for (int y = 0; y < vertNum; ++y) {
+			for (int x = 0; x < vertNum; ++x) {
+				float u = (float)x / resolution;
+				float v = (float)y / resolution;
+				float h = 0.1f * sinf(u * 20.0f) * cosf(v * 13.0f) + 0.01f * dist(rng);
+				data.positions[y * vertNum + x] = Vector3f(u - 0.5f, h, v - 0.5f);
+			}
+		}
+
+		data.indices.reserve(resolution * resolution * 6);
+		for (int y = 0; y < resolution; ++y) {
+			for (int x = 0; x < resolution; ++x) {
+				int i00 = y * vertNum + x;
+				int i10 = i00 + 1;
+				int i01 = i00 + vertNum;
+				int i11 = i01 + 1;
+				data.indices.insert(data.indices.end(), { i00, i01, i10, i10, i01, i11 });
+			}
+		}
+
+		return data;
+	}
+
+	// 構築結果が同じであることを確かめるため、固定したレイの交差距離を足し合わせる
+	template<typename F> double traceChecksum(F intersect) {
+		std::mt19937 rng(1234);
+		std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+		double sum = 0.0;
+		for (int i = 0; i < 100000; ++i) {
+			Ray ray(Vector3f(dist(rng), 1.0f, dist(rng)), normalize(Vector3f(dist(rng) * 0.2f, -1.0f, dist(rng) * 0.2f)));
+			if (intersect(ray)) { sum += ray.tMax; }
+		}
+		return sum;
+	}
+
+	std::vector<int> threadNums() {
+		std::vector<int> res;
+		const int maxThreadNum = omp_get_max_threads();
+		for (int n = 1; n < maxThreadNum; n *= 2) {
+			res.push_back(n);
+		}
+		res.push_back(maxThreadNum);
+		return res;
+	}
+
+	double elapsedMilliseconds(const std::chrono::system_clock::time_point& start) {
+		return std::chrono::duration<double, std::milli>(std::chrono::system_clock::now() - start).count();
+	}
+
+	void benchmarkSingleMesh(int resolution) {
+		GridMeshData data = createGridMeshData(resolution, 1);
+		const int faceNum = data.indices.size() / 3;
+
+		std::vector<TriangleIndexed*> triangles(faceNum);
+		for (int i = 0; i < faceNum; ++i) {
+			triangles[i] = new TriangleIndexed(data.positions.data(), nullptr, nullptr, nullptr, nullptr, data.indices.data(), i);
+		}
+
+		printf("single mesh : %d triangles\n", faceNum);
+		printf("  threads  build [ms]  speedup  checksum\n");
+		double baseTime = 0.0;
+		for (int threadNum : threadNums()) {
+			omp_set_num_threads(threadNum);
+			auto start = std::chrono::system_clock::now();
+			_BVH bvh(triangles);
+			double time = elapsedMilliseconds(start);
+			if (threadNum == 1) { baseTime = time; }
+
+			HitRecord hit;
+			double checksum = traceChecksum([&](Ray& ray) { return bvh.intersect(ray, &hit); });
+			printf("  %7d  %10.1f  %7.2f  %.6f\n", threadNum, time, baseTime / time, checksum);
+		}
+
+		for (auto* tri : triangles) {
+			delete tri;
+		}
+	}
+
+	void benchmarkScene(int meshNum, int resolution) {
+		std::vector<GridMeshData> data;
+		for (int i = 0; i < meshNum; ++i) {
+			data.push_back(createGridMeshData(resolution, i + 1));
+		}
+
+		printf("scene : %d meshes x %d triangles\n", meshNum, resolution * resolution * 2);
+		printf("  threads  build [ms]  speedup  checksum\n");
+		double baseTime = 0.0;
+		for (int threadNum : threadNums()) {
+			omp_set_num_threads(threadNum);
+
+			auto material = std::make_shared<Diffuse>(Vector3f(0.5f));
+			Scene scene;
+			for (int i = 0; i < meshNum; ++i) {
+				auto mesh = std::make_shared<TriangleMesh>();
+				mesh->setGeometry(data[i].positions.size(), data[i].positions.data(), nullptr, nullptr, nullptr, nullptr, data[i].indices.size(), data[i].indices.data());
+				Transform t = translate((i % 8) * 1.1f, 0.0f, (i / 8) * 1.1f);
+				scene.addObject(std::make_shared<Object>(mesh, material, t));
+			}
+
+			auto start = std::chrono::system_clock::now();
+			scene.buildAccelerationStructure();
+			double time = elapsedMilliseconds(start);
+			if (threadNum == 1) { baseTime = time; }
+
+			HitRecord hit;
+			double checksum = traceChecksum([&](Ray& ray) { return scene.intersect(ray, &hit); });
+			printf("  %7d  %10.1f  %7.2f  %.6f\n", threadNum, time, baseTime / time, checksum);
+		}
+	}
+
+	// 一部の Object を動かしたときの、上位の AccelerationStructure の更新にかかる時間
+	void benchmarkInstanceUpdate(int instanceNum, int movedNum) {
+		GridMeshData data = createGridMeshData(256, 1);
+		auto mesh = std::make_shared<TriangleMesh>();
+		mesh->setGeometry(data.positions.size(), data.positions.data(), nullptr, nullptr, nullptr, nullptr, data.indices.size(), data.indices.data());
+		auto material = std::make_shared<Diffuse>(Vector3f(0.5f));
+
+		std::mt19937 rng(1);
+		std::uniform_real_distribution<float> dist(-10.0f, 10.0f);
+
+		Scene scene;
+		std::vector<std::shared_ptr<Object>> objects;
+		for (int i = 0; i < instanceNum; ++i) {
+			auto object = std::make_shared<Object>(mesh, material, translate(dist(rng), dist(rng), dist(rng)));
+			objects.push_back(object);
+			scene.addObject(object);
+		}
+
+		printf("instances : %d instances of a %d triangle mesh, %d moved\n", instanceNum, (int)data.indices.size() / 3, movedNum);
+
+		auto start = std::chrono::system_clock::now();
+		scene.buildAccelerationStructure();
+		printf("  full build : %10.1f us\n", elapsedMilliseconds(start) * 1000.0);
+
+		auto moveObjects = [&]() {
+			for (int i = 0; i < movedNum; ++i) {
+				scene.setObjectTransform(objects[i * instanceNum / movedNum], translate(dist(rng), dist(rng), dist(rng)));
+			}
+		};
+
+		moveObjects();
+		start = std::chrono::system_clock::now();
+		scene.updateAccelerationStructure(false);
+		printf("  refit      : %10.1f us\n", elapsedMilliseconds(start) * 1000.0);
+
+		moveObjects();
+		start = std::chrono::system_clock::now();
+		scene.updateAccelerationStructure(true);
+		printf("  rebuild    : %10.1f us\n", elapsedMilliseconds(start) * 1000.0);
+	}
+
+	// 頂点アニメーションするメッシュの BVH の更新にかかる時間
+	void benchmarkDeformingMesh(int resolution, int frameNum) {
+		GridMeshData data = createGridMeshData(resolution, 1);
+		auto mesh = std::make_shared<TriangleMesh>();
+		mesh->setGeometry(data.positions.size(), data.positions.data(), nullptr, nullptr, nullptr, nullptr, data.indices.size(), data.indices.data());
+
+		auto start = std::chrono::system_clock::now();
+		mesh->buildAccelerationStructure();
+		printf("deforming mesh : %d triangles, %d frames\n", (int)data.indices.size() / 3, frameNum);
+		printf("  build                 : %10.1f ms\n", elapsedMilliseconds(start));
+
+		std::vector<Vector3f> positions = data.positions;
+		auto animate = [&](int frame) {
+			for (int i = 0; i < (int)positions.size(); ++i) {
+				const Vector3f& p = data.positions[i];
+				positions[i] = Vector3f(p.x, p.y + 0.2f * sinf(p.x * 10.0f + frame * 0.3f), p.z);
+			}
+		};
+
+		double refitTime = 0.0;
+		for (int frame = 0; frame < frameNum; ++frame) {
+			animate(frame);
+			start = std::chrono::system_clock::now();
+			mesh->updatePositions(positions.size(), positions.data());
+			refitTime += elapsedMilliseconds(start);
+		}
+		printf("  refit                 : %10.1f ms/frame\n", refitTime / frameNum);
+
+		double rebuildTime = 0.0;
+		for (int frame = 0; frame < frameNum; ++frame) {
+			animate(frame);
+			start = std::chrono::system_clock::now();
+			mesh->updatePositions(positions.size(), positions.data(), nullptr, nullptr, nullptr, 1.5f);
+			rebuildTime += elapsedMilliseconds(start);
+		}
+		printf("  refit + rebuild (1.5) : %10.1f ms/frame\n", rebuildTime / frameNum);
+	}
+
+	// BVHCache を使った場合の、初回 (構築して保存する) と 2 回目以降 (読み込む) の時間
+	void benchmarkBVHCache(int resolution) {
+		GridMeshData data = createGridMeshData(resolution, 1);
+		auto createMesh = [&]() {
+			auto mesh = std::make_shared<TriangleMesh>();
+			mesh->setGeometry(data.positions.size(), data.positions.data(), nullptr, nullptr, nullptr, nullptr, data.indices.size(), data.indices.data());
+			return mesh;
+		};
+
+		const std::string directory = "BVHCacheBenchmark";
+		std::filesystem::remove_all(directory);
+		BVHCache cache(directory);
+
+		printf("bvh cache : %d triangles\n", (int)data.indices.size() / 3);
+
+		auto mesh = createMesh();
+		auto start = std::chrono::system_clock::now();
+		mesh->buildAccelerationStructure();
+		printf("  build         : %10.1f ms\n", elapsedMilliseconds(start));
+
+		mesh = createMesh();
+		start = std::chrono::system_clock::now();
+		mesh->buildAccelerationStructure(&cache);
+		printf("  build + store : %10.1f ms\n", elapsedMilliseconds(start));
+
+		mesh = createMesh();
+		start = std::chrono::system_clock::now();
+		mesh->buildAccelerationStructure(&cache);
+		printf("  load          : %10.1f ms\n", elapsedMilliseconds(start));
+
+		std::filesystem::remove_all(directory);
+	}
+
+	// 拡散反射面に囲まれた部屋を WavefrontPathTracer で描画し、反射後のレイを並べ替えた場合とそうでない場合の時間を比べる
+	// 一度に評価するレイの数が少ないと、並べ替えても近いレイが少なく、並べ替えの時間に見合わない
+	// メモリアクセスの効果を見るため、Object ごとに別のメッシュを使う
+	void benchmarkRaySorting(int resolution, int imageSize) {
+		const int meshNum = 6 + 16;
+		std::vector<GridMeshData> data;
+		std::vector<std::shared_ptr<TriangleMesh>> meshes;
+		for (int i = 0; i < meshNum; ++i) {
+			data.push_back(createGridMeshData(resolution, i + 1));
+		}
+		for (int i = 0; i < meshNum; ++i) {
+			auto mesh = std::make_shared<TriangleMesh>();
+			mesh->setGeometry(data[i].positions.size(), data[i].positions.data(), nullptr, nullptr, nullptr, nullptr, data[i].indices.size(), data[i].indices.data());
+			meshes.push_back(mesh);
+		}
+		auto material = std::make_shared<Diffuse>(Vector3f(0.7f));
+
+		Scene scene;
+		const Transform wallScale = scale(10.0f, 1.0f, 10.0f);
+		scene.addObject(std::make_shared<Object>(meshes[0], material, translate(0.0f, -5.0f, 0.0f) * wallScale));
+		scene.addObject(std::make_shared<Object>(meshes[1], material, translate(0.0f, 5.0f, 0.0f) * rotateX(180.0f) * wallScale));
+		scene.addObject(std::make_shared<Object>(meshes[2], material, translate(0.0f, 0.0f, 5.0f) * rotateX(-90.0f) * wallScale));
+		scene.addObject(std::make_shared<Object>(meshes[3], material, translate(0.0f, 0.0f, -5.0f) * rotateX(90.0f) * wallScale));
+		scene.addObject(std::make_shared<Object>(meshes[4], material, translate(5.0f, 0.0f, 0.0f) * rotateZ(90.0f) * wallScale));
+		scene.addObject(std::make_shared<Object>(meshes[5], material, translate(-5.0f, 0.0f, 0.0f) * rotateZ(-90.0f) * wallScale));
+
+		std::mt19937 rng(1);
+		std::uniform_real_distribution<float> dist(-3.0f, 3.0f);
+		for (int i = 6; i < meshNum; ++i) {
+			scene.addObject(std::make_shared<Object>(meshes[i], material, translate(dist(rng), dist(rng), dist(rng)) * rotateYXZ(dist(rng) * 30.0f, dist(rng) * 30.0f, 0.0f) * scale(2.0f, 2.0f, 2.0f)));
+		}
+		scene.addObject(std::make_shared<Object>(std::make_shared<Plane>(), std::make_shared<Emission>(Vector3f(10.0f)), translate(0.0f, 4.5f, 0.0f) * rotateX(90.0f) * scale(3.0f, 3.0f, 3.0f)));
+		scene.buildAccelerationStructure();
+
+		// 画像の左上から順に並べたカメラレイ
+		std::vector<Ray> rays(imageSize * imageSize);
+		for (int y = 0; y < imageSize; ++y) {
+			for (int x = 0; x < imageSize; ++x) {
+				Vector3f d((float)x / imageSize - 0.5f, 0.5f - (float)y / imageSize, 1.0f);
+				rays[y * imageSize + x] = Ray(Vector3f(0.0f, 0.0f, -4.5f), normalize(d));
+			}
+		}
+		const int rayNum = rays.size();
+
+		printf("ray sorting : room of %d triangles, %d camera rays\n", (int)data[0].indices.size() / 3 * meshNum, rayNum);
+		printf("  batch size  unsorted [ms]  sorted [ms]  sort only [ms, sum of %d threads]\n", omp_get_max_threads());
+		for (int batchSize = 256; batchSize <= rayNum; batchSize *= 4) {
+			const int batchNum = (rayNum + batchSize - 1) / batchSize;
+
+			double times[2];
+			double sortTime;
+			for (int sorted = 0; sorted < 2; ++sorted) {
+				WavefrontPathTracer pathTracer(sorted == 1);
+				std::vector<PathTracerEvalResult> results(rayNum);
+				auto start = std::chrono::system_clock::now();
+#pragma omp parallel for schedule(dynamic, 1)
+				for (int b = 0; b < batchNum; ++b) {
+					Sampler sampler(b);
+					const int begin = b * batchSize;
+					pathTracer.evalBatch(scene, sampler, &rays[begin], std::min(batchSize, rayNum - begin), &results[begin]);
+				}
+				times[sorted] = elapsedMilliseconds(start);
+				// 並べ替えのみにかかる時間は、sorted の描画で実際に辿った反射後のレイのキューを並べ替えた時間を測る
+				if (sorted == 1) {
+					sortTime = pathTracer.sortMilliseconds();
+				}
+			}
+
+			printf("  %10d  %13.1f  %11.1f  %14.2f\n", batchSize, times[0], times[1], sortTime);
+		}
+	}
+
+	// 構築した階層の統計と、レイ 1 本あたりに辿ったノード数、判定したプリミティブ数を比べる
+	template<typename T> void printStructureStatistics(const char* name, const std::vector<TriangleIndexed*>& triangles) {
+		T accel(triangles);
+		printf("%s\n%s", name, accel.statistics().report().c_str());
+
+		TraversalStatistics stats;
+		int rayNum = 0;
+		HitRecord hit;
+		traceChecksum([&](Ray& ray) {
+			++rayNum;
+			return accel.intersectWithStatistics(ray, &hit, &stats);
+			});
+		printf("traversal     : %.1f nodes, %.1f primitives per ray\n", (double)stats.nodesVisited / rayNum, (double)stats.primitivesTested / rayNum);
+	}
+
+	void benchmarkStructureStatistics(int resolution) {
+		GridMeshData data = createGridMeshData(resolution, 1);
+		const int faceNum = data.indices.size() / 3;
+
+		std::vector<TriangleIndexed*> triangles(faceNum);
+		for (int i = 0; i < faceNum; ++i) {
+			triangles[i] = new TriangleIndexed(data.positions.data(), nullptr, nullptr, nullptr, nullptr, data.indices.data(), i);
+		}
+
+		printf("statistics : %d triangles\n", faceNum);
+		printStructureStatistics<_BVH>("[BVH]", triangles);
+		printStructureStatistics<_BVH4>("[BVH4]", triangles);
+		printStructureStatistics<_BVH8>("[BVH8]", triangles);
+
+		for (auto* tri : triangles) {
+			delete tri;
+		}
+	}
+
+	// 向きのばらばらな細長い三角形が重なり合うシーン (毛や破片のようなもの) で、空間分割の有無と参照の複製数の上限を変えて比べる
+	template<typename T> void printSpatialSplitResult(const char* name, const std::vector<TriangleIndexed*>& triangles, const BVHBuildSettings& settings) {
+		auto start = std::chrono::system_clock::now();
+		T accel(triangles, settings);
+		double buildTime = elapsedMilliseconds(start);
+		auto statistics = accel.statistics();
+
+		TraversalStatistics stats;
+		int rayNum = 0;
+		HitRecord hit;
+		traceChecksum([&](Ray& ray) {
+			++rayNum;
+			return accel.intersectWithStatistics(ray, &hit, &stats);
+			});
+
+		start = std::chrono::system_clock::now();
+		double checksum = traceChecksum([&](Ray& ray) { return accel.intersect(ray, &hit); });
+		double traceTime = elapsedMilliseconds(start);
+
+		printf("  %-10s  %10.1f  %10d  %11.1f  %8.2f  %10.1f  %11.1f  %10.1f  %.6f\n", name, buildTime,
+			statistics.primitiveNum, statistics.memoryBytes / 1024.0, statistics.sahCost, traceTime,
+			(double)stats.nodesVisited / rayNum, (double)stats.primitivesTested / rayNum, checksum);
+	}
+
+	void benchmarkSpatialSplit(int triangleNum) {
+		std::mt19937 rng(1);
+		std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+		std::vector<Vector3f> positions;
+		std::vector<int> indices;
+		for (int i = 0; i < triangleNum; ++i) {
+			Vector3f root(dist(rng), dist(rng), dist(rng));
+			Vector3f tip = root + normalize(Vector3f(dist(rng), dist(rng), dist(rng)));
+			Vector3f side(dist(rng) * 0.002f, dist(rng) * 0.002f, dist(rng) * 0.002f);
+			positions.insert(positions.end(), { root - side, root + side, tip });
+			indices.insert(indices.end(), { i * 3, i * 3 + 1, i * 3 + 2 });
+		}
+
+		std::vector<TriangleIndexed*> triangles(triangleNum);
+		for (int i = 0; i < triangleNum; ++i) {
+			triangles[i] = new TriangleIndexed(positions.data(), nullptr, nullptr, nullptr, nullptr, indices.data(), i);
+		}
+
+		printf("spatial split : %d thin triangles\n", triangleNum);
+		printf("  builder     build [ms]  references  memory [KB]       SAH  trace [ms]  nodes / ray  prims / ray  checksum\n");
+		BVHBuildSettings binned;
+		printSpatialSplitResult<_BVH>("binned", triangles, binned);
+		printSpatialSplitResult<_BVH4>("binned x4", triangles, binned);
+		for (float maxGrowth : { 0.1f, 0.3f, 1.0f }) {
+			BVHBuildSettings settings;
+			settings.spatialSplit = true;
+			settings.spatialSplitMaxGrowth = maxGrowth;
+			char name[32];
+			snprintf(name, sizeof(name), "SBVH %.1f", maxGrowth);
+			printSpatialSplitResult<_BVH>(name, triangles, settings);
+		}
+		BVHBuildSettings wideSettings;
+		wideSettings.spatialSplit = true;
+		printSpatialSplitResult<_BVH4>("SBVH x4", triangles, wideSettings);
+
+		for (auto* tri : triangles) {
+			delete tri;
+		}
+	}
+
+	// 毎フレームの作り直しを想定して、TriangleMesh の BVH を SAH と LBVH (treelet の組み替えの回数を変えて) で構築する時間を比べる
+	void benchmarkLinearBuild(int resolution) {
+		GridMeshData data = createGridMeshData(resolution, 1);
+		const int faceNum = data.indices.size() / 3;
+
+		printf("linear build : %d triangles, %d threads\n", faceNum, omp_get_max_threads());
+		printf("  builder       build [ms]       SAH  trace [ms]  nodes / ray  checksum\n");
+		const char* names[] = { "binned SAH", "LBVH", "LBVH + 1", "LBVH + 3" };
+		const int treeletIterations[] = { 0, 0, 1, 3 };
+		for (int i = 0; i < 4; ++i) {
+			auto mesh = std::make_shared<TriangleMesh>();
+			mesh->setGeometry(data.positions.size(), data.positions.data(), nullptr, nullptr, nullptr, nullptr, data.indices.size(), data.indices.data());
+			mesh->setLinearBuild(i > 0, treeletIterations[i]);
+			mesh->buildAccelerationStructure();
+
+			// 1 回目はメモリの確保などを含むので、作り直しの時間を数回測って平均する
+			const int rebuildNum = 4;
+			auto start = std::chrono::system_clock::now();
+			for (int k = 0; k < rebuildNum; ++k) {
+				mesh->rebuildAccelerationStructure();
+			}
+			double buildTime = elapsedMilliseconds(start) / rebuildNum;
+
+			TraversalStatistics stats;
+			int rayNum = 0;
+			float tHit;
+			HitRecord hit;
+			traceChecksum([&](Ray& ray) {
+				++rayNum;
+				return mesh->intersectWithStatistics(ray, &tHit, &hit, &stats);
+				});
+			start = std::chrono::system_clock::now();
+			double checksum = traceChecksum([&](Ray& ray) {
+				if (!mesh->intersect(ray, &tHit, &hit)) { return false; }
+				ray.tMax = tHit;
+				return true;
+				});
+			double traceTime = elapsedMilliseconds(start);
+
+			printf("  %-12s  %10.1f  %8.2f  %10.1f  %11.1f  %.6f\n", names[i], buildTime, mesh->accelerationStructureStatistics().sahCost,
+				traceTime, (double)stats.nodesVisited / rayNum, checksum);
+		}
+	}
+
+}
+
+int main()
+{
+	benchmarkSingleMesh(1024);
+	printf("\n");
+	benchmarkScene(32, 256);
+	printf("\n");
+	// 大きなメッシュが 1 つだけのシーンでも、メッシュの BVH の構築が並列化されること
+	benchmarkScene(1, 1024);
+	printf("\n");
+	benchmarkInstanceUpdate(4096, 16);
+	printf("\n");
+	benchmarkDeformingMesh(512, 8);
+	printf("\n");
+	benchmarkBVHCache(1024);
+	printf("\n");
+	benchmarkRaySorting(256, 256);
+	printf("\n");
+	benchmarkStructureStatistics(512);
+	printf("\n");
+	benchmarkSpatialSplit(50000);
+	printf("\n");
+	benchmarkLinearBuild(708);
+	return 0;
+}
@@ -74,7 +74,7 @@ public:
 			0,1,2, 1,3,2
 		};
 
-		setGeometryWithShellMapping(positions.size(),
+		setGeometryWithPrismShellMapping(positions.size(),
 			positions.data(),
 			texCoords.data(),
 			normals.data(),
@@ -992,7 +992,7 @@ void MyApp::onSetup(MyFrameData* frameData, MyUIFrameData* uiFrameData) {
 
 	if (MethodMode == MethodModeReference) {
 		auto cloth = std::make_shared<TriangleMesh>();
-		cloth->setGeometryWithShellMapping(*std::make_shared<TriMesh>(ObjLoader(loadFile("cloth.obj"))), dispTexOrig, DispScale, ShellMappingLayerNum);
+		cloth->setGeometryWithPrismShellMapping(*std::make_shared<TriMesh>(ObjLoader(loadFile("cloth.obj"))), dispTexOrig, DispScale, ShellMappingLayerNum);
 		scene->addObject(
 			std::make_shared<Object>(cloth, baseMaterial, transformTRS(Vector3f(0, -0.025f, 0), Vector3f(0, 0, 0), Vector3f(1.0f)))
 		);
@@ -1000,7 +1000,7 @@ void MyApp::onSetup(MyFrameData* frameData, MyUIFrameData* uiFrameData) {
 		auto svndf = std::make_shared<SVNDF>();
 		auto dispTexLow = downsampleDisplacementTexture(dispTexOrig, DispScale, svndf);
 		auto cloth = std::make_shared<TriangleMesh>();
-		cloth->setGeometryWithShellMapping(*std::make_shared<TriMesh>(ObjLoader(loadFile("cloth.obj"))), dispTexLow, DispScale, ShellMappingLayerNum);
+		cloth->setGeometryWithPrismShellMapping(*std::make_shared<TriMesh>(ObjLoader(loadFile("cloth.obj"))), dispTexLow, DispScale, ShellMappingLayerNum);
 		scene->addObject(
 			std::make_shared<Object>(cloth, baseMaterial, transformTRS(Vector3f(0, -0.03f, 0), Vector3f(0, 0, 0), Vector3f(1.0f)))
 		);
@@ -1009,14 +1009,14 @@ void MyApp::onSetup(MyFrameData* frameData, MyUIFrameData* uiFrameData) {
 		auto dispTexLow = downsampleDisplacementTexture(dispTexOrig, DispScale, svndf);
 		auto multiLobeSVBRDF = std::make_shared<MultiLobeSVBRDF>(baseMaterial, dispTexLow, DispScale, svndf);
 		auto cloth = std::make_shared<TriangleMesh>();
-		cloth->setGeometryWithShellMapping(*std::make_shared<TriMesh>(ObjLoader(loadFile("cloth.obj"))), dispTexLow, DispScale, ShellMappingLayerNum);
+		cloth->setGeometryWithPrismShellMapping(*std::make_shared<TriMesh>(ObjLoader(loadFile("cloth.obj"))), dispTexLow, DispScale, ShellMappingLayerNum);
 		scene->addObject(
 			std::make_shared<Object>(cloth, multiLobeSVBRDF, transformTRS(Vector3f(0, -0.03f, 0), Vector3f(0, 0, 0), Vector3f(1.0f)))
 		);
 	} else if (MethodMode == MethodModeProposed) {
 		auto prefilteredDispMaterial = std::make_shared<PrefilteredDisplaceMapping>(baseMaterial, dispTexOrig, DispScale);
 		auto cloth = std::make_shared<TriangleMesh>();
-		cloth->setGeometryWithShellMapping(*std::make_shared<TriMesh>(ObjLoader(loadFile("cloth.obj"))), prefilteredDispMaterial->getDisplacementTextureLow(), DispScale, ShellMappingLayerNum);
+		cloth->setGeometryWithPrismShellMapping(*std::make_shared<TriMesh>(ObjLoader(loadFile("cloth.obj"))), prefilteredDispMaterial->getDisplacementTextureLow(), DispScale, ShellMappingLayerNum);
 		scene->addObject(
 			std::make_shared<Object>(cloth, prefilteredDispMaterial, transformTRS(Vector3f(0, -0.03f, 0), Vector3f(0, 0, 0), Vector3f(1.0f)))
 		);
@@ -111,7 +111,7 @@ void MyApp::onSetup(MyFrameData* frameData, MyUIFrameData* uiFrameData) {
 
 	renderTarget = std::make_shared<SimpleRenderTarget>(ImageSize.x, ImageSize.y);
 
-	pathTracer = std::make_shared<StandardPathTracer>();
+	pathTracer = std::make_shared<WavefrontPathTracer>();
 
 	auto time_end = std::chrono::system_clock::now();
 
@@ -131,10 +131,17 @@ void MyApp::onUpdate(MyFrameData& frameData, const MyUIFrameData& uiFrameData) {
 
 	frameData.sampleNum += sample;
 
-	renderTarget->render(*scene, sample, [&](const Vector2f& pFilm, Sampler& sampler, Vector3f& color) {
-		auto ray = scene->camera->generateRay(pFilm, sampler);
-
-		color += pathTracer->eval(*scene, sampler, ray).color;
+	renderTarget->renderBatch(*scene, sample, [&](const Vector2f* pFilms, int num, Sampler& sampler, Vector3f** colors) {
+		std::vector<Ray> rays(num);
+		for (int i = 0; i < num; ++i) {
+			rays[i] = scene->camera->generateRay(pFilms[i], sampler);
+		}
+
+		std::vector<PathTracerEvalResult> res(num);
+		pathTracer->evalBatch(*scene, sampler, rays.data(), num, res.data());
+		for (int i = 0; i < num; ++i) {
+			*colors[i] += res[i].color;
+		}
 	});
 
 	renderTarget->map(&frameData.surface, [&frameData](const Vector3f& pixel)
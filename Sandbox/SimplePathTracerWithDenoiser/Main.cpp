@@ -141,13 +141,19 @@ void MyApp::onUpdate(MyFrameData& frameData, const MyUIFrameData& uiFrameData) {
 
 	frameData.sampleNum += sample;
 
-	renderTarget->render(*scene, sample, [&](const Vector2f& pFilm, Sampler& sampler, DenoisableRenderTargetPixel& pixel) {
-		auto ray = scene->camera->generateRay(pFilm, sampler);
-
-		auto res = pathTracer->eval(*scene, sampler, ray);
-		pixel.color += res.color;
-		pixel.albedo += res.albedo;
-		pixel.normal += res.normal;
+	renderTarget->renderPacket(*scene, sample, [&](const Vector2f* pFilms, int num, Sampler& sampler, DenoisableRenderTargetPixel** pixels) {
+		RayPacket rays;
+		for (int i = 0; i < num; ++i) {
+			rays.setRay(i, scene->camera->generateRay(pFilms[i], sampler));
+		}
+
+		PathTracerEvalResult res[RayPacket::Size];
+		pathTracer->evalPacket(*scene, sampler, rays, num, res);
+		for (int i = 0; i < num; ++i) {
+			pixels[i]->color += res[i].color;
+			pixels[i]->albedo += res[i].albedo;
+			pixels[i]->normal += res[i].normal;
+		}
 		});
 
 	renderTarget->map([&frameData](DenoisableRenderTargetPixel& pixel)
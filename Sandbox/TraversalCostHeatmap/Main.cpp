@@ -0,0 +1,162 @@
+﻿#include <Xitils/AccelerationStructure.h>
+#include <Xitils/App.h>
+#include <Xitils/Camera.h>
+#include <Xitils/Geometry.h>
+#include <Xitils/PathTracer.h>
+#include <Xitils/Scene.h>
+#include <Xitils/TraversalCostHeatmap.h>
+#include <Xitils/TriangleMesh.h>
+#include <Xitils/RenderTarget.h>
+#include <CinderImGui.h>
+
+// レイ 1 本あたりに辿ったノード数、判定したプリミティブ数、シェーディングの時間をヒートマップで表示する
+// コストの大きい画面上の領域は標準出力にまとめて出力する
+
+using namespace xitils;
+using namespace ci;
+using namespace ci::app;
+using namespace ci::geom;
+
+struct MyFrameData {
+	float initElapsed;
+	Surface surface;
+	int sampleNum = 0;
+	std::string report;
+};
+
+struct MyUIFrameData {
+	int channel = TraversalCostRenderTargetPixel::NodesVisited;
+	float maxValue = 100.0f;
+	bool showColor = false;
+};
+
+class MyApp : public xitils::app::XApp<MyFrameData, MyUIFrameData> {
+public:
+	void onSetup(MyFrameData* frameData, MyUIFrameData* uiFrameData) override;
+	void onCleanup(MyFrameData* frameData, MyUIFrameData* uiFrameData) override;
+	void onUpdate(MyFrameData& frameData, const MyUIFrameData& uiFrameData) override;
+	void onDraw(const MyFrameData& frameData, MyUIFrameData& uiFrameData) override;
+
+private:
+
+	gl::TextureRef texture;
+
+	std::shared_ptr<Scene> scene;
+	inline static const glm::ivec2 ImageSize = glm::ivec2(800, 800);
+
+	std::shared_ptr<TraversalCostRenderTarget> renderTarget;
+	std::shared_ptr<DebugRayCaster> rayCaster;
+};
+
+void MyApp::onSetup(MyFrameData* frameData, MyUIFrameData* uiFrameData) {
+	auto init_time_start = std::chrono::system_clock::now();
+
+	frameData->surface = Surface(ImageSize.x, ImageSize.y, false);
+	frameData->sampleNum = 0;
+
+	getWindow()->setTitle("Xitils");
+	setWindowSize(ImageSize);
+	setFrameRate(60);
+
+	ui::initialize();
+
+	scene = std::make_shared<Scene>();
+
+	scene->camera = std::make_shared<PinholeCamera>(
+		translate(0, 2.0f, -5), 60 * ToRad, (float)ImageSize.y / ImageSize.x
+		);
+
+	auto diffuse_white = std::make_shared<Diffuse>(Vector3f(0.8f));
+	auto cube = std::make_shared<xitils::Cube>();
+	scene->addObject(
+		std::make_shared<Object>(cube, diffuse_white, transformTRS(Vector3f(0, 0, 0), Vector3f(), Vector3f(4, 0.01f, 4)))
+	);
+
+	// 細かさの異なる teapot を並べる
+	const int subdivisions[] = { 2, 10, 40 };
+	for (int i = 0; i < 3; ++i) {
+		auto teapot = std::make_shared<Teapot>();
+		teapot->subdivisions(subdivisions[i]);
+		auto teapotMeshData = std::make_shared<TriMesh>(*teapot);
+		auto teapotMesh = std::make_shared<TriangleMesh>();
+		teapotMesh->setGeometry(*teapotMeshData);
+		scene->addObject(std::make_shared<Object>(teapotMesh, diffuse_white,
+			transformTRS(Vector3f(-1.2f + 1.2f * i, 0, 0.0f), Vector3f(0, 0, 0), Vector3f(0.8f))
+			));
+	}
+
+	scene->buildAccelerationStructure();
+
+	renderTarget = std::make_shared<TraversalCostRenderTarget>(ImageSize.x, ImageSize.y);
+
+	rayCaster = std::make_shared<DebugRayCaster>([](const SurfaceIntersection& isect, Sampler& sampler) {
+		PathTracerEvalResult res;
+		res.color = isect.object->material->getAlbedo(isect) * fabsf(isect.shading.n.y);
+		res.albedo = isect.object->material->getAlbedo(isect);
+		res.normal = isect.shading.n;
+		return res;
+		});
+
+	auto time_end = std::chrono::system_clock::now();
+	frameData->initElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(time_end - init_time_start).count();
+}
+
+void MyApp::onCleanup(MyFrameData* frameData, MyUIFrameData* uiFrameData) {
+
+}
+
+void MyApp::onUpdate(MyFrameData& frameData, const MyUIFrameData& uiFrameData) {
+
+	const int sample = 1;
+	frameData.sampleNum += sample;
+
+	renderTarget->render(*scene, sample, [&](const Vector2f& pFilm, Sampler& sampler, TraversalCostRenderTargetPixel& pixel) {
+		Ray ray = scene->camera->generateRay(pFilm, sampler);
+		RayCost cost;
+		auto res = rayCaster->evalWithCost(*scene, sampler, ray, &cost);
+		pixel.add(res, cost);
+		});
+
+	const auto channel = (TraversalCostRenderTargetPixel::Channel)uiFrameData.channel;
+	renderTarget->map(&frameData.surface, [&](const TraversalCostRenderTargetPixel& pixel) {
+		if (uiFrameData.showColor) {
+			auto color = pixel.color / pixel.sampleNum;
+			ci::ColorA8u colA8u;
+			colA8u.r = xitils::clamp((int)(color.x * 255), 0, 255);
+			colA8u.g = xitils::clamp((int)(color.y * 255), 0, 255);
+			colA8u.b = xitils::clamp((int)(color.z * 255), 0, 255);
+			colA8u.a = 255;
+			return colA8u;
+		}
+		return traversalCostToColor(pixel.value(channel), uiFrameData.maxValue);
+		});
+
+	auto summary = summarizeTraversalCost(*renderTarget, channel);
+	frameData.report = summary.report();
+	if (frameData.sampleNum == 1) {
+		printf("%s", frameData.report.c_str());
+	}
+}
+
+void MyApp::onDraw(const MyFrameData& frameData, MyUIFrameData& uiFrameData) {
+
+	texture = gl::Texture::create(frameData.surface);
+
+	gl::clear(Color::gray(0.5f));
+
+	auto windowSize = ci::app::getWindowSize();
+	gl::draw(texture, (windowSize - ImageSize) / 2);
+
+	ImGui::Begin("ImGui Window");
+	ImGui::Text(("Elapsed in Initialization: " + std::to_string(frameData.initElapsed) + " ms").c_str());
+	ImGui::Text(("Samples: " + std::to_string(frameData.sampleNum)).c_str());
+	const char* channels[] = { "Nodes Visited", "Primitives Tested", "Shading Time" };
+	ImGui::Combo("Channel", &uiFrameData.channel, channels, TraversalCostRenderTargetPixel::ChannelNum);
+	ImGui::SliderFloat("Max", &uiFrameData.maxValue, 1.0f, 500.0f);
+	ImGui::Checkbox("Show Color", &uiFrameData.showColor);
+	ImGui::Text(frameData.report.c_str());
+	ImGui::End();
+}
+
+
+XITILS_APP(MyApp)